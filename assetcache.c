@@ -0,0 +1,371 @@
+#define _GNU_SOURCE
+#include "assetcache.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ASSET_CACHE_MAGIC "REELAST1"
+#define ASSET_CACHE_VERSION 1
+// Pixel data is aligned so it can be handed to GL straight from the mapping
+#define ASSET_CACHE_ALIGN 64
+#define ASSET_SOURCE_MAX 256
+// LoadFontEx default: ASCII 32..126
+#define ASSET_FONT_GLYPHS 95
+#define ASSET_FONT_PADDING 4
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t entryCount;
+  uint64_t fileSize;
+} CacheHeader;
+
+typedef struct {
+  char source[ASSET_SOURCE_MAX];
+  uint32_t type;
+  int32_t fontSize;
+  float scale;
+  int32_t width;
+  int32_t height;
+  int32_t format; // raylib PixelFormat
+  int32_t glyphCount;
+  int32_t glyphPadding;
+  int64_t sourceSize; // source file stamp at bake time
+  int64_t sourceMtime;
+  uint64_t pixelOffset;
+  uint64_t pixelSize;
+  uint64_t glyphOffset; // CacheGlyph[glyphCount], fonts only
+} CacheEntry;
+
+typedef struct {
+  int32_t value;
+  int32_t offsetX;
+  int32_t offsetY;
+  int32_t advanceX;
+  float x, y, width, height; // atlas rectangle
+} CacheGlyph;
+
+struct AssetCache {
+  const uint8_t *data;
+  size_t size;
+  const CacheEntry *entries;
+  uint32_t entryCount;
+};
+
+static int statSource(const char *path, int64_t *size, int64_t *mtime) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return -1;
+  *size = st.st_size;
+  *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  return 0;
+}
+
+AssetCache *openAssetCache(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    printf("Warning: Could not map asset cache %s\n", path);
+    return NULL;
+  }
+
+  const CacheHeader *header = data;
+  size_t tableEnd =
+      sizeof(CacheHeader) + (size_t)header->entryCount * sizeof(CacheEntry);
+  if (memcmp(header->magic, ASSET_CACHE_MAGIC, 8) != 0 ||
+      header->version != ASSET_CACHE_VERSION ||
+      header->fileSize != (uint64_t)st.st_size || tableEnd > header->fileSize) {
+    printf("Warning: Ignoring invalid asset cache %s\n", path);
+    munmap(data, st.st_size);
+    return NULL;
+  }
+
+  AssetCache *cache = calloc(1, sizeof(AssetCache));
+  if (!cache) {
+    munmap(data, st.st_size);
+    return NULL;
+  }
+  cache->data = data;
+  cache->size = st.st_size;
+  cache->entries = (const CacheEntry *)(cache->data + sizeof(CacheHeader));
+  cache->entryCount = header->entryCount;
+  return cache;
+}
+
+void closeAssetCache(AssetCache *cache) {
+  if (!cache)
+    return;
+  munmap((void *)cache->data, cache->size);
+  free(cache);
+}
+
+// Find an up to date entry for this source and bake parameters
+static const CacheEntry *findEntry(AssetCache *cache, AssetType type,
+                                   const char *source, float scale,
+                                   int fontSize) {
+  if (!cache)
+    return NULL;
+
+  for (uint32_t i = 0; i < cache->entryCount; i++) {
+    const CacheEntry *e = &cache->entries[i];
+    if (e->type != (uint32_t)type ||
+        strncmp(e->source, source, ASSET_SOURCE_MAX) != 0)
+      continue;
+    if (type == ASSET_SPRITE ? e->scale != scale : e->fontSize != fontSize)
+      continue;
+
+    int64_t size, mtime;
+    if (statSource(source, &size, &mtime) == 0 &&
+        (size != e->sourceSize || mtime != e->sourceMtime)) {
+      printf("Warning: Asset cache entry for %s is stale, loading source "
+             "(rerun --bake-assets)\n",
+             source);
+      return NULL;
+    }
+    uint64_t glyphEnd =
+        e->glyphOffset + (uint64_t)e->glyphCount * sizeof(CacheGlyph);
+    if (e->pixelOffset + e->pixelSize > cache->size ||
+        (type == ASSET_FONT && glyphEnd > cache->size))
+      return NULL;
+    return e;
+  }
+  return NULL;
+}
+
+static Image cachedImage(AssetCache *cache, const CacheEntry *e) {
+  return (Image){.data = (void *)(cache->data + e->pixelOffset),
+                 .width = e->width,
+                 .height = e->height,
+                 .mipmaps = 1,
+                 .format = e->format};
+}
+
+// Premultiply and scale a freshly loaded sprite the way the cache stores it
+static void prepareSpriteImage(Image *image, float scale) {
+  // Premultiply before scaling so transparent pixels don't bleed colour
+  ImageFormat(image, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+  ImageAlphaPremultiply(image);
+  int width = (int)(image->width * scale);
+  int height = (int)(image->height * scale);
+  if (width < 1)
+    width = 1;
+  if (height < 1)
+    height = 1;
+  if (width != image->width || height != image->height)
+    ImageResize(image, width, height);
+}
+
+Image loadSpriteImage(AssetCache *cache, const char *source, float scale) {
+  const CacheEntry *e = findEntry(cache, ASSET_SPRITE, source, scale, 0);
+  if (e)
+    return ImageCopy(cachedImage(cache, e));
+  Image image = LoadImage(source);
+  if (image.data)
+    prepareSpriteImage(&image, scale);
+  return image;
+}
+
+Font loadFontAsset(AssetCache *cache, const char *source, int fontSize) {
+  Font font = {0};
+  const CacheEntry *e = findEntry(cache, ASSET_FONT, source, 0.0f, fontSize);
+  if (e) {
+    font.texture = LoadTextureFromImage(cachedImage(cache, e));
+    font.glyphs = MemAlloc(e->glyphCount * sizeof(GlyphInfo));
+    font.recs = MemAlloc(e->glyphCount * sizeof(Rectangle));
+    if (font.texture.id != 0 && font.glyphs && font.recs) {
+      const CacheGlyph *glyphs =
+          (const CacheGlyph *)(cache->data + e->glyphOffset);
+      for (int i = 0; i < e->glyphCount; i++) {
+        // Glyph images are only needed for CPU-side text drawing
+        font.glyphs[i] = (GlyphInfo){.value = glyphs[i].value,
+                                     .offsetX = glyphs[i].offsetX,
+                                     .offsetY = glyphs[i].offsetY,
+                                     .advanceX = glyphs[i].advanceX};
+        font.recs[i] = (Rectangle){glyphs[i].x, glyphs[i].y,
+                                   glyphs[i].width, glyphs[i].height};
+      }
+      font.baseSize = e->fontSize;
+      font.glyphCount = e->glyphCount;
+      font.glyphPadding = e->glyphPadding;
+    } else {
+      if (font.texture.id != 0)
+        UnloadTexture(font.texture);
+      MemFree(font.glyphs);
+      MemFree(font.recs);
+      font = (Font){0};
+    }
+  }
+  if (font.texture.id == 0)
+    font = LoadFontEx(source, fontSize, NULL, 0);
+  if (font.texture.id != 0)
+    SetTextureFilter(font.texture, TEXTURE_FILTER_BILINEAR);
+  return font;
+}
+
+// ---------------------------------------------------------------------------
+// Baking
+
+static long alignOffset(FILE *file) {
+  long pos = ftell(file);
+  long aligned = (pos + ASSET_CACHE_ALIGN - 1) & ~(long)(ASSET_CACHE_ALIGN - 1);
+  static const uint8_t zeros[ASSET_CACHE_ALIGN];
+  if (aligned > pos)
+    fwrite(zeros, 1, aligned - pos, file);
+  return aligned;
+}
+
+static int bakeSprite(FILE *file, const AssetSpec *spec, CacheEntry *e) {
+  Image image = LoadImage(spec->source);
+  if (!image.data) {
+    printf("Error: Could not load %s\n", spec->source);
+    return -1;
+  }
+  prepareSpriteImage(&image, spec->scale);
+
+  e->width = image.width;
+  e->height = image.height;
+  e->format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+  e->pixelSize = (uint64_t)image.width * image.height * 4;
+  e->pixelOffset = alignOffset(file);
+  size_t written = fwrite(image.data, 1, e->pixelSize, file);
+  UnloadImage(image);
+  return written == e->pixelSize ? 0 : -1;
+}
+
+static int bakeFont(FILE *file, const AssetSpec *spec, CacheEntry *e) {
+  int dataSize = 0;
+  unsigned char *data = LoadFileData(spec->source, &dataSize);
+  if (!data) {
+    printf("Error: Could not load %s\n", spec->source);
+    return -1;
+  }
+
+  // Same rasterisation LoadFontEx does
+  GlyphInfo *glyphs = LoadFontData(data, dataSize, spec->fontSize, NULL, 0,
+                                   FONT_DEFAULT);
+  UnloadFileData(data);
+  if (!glyphs) {
+    printf("Error: Could not rasterise %s\n", spec->source);
+    return -1;
+  }
+  Rectangle *recs = NULL;
+  Image atlas = GenImageFontAtlas(glyphs, &recs, ASSET_FONT_GLYPHS,
+                                  spec->fontSize, ASSET_FONT_PADDING, 0);
+  if (!atlas.data || !recs) {
+    printf("Error: Could not build glyph atlas for %s\n", spec->source);
+    UnloadFontData(glyphs, ASSET_FONT_GLYPHS);
+    MemFree(recs);
+    return -1;
+  }
+
+  ImageFormat(&atlas, PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA);
+  e->width = atlas.width;
+  e->height = atlas.height;
+  e->format = atlas.format;
+  e->glyphCount = ASSET_FONT_GLYPHS;
+  e->glyphPadding = ASSET_FONT_PADDING;
+  e->pixelSize = (uint64_t)atlas.width * atlas.height * 2; // gray + alpha
+  e->pixelOffset = alignOffset(file);
+  int ret = fwrite(atlas.data, 1, e->pixelSize, file) == e->pixelSize ? 0 : -1;
+
+  e->glyphOffset = alignOffset(file);
+  for (int i = 0; i < ASSET_FONT_GLYPHS && ret == 0; i++) {
+    CacheGlyph g = {glyphs[i].value,  glyphs[i].offsetX, glyphs[i].offsetY,
+                    glyphs[i].advanceX, recs[i].x,       recs[i].y,
+                    recs[i].width,    recs[i].height};
+    if (fwrite(&g, sizeof(g), 1, file) != 1)
+      ret = -1;
+  }
+
+  UnloadImage(atlas);
+  UnloadFontData(glyphs, ASSET_FONT_GLYPHS);
+  MemFree(recs);
+  return ret;
+}
+
+int bakeAssets(const char *path, const AssetSpec *specs, int count) {
+  // Write next to the target and rename, so running renders never map a
+  // half-written file
+  char tmpPath[512];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  FILE *file = fopen(tmpPath, "wb");
+  if (!file) {
+    printf("Error: Could not create %s\n", tmpPath);
+    return -1;
+  }
+
+  CacheEntry *entries = calloc(count, sizeof(CacheEntry));
+  if (!entries) {
+    fclose(file);
+    return -1;
+  }
+  // Table goes first, filled in once the data offsets are known
+  fseek(file, sizeof(CacheHeader) + count * sizeof(CacheEntry), SEEK_SET);
+
+  int ret = 0;
+  for (int i = 0; i < count && ret == 0; i++) {
+    const AssetSpec *spec = &specs[i];
+    CacheEntry *e = &entries[i];
+    if (strlen(spec->source) >= ASSET_SOURCE_MAX ||
+        statSource(spec->source, &e->sourceSize, &e->sourceMtime) < 0) {
+      printf("Error: Cannot bake %s\n", spec->source);
+      ret = -1;
+      break;
+    }
+    strcpy(e->source, spec->source);
+    e->type = spec->type;
+    if (spec->type == ASSET_SPRITE) {
+      e->scale = spec->scale;
+      ret = bakeSprite(file, spec, e);
+      if (ret == 0)
+        printf("Baked sprite %s: %dx%d premultiplied\n", spec->source,
+               e->width, e->height);
+    } else {
+      e->fontSize = spec->fontSize;
+      ret = bakeFont(file, spec, e);
+      if (ret == 0)
+        printf("Baked font %s: %dpx, %d glyphs, %dx%d atlas\n", spec->source,
+               e->fontSize, e->glyphCount, e->width, e->height);
+    }
+  }
+
+  if (ret == 0) {
+    CacheHeader header = {.version = ASSET_CACHE_VERSION,
+                          .entryCount = count,
+                          .fileSize = ftell(file)};
+    memcpy(header.magic, ASSET_CACHE_MAGIC, 8);
+    fseek(file, 0, SEEK_SET);
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(entries, sizeof(CacheEntry), count, file) != (size_t)count)
+      ret = -1;
+  }
+  free(entries);
+  if (fclose(file) != 0)
+    ret = -1;
+
+  if (ret == 0 && rename(tmpPath, path) != 0) {
+    printf("Error: Could not replace %s\n", path);
+    ret = -1;
+  }
+  if (ret < 0) {
+    unlink(tmpPath);
+    return -1;
+  }
+  printf("Asset cache written to %s\n", path);
+  return 0;
+}
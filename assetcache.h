@@ -0,0 +1,41 @@
+#ifndef ASSETCACHE_H
+#define ASSETCACHE_H
+
+#include <raylib.h>
+#include <stdbool.h>
+
+// Baked asset cache. Sprites are stored pre-scaled with premultiplied alpha
+// and fonts as a finished glyph atlas plus metrics, so startup only has to
+// mmap the file and upload textures. Every entry remembers the size and
+// mtime of its source file; stale or missing entries fall back to loading
+// the source.
+#define ASSET_CACHE_PATH "./media/assets.cache"
+
+typedef enum { ASSET_SPRITE, ASSET_FONT } AssetType;
+
+// One asset to bake
+typedef struct {
+  AssetType type;
+  const char *source;
+  float scale;  // sprites: size relative to the source image
+  int fontSize; // fonts: rasterisation size in pixels
+} AssetSpec;
+
+typedef struct AssetCache AssetCache;
+
+// Map the cache file. Returns NULL (quietly) if it doesn't exist.
+AssetCache *openAssetCache(const char *path);
+void closeAssetCache(AssetCache *cache);
+
+// Write all assets to path. Returns 0 on success, -1 on error.
+int bakeAssets(const char *path, const AssetSpec *specs, int count);
+
+// CPU copy of a sprite at scale (RGBA, premultiplied alpha), from the
+// cache if it has an up to date entry, otherwise from the source image.
+// cache may be NULL. data is NULL if the sprite could not be loaded.
+Image loadSpriteImage(AssetCache *cache, const char *source, float scale);
+
+// Font rasterised at fontSize, from the cache like sprites
+Font loadFontAsset(AssetCache *cache, const char *source, int fontSize);
+
+#endif
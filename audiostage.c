@@ -0,0 +1,258 @@
+#include "audiostage.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "common.h"
+
+typedef struct StagePacket {
+  struct StagePacket *next;
+  AVPacket *pkt;
+} StagePacket;
+
+struct AudioStage {
+  Project *project;
+  AVCodecContext *encoder;
+  AudioTrack *track;
+  int64_t sampleCount;
+  const FrameTap *tap;
+  int64_t frameBytes; // mix frame
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  StagePacket *head;
+  StagePacket *tail;
+  int64_t queuedBytes;
+  int64_t queuedEnd; // end of the last queued packet, in samples
+  int64_t readEnd;   // end of the last packet read
+  bool finished;
+  bool failed;
+  bool stopping;
+
+  // Stats
+  int64_t peakBytes;
+  double ms;
+};
+
+static double nowMs(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// Hand pkt's contents to the queue, waiting while it is far enough ahead.
+// Returns -1 if the stage is being stopped.
+static int queuePacket(AudioStage *stage, AVPacket *pkt) {
+  StagePacket *entry = malloc(sizeof(StagePacket));
+  if (!entry || !(entry->pkt = av_packet_alloc())) {
+    free(entry);
+    av_packet_unref(pkt);
+    return -1;
+  }
+  av_packet_move_ref(entry->pkt, pkt);
+  entry->next = NULL;
+  int64_t end = entry->pkt->pts + entry->pkt->duration;
+  int64_t ahead = (int64_t)AUDIO_STAGE_AHEAD_SECONDS * AUDIO_SAMPLE_RATE;
+
+  pthread_mutex_lock(&stage->lock);
+  while (!stage->stopping && stage->head &&
+         stage->queuedEnd - stage->readEnd > ahead)
+    pthread_cond_wait(&stage->cond, &stage->lock);
+  bool stopping = stage->stopping;
+  if (!stopping) {
+    if (stage->tail)
+      stage->tail->next = entry;
+    else
+      stage->head = entry;
+    stage->tail = entry;
+    stage->queuedBytes += entry->pkt->size;
+    if (stage->queuedBytes + stage->frameBytes > stage->peakBytes)
+      stage->peakBytes = stage->queuedBytes + stage->frameBytes;
+    if (end > stage->queuedEnd)
+      stage->queuedEnd = end;
+    pthread_cond_broadcast(&stage->cond);
+  }
+  pthread_mutex_unlock(&stage->lock);
+  if (stopping) {
+    av_packet_free(&entry->pkt);
+    free(entry);
+    return -1;
+  }
+  return 0;
+}
+
+// Send a frame (NULL to flush) and queue whatever packets come back
+static int encodeStageFrame(AudioStage *stage, AVFrame *frame, AVPacket *pkt) {
+  int ret = avcodec_send_frame(stage->encoder, frame);
+  if (ret < 0)
+    return ret;
+  while (avcodec_receive_packet(stage->encoder, pkt) >= 0) {
+    if (queuePacket(stage, pkt) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int runMixer(AudioStage *stage, AVPacket *pkt) {
+  int frameSize = stage->encoder->frame_size;
+  AVFrame *frame = av_frame_alloc();
+  if (!frame)
+    return -1;
+  frame->format = AV_SAMPLE_FMT_FLTP;
+  frame->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO;
+  frame->sample_rate = AUDIO_SAMPLE_RATE;
+  frame->nb_samples = frameSize;
+  int ret = av_frame_get_buffer(frame, 0);
+
+  for (int64_t first = 0; ret >= 0 && first < stage->sampleCount;
+       first += frameSize) {
+    if (av_frame_make_writable(frame) < 0) {
+      ret = -1;
+      break;
+    }
+    // The last frame is padded with silence
+    int samples = stage->sampleCount - first < frameSize
+                      ? (int)(stage->sampleCount - first)
+                      : frameSize;
+    float *left = (float *)frame->data[0];
+    float *right = (float *)frame->data[1];
+    loadProjectAudio(stage->project, first, first + samples);
+    mixProjectAudio(stage->project, first, samples, left, right);
+    memset(left + samples, 0, (frameSize - samples) * sizeof(float));
+    memset(right + samples, 0, (frameSize - samples) * sizeof(float));
+    frame->pts = first;
+    if (stage->tap && stage->tap->audio)
+      stage->tap->audio(stage->tap->arg, frame);
+    ret = encodeStageFrame(stage, frame, pkt);
+  }
+  if (ret >= 0)
+    ret = encodeStageFrame(stage, NULL, pkt);
+  av_frame_free(&frame);
+  return ret;
+}
+
+static int runTrack(AudioStage *stage, AVPacket *pkt) {
+  int ret;
+  while ((ret = readAudioTrack(stage->track, -1, pkt)) > 0) {
+    if (queuePacket(stage, pkt) < 0)
+      return -1;
+  }
+  return ret;
+}
+
+static void *audioStageThread(void *arg) {
+  AudioStage *stage = arg;
+  double start = nowMs();
+  AVPacket *pkt = av_packet_alloc();
+  int ret = -1;
+  if (pkt)
+    ret = stage->track ? runTrack(stage, pkt) : runMixer(stage, pkt);
+  av_packet_free(&pkt);
+
+  pthread_mutex_lock(&stage->lock);
+  if (ret < 0 && !stage->stopping)
+    printf("Error: Could not produce the audio track\n");
+  stage->failed = ret < 0;
+  stage->finished = true;
+  stage->ms = nowMs() - start;
+  pthread_cond_broadcast(&stage->cond);
+  pthread_mutex_unlock(&stage->lock);
+  return NULL;
+}
+
+AudioStage *startAudioStage(Project *project, AVCodecContext *encoder,
+                            AudioTrack *track, int64_t sampleCount,
+                            const FrameTap *tap) {
+  AudioStage *stage = calloc(1, sizeof(AudioStage));
+  if (!stage)
+    return NULL;
+  stage->project = project;
+  stage->encoder = encoder;
+  stage->track = track;
+  stage->sampleCount = sampleCount;
+  stage->tap = tap;
+  if (!track)
+    stage->frameBytes = 2 * (int64_t)encoder->frame_size * sizeof(float);
+  pthread_mutex_init(&stage->lock, NULL);
+  pthread_cond_init(&stage->cond, NULL);
+  if (pthread_create(&stage->thread, NULL, audioStageThread, stage) != 0) {
+    printf("Error: Could not start the audio thread\n");
+    pthread_mutex_destroy(&stage->lock);
+    pthread_cond_destroy(&stage->cond);
+    free(stage);
+    return NULL;
+  }
+  return stage;
+}
+
+int readAudioStage(AudioStage *stage, int64_t until, AVPacket *pkt) {
+  pthread_mutex_lock(&stage->lock);
+  while (!stage->head && !stage->finished)
+    pthread_cond_wait(&stage->cond, &stage->lock);
+  StagePacket *entry = stage->head;
+  int ret = stage->failed ? -1 : 0;
+  if (entry && ret == 0 &&
+      (until < 0 || entry->pkt->pts + entry->pkt->duration <= until)) {
+    stage->head = entry->next;
+    if (!stage->head)
+      stage->tail = NULL;
+    stage->queuedBytes -= entry->pkt->size;
+    stage->readEnd = entry->pkt->pts + entry->pkt->duration;
+    pthread_cond_broadcast(&stage->cond);
+    ret = 1;
+  }
+  pthread_mutex_unlock(&stage->lock);
+  if (ret == 1) {
+    av_packet_move_ref(pkt, entry->pkt);
+    av_packet_free(&entry->pkt);
+    free(entry);
+  }
+  return ret;
+}
+
+int64_t audioStagePeakBytes(AudioStage *stage) {
+  pthread_mutex_lock(&stage->lock);
+  int64_t peak = stage->peakBytes;
+  pthread_mutex_unlock(&stage->lock);
+  return peak;
+}
+
+double audioStageMs(AudioStage *stage) {
+  pthread_mutex_lock(&stage->lock);
+  double ms = stage->ms;
+  pthread_mutex_unlock(&stage->lock);
+  return ms;
+}
+
+int64_t estimateAudioStageBytes(int64_t bitRate) {
+  // AAC frames are 1024 samples; each queued packet has its own AVPacket
+  int64_t packets = (int64_t)AUDIO_STAGE_AHEAD_SECONDS * AUDIO_SAMPLE_RATE /
+                    1024;
+  return bitRate / 8 * AUDIO_STAGE_AHEAD_SECONDS +
+         packets * (int64_t)(sizeof(StagePacket) + sizeof(AVPacket)) +
+         2 * 1024 * sizeof(float);
+}
+
+void stopAudioStage(AudioStage *stage) {
+  if (!stage)
+    return;
+  pthread_mutex_lock(&stage->lock);
+  stage->stopping = true;
+  pthread_cond_broadcast(&stage->cond);
+  pthread_mutex_unlock(&stage->lock);
+  pthread_join(stage->thread, NULL);
+  while (stage->head) {
+    StagePacket *entry = stage->head;
+    stage->head = entry->next;
+    av_packet_free(&entry->pkt);
+    free(entry);
+  }
+  pthread_mutex_destroy(&stage->lock);
+  pthread_cond_destroy(&stage->cond);
+  free(stage);
+}
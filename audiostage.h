@@ -0,0 +1,46 @@
+#ifndef AUDIOSTAGE_H
+#define AUDIOSTAGE_H
+
+#include <libavcodec/avcodec.h>
+#include <stdint.h>
+
+#include "audiotrack.h"
+#include "project.h"
+#include "render.h"
+
+// Most encoded audio the stage gets ahead of whoever reads its packets
+#define AUDIO_STAGE_AHEAD_SECONDS 30
+
+// A project's audio, mixed and encoded (or put together from cached clip
+// encodes) on a thread of its own. The track only depends on the caption
+// timings and the clips, so it runs ahead of the video and the frame loop
+// just takes the packets that are due.
+typedef struct AudioStage AudioStage;
+
+// Produce samples [0, sampleCount) of the project's mix: from track if it
+// isn't NULL, otherwise by mixing into encoder. Until the stage is stopped
+// its thread is the only one to use project's audio, encoder and track.
+// The tap, if any, sees every mixed frame from that thread. Returns NULL
+// if the thread could not be started.
+AudioStage *startAudioStage(Project *project, AVCodecContext *encoder,
+                            AudioTrack *track, int64_t sampleCount,
+                            const FrameTap *tap);
+
+// Next packet if its audio ends by sample until (until < 0 for no limit),
+// timestamps in samples. Waits only while the stage has nothing queued.
+// Returns 1 with pkt set, 0 if nothing is due yet or the track is
+// finished, -1 if the stage failed.
+int readAudioStage(AudioStage *stage, int64_t until, AVPacket *pkt);
+
+// Mix frame and packet queue at their largest so far, and time spent
+// mixing and encoding
+int64_t audioStagePeakBytes(AudioStage *stage);
+double audioStageMs(AudioStage *stage);
+
+// Queue and mix frame at the most for an encode at bitRate, for estimates
+int64_t estimateAudioStageBytes(int64_t bitRate);
+
+// Stop the thread, wherever it is, and free what it queued
+void stopAudioStage(AudioStage *stage);
+
+#endif
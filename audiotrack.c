@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+#include "audiotrack.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+#define AUDIO_CACHE_MAGIC "REELAAC1"
+
+// One cache file: this header, the encoder's extradata, then packetCount
+// packets as (int32 size, int32 flags, data). Packet j has pts
+// (j - 1) * frameSize; the first one is the encoder's priming frame.
+typedef struct {
+  char magic[8];
+  uint64_t key;
+  int32_t sampleRate;
+  int32_t channels;
+  int32_t frameSize;
+  int32_t priming;      // encoder delay, dropped by the player
+  int32_t leadSamples;  // silence before the clip in its first frame
+  int32_t clipSamples;
+  int32_t trailSamples; // silence after it in its last frame
+  int32_t packetCount;
+  int32_t extradataSize;
+  int32_t reserved;
+} AudioCacheHeader;
+
+// Encoder frames [firstFrame, lastFrame] of the track hold the clips'
+// audio. The span's own encode provides packets firstFrame - 1 (the
+// priming frame, silent here) through lastFrame.
+typedef struct {
+  int firstFrame;
+  int lastFrame;
+  int clip; // audio file index, -1 for a mix of several
+  int64_t clipStart, clipEnd;
+  AVPacket **packets; // lastFrame - firstFrame + 2, once prepared
+} AudioSpan;
+
+struct AudioTrack {
+  Project *project; // its clips are loaded as spans need them
+  const AVCodec *codec;
+  int64_t bitRate;
+  int sampleRate;
+  int frameSize;
+  AVChannelLayout layout;
+  uint8_t *extradata;
+  int extradataSize;
+  uint64_t settings; // hash of everything that shapes the packets
+  int64_t sampleCount;
+  int frameCount;
+  AVPacket *silence;
+  AudioSpan *spans;
+  int spanCount;
+  int nextSpan;
+  int nextPacket; // from -1, the priming frame
+  AudioTrackStats stats;
+};
+
+// Fresh encoder with the settings of the one the track stands in for
+static AVCodecContext *openSpanEncoder(const AudioTrack *track) {
+  AVCodecContext *enc = avcodec_alloc_context3(track->codec);
+  if (!enc)
+    return NULL;
+  enc->bit_rate = track->bitRate;
+  enc->sample_rate = track->sampleRate;
+  enc->sample_fmt = AV_SAMPLE_FMT_FLTP;
+  enc->time_base = (AVRational){1, track->sampleRate};
+  if (av_channel_layout_copy(&enc->ch_layout, &track->layout) < 0 ||
+      avcodec_open2(enc, track->codec, NULL) < 0)
+    avcodec_free_context(&enc);
+  return enc;
+}
+
+static void freePackets(AVPacket **packets, int count) {
+  if (!packets)
+    return;
+  for (int i = 0; i < count; i++)
+    av_packet_free(&packets[i]);
+  free(packets);
+}
+
+// Encode frameCount frames of planar stereo PCM with a fresh encoder.
+// Fills packets[frameCount + 1], placed by their timestamps.
+static int encodeSpan(const AudioTrack *track, const float *left,
+                      const float *right, int frameCount, AVPacket **packets) {
+  AVCodecContext *enc = openSpanEncoder(track);
+  AVFrame *frame = av_frame_alloc();
+  AVPacket *pkt = av_packet_alloc();
+  int ret = enc && frame && pkt ? 0 : -1;
+  if (ret == 0) {
+    frame->format = AV_SAMPLE_FMT_FLTP;
+    frame->sample_rate = track->sampleRate;
+    frame->nb_samples = track->frameSize;
+    ret = av_channel_layout_copy(&frame->ch_layout, &track->layout);
+  }
+  if (ret >= 0)
+    ret = av_frame_get_buffer(frame, 0);
+
+  int F = track->frameSize;
+  for (int f = 0; ret >= 0 && f <= frameCount; f++) {
+    if (f < frameCount) {
+      ret = av_frame_make_writable(frame);
+      if (ret < 0)
+        break;
+      memcpy(frame->data[0], left + (int64_t)f * F, F * sizeof(float));
+      memcpy(frame->data[1], right + (int64_t)f * F, F * sizeof(float));
+      frame->pts = (int64_t)f * F;
+      ret = avcodec_send_frame(enc, frame);
+    } else {
+      ret = avcodec_send_frame(enc, NULL);
+    }
+    while (ret >= 0 && avcodec_receive_packet(enc, pkt) >= 0) {
+      int64_t slot = pkt->pts / F + 1;
+      if (pkt->pts % F != 0 || slot < 0 || slot > frameCount ||
+          packets[slot]) {
+        printf("Error: Unexpected packet timing from the audio encoder\n");
+        ret = -1;
+      } else {
+        packets[slot] = av_packet_clone(pkt);
+        if (!packets[slot])
+          ret = -1;
+      }
+      av_packet_unref(pkt);
+    }
+  }
+  for (int j = 0; ret >= 0 && j <= frameCount; j++) {
+    if (!packets[j]) {
+      printf("Error: Audio encoder left out packet %d of %d\n", j,
+             frameCount + 1);
+      ret = -1;
+    }
+  }
+  av_packet_free(&pkt);
+  av_frame_free(&frame);
+  avcodec_free_context(&enc);
+  return ret < 0 ? -1 : 0;
+}
+
+static void cachePath(char *path, size_t size, uint64_t key) {
+  snprintf(path, size, "%s/%016llx.aac", AUDIO_CACHE_DIR,
+           (unsigned long long)key);
+}
+
+// Packets of a cached clip, or -1 if there is no usable entry
+static int loadCachedClip(const AudioTrack *track, uint64_t key,
+                          int packetCount, AVPacket **packets) {
+  char path[256];
+  cachePath(path, sizeof(path), key);
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return -1;
+
+  AudioCacheHeader header;
+  int ret = fread(&header, sizeof(header), 1, file) == 1 ? 0 : -1;
+  if (ret == 0 &&
+      (memcmp(header.magic, AUDIO_CACHE_MAGIC, 8) != 0 || header.key != key ||
+       header.sampleRate != track->sampleRate ||
+       header.frameSize != track->frameSize ||
+       header.packetCount != packetCount ||
+       header.extradataSize != track->extradataSize))
+    ret = -1;
+  // Packets from an encoder set up differently would not decode right
+  uint8_t *extradata = ret == 0 ? malloc(header.extradataSize + 1) : NULL;
+  if (ret == 0 &&
+      (!extradata ||
+       fread(extradata, 1, header.extradataSize, file) !=
+           (size_t)header.extradataSize ||
+       memcmp(extradata, track->extradata, track->extradataSize) != 0))
+    ret = -1;
+  free(extradata);
+
+  for (int j = 0; ret == 0 && j < packetCount; j++) {
+    int32_t info[2];
+    if (fread(info, sizeof(info), 1, file) != 1 || info[0] <= 0 ||
+        !(packets[j] = av_packet_alloc()) ||
+        av_new_packet(packets[j], info[0]) < 0 ||
+        fread(packets[j]->data, 1, info[0], file) != (size_t)info[0]) {
+      ret = -1;
+      break;
+    }
+    packets[j]->flags = info[1];
+  }
+  fclose(file);
+  if (ret < 0) {
+    printf("Warning: Ignoring damaged or outdated audio cache entry %s\n",
+           path);
+    for (int j = 0; j < packetCount; j++)
+      av_packet_free(&packets[j]);
+  }
+  return ret;
+}
+
+static void saveCachedClip(const AudioTrack *track, const AudioSpan *span,
+                           uint64_t key, AVPacket **packets, int packetCount) {
+  if (mkdir(AUDIO_CACHE_DIR, 0755) < 0 && errno != EEXIST) {
+    printf("Warning: Could not create %s\n", AUDIO_CACHE_DIR);
+    return;
+  }
+  char path[256], tmpPath[272];
+  cachePath(path, sizeof(path), key);
+  // Concurrent renders of the same clip each write their own file; the
+  // last rename wins and they are identical anyway
+  snprintf(tmpPath, sizeof(tmpPath), "%s.XXXXXX", path);
+  int fd = mkstemp(tmpPath);
+  FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (!file) {
+    if (fd >= 0)
+      close(fd);
+    printf("Warning: Could not write audio cache entry %s\n", path);
+    return;
+  }
+  fchmod(fd, 0644);
+
+  int64_t firstSample = (int64_t)span->firstFrame * track->frameSize;
+  AudioCacheHeader header = {
+      .key = key,
+      .sampleRate = track->sampleRate,
+      .channels = track->layout.nb_channels,
+      .frameSize = track->frameSize,
+      .priming = track->frameSize,
+      .leadSamples = (int32_t)(span->clipStart - firstSample),
+      .clipSamples = (int32_t)(span->clipEnd - span->clipStart),
+      .trailSamples = (int32_t)((int64_t)(span->lastFrame + 1) *
+                                    track->frameSize -
+                                span->clipEnd),
+      .packetCount = packetCount,
+      .extradataSize = track->extradataSize};
+  memcpy(header.magic, AUDIO_CACHE_MAGIC, 8);
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(track->extradata, 1, track->extradataSize, file) ==
+                (size_t)track->extradataSize;
+  for (int j = 0; ok && j < packetCount; j++) {
+    int32_t info[2] = {packets[j]->size, packets[j]->flags};
+    ok = fwrite(info, sizeof(info), 1, file) == 1 &&
+         fwrite(packets[j]->data, 1, packets[j]->size, file) ==
+             (size_t)packets[j]->size;
+  }
+  if (fclose(file) != 0 || !ok || rename(tmpPath, path) != 0) {
+    printf("Warning: Could not write audio cache entry %s\n", path);
+    remove(tmpPath);
+  }
+}
+
+// Mix the span and get its packets: from the cache for a lone clip whose
+// audio has been encoded before, otherwise by encoding it now
+static int prepareSpan(AudioTrack *track, AudioSpan *span) {
+  int frames = span->lastFrame - span->firstFrame + 1;
+  int64_t samples = (int64_t)frames * track->frameSize;
+  int64_t firstSample = (int64_t)span->firstFrame * track->frameSize;
+  float *left = malloc(samples * sizeof(float));
+  float *right = malloc(samples * sizeof(float));
+  span->packets = calloc(frames + 1, sizeof(AVPacket *));
+  if (!left || !right || !span->packets) {
+    free(left);
+    free(right);
+    return -1;
+  }
+  loadProjectAudio(track->project, firstSample, firstSample + samples);
+  mixProjectAudio(track->project, firstSample, (int)samples, left, right);
+  // Past the end of the render the live encode would have had zeros
+  int64_t valid = track->sampleCount - firstSample;
+  if (valid < samples) {
+    memset(left + valid, 0, (samples - valid) * sizeof(float));
+    memset(right + valid, 0, (samples - valid) * sizeof(float));
+  }
+
+  int ret;
+  if (span->clip >= 0) {
+    // The mixed audio carries the clip's gain, cut and offset into its
+    // first frame, all of which change the packets (see audiotrack.h)
+    uint64_t key = hashManifestData(track->settings, &frames, sizeof(int));
+    key = hashManifestData(key, left, samples * sizeof(float));
+    key = hashManifestData(key, right, samples * sizeof(float));
+    ret = loadCachedClip(track, key, frames + 1, span->packets);
+    if (ret == 0) {
+      track->stats.cachedClips++;
+    } else {
+      ret = encodeSpan(track, left, right, frames, span->packets);
+      if (ret == 0) {
+        saveCachedClip(track, span, key, span->packets, frames + 1);
+        track->stats.encodedClips++;
+      }
+    }
+  } else {
+    ret = encodeSpan(track, left, right, frames, span->packets);
+    track->stats.mixedSpans++;
+  }
+  free(left);
+  free(right);
+  return ret;
+}
+
+// A packet of digital silence in the steady state, after the priming
+static AVPacket *encodeSilence(const AudioTrack *track) {
+  int frames = 3;
+  int64_t samples = (int64_t)frames * track->frameSize;
+  float *zeros = calloc(samples, sizeof(float));
+  AVPacket *packets[4] = {NULL};
+  AVPacket *silence = NULL;
+  if (zeros && encodeSpan(track, zeros, zeros, frames, packets) == 0) {
+    silence = packets[2];
+    packets[2] = NULL;
+  }
+  for (int j = 0; j <= frames; j++)
+    av_packet_free(&packets[j]);
+  free(zeros);
+  return silence;
+}
+
+AudioTrack *openAudioTrack(Project *project, const AVCodecContext *encoder,
+                           int64_t sampleCount) {
+  // Splicing relies on fixed-size frames, one frame of encoder delay and
+  // the planar stereo float the mixer produces
+  int F = encoder->frame_size;
+  if (F <= 0 || encoder->initial_padding != F ||
+      encoder->sample_fmt != AV_SAMPLE_FMT_FLTP ||
+      encoder->ch_layout.nb_channels != 2 || sampleCount <= 0) {
+    printf("Warning: The %s encoder's framing doesn't allow reusing "
+           "encoded clips, encoding the whole mix\n",
+           encoder->codec->name);
+    return NULL;
+  }
+
+  AudioTrack *track = calloc(1, sizeof(AudioTrack));
+  if (!track)
+    return NULL;
+  track->project = project;
+  track->codec = encoder->codec;
+  track->bitRate = encoder->bit_rate;
+  track->sampleRate = encoder->sample_rate;
+  track->frameSize = F;
+  track->sampleCount = sampleCount;
+  track->frameCount = (int)((sampleCount + F - 1) / F);
+  track->nextPacket = -1;
+  track->extradataSize = encoder->extradata_size;
+  track->extradata = malloc(encoder->extradata_size + 1);
+  track->spans = calloc(project->audioFileCount > 0 ? project->audioFileCount
+                                                    : 1,
+                        sizeof(AudioSpan));
+  if (!track->extradata || !track->spans ||
+      av_channel_layout_copy(&track->layout, &encoder->ch_layout) < 0) {
+    closeAudioTrack(track);
+    return NULL;
+  }
+  if (encoder->extradata_size > 0)
+    memcpy(track->extradata, encoder->extradata, encoder->extradata_size);
+
+  int version = LIBAVCODEC_VERSION_INT;
+  int layout[] = {track->sampleRate, F, track->layout.nb_channels, version};
+  track->settings = hashManifestString(MANIFEST_HASH_INIT, track->codec->name);
+  track->settings =
+      hashManifestData(track->settings, &track->bitRate, sizeof(int64_t));
+  track->settings = hashManifestData(track->settings, layout, sizeof(layout));
+
+  // One span per clip, in timeline order
+  for (int i = 0; i < project->audioFileCount; i++) {
+    int64_t start, end;
+    if (!projectClipSpan(project, i, &start, &end) || start >= sampleCount)
+      continue;
+    if (end > sampleCount)
+      end = sampleCount;
+    AudioSpan span = {(int)(start / F), (int)((end - 1) / F), i, start, end,
+                      NULL};
+    int at = track->spanCount++;
+    while (at > 0 && track->spans[at - 1].firstFrame > span.firstFrame) {
+      track->spans[at] = track->spans[at - 1];
+      at--;
+    }
+    track->spans[at] = span;
+  }
+  // A span's priming frame has to be silent, so clips with less than a
+  // frame of silence between them are mixed and encoded together
+  int merged = 0;
+  for (int i = 0; i < track->spanCount; i++) {
+    AudioSpan *last = merged > 0 ? &track->spans[merged - 1] : NULL;
+    AudioSpan *span = &track->spans[i];
+    if (last && span->firstFrame < last->lastFrame + 2) {
+      if (span->lastFrame > last->lastFrame)
+        last->lastFrame = span->lastFrame;
+      last->clip = -1;
+    } else {
+      track->spans[merged++] = *span;
+    }
+  }
+  track->spanCount = merged;
+
+  track->silence = encodeSilence(track);
+  if (!track->silence) {
+    printf("Warning: Could not encode silence, encoding the whole mix\n");
+    closeAudioTrack(track);
+    return NULL;
+  }
+  return track;
+}
+
+int readAudioTrack(AudioTrack *track, int64_t until, AVPacket *pkt) {
+  int k = track->nextPacket;
+  int64_t F = track->frameSize;
+  if (k >= track->frameCount || (until >= 0 && (k + 1) * F > until))
+    return 0;
+
+  AudioSpan *span = track->nextSpan < track->spanCount
+                        ? &track->spans[track->nextSpan]
+                        : NULL;
+  const AVPacket *src = track->silence;
+  if (span && k >= span->firstFrame - 1) {
+    if (!span->packets && prepareSpan(track, span) < 0)
+      return -1;
+    src = span->packets[k - (span->firstFrame - 1)];
+  }
+  if (av_packet_ref(pkt, src) < 0)
+    return -1;
+  pkt->pts = pkt->dts = k * F;
+  pkt->duration = F;
+  pkt->flags |= AV_PKT_FLAG_KEY;
+
+  if (span && k == span->lastFrame) {
+    freePackets(span->packets, span->lastFrame - span->firstFrame + 2);
+    span->packets = NULL;
+    track->nextSpan++;
+  }
+  track->nextPacket++;
+  return 1;
+}
+
+void getAudioTrackStats(const AudioTrack *track, AudioTrackStats *stats) {
+  *stats = track->stats;
+}
+
+void closeAudioTrack(AudioTrack *track) {
+  if (!track)
+    return;
+  for (int i = 0; i < track->spanCount; i++) {
+    AudioSpan *span = &track->spans[i];
+    freePackets(span->packets, span->lastFrame - span->firstFrame + 2);
+  }
+  av_packet_free(&track->silence);
+  av_channel_layout_uninit(&track->layout);
+  free(track->spans);
+  free(track->extradata);
+  free(track);
+}
@@ -0,0 +1,50 @@
+#ifndef AUDIOTRACK_H
+#define AUDIOTRACK_H
+
+#include <libavcodec/avcodec.h>
+#include <stdint.h>
+
+#include "project.h"
+
+// Pre-encoded voice clips, one file per clip named after the hash of the
+// PCM it encodes and the encoder settings
+#define AUDIO_CACHE_DIR "media/audiocache"
+
+// A project's AAC track put together from packets instead of one encode of
+// the whole mix. A voice clip with at least one silent encoder frame on
+// either side is encoded once on its own, with its offset into its first
+// frame as leading silence, and its packets are copied into the track from
+// the cache from then on. Clips closer together than that are mixed and
+// encoded when the track gets to them. Everything in between is one packet
+// of encoded silence, repeated.
+//
+// An entry is keyed on the clip's audio as mixed into the track, so it
+// includes the clip's offset into its first frame: moving a clip by whole
+// encoder frames (frame_size samples, 1024 for AAC) still hits, but any
+// other shift needs a new encode. AAC frames sit on a fixed grid, so
+// packets encoded at one offset can't be reused at another.
+typedef struct AudioTrack AudioTrack;
+
+typedef struct {
+  int cachedClips;  // copied from the cache
+  int encodedClips; // encoded and added to the cache
+  int mixedSpans;   // overlapping clips, encoded for this render only
+} AudioTrackStats;
+
+// Plan the track for the first sampleCount samples of the project's mix.
+// encoder is the open AAC encoder the track stands in for; its stream
+// parameters stay valid. Streamed clips are loaded as the track gets to
+// them. Returns NULL if the encoder's framing doesn't allow splicing, in
+// which case the caller encodes the mix itself.
+AudioTrack *openAudioTrack(Project *project, const AVCodecContext *encoder,
+                           int64_t sampleCount);
+
+// Next packet if its audio ends by sample until (until < 0 for no limit),
+// timestamps in samples. Returns 1 with pkt set, 0 if there is nothing due
+// yet or the track is finished, -1 on error.
+int readAudioTrack(AudioTrack *track, int64_t until, AVPacket *pkt);
+
+void getAudioTrackStats(const AudioTrack *track, AudioTrackStats *stats);
+void closeAudioTrack(AudioTrack *track);
+
+#endif
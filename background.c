@@ -0,0 +1,1000 @@
+#include "background.h"
+
+#include <errno.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+// Start positioning the standby decoder this long before the clip ends
+#define BG_PREFETCH_LEAD 1.0
+// Length of the stretches decoded for ping-pong reverse playback
+#define BG_SEGMENT_LENGTH 0.5
+// Forward jumps larger than this seek instead of decoding through
+#define BG_SEEK_THRESHOLD 0.5
+// Frames a decoder keeps besides one per frame thread: references and the
+// frame being output, for the estimate in accountBackgroundMemory
+#define BG_DECODER_FRAMES 6
+
+int parseBackgroundMode(const char *name, BackgroundMode *mode) {
+  if (strcmp(name, "once") == 0) {
+    *mode = BG_MODE_ONCE;
+  } else if (strcmp(name, "loop") == 0) {
+    *mode = BG_MODE_LOOP;
+  } else if (strcmp(name, "pingpong") == 0) {
+    *mode = BG_MODE_PINGPONG;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+const char *backgroundModeName(BackgroundMode mode) {
+  switch (mode) {
+  case BG_MODE_LOOP:
+    return "loop";
+  case BG_MODE_PINGPONG:
+    return "pingpong";
+  default:
+    return "once";
+  }
+}
+
+int parseBackgroundFit(const char *name, BackgroundFit *fit) {
+  if (strcmp(name, "crop") == 0) {
+    *fit = BG_FIT_CROP;
+  } else if (strcmp(name, "fit") == 0) {
+    *fit = BG_FIT_CONTAIN;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+const char *backgroundFitName(BackgroundFit fit) {
+  return fit == BG_FIT_CONTAIN ? "fit" : "crop";
+}
+
+static int evenDown(double value) { return ((int)value) & ~1; }
+
+// Work out which part of a src_width x src_height source is shown and where
+// it lands in the output, keeping the source's display aspect ratio
+static void fitBackgroundRects(BackgroundScaler *s, BackgroundFit fit,
+                               AVRational sar) {
+  double display_width = s->src_width;
+  if (sar.num > 0 && sar.den > 0)
+    display_width *= av_q2d(sar);
+  double src_aspect = display_width / s->src_height;
+  double dst_aspect = (double)WIDTH / HEIGHT;
+
+  s->crop_x = 0;
+  s->crop_y = 0;
+  s->crop_width = s->src_width & ~1;
+  s->crop_height = s->src_height & ~1;
+  s->dst_x = 0;
+  s->dst_y = 0;
+  s->dst_width = WIDTH;
+  s->dst_height = HEIGHT;
+  if (fabs(src_aspect - dst_aspect) < 0.001)
+    return;
+
+  if (fit == BG_FIT_CROP) {
+    if (src_aspect > dst_aspect) {
+      // Wider than the output (landscape): cut the sides
+      s->crop_width = evenDown(s->src_width * dst_aspect / src_aspect);
+      s->crop_x = evenDown((s->src_width - s->crop_width) / 2.0);
+    } else {
+      s->crop_height = evenDown(s->src_height * src_aspect / dst_aspect);
+      s->crop_y = evenDown((s->src_height - s->crop_height) / 2.0);
+    }
+  } else if (src_aspect > dst_aspect) {
+    s->dst_height = evenDown(HEIGHT * dst_aspect / src_aspect);
+    s->dst_y = evenDown((HEIGHT - s->dst_height) / 2.0);
+  } else {
+    s->dst_width = evenDown(WIDTH * src_aspect / dst_aspect);
+    s->dst_x = evenDown((WIDTH - s->dst_width) / 2.0);
+  }
+}
+
+static int setupBackgroundScaler(BackgroundScaler *s, BackgroundFit fit,
+                                 const AVFrame *src) {
+  if (s->sws_ctx)
+    sws_freeContext(s->sws_ctx);
+  s->src_width = src->width;
+  s->src_height = src->height;
+  s->src_format = src->format;
+  fitBackgroundRects(s, fit, src->sample_aspect_ratio);
+  if (!s->cropped)
+    s->cropped = av_frame_alloc();
+  if (!s->window)
+    s->window = av_frame_alloc();
+
+  // Downscaling a 4K frame is the expensive part, so let swscale slice it
+  // across threads (which only sws_scale_frame does)
+  s->sws_ctx = sws_alloc_context();
+  if (!s->sws_ctx || !s->cropped || !s->window)
+    return -1;
+  av_opt_set_int(s->sws_ctx, "srcw", s->crop_width, 0);
+  av_opt_set_int(s->sws_ctx, "srch", s->crop_height, 0);
+  av_opt_set_int(s->sws_ctx, "src_format", src->format, 0);
+  av_opt_set_int(s->sws_ctx, "dstw", s->dst_width, 0);
+  av_opt_set_int(s->sws_ctx, "dsth", s->dst_height, 0);
+  av_opt_set_int(s->sws_ctx, "dst_format", AV_PIX_FMT_YUV420P, 0);
+  av_opt_set_int(s->sws_ctx, "sws_flags", SWS_BILINEAR, 0);
+  av_opt_set_int(s->sws_ctx, "threads", cpuCount(), 0);
+  if (sws_init_context(s->sws_ctx, NULL, NULL) < 0) {
+    sws_freeContext(s->sws_ctx);
+    s->sws_ctx = NULL;
+    return -1;
+  }
+  printf("Background scaling %dx%d -> %dx%d (%s, showing %dx%d at %d,%d)\n",
+         src->width, src->height, s->dst_width, s->dst_height,
+         backgroundFitName(fit), s->crop_width, s->crop_height, s->crop_x,
+         s->crop_y);
+  return 0;
+}
+
+static void freeBackgroundScaler(BackgroundScaler *s) {
+  if (s->sws_ctx)
+    sws_freeContext(s->sws_ctx);
+  if (s->cropped)
+    av_frame_free(&s->cropped);
+  if (s->window)
+    av_frame_free(&s->window);
+  memset(s, 0, sizeof(BackgroundScaler));
+}
+
+// Black out a rectangle of a YUV420P frame (all values even)
+static void fillBlack(AVFrame *frame, int x, int y, int width, int height) {
+  uint8_t *data[4] = {
+      frame->data[0] + y * frame->linesize[0] + x,
+      frame->data[1] + y / 2 * frame->linesize[1] + x / 2,
+      frame->data[2] + y / 2 * frame->linesize[2] + x / 2, NULL};
+  ptrdiff_t linesize[4] = {frame->linesize[0], frame->linesize[1],
+                           frame->linesize[2], 0};
+  av_image_fill_black(data, linesize, AV_PIX_FMT_YUV420P, AVCOL_RANGE_MPEG,
+                      width, height);
+}
+
+// Crop and scale src into dst, a WIDTH x HEIGHT YUV420P frame
+static int scaleBackgroundFrame(BackgroundScaler *s, BackgroundFit fit,
+                                const AVFrame *src, AVFrame *dst) {
+  if (!s->sws_ctx || src->width != s->src_width ||
+      src->height != s->src_height || src->format != s->src_format) {
+    if (setupBackgroundScaler(s, fit, src) < 0) {
+      printf("Error: Could not set up background scaling\n");
+      return -1;
+    }
+  }
+  if (av_frame_ref(s->cropped, src) < 0)
+    return -1;
+  s->cropped->crop_left = s->crop_x;
+  s->cropped->crop_top = s->crop_y;
+  s->cropped->crop_right = src->width - s->crop_x - s->crop_width;
+  s->cropped->crop_bottom = src->height - s->crop_y - s->crop_height;
+  int ret = av_frame_apply_cropping(s->cropped, AV_FRAME_CROP_UNALIGNED);
+
+  // dst restricted to where the picture goes
+  if (ret >= 0)
+    ret = av_frame_ref(s->window, dst);
+  if (ret >= 0) {
+    s->window->data[0] += s->dst_y * dst->linesize[0] + s->dst_x;
+    for (int plane = 1; plane < 3; plane++)
+      s->window->data[plane] +=
+          s->dst_y / 2 * dst->linesize[plane] + s->dst_x / 2;
+    s->window->width = s->dst_width;
+    s->window->height = s->dst_height;
+    ret = sws_scale_frame(s->sws_ctx, s->window, s->cropped);
+  }
+  av_frame_unref(s->window);
+  av_frame_unref(s->cropped);
+  if (ret < 0)
+    return -1;
+
+  // Bars for fit mode; the rest of the frame was just overwritten
+  if (s->dst_y > 0) {
+    fillBlack(dst, 0, 0, WIDTH, s->dst_y);
+    fillBlack(dst, 0, s->dst_y + s->dst_height, WIDTH,
+              HEIGHT - s->dst_y - s->dst_height);
+  }
+  if (s->dst_x > 0) {
+    fillBlack(dst, 0, 0, s->dst_x, HEIGHT);
+    fillBlack(dst, s->dst_x + s->dst_width, 0,
+              WIDTH - s->dst_x - s->dst_width, HEIGHT);
+  }
+  // swscale converts full range YUVJ input; plain YUV keeps its range
+  dst->color_range = src->format != AV_PIX_FMT_YUVJ420P
+                         ? src->color_range
+                         : AVCOL_RANGE_MPEG;
+  dst->pts = src->pts;
+  return 0;
+}
+
+static AVFrame *allocScaledFrame(void) {
+  AVFrame *frame = av_frame_alloc();
+  if (!frame)
+    return NULL;
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width = WIDTH;
+  frame->height = HEIGHT;
+  if (av_frame_get_buffer(frame, 0) < 0)
+    av_frame_free(&frame);
+  return frame;
+}
+
+// Open the demuxer and decoder for one of the two decoders
+static int openBackgroundDecoder(BackgroundVideo *bg, BackgroundDecoder *dec,
+                                 const char *filename, bool verbose) {
+  // Demux from the shared mapping when there is one
+  if (bg->input) {
+    dec->fmt_ctx = avformat_alloc_context();
+    dec->io = dec->fmt_ctx ? openMappedReader(bg->input) : NULL;
+    if (!dec->io) {
+      printf("Error: Could not set up background video input\n");
+      return -1;
+    }
+    dec->fmt_ctx->pb = dec->io;
+    dec->fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
+
+  // Open video file
+  if (avformat_open_input(&dec->fmt_ctx, filename, NULL, NULL) < 0) {
+    printf("Error: Could not open background video file: %s\n", filename);
+    return -1;
+  }
+
+  if (avformat_find_stream_info(dec->fmt_ctx, NULL) < 0) {
+    printf("Error: Could not find stream information\n");
+    return -1;
+  }
+
+  // Find video stream
+  int stream_index = -1;
+  for (unsigned int i = 0; i < dec->fmt_ctx->nb_streams; i++) {
+    if (dec->fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+      stream_index = i;
+      break;
+    }
+  }
+
+  if (stream_index == -1) {
+    printf("Error: No video stream found\n");
+    return -1;
+  }
+  AVStream *stream = dec->fmt_ctx->streams[stream_index];
+
+  // Find H.264 decoder with hardware acceleration support
+  const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+  if (!codec) {
+    printf("Error: Could not find decoder for codec\n");
+    return -1;
+  }
+
+  if (verbose)
+    printf("Found decoder: %s\n", codec->name);
+
+  // Allocate codec context
+  dec->codec_ctx = avcodec_alloc_context3(codec);
+  if (!dec->codec_ctx) {
+    printf("Error: Could not allocate codec context\n");
+    return -1;
+  }
+
+  // Copy codec parameters
+  if (avcodec_parameters_to_context(dec->codec_ctx, stream->codecpar) < 0) {
+    printf("Error: Could not copy codec parameters\n");
+    return -1;
+  }
+
+  // Try VAAPI hardware acceleration first
+  AVDictionary *opts = NULL;
+  av_dict_set(&opts, "hwaccel", "vaapi", 0);
+  av_dict_set(&opts, "hwaccel_device", "/dev/dri/renderD128", 0);
+
+  if (avcodec_open2(dec->codec_ctx, codec, &opts) >= 0) {
+    if (verbose)
+      printf("Successfully initialized VAAPI hardware acceleration\n");
+  } else {
+    printf("Warning: VAAPI failed, trying software decoder\n");
+    av_dict_free(&opts);
+    avcodec_free_context(&dec->codec_ctx);
+
+    // Fallback to software decoder
+    dec->codec_ctx = avcodec_alloc_context3(codec);
+    if (!dec->codec_ctx ||
+        avcodec_parameters_to_context(dec->codec_ctx, stream->codecpar) < 0 ||
+        avcodec_open2(dec->codec_ctx, codec, NULL) < 0) {
+      printf("Error: Could not initialize decoder\n");
+      return -1;
+    }
+    if (verbose)
+      printf("Using software decoder\n");
+  }
+  av_dict_free(&opts);
+
+  // Allocate frame and packet
+  dec->frame = av_frame_alloc();
+  dec->pkt = av_packet_alloc();
+
+  if (!dec->frame || !dec->pkt) {
+    printf("Error: Could not allocate frames or packet\n");
+    return -1;
+  }
+
+  if (bg->stream_index == -1) {
+    bg->stream_index = stream_index;
+    bg->video_stream = stream;
+  }
+  return 0;
+}
+
+static void closeBackgroundDecoder(BackgroundDecoder *dec) {
+  if (dec->frame)
+    av_frame_free(&dec->frame);
+  if (dec->pkt)
+    av_packet_free(&dec->pkt);
+  if (dec->codec_ctx)
+    avcodec_free_context(&dec->codec_ctx);
+  if (dec->fmt_ctx)
+    avformat_close_input(&dec->fmt_ctx);
+  closeMappedReader(&dec->io);
+}
+
+static void seekBackgroundDecoder(BackgroundVideo *bg, BackgroundDecoder *dec,
+                                  double source_time) {
+  // Calculate target PTS for seeking
+  int64_t target_pts = (int64_t)(source_time / bg->time_base);
+  if (bg->start_time != AV_NOPTS_VALUE) {
+    target_pts += bg->start_time;
+  }
+
+  if (av_seek_frame(dec->fmt_ctx, bg->stream_index, target_pts,
+                    AVSEEK_FLAG_BACKWARD) >= 0) {
+    avcodec_flush_buffers(dec->codec_ctx);
+  }
+  dec->has_pending = false;
+  dec->draining = false;
+  dec->eof = false;
+}
+
+// Decode the next frame into dec->frame. Returns -1 at the end of the file.
+static int decodeNextFrame(BackgroundVideo *bg, BackgroundDecoder *dec) {
+  if (dec->eof)
+    return -1;
+
+  for (;;) {
+    int ret = avcodec_receive_frame(dec->codec_ctx, dec->frame);
+    if (ret >= 0) {
+      int64_t frame_pts = dec->frame->pts;
+      if (frame_pts == AV_NOPTS_VALUE)
+        frame_pts = dec->frame->best_effort_timestamp;
+      if (bg->start_time != AV_NOPTS_VALUE) {
+        frame_pts -= bg->start_time;
+      }
+      dec->pending_time = frame_pts * bg->time_base;
+      dec->has_pending = true;
+      return 0;
+    }
+    if (ret != AVERROR(EAGAIN) || dec->draining) {
+      dec->eof = true;
+      return -1;
+    }
+
+    ret = av_read_frame(dec->fmt_ctx, dec->pkt);
+    if (ret < 0) {
+      // Out of packets: flush the frames still buffered in the decoder
+      avcodec_send_packet(dec->codec_ctx, NULL);
+      dec->draining = true;
+      continue;
+    }
+    if (dec->pkt->stream_index == bg->stream_index) {
+      avcodec_send_packet(dec->codec_ctx, dec->pkt);
+    }
+    av_packet_unref(dec->pkt);
+  }
+}
+
+// Move the decoder's pending frame into a standalone software frame at
+// output size. Segments are only decoded while the prefetch thread is idle
+// or on it, so they have a scaler of their own.
+static AVFrame *takePendingFrame(BackgroundVideo *bg, BackgroundDecoder *dec) {
+  AVFrame *copy = av_frame_alloc();
+  if (!copy)
+    return NULL;
+
+  if (dec->frame->format == AV_PIX_FMT_VAAPI) {
+    // Don't hold on to GPU surfaces, the decoder's pool is small
+    if (av_hwframe_transfer_data(copy, dec->frame, 0) < 0) {
+      av_frame_free(&copy);
+      return NULL;
+    }
+    av_frame_copy_props(copy, dec->frame);
+    av_frame_unref(dec->frame);
+  } else {
+    av_frame_move_ref(copy, dec->frame);
+  }
+  dec->has_pending = false;
+
+  // A 4K segment would hold several times the memory for no benefit
+  if (copy->width != WIDTH || copy->height != HEIGHT) {
+    AVFrame *scaled = allocScaledFrame();
+    if (!scaled || scaleBackgroundFrame(&bg->prefetch_scaler, bg->fit, copy,
+                                        scaled) < 0) {
+      av_frame_free(&scaled);
+      av_frame_free(&copy);
+      return NULL;
+    }
+    av_frame_free(&copy);
+    return scaled;
+  }
+  return copy;
+}
+
+static void clearSegment(BackgroundSegment *seg) {
+  for (int i = 0; i < seg->count; i++) {
+    av_frame_free(&seg->frames[i]);
+  }
+  seg->count = 0;
+  seg->start = 0.0;
+  seg->end = -1.0;
+}
+
+static bool segmentCovers(const BackgroundSegment *seg, double source_time) {
+  return seg->count > 0 && source_time >= seg->start &&
+         source_time <= seg->end;
+}
+
+// Decode the frames needed to show source times [start, end] into seg
+static void decodeSegment(BackgroundVideo *bg, BackgroundDecoder *dec,
+                          BackgroundSegment *seg, double start, double end) {
+  clearSegment(seg);
+  seekBackgroundDecoder(bg, dec, start);
+
+  // Keep the frame already on screen at `start` as well
+  double first_wanted = start - bg->frame_duration;
+  double last_wanted = end + 0.5 / FPS;
+
+  while (decodeNextFrame(bg, dec) == 0) {
+    double frame_time = dec->pending_time;
+    if (frame_time > last_wanted) {
+      break;
+    }
+    if (frame_time <= first_wanted) {
+      // Still decoding up from the keyframe before the segment
+      dec->has_pending = false;
+      continue;
+    }
+
+    if (seg->count == seg->capacity) {
+      int capacity = seg->capacity ? seg->capacity * 2 : 32;
+      AVFrame **frames = realloc(seg->frames, capacity * sizeof(AVFrame *));
+      double *times = realloc(seg->times, capacity * sizeof(double));
+      if (frames)
+        seg->frames = frames;
+      if (times)
+        seg->times = times;
+      if (!frames || !times) {
+        printf("Error: Could not grow reverse playback buffer\n");
+        break;
+      }
+      seg->capacity = capacity;
+    }
+
+    AVFrame *copy = takePendingFrame(bg, dec);
+    if (!copy) {
+      printf("Error: Failed to transfer or scale background frame\n");
+      break;
+    }
+    seg->frames[seg->count] = copy;
+    seg->times[seg->count] = frame_time;
+    seg->count++;
+  }
+
+  // The decoder is left somewhere in the middle of the clip
+  dec->has_pending = false;
+  seg->start = start;
+  seg->end = end;
+}
+
+static void runPrefetchJob(BackgroundVideo *bg, BackgroundJob job,
+                           double start, double end) {
+  if (job == BG_JOB_ARM_START) {
+    seekBackgroundDecoder(bg, bg->standby, 0.0);
+    bg->standby_armed = decodeNextFrame(bg, bg->standby) == 0;
+  } else if (job == BG_JOB_SEGMENT) {
+    bg->standby_armed = false;
+    decodeSegment(bg, bg->standby, bg->next_segment, start, end);
+  }
+}
+
+static void *backgroundPrefetchThread(void *arg) {
+  BackgroundVideo *bg = arg;
+
+  pthread_mutex_lock(&bg->prefetch_lock);
+  for (;;) {
+    while (bg->prefetch_job == BG_JOB_NONE && !bg->prefetch_quit) {
+      pthread_cond_wait(&bg->prefetch_cond, &bg->prefetch_lock);
+    }
+    if (bg->prefetch_quit)
+      break;
+
+    BackgroundJob job = bg->prefetch_job;
+    double start = bg->prefetch_start;
+    double end = bg->prefetch_end;
+    pthread_mutex_unlock(&bg->prefetch_lock);
+
+    runPrefetchJob(bg, job, start, end);
+
+    pthread_mutex_lock(&bg->prefetch_lock);
+    bg->prefetch_job = BG_JOB_NONE;
+    pthread_cond_broadcast(&bg->prefetch_cond);
+  }
+  pthread_mutex_unlock(&bg->prefetch_lock);
+  return NULL;
+}
+
+// Hand a job to the prefetch thread unless it is still busy
+static void requestPrefetch(BackgroundVideo *bg, BackgroundJob job,
+                            double start, double end) {
+  pthread_mutex_lock(&bg->prefetch_lock);
+  if (bg->prefetch_job == BG_JOB_NONE) {
+    bg->prefetch_job = job;
+    bg->prefetch_start = start;
+    bg->prefetch_end = end;
+    pthread_cond_broadcast(&bg->prefetch_cond);
+  }
+  pthread_mutex_unlock(&bg->prefetch_lock);
+}
+
+// Block until the prefetch thread is idle, after which the standby decoder
+// and next_segment belong to the caller
+static void waitForPrefetch(BackgroundVideo *bg) {
+  if (!bg->prefetch_running)
+    return;
+  pthread_mutex_lock(&bg->prefetch_lock);
+  while (bg->prefetch_job != BG_JOB_NONE) {
+    pthread_cond_wait(&bg->prefetch_cond, &bg->prefetch_lock);
+  }
+  pthread_mutex_unlock(&bg->prefetch_lock);
+}
+
+static bool prefetchIdle(BackgroundVideo *bg) {
+  pthread_mutex_lock(&bg->prefetch_lock);
+  bool idle = bg->prefetch_job == BG_JOB_NONE;
+  pthread_mutex_unlock(&bg->prefetch_lock);
+  return idle;
+}
+
+// Initialize background video decoder
+int initBackgroundVideo(BackgroundVideo *bg, const char *filename,
+                        BackgroundMode mode, BackgroundFit fit) {
+  memset(bg, 0, sizeof(BackgroundVideo));
+  bg->stream_index = -1;
+  bg->mode = mode;
+  bg->fit = fit;
+  bg->first_seek = true;
+  bg->leg = -1;
+  bg->active = &bg->decoders[0];
+  bg->standby = &bg->decoders[1];
+  bg->current_segment = &bg->segments[0];
+  bg->next_segment = &bg->segments[1];
+  clearSegment(bg->current_segment);
+  clearSegment(bg->next_segment);
+
+  // Demuxing never waits on the disk as long as read-ahead keeps up
+  bg->input = openMappedFile(filename);
+  if (bg->input)
+    printf("Background input: memory-mapped, %d MB read-ahead\n",
+           MAPPED_READAHEAD >> 20);
+
+  if (openBackgroundDecoder(bg, bg->active, filename, true) < 0) {
+    return -1;
+  }
+  AVCodecContext *codec_ctx = bg->active->codec_ctx;
+
+  bg->sw_frame = av_frame_alloc();
+  bg->shown = av_frame_alloc();
+  if (!bg->sw_frame || !bg->shown) {
+    printf("Error: Could not allocate frames or packet\n");
+    return -1;
+  }
+
+  // Anything but WIDTH x HEIGHT is cropped or fitted as it is decoded
+  if (codec_ctx->width != WIDTH || codec_ctx->height != HEIGHT) {
+    bg->scaled = allocScaledFrame();
+    if (!bg->scaled) {
+      printf("Error: Could not allocate scaled background frame\n");
+      return -1;
+    }
+  }
+
+  bg->time_base = av_q2d(bg->video_stream->time_base);
+  bg->start_time = bg->video_stream->start_time;
+
+  if (bg->video_stream->duration != AV_NOPTS_VALUE) {
+    bg->duration = bg->video_stream->duration * bg->time_base;
+  } else if (bg->active->fmt_ctx->duration != AV_NOPTS_VALUE) {
+    bg->duration = (double)bg->active->fmt_ctx->duration / AV_TIME_BASE;
+  }
+  AVRational frame_rate = bg->video_stream->avg_frame_rate;
+  bg->frame_duration = frame_rate.num > 0 && frame_rate.den > 0
+                           ? 1.0 / av_q2d(frame_rate)
+                           : 1.0 / 30.0;
+
+  printf("Background video initialized: %dx%d, time_base: %f, "
+         "duration: %.2fs, mode: %s, %s\n",
+         codec_ctx->width, codec_ctx->height, bg->time_base, bg->duration,
+         backgroundModeName(mode), backgroundFitName(fit));
+
+  if (mode != BG_MODE_ONCE) {
+    // Second decoder on the same file, kept parked on the loop point
+    if (openBackgroundDecoder(bg, bg->standby, filename, false) < 0) {
+      return -1;
+    }
+    pthread_mutex_init(&bg->prefetch_lock, NULL);
+    pthread_cond_init(&bg->prefetch_cond, NULL);
+    if (pthread_create(&bg->prefetch_thread, NULL, backgroundPrefetchThread,
+                       bg) != 0) {
+      printf("Error: Could not start background prefetch thread\n");
+      pthread_mutex_destroy(&bg->prefetch_lock);
+      pthread_cond_destroy(&bg->prefetch_cond);
+      return -1;
+    }
+    bg->prefetch_running = true;
+  }
+
+  return 0;
+}
+
+// Map an output time onto the clip. Sets the loop iteration and returns true
+// while ping-pong playback is running backwards.
+static bool mapBackgroundTime(const BackgroundVideo *bg, double target_time,
+                              double *source_time, int64_t *leg) {
+  double duration = bg->duration;
+  if (bg->mode == BG_MODE_ONCE || duration <= 0.0 || target_time < 0.0) {
+    *source_time = target_time;
+    *leg = 0;
+    return false;
+  }
+
+  int64_t n = (int64_t)floor(target_time / duration);
+  double offset = target_time - n * duration;
+  *leg = n;
+  if (bg->mode == BG_MODE_PINGPONG && (n & 1)) {
+    *source_time = duration - offset;
+    return true;
+  }
+  *source_time = offset;
+  return false;
+}
+
+// Pick up the decoder or segment the prefetch thread prepared for a new leg
+static void startBackgroundLeg(BackgroundVideo *bg, bool reverse,
+                               double source_time) {
+  waitForPrefetch(bg);
+
+  if (!reverse) {
+    if (bg->leg >= 0 && bg->standby_armed) {
+      // Standby already sits on the loop start with its first frame decoded
+      BackgroundDecoder *parked = bg->standby;
+      bg->standby = bg->active;
+      bg->active = parked;
+      bg->standby_armed = false;
+      bg->first_seek = false;
+      bg->last_source_time = 0.0;
+      bg->shown_valid = false;
+    } else {
+      bg->first_seek = true;
+    }
+    return;
+  }
+
+  if (segmentCovers(bg->next_segment, source_time)) {
+    BackgroundSegment *ready = bg->next_segment;
+    bg->next_segment = bg->current_segment;
+    bg->current_segment = ready;
+  }
+}
+
+static int selectForwardFrame(BackgroundVideo *bg, double source_time) {
+  BackgroundDecoder *dec = bg->active;
+
+  // Smart seeking - only seek for large jumps or backwards
+  bool should_seek = bg->first_seek || source_time < bg->last_source_time ||
+                     (source_time - bg->last_source_time) > BG_SEEK_THRESHOLD;
+
+  if (should_seek) {
+    seekBackgroundDecoder(bg, dec, source_time);
+    bg->first_seek = false;
+    bg->shown_valid = false;
+  }
+  bg->last_source_time = source_time;
+
+  // Show the newest frame due by the middle of this output frame; the first
+  // one past that stays pending in the decoder for a later call
+  double limit = source_time + 0.5 / FPS;
+  bool updated = false;
+  for (;;) {
+    if (!dec->has_pending && decodeNextFrame(bg, dec) < 0)
+      break;
+    if (dec->pending_time > limit && (bg->shown_valid || updated))
+      break;
+
+    av_frame_unref(bg->shown);
+    av_frame_move_ref(bg->shown, dec->frame);
+    bg->shown_time = dec->pending_time;
+    dec->has_pending = false;
+    updated = true;
+    if (bg->shown_time > limit)
+      break;
+  }
+
+  if (updated) {
+    bg->shown_valid = true;
+    bg->shown_serial++;
+  }
+  if (!bg->shown_valid)
+    return -1;
+
+  // Past the last frame: hold it until the loop wraps, or stop in once mode
+  if (dec->eof && !dec->has_pending &&
+      source_time > bg->shown_time + bg->frame_duration) {
+    return bg->mode == BG_MODE_ONCE ? -1 : 1;
+  }
+  return 0;
+}
+
+static int selectReverseFrame(BackgroundVideo *bg, double source_time) {
+  if (!segmentCovers(bg->current_segment, source_time)) {
+    waitForPrefetch(bg);
+    if (segmentCovers(bg->next_segment, source_time)) {
+      BackgroundSegment *ready = bg->next_segment;
+      bg->next_segment = bg->current_segment;
+      bg->current_segment = ready;
+    } else {
+      // Prefetch didn't get here in time (or we jumped): decode in place
+      double start = fmax(0.0, source_time - BG_SEGMENT_LENGTH);
+      decodeSegment(bg, bg->standby, bg->current_segment, start, source_time);
+      bg->standby_armed = false;
+    }
+  }
+
+  BackgroundSegment *seg = bg->current_segment;
+  if (seg->count == 0)
+    return -1;
+
+  double limit = source_time + 0.5 / FPS;
+  int pick = 0;
+  for (int i = 0; i < seg->count; i++) {
+    if (seg->times[i] <= limit && seg->times[i] >= seg->times[pick])
+      pick = i;
+  }
+
+  if (!bg->shown_valid || bg->shown_time != seg->times[pick]) {
+    av_frame_unref(bg->shown);
+    if (av_frame_ref(bg->shown, seg->frames[pick]) < 0) {
+      bg->shown_valid = false;
+      return -1;
+    }
+    bg->shown_time = seg->times[pick];
+    bg->shown_valid = true;
+    bg->shown_serial++;
+  }
+  // Forward playback has to seek again after the turn
+  bg->first_seek = true;
+  return 0;
+}
+
+// Get the loop point ready on the standby decoder before it is needed
+static void schedulePrefetch(BackgroundVideo *bg, double source_time,
+                             bool reverse) {
+  if (!bg->prefetch_running || bg->duration <= 0.0 || !prefetchIdle(bg))
+    return;
+
+  double duration = bg->duration;
+  if (!reverse) {
+    if (source_time < duration - BG_PREFETCH_LEAD)
+      return;
+    if (bg->mode == BG_MODE_LOOP) {
+      if (!bg->standby_armed)
+        requestPrefetch(bg, BG_JOB_ARM_START, 0.0, 0.0);
+    } else if (!segmentCovers(bg->next_segment, duration)) {
+      requestPrefetch(bg, BG_JOB_SEGMENT,
+                      fmax(0.0, duration - BG_SEGMENT_LENGTH), duration);
+    }
+    return;
+  }
+
+  double segment_start = bg->current_segment->start;
+  if (segment_start > 0.0) {
+    if (!segmentCovers(bg->next_segment, segment_start - 0.5 / FPS)) {
+      requestPrefetch(bg, BG_JOB_SEGMENT,
+                      fmax(0.0, segment_start - BG_SEGMENT_LENGTH),
+                      segment_start);
+    }
+  } else if (!bg->standby_armed) {
+    // Last reverse segment: park the standby decoder on the start for the
+    // turn back to forward playback
+    requestPrefetch(bg, BG_JOB_ARM_START, 0.0, 0.0);
+  }
+}
+
+static int convertShownFrame(BackgroundVideo *bg, uint8_t *rgba_buffer) {
+  if (bg->converted_buffer == rgba_buffer &&
+      bg->converted_serial == bg->shown_serial)
+    return 0;
+
+  // Check if this is a hardware frame that needs transfer
+  AVFrame *src_frame = bg->shown;
+  if (src_frame->format == AV_PIX_FMT_VAAPI) {
+    av_frame_unref(bg->sw_frame);
+    int ret = av_hwframe_transfer_data(bg->sw_frame, src_frame, 0);
+    if (ret < 0) {
+      printf("Error: Failed to transfer frame from GPU to CPU (ret=%d)\n", ret);
+      return -1;
+    }
+    src_frame = bg->sw_frame;
+  }
+
+  // Everything is converted at output size
+  if (src_frame->width != WIDTH || src_frame->height != HEIGHT) {
+    if (!bg->scaled && !(bg->scaled = allocScaledFrame()))
+      return -1;
+    if (scaleBackgroundFrame(&bg->scaler, bg->fit, src_frame, bg->scaled) <
+        0)
+      return -1;
+    src_frame = bg->scaled;
+  }
+
+  // Direct conversion from YUV to RGBA
+  if (bg->converter && src_frame->color_range != AVCOL_RANGE_JPEG &&
+      colorConverterSupports(src_frame->format, WIDTH, HEIGHT)) {
+    if (convertYUVToRGBA(bg->converter, src_frame, rgba_buffer, WIDTH * 4) < 0)
+      return -1;
+    bg->converted_buffer = rgba_buffer;
+    bg->converted_serial = bg->shown_serial;
+    return 0;
+  }
+
+  bg->sws_ctx = sws_getCachedContext(bg->sws_ctx, WIDTH, HEIGHT,
+                                     src_frame->format, WIDTH, HEIGHT,
+                                     AV_PIX_FMT_RGBA, SWS_FAST_BILINEAR, NULL,
+                                     NULL, NULL);
+  if (!bg->sws_ctx) {
+    printf("Error: Could not initialize color conversion context\n");
+    return -1;
+  }
+  const uint8_t *src_data[4] = {src_frame->data[0], src_frame->data[1],
+                                src_frame->data[2], NULL};
+  int src_linesize[4] = {src_frame->linesize[0], src_frame->linesize[1],
+                         src_frame->linesize[2], 0};
+  uint8_t *dst_data[1] = {rgba_buffer};
+  int dst_linesize[1] = {WIDTH * 4};
+
+  sws_scale(bg->sws_ctx, src_data, src_linesize, 0, HEIGHT, dst_data,
+            dst_linesize);
+
+  bg->converted_buffer = rgba_buffer;
+  bg->converted_serial = bg->shown_serial;
+  return 0;
+}
+
+// Move playback to an output time, decoding up to the frame due then.
+// Returns 0 with bg->shown holding it, -1 if there is nothing to show.
+static int selectBackgroundFrame(BackgroundVideo *bg, double target_time) {
+  double source_time;
+  int64_t leg;
+  bool reverse =
+      mapBackgroundTime(bg, target_time + bg->offset, &source_time, &leg);
+
+  if (leg != bg->leg) {
+    startBackgroundLeg(bg, reverse, source_time);
+    bg->leg = leg;
+  }
+
+  int ret = reverse ? selectReverseFrame(bg, source_time)
+                    : selectForwardFrame(bg, source_time);
+
+  if (ret == 1 && bg->duration <= 0.0) {
+    // Container didn't report a duration; the end of the file tells us
+    bg->duration = bg->shown_time + bg->frame_duration;
+    printf("Background duration detected at end of file: %.2fs\n",
+           bg->duration);
+    return selectBackgroundFrame(bg, target_time);
+  }
+  if (ret < 0)
+    return -1;
+
+  schedulePrefetch(bg, source_time, reverse);
+  return 0;
+}
+
+// Get background video frame at specific time on-demand
+int getBackgroundFrame(BackgroundVideo *bg, double target_time,
+                       uint8_t *rgba_buffer) {
+  if (selectBackgroundFrame(bg, target_time) < 0)
+    return -1;
+  return convertShownFrame(bg, rgba_buffer);
+}
+
+void skipBackgroundFrame(BackgroundVideo *bg, double target_time) {
+  selectBackgroundFrame(bg, target_time);
+}
+
+void resetBackgroundVideo(BackgroundVideo *bg, double offset) {
+  // The standby decoder and decoded segments only depend on source times,
+  // so whatever the prefetch thread prepared stays usable
+  waitForPrefetch(bg);
+  bg->offset = offset;
+  bg->first_seek = true;
+  bg->last_source_time = 0.0;
+  bg->leg = -1;
+  bg->shown_valid = false;
+  bg->converted_buffer = NULL;
+}
+
+// Cleanup background video
+void cleanupBackgroundVideo(BackgroundVideo *bg) {
+  if (bg->prefetch_running) {
+    pthread_mutex_lock(&bg->prefetch_lock);
+    bg->prefetch_quit = true;
+    pthread_cond_broadcast(&bg->prefetch_cond);
+    pthread_mutex_unlock(&bg->prefetch_lock);
+    pthread_join(bg->prefetch_thread, NULL);
+    pthread_mutex_destroy(&bg->prefetch_lock);
+    pthread_cond_destroy(&bg->prefetch_cond);
+    bg->prefetch_running = false;
+  }
+  for (int i = 0; i < 2; i++) {
+    clearSegment(&bg->segments[i]);
+    free(bg->segments[i].frames);
+    free(bg->segments[i].times);
+    closeBackgroundDecoder(&bg->decoders[i]);
+  }
+  closeMappedFile(bg->input);
+  bg->input = NULL;
+  if (bg->sws_ctx)
+    sws_freeContext(bg->sws_ctx);
+  freeBackgroundScaler(&bg->scaler);
+  freeBackgroundScaler(&bg->prefetch_scaler);
+  if (bg->scaled)
+    av_frame_free(&bg->scaled);
+  if (bg->sw_frame)
+    av_frame_free(&bg->sw_frame);
+  if (bg->shown)
+    av_frame_free(&bg->shown);
+}
+
+void accountBackgroundMemory(const BackgroundVideo *bg,
+                             MemoryAccount *account) {
+  const AVCodecParameters *par = bg->video_stream->codecpar;
+  int64_t source =
+      av_image_get_buffer_size(par->format, par->width, par->height, 1);
+  if (source <= 0)
+    source = (int64_t)par->width * par->height * 3 / 2;
+  int64_t output =
+      av_image_get_buffer_size(AV_PIX_FMT_YUV420P, WIDTH, HEIGHT, 1);
+
+  // Shown and scaled frames, the CPU copy of hardware frames and, for
+  // ping-pong, two full reverse playback segments
+  int64_t buffers = output + source * 2;
+  if (bg->mode == BG_MODE_PINGPONG) {
+    double interval = bg->frame_duration > 0 ? bg->frame_duration : 1.0 / 30;
+    buffers += 2 * ((int64_t)ceil(BG_SEGMENT_LENGTH / interval) + 2) * output;
+  }
+  account->bytes[MEMORY_FRAME_BUFFERS] += buffers;
+
+  for (int i = 0; i < 2; i++) {
+    const AVCodecContext *codec = bg->decoders[i].codec_ctx;
+    if (codec)
+      account->bytes[MEMORY_CODECS] +=
+          source *
+          (BG_DECODER_FRAMES + (codec->thread_count > 1 ? codec->thread_count
+                                                        : 1));
+  }
+}
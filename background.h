@@ -0,0 +1,161 @@
+#ifndef BACKGROUND_H
+#define BACKGROUND_H
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "colorconv.h"
+#include "mappedio.h"
+#include "memstats.h"
+
+// What happens once the captions outlast the background clip
+typedef enum {
+  BG_MODE_ONCE,     // play through once, then fall back to a plain colour
+  BG_MODE_LOOP,     // jump back to the start
+  BG_MODE_PINGPONG  // play backwards to the start, then forwards again
+} BackgroundMode;
+
+// How a source of another size or aspect ratio fills the WIDTH x HEIGHT frame
+typedef enum {
+  BG_FIT_CROP,   // fill the frame, cutting off what sticks out (centred)
+  BG_FIT_CONTAIN // show all of it between black bars
+} BackgroundFit;
+
+// Crops and scales decoded frames into WIDTH x HEIGHT YUV420P frames. Set up
+// on the first frame and again whenever the source size or format changes;
+// each thread that scales has its own.
+typedef struct {
+  struct SwsContext *sws_ctx; // multi-threaded
+  int src_width;
+  int src_height;
+  int src_format;
+  int crop_x, crop_y, crop_width, crop_height; // part of the source shown
+  int dst_x, dst_y, dst_width, dst_height;     // where it lands
+  AVFrame *cropped; // scratch references to the source and to the part
+  AVFrame *window;  // of the output it is scaled into
+} BackgroundScaler;
+
+// Work the prefetch thread can do on the standby decoder
+typedef enum {
+  BG_JOB_NONE,
+  BG_JOB_ARM_START, // seek to the loop start and decode its first frame
+  BG_JOB_SEGMENT    // decode a range of frames for reverse playback
+} BackgroundJob;
+
+// One demuxer/decoder pair on the background file
+typedef struct {
+  AVFormatContext *fmt_ctx;
+  AVIOContext *io; // reader on BackgroundVideo.input, NULL without one
+  AVCodecContext *codec_ctx;
+  AVFrame *frame;      // last decoded frame, valid while has_pending is set
+  AVPacket *pkt;
+  double pending_time; // presentation time of frame in seconds
+  bool has_pending;
+  bool draining;       // sent the flush packet after the last demuxed packet
+  bool eof;
+} BackgroundDecoder;
+
+// Decoded frames of one stretch of the clip, played back newest first
+typedef struct {
+  AVFrame **frames;
+  double *times;
+  int count;
+  int capacity;
+  double start; // covers source times [start, end]
+  double end;
+} BackgroundSegment;
+
+// Background video decoder context for on-demand loading
+typedef struct {
+  // Two decoders on the same file: the active one feeds forward playback
+  // while the standby one is positioned on the loop point ahead of time
+  BackgroundDecoder decoders[2];
+  BackgroundDecoder *active;
+  BackgroundDecoder *standby;
+  MappedFile *input; // shared by both decoders, NULL for avformat's own I/O
+  AVStream *video_stream;
+  struct SwsContext *sws_ctx;     // fallback for formats the kernels lack
+  BackgroundFit fit;
+  BackgroundScaler scaler;          // for frames shown by the caller
+  BackgroundScaler prefetch_scaler; // for segments, wherever they decode
+  AVFrame *scaled;                  // shown frame at output size
+  ColorConverter *converter;     // set by the caller, may be NULL
+  AVFrame *sw_frame;  // Software frame for CPU access
+  int stream_index;
+  double time_base;
+  int64_t start_time;
+  double duration;       // clip length in seconds, 0 if unknown
+  double frame_duration; // source frame interval in seconds
+  BackgroundMode mode;
+  double offset; // output time 0 shows this point of the clip
+
+  // Playback position
+  double last_source_time;
+  bool first_seek;
+  int64_t leg; // loop iteration (or ping-pong direction change) in progress
+
+  // Frame currently on screen and the buffer it was last converted into
+  AVFrame *shown;
+  double shown_time;
+  bool shown_valid;
+  int64_t shown_serial;
+  const uint8_t *converted_buffer;
+  int64_t converted_serial;
+
+  // Reverse playback for ping-pong mode
+  BackgroundSegment segments[2];
+  BackgroundSegment *current_segment;
+  BackgroundSegment *next_segment; // filled by the prefetch thread
+
+  // Prefetch thread; it only ever touches standby and next_segment
+  pthread_t prefetch_thread;
+  pthread_mutex_t prefetch_lock;
+  pthread_cond_t prefetch_cond;
+  BackgroundJob prefetch_job;
+  double prefetch_start;
+  double prefetch_end;
+  bool prefetch_quit;
+  bool prefetch_running;
+  bool standby_armed; // standby holds the first frame of the loop start
+} BackgroundVideo;
+
+int parseBackgroundMode(const char *name, BackgroundMode *mode);
+const char *backgroundModeName(BackgroundMode mode);
+int parseBackgroundFit(const char *name, BackgroundFit *fit);
+const char *backgroundFitName(BackgroundFit fit);
+
+// Initialize background video decoder. Sources of any size and orientation
+// are scaled to WIDTH x HEIGHT as they are decoded. Regular files are read
+// through a memory mapping with read-ahead (see mappedio.h).
+int initBackgroundVideo(BackgroundVideo *bg, const char *filename,
+                        BackgroundMode mode, BackgroundFit fit);
+
+// Get background video frame for an output time. Times past the end of the
+// clip are mapped back into it according to the background mode. Returns 0
+// with rgba_buffer holding the frame, -1 if there is nothing to show.
+int getBackgroundFrame(BackgroundVideo *bg, double target_time,
+                       uint8_t *rgba_buffer);
+
+// Keep playback at an output time whose frame isn't shown: decode up to it
+// but leave out the conversion. The next getBackgroundFrame then only has
+// to decode on from here instead of through the whole gap.
+void skipBackgroundFrame(BackgroundVideo *bg, double target_time);
+
+// Rewind for a new render that starts offset seconds into the clip, keeping
+// the open decoders
+void resetBackgroundVideo(BackgroundVideo *bg, double offset);
+
+// Add what bg holds to account: frame buffers, counting reverse playback
+// segments as full, and the decoders' internals, estimated from the source
+// size and decoder threads
+void accountBackgroundMemory(const BackgroundVideo *bg,
+                             MemoryAccount *account);
+
+// Cleanup background video
+void cleanupBackgroundVideo(BackgroundVideo *bg);
+
+#endif
@@ -0,0 +1,792 @@
+#define _GNU_SOURCE
+#include "colorconv.h"
+
+#include <libswscale/swscale.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COLORCONV_X86 1
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define COLORCONV_NEON 1
+#endif
+
+// BT.601 limited range RGB -> YUV, 14-bit fixed point. Chroma is computed
+// from the sum of a 2x2 block, hence the extra 2 bits of shift.
+#define Y_R 4207
+#define Y_G 8260
+#define Y_B 1604
+#define U_R (-2428)
+#define U_G (-4768)
+#define U_B 7196
+#define V_R 7196
+#define V_G (-6026)
+#define V_B (-1170)
+#define Y_BIAS ((16 << 14) + (1 << 13))
+#define C_BIAS ((128 << 16) + (1 << 15))
+
+// BT.601 limited range YUV -> RGB, 16-bit fixed point
+#define C_Y 76309
+#define C_RV 104597
+#define C_GU 25675
+#define C_GV 53279
+#define C_BU 132202
+#define RGB_BIAS (1 << 15)
+
+// Converts one chroma row: two RGBA rows into two luma rows plus one row of
+// U and V (or one interleaved UV row for NV12, passed in u)
+typedef void (*RGBAToYUVRows)(const uint8_t *r0, const uint8_t *r1,
+                              uint8_t *y0, uint8_t *y1, uint8_t *u,
+                              uint8_t *v, int x, int width, bool nv12);
+
+// Converts two luma rows sharing one chroma row into two RGBA rows
+typedef void (*YUVToRGBARows)(const uint8_t *y0, const uint8_t *y1,
+                              const uint8_t *u, const uint8_t *v, uint8_t *d0,
+                              uint8_t *d1, int x, int width, bool nv12);
+
+static inline uint8_t clampByte(int v) {
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline uint8_t lumaOf(const uint8_t *p) {
+  return clampByte((Y_R * p[0] + Y_G * p[1] + Y_B * p[2] + Y_BIAS) >> 14);
+}
+
+static void rgbaToYuvRowsScalar(const uint8_t *r0, const uint8_t *r1,
+                                uint8_t *y0, uint8_t *y1, uint8_t *u,
+                                uint8_t *v, int x, int width, bool nv12) {
+  for (; x < width; x += 2) {
+    const uint8_t *a = r0 + x * 4;
+    const uint8_t *b = a + 4;
+    const uint8_t *c = r1 + x * 4;
+    const uint8_t *d = c + 4;
+    y0[x] = lumaOf(a);
+    y0[x + 1] = lumaOf(b);
+    y1[x] = lumaOf(c);
+    y1[x + 1] = lumaOf(d);
+
+    int sr = a[0] + b[0] + c[0] + d[0];
+    int sg = a[1] + b[1] + c[1] + d[1];
+    int sb = a[2] + b[2] + c[2] + d[2];
+    uint8_t cu = clampByte((U_R * sr + U_G * sg + U_B * sb + C_BIAS) >> 16);
+    uint8_t cv = clampByte((V_R * sr + V_G * sg + V_B * sb + C_BIAS) >> 16);
+    if (nv12) {
+      u[x] = cu;
+      u[x + 1] = cv;
+    } else {
+      u[x / 2] = cu;
+      v[x / 2] = cv;
+    }
+  }
+}
+
+static inline void storePixel(uint8_t *d, int c, int ru, int gu, int bu) {
+  d[0] = clampByte((c + ru) >> 16);
+  d[1] = clampByte((c - gu) >> 16);
+  d[2] = clampByte((c + bu) >> 16);
+  d[3] = 255;
+}
+
+static void yuvToRgbaRowsScalar(const uint8_t *y0, const uint8_t *y1,
+                                const uint8_t *u, const uint8_t *v,
+                                uint8_t *d0, uint8_t *d1, int x, int width,
+                                bool nv12) {
+  for (; x < width; x += 2) {
+    int cu = (nv12 ? u[x] : u[x / 2]) - 128;
+    int cv = (nv12 ? u[x + 1] : v[x / 2]) - 128;
+    int ru = C_RV * cv;
+    int gu = C_GU * cu + C_GV * cv;
+    int bu = C_BU * cu;
+
+    storePixel(d0 + x * 4, (y0[x] - 16) * C_Y + RGB_BIAS, ru, gu, bu);
+    storePixel(d0 + x * 4 + 4, (y0[x + 1] - 16) * C_Y + RGB_BIAS, ru, gu, bu);
+    storePixel(d1 + x * 4, (y1[x] - 16) * C_Y + RGB_BIAS, ru, gu, bu);
+    storePixel(d1 + x * 4 + 4, (y1[x + 1] - 16) * C_Y + RGB_BIAS, ru, gu, bu);
+  }
+}
+
+#ifdef COLORCONV_X86
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+// Two int16 coefficients per 32-bit lane for _mm256_madd_epi16
+static inline AVX2_TARGET __m256i coefPair(int lo, int hi) {
+  return _mm256_set1_epi32(
+      (int)(((uint32_t)(uint16_t)hi << 16) | (uint16_t)lo));
+}
+
+static inline AVX2_TARGET __m128i packBytes(__m256i v) {
+  __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(v),
+                                   _mm256_extracti128_si256(v, 1));
+  return _mm_packus_epi16(words, words);
+}
+
+static AVX2_TARGET void rgbaToYuvRowsAVX2(const uint8_t *r0, const uint8_t *r1,
+                                          uint8_t *y0, uint8_t *y1, uint8_t *u,
+                                          uint8_t *v, int x, int width,
+                                          bool nv12) {
+  const __m256i byteMask = _mm256_set1_epi32(0x00FF00FF);
+  const __m256i yRB = coefPair(Y_R, Y_B), yG = coefPair(Y_G, 0);
+  const __m256i uRB = coefPair(U_R, U_B), uG = coefPair(U_G, 0);
+  const __m256i vRB = coefPair(V_R, V_B), vG = coefPair(V_G, 0);
+  const __m256i yBias = _mm256_set1_epi32(Y_BIAS);
+  const __m256i cBias = _mm256_set1_epi32(C_BIAS);
+  const __m256i planarOrder = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+  const __m256i nv12Order = _mm256_setr_epi32(0, 2, 1, 3, 4, 6, 5, 7);
+
+  for (; x + 8 <= width; x += 8) {
+    __m256i p0 = _mm256_loadu_si256((const __m256i *)(r0 + x * 4));
+    __m256i p1 = _mm256_loadu_si256((const __m256i *)(r1 + x * 4));
+    // 16-bit (R, B) and (G, A) pairs per pixel
+    __m256i rb0 = _mm256_and_si256(p0, byteMask);
+    __m256i ga0 = _mm256_and_si256(_mm256_srli_epi32(p0, 8), byteMask);
+    __m256i rb1 = _mm256_and_si256(p1, byteMask);
+    __m256i ga1 = _mm256_and_si256(_mm256_srli_epi32(p1, 8), byteMask);
+
+    __m256i l0 = _mm256_add_epi32(_mm256_madd_epi16(rb0, yRB),
+                                  _mm256_madd_epi16(ga0, yG));
+    __m256i l1 = _mm256_add_epi32(_mm256_madd_epi16(rb1, yRB),
+                                  _mm256_madd_epi16(ga1, yG));
+    l0 = _mm256_srai_epi32(_mm256_add_epi32(l0, yBias), 14);
+    l1 = _mm256_srai_epi32(_mm256_add_epi32(l1, yBias), 14);
+    _mm_storel_epi64((__m128i *)(y0 + x), packBytes(l0));
+    _mm_storel_epi64((__m128i *)(y1 + x), packBytes(l1));
+
+    // Column sums over both rows, then pairs of columns
+    __m256i rbs = _mm256_add_epi16(rb0, rb1);
+    __m256i gas = _mm256_add_epi16(ga0, ga1);
+    __m256i cu = _mm256_add_epi32(_mm256_madd_epi16(rbs, uRB),
+                                  _mm256_madd_epi16(gas, uG));
+    __m256i cv = _mm256_add_epi32(_mm256_madd_epi16(rbs, vRB),
+                                  _mm256_madd_epi16(gas, vG));
+    // [U0 U1 V0 V1 | U2 U3 V2 V3]
+    __m256i uv = _mm256_hadd_epi32(cu, cv);
+    uv = _mm256_srai_epi32(_mm256_add_epi32(uv, cBias), 16);
+
+    if (nv12) {
+      uv = _mm256_permutevar8x32_epi32(uv, nv12Order);
+      _mm_storel_epi64((__m128i *)(u + x), packBytes(uv));
+    } else {
+      uv = _mm256_permutevar8x32_epi32(uv, planarOrder);
+      __m128i bytes = packBytes(uv);
+      uint32_t uBytes = (uint32_t)_mm_cvtsi128_si32(bytes);
+      uint32_t vBytes = (uint32_t)_mm_extract_epi32(bytes, 1);
+      memcpy(u + x / 2, &uBytes, 4);
+      memcpy(v + x / 2, &vBytes, 4);
+    }
+  }
+  rgbaToYuvRowsScalar(r0, r1, y0, y1, u, v, x, width, nv12);
+}
+
+static inline AVX2_TARGET void storePixelsAVX2(uint8_t *d, const uint8_t *y,
+                                               __m256i ru, __m256i gu,
+                                               __m256i bu) {
+  const __m256i cy = _mm256_set1_epi32(C_Y);
+  const __m256i bias = _mm256_set1_epi32(RGB_BIAS - 16 * C_Y);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i max = _mm256_set1_epi32(255);
+  const __m256i alpha = _mm256_set1_epi32((int)0xFF000000u);
+
+  __m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)y));
+  c = _mm256_add_epi32(_mm256_mullo_epi32(c, cy), bias);
+  __m256i r = _mm256_srai_epi32(_mm256_add_epi32(c, ru), 16);
+  __m256i g = _mm256_srai_epi32(_mm256_sub_epi32(c, gu), 16);
+  __m256i b = _mm256_srai_epi32(_mm256_add_epi32(c, bu), 16);
+  r = _mm256_max_epi32(_mm256_min_epi32(r, max), zero);
+  g = _mm256_max_epi32(_mm256_min_epi32(g, max), zero);
+  b = _mm256_max_epi32(_mm256_min_epi32(b, max), zero);
+
+  __m256i px = _mm256_or_si256(
+      _mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+      _mm256_or_si256(_mm256_slli_epi32(b, 16), alpha));
+  _mm256_storeu_si256((__m256i *)d, px);
+}
+
+static AVX2_TARGET void yuvToRgbaRowsAVX2(const uint8_t *y0, const uint8_t *y1,
+                                          const uint8_t *u, const uint8_t *v,
+                                          uint8_t *d0, uint8_t *d1, int x,
+                                          int width, bool nv12) {
+  const __m256i bias = _mm256_set1_epi32(128);
+  const __m256i dupLow = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+  const __m256i dupEven = _mm256_setr_epi32(0, 0, 2, 2, 4, 4, 6, 6);
+  const __m256i dupOdd = _mm256_setr_epi32(1, 1, 3, 3, 5, 5, 7, 7);
+
+  for (; x + 8 <= width; x += 8) {
+    __m256i cu, cv;
+    if (nv12) {
+      __m256i uv = _mm256_cvtepu8_epi32(
+          _mm_loadl_epi64((const __m128i *)(u + x)));
+      cu = _mm256_permutevar8x32_epi32(uv, dupEven);
+      cv = _mm256_permutevar8x32_epi32(uv, dupOdd);
+    } else {
+      uint32_t uBytes, vBytes;
+      memcpy(&uBytes, u + x / 2, 4);
+      memcpy(&vBytes, v + x / 2, 4);
+      cu = _mm256_permutevar8x32_epi32(
+          _mm256_cvtepu8_epi32(_mm_cvtsi32_si128((int)uBytes)), dupLow);
+      cv = _mm256_permutevar8x32_epi32(
+          _mm256_cvtepu8_epi32(_mm_cvtsi32_si128((int)vBytes)), dupLow);
+    }
+    cu = _mm256_sub_epi32(cu, bias);
+    cv = _mm256_sub_epi32(cv, bias);
+
+    __m256i ru = _mm256_mullo_epi32(cv, _mm256_set1_epi32(C_RV));
+    __m256i gu = _mm256_add_epi32(_mm256_mullo_epi32(cu, _mm256_set1_epi32(C_GU)),
+                                  _mm256_mullo_epi32(cv, _mm256_set1_epi32(C_GV)));
+    __m256i bu = _mm256_mullo_epi32(cu, _mm256_set1_epi32(C_BU));
+
+    storePixelsAVX2(d0 + x * 4, y0 + x, ru, gu, bu);
+    storePixelsAVX2(d1 + x * 4, y1 + x, ru, gu, bu);
+  }
+  yuvToRgbaRowsScalar(y0, y1, u, v, d0, d1, x, width, nv12);
+}
+#endif
+
+#ifdef COLORCONV_NEON
+static inline uint16x4_t chromaNEON(uint32x4_t sr, uint32x4_t sg,
+                                    uint32x4_t sb, int cr, int cg, int cb) {
+  int32x4_t acc = vdupq_n_s32(C_BIAS);
+  acc = vmlaq_n_s32(acc, vreinterpretq_s32_u32(sr), cr);
+  acc = vmlaq_n_s32(acc, vreinterpretq_s32_u32(sg), cg);
+  acc = vmlaq_n_s32(acc, vreinterpretq_s32_u32(sb), cb);
+  return vqmovun_s32(vshrq_n_s32(acc, 16));
+}
+
+static inline uint8x8_t lumaNEON(uint8x8x4_t px) {
+  uint16x8_t r = vmovl_u8(px.val[0]);
+  uint16x8_t g = vmovl_u8(px.val[1]);
+  uint16x8_t b = vmovl_u8(px.val[2]);
+  uint32x4_t lo = vdupq_n_u32(Y_BIAS), hi = vdupq_n_u32(Y_BIAS);
+  lo = vmlal_n_u16(lo, vget_low_u16(r), Y_R);
+  lo = vmlal_n_u16(lo, vget_low_u16(g), Y_G);
+  lo = vmlal_n_u16(lo, vget_low_u16(b), Y_B);
+  hi = vmlal_n_u16(hi, vget_high_u16(r), Y_R);
+  hi = vmlal_n_u16(hi, vget_high_u16(g), Y_G);
+  hi = vmlal_n_u16(hi, vget_high_u16(b), Y_B);
+  return vqmovn_u16(vcombine_u16(vshrn_n_u32(lo, 14), vshrn_n_u32(hi, 14)));
+}
+
+static void rgbaToYuvRowsNEON(const uint8_t *r0, const uint8_t *r1,
+                              uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                              int x, int width, bool nv12) {
+  for (; x + 8 <= width; x += 8) {
+    uint8x8x4_t p0 = vld4_u8(r0 + x * 4);
+    uint8x8x4_t p1 = vld4_u8(r1 + x * 4);
+    vst1_u8(y0 + x, lumaNEON(p0));
+    vst1_u8(y1 + x, lumaNEON(p1));
+
+    // Column sums over both rows, then pairs of columns
+    uint32x4_t sr = vpaddlq_u16(vaddl_u8(p0.val[0], p1.val[0]));
+    uint32x4_t sg = vpaddlq_u16(vaddl_u8(p0.val[1], p1.val[1]));
+    uint32x4_t sb = vpaddlq_u16(vaddl_u8(p0.val[2], p1.val[2]));
+    uint16x4_t cu = chromaNEON(sr, sg, sb, U_R, U_G, U_B);
+    uint16x4_t cv = chromaNEON(sr, sg, sb, V_R, V_G, V_B);
+
+    if (nv12) {
+      uint16x4x2_t zipped = vzip_u16(cu, cv);
+      vst1_u8(u + x, vqmovn_u16(vcombine_u16(zipped.val[0], zipped.val[1])));
+    } else {
+      uint32x2_t bytes =
+          vreinterpret_u32_u8(vqmovn_u16(vcombine_u16(cu, cv)));
+      uint32_t uBytes = vget_lane_u32(bytes, 0);
+      uint32_t vBytes = vget_lane_u32(bytes, 1);
+      memcpy(u + x / 2, &uBytes, 4);
+      memcpy(v + x / 2, &vBytes, 4);
+    }
+  }
+  rgbaToYuvRowsScalar(r0, r1, y0, y1, u, v, x, width, nv12);
+}
+
+static inline uint8x8_t channelNEON(int32x4_t lo, int32x4_t hi) {
+  return vqmovn_u16(vcombine_u16(vqmovun_s32(vshrq_n_s32(lo, 16)),
+                                 vqmovun_s32(vshrq_n_s32(hi, 16))));
+}
+
+static inline void storePixelsNEON(uint8_t *d, const uint8_t *y,
+                                   int16x8_t cu, int16x8_t cv) {
+  int16x8_t yy = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y))),
+                           vdupq_n_s16(16));
+  int32x4_t cLo = vmlaq_n_s32(vdupq_n_s32(RGB_BIAS),
+                              vmovl_s16(vget_low_s16(yy)), C_Y);
+  int32x4_t cHi = vmlaq_n_s32(vdupq_n_s32(RGB_BIAS),
+                              vmovl_s16(vget_high_s16(yy)), C_Y);
+  int32x4_t uLo = vmovl_s16(vget_low_s16(cu)), uHi = vmovl_s16(vget_high_s16(cu));
+  int32x4_t vLo = vmovl_s16(vget_low_s16(cv)), vHi = vmovl_s16(vget_high_s16(cv));
+
+  uint8x8x4_t px;
+  px.val[0] = channelNEON(vmlaq_n_s32(cLo, vLo, C_RV),
+                          vmlaq_n_s32(cHi, vHi, C_RV));
+  px.val[1] = channelNEON(
+      vmlsq_n_s32(vmlsq_n_s32(cLo, uLo, C_GU), vLo, C_GV),
+      vmlsq_n_s32(vmlsq_n_s32(cHi, uHi, C_GU), vHi, C_GV));
+  px.val[2] = channelNEON(vmlaq_n_s32(cLo, uLo, C_BU),
+                          vmlaq_n_s32(cHi, uHi, C_BU));
+  px.val[3] = vdup_n_u8(255);
+  vst4_u8(d, px);
+}
+
+static void yuvToRgbaRowsNEON(const uint8_t *y0, const uint8_t *y1,
+                              const uint8_t *u, const uint8_t *v, uint8_t *d0,
+                              uint8_t *d1, int x, int width, bool nv12) {
+  for (; x + 8 <= width; x += 8) {
+    uint8x8_t cu8, cv8;
+    if (nv12) {
+      uint8x8_t uv = vld1_u8(u + x);
+      uint8x8x2_t split = vuzp_u8(uv, uv);
+      cu8 = split.val[0];
+      cv8 = split.val[1];
+    } else {
+      uint32_t uBytes, vBytes;
+      memcpy(&uBytes, u + x / 2, 4);
+      memcpy(&vBytes, v + x / 2, 4);
+      cu8 = vreinterpret_u8_u32(vdup_n_u32(uBytes));
+      cv8 = vreinterpret_u8_u32(vdup_n_u32(vBytes));
+    }
+    // Each chroma sample covers two pixels
+    cu8 = vzip_u8(cu8, cu8).val[0];
+    cv8 = vzip_u8(cv8, cv8).val[0];
+    int16x8_t cu = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(cu8)),
+                             vdupq_n_s16(128));
+    int16x8_t cv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(cv8)),
+                             vdupq_n_s16(128));
+
+    storePixelsNEON(d0 + x * 4, y0 + x, cu, cv);
+    storePixelsNEON(d1 + x * 4, y1 + x, cu, cv);
+  }
+  yuvToRgbaRowsScalar(y0, y1, u, v, d0, d1, x, width, nv12);
+}
+#endif
+
+static RGBAToYUVRows pickRGBAToYUV(const ColorConverter *cc) {
+  if (cc->useSimd) {
+#ifdef COLORCONV_X86
+    if (__builtin_cpu_supports("avx2"))
+      return rgbaToYuvRowsAVX2;
+#endif
+#ifdef COLORCONV_NEON
+    return rgbaToYuvRowsNEON;
+#endif
+  }
+  return rgbaToYuvRowsScalar;
+}
+
+static YUVToRGBARows pickYUVToRGBA(const ColorConverter *cc) {
+  if (cc->useSimd) {
+#ifdef COLORCONV_X86
+    if (__builtin_cpu_supports("avx2"))
+      return yuvToRgbaRowsAVX2;
+#endif
+#ifdef COLORCONV_NEON
+    return yuvToRgbaRowsNEON;
+#endif
+  }
+  return yuvToRgbaRowsScalar;
+}
+
+void initColorConverter(ColorConverter *cc, ThreadPool *pool) {
+  cc->pool = pool;
+  cc->useSimd = true;
+}
+
+const char *colorConverterKernelName(const ColorConverter *cc) {
+  if (!cc->useSimd)
+    return "scalar";
+#ifdef COLORCONV_X86
+  if (pickRGBAToYUV(cc) == rgbaToYuvRowsAVX2)
+    return "avx2";
+#endif
+#ifdef COLORCONV_NEON
+  return "neon";
+#endif
+  return "scalar";
+}
+
+bool colorConverterSupports(int pix_fmt, int width, int height) {
+  return (pix_fmt == AV_PIX_FMT_YUV420P || pix_fmt == AV_PIX_FMT_NV12) &&
+         width >= 2 && height >= 2 && width % 2 == 0 && height % 2 == 0;
+}
+
+// One conversion split into bands of chroma rows
+typedef struct {
+  RGBAToYUVRows toYuv;
+  YUVToRGBARows toRgba;
+  const uint8_t *rgbaIn;
+  uint8_t *rgbaOut;
+  int rgbaStride;
+  bool flip;
+  const AVFrame *frame;
+  int width;
+  int height;
+  bool nv12;
+} ConvertJob;
+
+static void bandRange(const ConvertJob *job, int task, int taskCount,
+                      int *first, int *last) {
+  int pairs = job->height / 2;
+  *first = (int)((int64_t)pairs * task / taskCount);
+  *last = (int)((int64_t)pairs * (task + 1) / taskCount);
+}
+
+static void rgbaToYuvBand(void *arg, int task, int taskCount) {
+  const ConvertJob *job = arg;
+  const AVFrame *f = job->frame;
+  int first, last;
+  bandRange(job, task, taskCount, &first, &last);
+
+  for (int cy = first; cy < last; cy++) {
+    int y = cy * 2;
+    // Vertical flip is just a different choice of source row
+    int s0 = job->flip ? job->height - 1 - y : y;
+    int s1 = job->flip ? s0 - 1 : s0 + 1;
+    job->toYuv(job->rgbaIn + (size_t)s0 * job->rgbaStride,
+               job->rgbaIn + (size_t)s1 * job->rgbaStride,
+               f->data[0] + (size_t)y * f->linesize[0],
+               f->data[0] + (size_t)(y + 1) * f->linesize[0],
+               f->data[1] + (size_t)cy * f->linesize[1],
+               job->nv12 ? NULL : f->data[2] + (size_t)cy * f->linesize[2], 0,
+               job->width, job->nv12);
+  }
+}
+
+static void yuvToRgbaBand(void *arg, int task, int taskCount) {
+  const ConvertJob *job = arg;
+  const AVFrame *f = job->frame;
+  int first, last;
+  bandRange(job, task, taskCount, &first, &last);
+
+  for (int cy = first; cy < last; cy++) {
+    int y = cy * 2;
+    job->toRgba(f->data[0] + (size_t)y * f->linesize[0],
+                f->data[0] + (size_t)(y + 1) * f->linesize[0],
+                f->data[1] + (size_t)cy * f->linesize[1],
+                job->nv12 ? NULL : f->data[2] + (size_t)cy * f->linesize[2],
+                job->rgbaOut + (size_t)y * job->rgbaStride,
+                job->rgbaOut + (size_t)(y + 1) * job->rgbaStride, 0,
+                job->width, job->nv12);
+  }
+}
+
+int convertRGBAToYUV(const ColorConverter *cc, const uint8_t *rgba,
+                     int rgba_stride, bool flip, AVFrame *dst) {
+  if (!colorConverterSupports(dst->format, dst->width, dst->height))
+    return -1;
+
+  ConvertJob job = {.toYuv = pickRGBAToYUV(cc),
+                    .rgbaIn = rgba,
+                    .rgbaStride = rgba_stride,
+                    .flip = flip,
+                    .frame = dst,
+                    .width = dst->width,
+                    .height = dst->height,
+                    .nv12 = dst->format == AV_PIX_FMT_NV12};
+  runThreadPool(cc->pool, threadPoolSize(cc->pool), rgbaToYuvBand, &job);
+  return 0;
+}
+
+int convertYUVToRGBA(const ColorConverter *cc, const AVFrame *src,
+                     uint8_t *rgba, int rgba_stride) {
+  if (!colorConverterSupports(src->format, src->width, src->height))
+    return -1;
+
+  ConvertJob job = {.toRgba = pickYUVToRGBA(cc),
+                    .rgbaOut = rgba,
+                    .rgbaStride = rgba_stride,
+                    .frame = src,
+                    .width = src->width,
+                    .height = src->height,
+                    .nv12 = src->format == AV_PIX_FMT_NV12};
+  runThreadPool(cc->pool, threadPoolSize(cc->pool), yuvToRgbaBand, &job);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Microbenchmark and accuracy check
+
+#define BENCH_WIDTH 1080
+#define BENCH_HEIGHT 1920
+// Minimum PSNR against swscale before the check fails
+#define BENCH_MIN_PSNR 35.0
+
+static double benchNowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Gradients, hard-edged shapes and a little noise, roughly like a frame of
+// caption text over video
+static void fillBenchImage(uint8_t *rgba, int width, int height) {
+  uint32_t seed = 12345;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      seed = seed * 1664525u + 1013904223u;
+      int noise = (int)(seed >> 28) - 8;
+      uint8_t *p = rgba + ((size_t)y * width + x) * 4;
+      int r = x * 255 / width + noise;
+      int g = y * 255 / height + noise;
+      int b = 128 + (int)(100 * sinf(x * 0.02f) * cosf(y * 0.015f));
+      int dx = x - width / 2, dy = y - height / 2;
+      if (dx * dx + dy * dy < 200 * 200) {
+        r = 250;
+        g = 240;
+        b = 20;
+      }
+      if ((y / 64) % 5 == 0 && (x / 48) % 3 == 0) {
+        r = g = b = 0;
+      }
+      p[0] = clampByte(r);
+      p[1] = clampByte(g);
+      p[2] = clampByte(b);
+      p[3] = 255;
+    }
+  }
+}
+
+static double planePSNR(const uint8_t *a, int aStride, const uint8_t *b,
+                        int bStride, int width, int height, int *maxDiff) {
+  double sse = 0.0;
+  *maxDiff = 0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int d = a[(size_t)y * aStride + x] - b[(size_t)y * bStride + x];
+      if (abs(d) > *maxDiff)
+        *maxDiff = abs(d);
+      sse += (double)d * d;
+    }
+  }
+  if (sse == 0.0)
+    return INFINITY;
+  double mse = sse / ((double)width * height);
+  return 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+static bool planesEqual(const uint8_t *a, int aStride, const uint8_t *b,
+                        int bStride, int width, int height) {
+  for (int y = 0; y < height; y++) {
+    if (memcmp(a + (size_t)y * aStride, b + (size_t)y * bStride, width) != 0)
+      return false;
+  }
+  return true;
+}
+
+// Compare each plane of two YUV frames; returns the worst PSNR
+static double comparePlanes(const AVFrame *a, const AVFrame *b, int *maxDiff) {
+  bool nv12 = a->format == AV_PIX_FMT_NV12;
+  int planes = nv12 ? 2 : 3;
+  double worst = INFINITY;
+  *maxDiff = 0;
+  for (int p = 0; p < planes; p++) {
+    int w = p == 0 ? a->width : nv12 ? a->width : a->width / 2;
+    int h = p == 0 ? a->height : a->height / 2;
+    int diff;
+    double psnr = planePSNR(a->data[p], a->linesize[p], b->data[p],
+                            b->linesize[p], w, h, &diff);
+    if (psnr < worst)
+      worst = psnr;
+    if (diff > *maxDiff)
+      *maxDiff = diff;
+  }
+  return worst;
+}
+
+static bool framesEqual(const AVFrame *a, const AVFrame *b) {
+  bool nv12 = a->format == AV_PIX_FMT_NV12;
+  int planes = nv12 ? 2 : 3;
+  for (int p = 0; p < planes; p++) {
+    int w = p == 0 ? a->width : nv12 ? a->width : a->width / 2;
+    int h = p == 0 ? a->height : a->height / 2;
+    if (!planesEqual(a->data[p], a->linesize[p], b->data[p], b->linesize[p],
+                     w, h))
+      return false;
+  }
+  return true;
+}
+
+static AVFrame *allocBenchFrame(int format) {
+  AVFrame *frame = av_frame_alloc();
+  if (!frame)
+    return NULL;
+  frame->format = format;
+  frame->width = BENCH_WIDTH;
+  frame->height = BENCH_HEIGHT;
+  if (av_frame_get_buffer(frame, 32) < 0)
+    av_frame_free(&frame);
+  return frame;
+}
+
+static void printBenchLine(const char *name, double ms, double referenceMs) {
+  printf("  %-28s %8.3f ms/frame  %6.2fx\n", name, ms, referenceMs / ms);
+}
+
+// Benchmark and check one YUV format in both directions
+static int benchFormat(int format, const char *formatName, int iterations,
+                       const uint8_t *rgba, const uint8_t *rgbaFlipped,
+                       ThreadPool *pool) {
+  const int stride = BENCH_WIDTH * 4;
+  int failures = 0;
+  ColorConverter scalar = {.pool = NULL, .useSimd = false};
+  ColorConverter simd = {.pool = NULL, .useSimd = true};
+  ColorConverter threaded = {.pool = pool, .useSimd = true};
+
+  AVFrame *reference = allocBenchFrame(format);
+  AVFrame *out = allocBenchFrame(format);
+  AVFrame *check = allocBenchFrame(format);
+  uint8_t *rgbaReference = malloc((size_t)stride * BENCH_HEIGHT);
+  uint8_t *rgbaOut = malloc((size_t)stride * BENCH_HEIGHT);
+  uint8_t *rgbaCheck = malloc((size_t)stride * BENCH_HEIGHT);
+  struct SwsContext *toYuv =
+      sws_getContext(BENCH_WIDTH, BENCH_HEIGHT, AV_PIX_FMT_RGBA, BENCH_WIDTH,
+                     BENCH_HEIGHT, format, SWS_FAST_BILINEAR, NULL, NULL, NULL);
+  struct SwsContext *toRgba =
+      sws_getContext(BENCH_WIDTH, BENCH_HEIGHT, format, BENCH_WIDTH,
+                     BENCH_HEIGHT, AV_PIX_FMT_RGBA, SWS_FAST_BILINEAR, NULL,
+                     NULL, NULL);
+  if (!reference || !out || !check || !rgbaReference || !rgbaOut ||
+      !rgbaCheck || !toYuv || !toRgba) {
+    printf("Error: Could not allocate benchmark buffers\n");
+    failures++;
+    goto done;
+  }
+
+  // RGBA -> YUV
+  printf("RGBA -> %s\n", formatName);
+  const uint8_t *in_data[1] = {rgba};
+  int in_linesize[1] = {stride};
+  double start = benchNowMs();
+  for (int i = 0; i < iterations; i++)
+    sws_scale(toYuv, in_data, in_linesize, 0, BENCH_HEIGHT, reference->data,
+              reference->linesize);
+  double referenceMs = (benchNowMs() - start) / iterations;
+  printBenchLine("sws_scale", referenceMs, referenceMs);
+
+  struct {
+    const char *name;
+    const ColorConverter *cc;
+  } variants[] = {{"kernel scalar", &scalar},
+                  {"kernel simd", &simd},
+                  {"kernel simd + threads", &threaded}};
+  for (int v = 0; v < 3; v++) {
+    start = benchNowMs();
+    for (int i = 0; i < iterations; i++)
+      convertRGBAToYUV(variants[v].cc, rgba, stride, false, out);
+    printBenchLine(variants[v].name, (benchNowMs() - start) / iterations,
+                   referenceMs);
+  }
+
+  convertRGBAToYUV(&scalar, rgba, stride, false, check);
+  convertRGBAToYUV(&threaded, rgba, stride, false, out);
+  if (!framesEqual(check, out)) {
+    printf("  FAIL: simd and scalar kernels disagree\n");
+    failures++;
+  }
+  convertRGBAToYUV(&threaded, rgbaFlipped, stride, true, out);
+  if (!framesEqual(check, out)) {
+    printf("  FAIL: flipped conversion differs from unflipped\n");
+    failures++;
+  }
+  int maxDiff;
+  double psnr = comparePlanes(reference, check, &maxDiff);
+  printf("  accuracy vs swscale: worst plane PSNR %.2f dB, max diff %d\n",
+         psnr, maxDiff);
+  if (psnr < BENCH_MIN_PSNR) {
+    printf("  FAIL: below %.1f dB\n", BENCH_MIN_PSNR);
+    failures++;
+  }
+
+  // YUV -> RGBA, starting from swscale's YUV so both sides see the same input
+  printf("%s -> RGBA\n", formatName);
+  const uint8_t *src_data[4] = {reference->data[0], reference->data[1],
+                                reference->data[2], NULL};
+  int src_linesize[4] = {reference->linesize[0], reference->linesize[1],
+                         reference->linesize[2], 0};
+  uint8_t *dst_data[1] = {rgbaReference};
+  int dst_linesize[1] = {stride};
+  start = benchNowMs();
+  for (int i = 0; i < iterations; i++)
+    sws_scale(toRgba, src_data, src_linesize, 0, BENCH_HEIGHT, dst_data,
+              dst_linesize);
+  referenceMs = (benchNowMs() - start) / iterations;
+  printBenchLine("sws_scale", referenceMs, referenceMs);
+
+  for (int v = 0; v < 3; v++) {
+    start = benchNowMs();
+    for (int i = 0; i < iterations; i++)
+      convertYUVToRGBA(variants[v].cc, reference, rgbaOut, stride);
+    printBenchLine(variants[v].name, (benchNowMs() - start) / iterations,
+                   referenceMs);
+  }
+
+  convertYUVToRGBA(&scalar, reference, rgbaCheck, stride);
+  convertYUVToRGBA(&threaded, reference, rgbaOut, stride);
+  if (!planesEqual(rgbaCheck, stride, rgbaOut, stride, stride, BENCH_HEIGHT)) {
+    printf("  FAIL: simd and scalar kernels disagree\n");
+    failures++;
+  }
+  psnr = planePSNR(rgbaReference, stride, rgbaCheck, stride, stride,
+                   BENCH_HEIGHT, &maxDiff);
+  printf("  accuracy vs swscale: PSNR %.2f dB, max diff %d\n", psnr, maxDiff);
+  if (psnr < BENCH_MIN_PSNR) {
+    printf("  FAIL: below %.1f dB\n", BENCH_MIN_PSNR);
+    failures++;
+  }
+
+done:
+  sws_freeContext(toYuv);
+  sws_freeContext(toRgba);
+  av_frame_free(&reference);
+  av_frame_free(&out);
+  av_frame_free(&check);
+  free(rgbaReference);
+  free(rgbaOut);
+  free(rgbaCheck);
+  return failures;
+}
+
+int runColorConvBenchmark(int iterations) {
+  const int stride = BENCH_WIDTH * 4;
+  if (iterations <= 0)
+    iterations = COLORCONV_BENCH_ITERATIONS;
+
+  ThreadPool *pool = createThreadPool(0);
+  ColorConverter cc;
+  initColorConverter(&cc, pool);
+  printf("Colour conversion benchmark: %dx%d, %d iterations, %s kernels, "
+         "%d threads\n",
+         BENCH_WIDTH, BENCH_HEIGHT, iterations, colorConverterKernelName(&cc),
+         threadPoolSize(pool));
+
+  uint8_t *rgba = malloc((size_t)stride * BENCH_HEIGHT);
+  uint8_t *rgbaFlipped = malloc((size_t)stride * BENCH_HEIGHT);
+  if (!rgba || !rgbaFlipped) {
+    printf("Error: Could not allocate benchmark image\n");
+    free(rgba);
+    free(rgbaFlipped);
+    destroyThreadPool(pool);
+    return 1;
+  }
+  fillBenchImage(rgba, BENCH_WIDTH, BENCH_HEIGHT);
+  for (int y = 0; y < BENCH_HEIGHT; y++) {
+    memcpy(rgbaFlipped + (size_t)y * stride,
+           rgba + (size_t)(BENCH_HEIGHT - 1 - y) * stride, stride);
+  }
+
+  int failures = 0;
+  failures += benchFormat(AV_PIX_FMT_YUV420P, "YUV420P", iterations, rgba,
+                          rgbaFlipped, pool);
+  failures += benchFormat(AV_PIX_FMT_NV12, "NV12", iterations, rgba,
+                          rgbaFlipped, pool);
+
+  if (failures)
+    printf("Colour conversion check FAILED (%d)\n", failures);
+  else
+    printf("Colour conversion check passed\n");
+  free(rgba);
+  free(rgbaFlipped);
+  destroyThreadPool(pool);
+  return failures ? 1 : 0;
+}
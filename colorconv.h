@@ -0,0 +1,45 @@
+#ifndef COLORCONV_H
+#define COLORCONV_H
+
+#include <libavutil/frame.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+// Same-size RGBA <-> YUV420P/NV12 conversion (BT.601, limited range) for the
+// two conversions in the frame loop. Rows are split into bands across the
+// thread pool and each band runs an AVX2, NEON or scalar kernel. All three
+// kernels produce bit-identical output.
+typedef struct {
+  ThreadPool *pool; // may be NULL for single-threaded conversion
+  bool useSimd;
+} ColorConverter;
+
+void initColorConverter(ColorConverter *cc, ThreadPool *pool);
+
+// Name of the kernel set picked for this CPU ("avx2", "neon" or "scalar")
+const char *colorConverterKernelName(const ColorConverter *cc);
+
+// True if the kernels handle this format at this size; callers fall back
+// to sws_scale otherwise
+bool colorConverterSupports(int pix_fmt, int width, int height);
+
+// RGBA -> YUV420P/NV12 into dst (which must already have buffers). With
+// flip set, rgba holds the image bottom row first, as read back from GL.
+int convertRGBAToYUV(const ColorConverter *cc, const uint8_t *rgba,
+                     int rgba_stride, bool flip, AVFrame *dst);
+
+// YUV420P/NV12 -> RGBA
+int convertYUVToRGBA(const ColorConverter *cc, const AVFrame *src,
+                     uint8_t *rgba, int rgba_stride);
+
+// Iterations per kernel of --bench-convert without a count
+#define COLORCONV_BENCH_ITERATIONS 20
+
+// Kernel microbenchmark and accuracy check against swscale, iterations <= 0
+// running the default. Returns non-zero if any kernel strays too far from
+// swscale or the kernels disagree.
+int runColorConvBenchmark(int iterations);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef COMMON_H
+#define COMMON_H
+
+// Output geometry shared by the renderer and its helper modules
+#define WIDTH 1080
+#define HEIGHT 1920
+#define FPS 60
+
+#endif
@@ -0,0 +1,736 @@
+#define _GNU_SOURCE
+#include "daemon.h"
+
+#include <cjson/cJSON.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "plan.h"
+
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_REQUEST_MAX 4096
+// Background decoders kept open between jobs (also caps concurrent jobs)
+#define DAEMON_MAX_BACKGROUNDS 8
+// How long poll() sleeps while no job is running
+#define DAEMON_IDLE_POLL_MS 1000
+// How long to nap when every job is busy and one of them is live; well
+// under a frame interval, so no live job misses its slot for it
+#define DAEMON_LIVE_POLL_MS 1
+
+typedef enum { CLIENT_READING, CLIENT_QUEUED, CLIENT_RUNNING } ClientState;
+
+typedef struct {
+  char path[512];
+  BackgroundMode mode;
+  BackgroundFit fit;
+  BackgroundVideo video;
+  bool open;
+  bool inUse;
+  double lastUsed;
+} PooledBackground;
+
+typedef struct {
+  int fd;
+  int id;
+  ClientState state;
+  char request[DAEMON_REQUEST_MAX];
+  int requestLen;
+
+  // Parsed request
+  char project[256];
+  char output[512];
+  char background[512];
+  char profile[64];
+  OutputLayout outputLayout;
+  bool incremental;
+  int checkpointGops;
+  bool resume;
+  bool audioCache;
+  bool uniformQuality;
+  bool regionSample;
+  bool live;
+  bool plan; // answer with a plan instead of rendering
+  KeyframePolicy keyframes;
+  int maxGop;
+  BackgroundMode bgMode;
+  BackgroundFit bgFit;
+  double offset;
+  RenditionOptions renditions[RENDER_MAX_RENDITIONS];
+  char renditionOutputs[RENDER_MAX_RENDITIONS][512];
+  char renditionProfiles[RENDER_MAX_RENDITIONS][64];
+  int renditionCount;
+
+  RenderJob *job;
+  PooledBackground *bg;
+  double queuedAt;
+  double startedAt;
+} DaemonClient;
+
+typedef struct {
+  RenderContext *ctx;
+  int maxJobs;
+  int listenFd;
+  int nextJobId;
+  int nextStep; // round-robin position among running jobs
+  DaemonClient *clients[DAEMON_MAX_CLIENTS];
+  PooledBackground backgrounds[DAEMON_MAX_BACKGROUNDS];
+} RenderDaemon;
+
+static volatile sig_atomic_t daemonQuit = 0;
+
+static void onDaemonSignal(int sig) {
+  (void)sig;
+  daemonQuit = 1;
+}
+
+static double nowMs(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// Send one JSON line; the client may already be gone, which is fine
+static void sendReply(DaemonClient *client, cJSON *reply) {
+  char *text = cJSON_PrintUnformatted(reply);
+  if (text) {
+    size_t len = strlen(text);
+    text[len] = '\n';
+    send(client->fd, text, len + 1, MSG_NOSIGNAL);
+    text[len] = '\0';
+    cJSON_free(text);
+  }
+  cJSON_Delete(reply);
+}
+
+static cJSON *newReply(DaemonClient *client, const char *status) {
+  cJSON *reply = cJSON_CreateObject();
+  cJSON_AddStringToObject(reply, "status", status);
+  cJSON_AddNumberToObject(reply, "job", client->id);
+  return reply;
+}
+
+static void sendError(DaemonClient *client, const char *message) {
+  cJSON *reply = newReply(client, "error");
+  cJSON_AddStringToObject(reply, "message", message);
+  sendReply(client, reply);
+}
+
+static void closeClient(RenderDaemon *d, int index) {
+  DaemonClient *client = d->clients[index];
+  close(client->fd);
+  free(client);
+  d->clients[index] = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Background decoder pool
+
+static PooledBackground *acquireBackground(RenderDaemon *d, const char *path,
+                                           BackgroundMode mode,
+                                           BackgroundFit fit) {
+  PooledBackground *slot = NULL;
+  for (int i = 0; i < DAEMON_MAX_BACKGROUNDS; i++) {
+    PooledBackground *pb = &d->backgrounds[i];
+    if (pb->open && !pb->inUse && pb->mode == mode && pb->fit == fit &&
+        strcmp(pb->path, path) == 0) {
+      pb->inUse = true;
+      return pb;
+    }
+    if (!pb->open && !slot)
+      slot = pb;
+  }
+
+  if (!slot) {
+    // Close the decoder that has been idle longest
+    for (int i = 0; i < DAEMON_MAX_BACKGROUNDS; i++) {
+      PooledBackground *pb = &d->backgrounds[i];
+      if (pb->open && !pb->inUse && (!slot || pb->lastUsed < slot->lastUsed))
+        slot = pb;
+    }
+    if (!slot)
+      return NULL;
+    cleanupBackgroundVideo(&slot->video);
+    slot->open = false;
+  }
+
+  if (initBackgroundVideo(&slot->video, path, mode, fit) < 0) {
+    cleanupBackgroundVideo(&slot->video);
+    return NULL;
+  }
+  snprintf(slot->path, sizeof(slot->path), "%s", path);
+  slot->mode = mode;
+  slot->fit = fit;
+  slot->open = true;
+  slot->inUse = true;
+  return slot;
+}
+
+static void releaseBackground(PooledBackground *pb) {
+  pb->inUse = false;
+  pb->lastUsed = nowMs();
+}
+
+// ---------------------------------------------------------------------------
+// Requests
+
+static int copyString(cJSON *json, const char *key, char *dst, size_t size,
+                      bool required) {
+  cJSON *item = cJSON_GetObjectItem(json, key);
+  if (!item) {
+    dst[0] = '\0';
+    return required ? -1 : 0;
+  }
+  if (!cJSON_IsString(item) || strlen(item->valuestring) >= size)
+    return -1;
+  strcpy(dst, item->valuestring);
+  return 0;
+}
+
+// "renditions": [{"width": 720, "height": 1280, "bitrate": 2500000,
+// "profile": "fast", "output": "abc_720.mp4"}, ...]
+static const char *parseRenditions(DaemonClient *client, cJSON *json) {
+  cJSON *list = cJSON_GetObjectItem(json, "renditions");
+  client->renditionCount = 0;
+  if (!list)
+    return NULL;
+  if (!cJSON_IsArray(list) ||
+      cJSON_GetArraySize(list) > RENDER_MAX_RENDITIONS)
+    return "\"renditions\" must be an array of up to 4 objects";
+  cJSON *item;
+  cJSON_ArrayForEach(item, list) {
+    int i = client->renditionCount;
+    RenditionOptions *r = &client->renditions[i];
+    cJSON *width = cJSON_GetObjectItem(item, "width");
+    cJSON *height = cJSON_GetObjectItem(item, "height");
+    cJSON *bitrate = cJSON_GetObjectItem(item, "bitrate");
+    if (!cJSON_IsObject(item) || !cJSON_IsNumber(width) ||
+        !cJSON_IsNumber(height) ||
+        copyString(item, "output", client->renditionOutputs[i],
+                   sizeof(client->renditionOutputs[i]), true) < 0 ||
+        copyString(item, "profile", client->renditionProfiles[i],
+                   sizeof(client->renditionProfiles[i]), false) < 0)
+      return "rendition needs \"width\", \"height\" and \"output\"";
+    memset(r, 0, sizeof(RenditionOptions));
+    r->width = width->valueint;
+    r->height = height->valueint;
+    r->maxBitRate =
+        cJSON_IsNumber(bitrate) ? (int64_t)bitrate->valuedouble : 0;
+    r->output = client->renditionOutputs[i];
+    r->profile = client->renditionProfiles[i][0] != '\0'
+                     ? client->renditionProfiles[i]
+                     : NULL;
+    if (r->width <= 0 || r->height <= 0 || r->width % 2 != 0 ||
+        r->height % 2 != 0)
+      return "rendition sizes must be positive and even";
+    if (r->profile && !findEncoderProfile(r->profile))
+      return "unknown rendition \"profile\"";
+    if (strcmp(r->output, "-") == 0 || strncmp(r->output, "fd:", 3) == 0)
+      return "rendition \"output\" must be a file path";
+    client->renditionCount++;
+  }
+  return NULL;
+}
+
+// Fill in the job fields from the request line. Returns an error message
+// for the client, or NULL if the request is fine.
+static const char *parseRequest(DaemonClient *client) {
+  cJSON *json = cJSON_Parse(client->request);
+  if (!json || !cJSON_IsObject(json)) {
+    cJSON_Delete(json);
+    return "request is not a JSON object";
+  }
+
+  const char *error = NULL;
+  char mode[32];
+  char fit[32];
+  char layout[32];
+  char keyframes[32];
+  if (copyString(json, "project", client->project, sizeof(client->project),
+                 true) < 0 ||
+      strchr(client->project, '/') || client->project[0] == '\0') {
+    error = "missing or invalid \"project\"";
+  } else if (copyString(json, "output", client->output,
+                        sizeof(client->output), false) < 0 ||
+             copyString(json, "background", client->background,
+                        sizeof(client->background), false) < 0 ||
+             copyString(json, "profile", client->profile,
+                        sizeof(client->profile), false) < 0 ||
+             copyString(json, "bg_mode", mode, sizeof(mode), false) < 0 ||
+             copyString(json, "bg_fit", fit, sizeof(fit), false) < 0 ||
+             copyString(json, "output_layout", layout, sizeof(layout),
+                        false) < 0 ||
+             copyString(json, "keyframes", keyframes, sizeof(keyframes),
+                        false) < 0) {
+    error = "string field too long or not a string";
+  }
+
+  if (!error) {
+    if (client->output[0] == '\0')
+      snprintf(client->output, sizeof(client->output), "%s.mp4",
+               client->project);
+    client->bgMode = BG_MODE_ONCE;
+    if (mode[0] != '\0' && parseBackgroundMode(mode, &client->bgMode) < 0)
+      error = "unknown \"bg_mode\"";
+    client->bgFit = BG_FIT_CROP;
+    if (fit[0] != '\0' && parseBackgroundFit(fit, &client->bgFit) < 0)
+      error = "unknown \"bg_fit\"";
+    if (client->profile[0] != '\0' && !findEncoderProfile(client->profile))
+      error = "unknown \"profile\"";
+    client->outputLayout = OUTPUT_LAYOUT_AUTO;
+    if (layout[0] != '\0' &&
+        parseOutputLayout(layout, &client->outputLayout) < 0)
+      error = "unknown \"output_layout\"";
+    client->keyframes = KEYFRAMES_CAPTIONS;
+    if (keyframes[0] != '\0' &&
+        parseKeyframePolicy(keyframes, &client->keyframes) < 0)
+      error = "unknown \"keyframes\"";
+    // The daemon's own stdout and descriptors are not for clients
+    if (strcmp(client->output, "-") == 0 ||
+        strncmp(client->output, "fd:", 3) == 0)
+      error = "\"output\" must be a file path";
+
+    client->incremental =
+        cJSON_IsTrue(cJSON_GetObjectItem(json, "incremental"));
+    client->audioCache =
+        cJSON_IsTrue(cJSON_GetObjectItem(json, "audio_cache"));
+    cJSON *checkpoint = cJSON_GetObjectItem(json, "checkpoint_gops");
+    client->checkpointGops =
+        cJSON_IsNumber(checkpoint) ? checkpoint->valueint : 0;
+    if (client->checkpointGops < 0)
+      error = "\"checkpoint_gops\" must not be negative";
+    client->resume = cJSON_IsTrue(cJSON_GetObjectItem(json, "resume"));
+    client->uniformQuality = cJSON_IsFalse(cJSON_GetObjectItem(json, "roi"));
+    client->regionSample =
+        cJSON_IsTrue(cJSON_GetObjectItem(json, "roi_sample"));
+    client->live = cJSON_IsTrue(cJSON_GetObjectItem(json, "live"));
+    client->plan = cJSON_IsTrue(cJSON_GetObjectItem(json, "plan"));
+    cJSON *maxGop = cJSON_GetObjectItem(json, "max_gop");
+    client->maxGop = cJSON_IsNumber(maxGop) ? maxGop->valueint : 0;
+    if (client->maxGop < 0)
+      error = "\"max_gop\" must not be negative";
+    cJSON *offset = cJSON_GetObjectItem(json, "offset");
+    client->offset = cJSON_IsNumber(offset) ? offset->valuedouble : 0.0;
+    if (client->offset < 0.0)
+      error = "\"offset\" must not be negative";
+    if (!error)
+      error = parseRenditions(client, json);
+  }
+  cJSON_Delete(json);
+  return error;
+}
+
+static void acceptClients(RenderDaemon *d) {
+  for (;;) {
+    int fd = accept(d->listenFd, NULL, NULL);
+    if (fd < 0)
+      return;
+
+    int index = -1;
+    for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+      if (!d->clients[i]) {
+        index = i;
+        break;
+      }
+    }
+    DaemonClient *client = index >= 0 ? calloc(1, sizeof(DaemonClient)) : NULL;
+    if (!client) {
+      const char *busy = "{\"status\":\"error\",\"message\":\"too many "
+                         "clients\"}\n";
+      send(fd, busy, strlen(busy), MSG_NOSIGNAL);
+      close(fd);
+      continue;
+    }
+    client->fd = fd;
+    client->id = ++d->nextJobId;
+    client->state = CLIENT_READING;
+    d->clients[index] = client;
+  }
+}
+
+// What the client asked for; the caller sets the label
+static RenderOptions clientOptions(RenderDaemon *d, DaemonClient *client,
+                                   BackgroundVideo *background) {
+  // Concurrent jobs split the cores between their encoders
+  int encoderThreads = cpuCount() / d->maxJobs;
+  return (RenderOptions){
+      .projectId = client->project,
+      .output = client->output,
+      .outputLayout = client->outputLayout,
+      .incremental = client->incremental,
+      .checkpointGops = client->checkpointGops,
+      .resume = client->resume,
+      .uniformQuality = client->uniformQuality,
+      .regionSample = client->regionSample,
+      .keyframes = client->keyframes,
+      .maxGop = client->maxGop,
+      .live = client->live,
+      .audioCache = client->audioCache,
+      .renditions = client->renditions,
+      .renditionCount = client->renditionCount,
+      .profile = client->profile[0] != '\0' ? client->profile : NULL,
+      .background = background,
+      .backgroundOffset = client->offset,
+      .encoderThreads = encoderThreads > 0 ? encoderThreads : 1,
+      .encodeThread = true,
+      .verbose = false,
+  };
+}
+
+// Load and check the project without queueing it and answer right away
+static void planJob(RenderDaemon *d, int index) {
+  DaemonClient *client = d->clients[index];
+  if (client->background[0] != '\0') {
+    client->bg = acquireBackground(d, client->background, client->bgMode,
+                                   client->bgFit);
+    if (!client->bg) {
+      sendError(client, "could not open background video");
+      closeClient(d, index);
+      return;
+    }
+  }
+  RenderOptions opts =
+      clientOptions(d, client, client->bg ? &client->bg->video : NULL);
+  RenderPlan plan;
+  if (planRender(&opts, &plan) < 0) {
+    sendError(client, "could not load project");
+  } else {
+    cJSON *reply = newReply(client, "planned");
+    addRenderPlanJson(&plan, reply);
+    sendReply(client, reply);
+    printf("[job %d] Planned %s: %d problems\n", client->id,
+           client->project, plan.problemCount);
+    freeRenderPlan(&plan);
+  }
+  if (client->bg)
+    releaseBackground(client->bg);
+  closeClient(d, index);
+}
+
+// Read from a client until its request line is complete
+static void readRequest(RenderDaemon *d, int index) {
+  DaemonClient *client = d->clients[index];
+  int space = DAEMON_REQUEST_MAX - 1 - client->requestLen;
+  ssize_t n = recv(client->fd, client->request + client->requestLen, space, 0);
+  if (n <= 0) {
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+    closeClient(d, index);
+    return;
+  }
+  client->requestLen += n;
+  client->request[client->requestLen] = '\0';
+
+  char *newline = strchr(client->request, '\n');
+  if (!newline) {
+    if (client->requestLen == DAEMON_REQUEST_MAX - 1) {
+      sendError(client, "request too long");
+      closeClient(d, index);
+    }
+    return;
+  }
+  *newline = '\0';
+
+  const char *error = parseRequest(client);
+  if (error) {
+    sendError(client, error);
+    closeClient(d, index);
+    return;
+  }
+  if (client->plan) {
+    planJob(d, index);
+    return;
+  }
+  client->state = CLIENT_QUEUED;
+  client->queuedAt = nowMs();
+  sendReply(client, newReply(client, "queued"));
+}
+
+// ---------------------------------------------------------------------------
+// Jobs
+
+static int countClients(RenderDaemon *d, ClientState state) {
+  int count = 0;
+  for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+    if (d->clients[i] && d->clients[i]->state == state)
+      count++;
+  }
+  return count;
+}
+
+static void startJob(RenderDaemon *d, int index) {
+  DaemonClient *client = d->clients[index];
+  client->startedAt = nowMs();
+
+  BackgroundVideo *background = NULL;
+  if (client->background[0] != '\0') {
+    client->bg = acquireBackground(d, client->background, client->bgMode,
+                                   client->bgFit);
+    if (!client->bg) {
+      sendError(client, "could not open background video");
+      closeClient(d, index);
+      return;
+    }
+    background = &client->bg->video;
+  }
+
+  char label[32];
+  snprintf(label, sizeof(label), "job %d", client->id);
+  RenderOptions opts = clientOptions(d, client, background);
+  opts.label = label;
+  client->job = startRenderJob(d->ctx, &opts);
+  if (!client->job) {
+    if (client->bg)
+      releaseBackground(client->bg);
+    sendError(client, "could not start render");
+    closeClient(d, index);
+    return;
+  }
+
+  client->state = CLIENT_RUNNING;
+  printf("[%s] Started %s -> %s\n", label, client->project, client->output);
+  sendReply(client, newReply(client, "started"));
+}
+
+static void startQueuedJobs(RenderDaemon *d) {
+  int running = countClients(d, CLIENT_RUNNING);
+  while (running < d->maxJobs) {
+    // Oldest request first
+    int next = -1;
+    for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+      DaemonClient *c = d->clients[i];
+      if (c && c->state == CLIENT_QUEUED &&
+          (next < 0 || c->id < d->clients[next]->id))
+        next = i;
+    }
+    if (next < 0)
+      return;
+    startJob(d, next);
+    running = countClients(d, CLIENT_RUNNING);
+  }
+}
+
+static void finishJob(RenderDaemon *d, int index, const char *abortReason) {
+  DaemonClient *client = d->clients[index];
+  RenderStats stats;
+  int ret = finishRenderJob(client->job, &stats);
+  client->job = NULL;
+  if (client->bg)
+    releaseBackground(client->bg);
+
+  if (abortReason) {
+    sendError(client, abortReason);
+  } else if (ret < 0) {
+    sendError(client, "render failed");
+  } else {
+    recordStageCosts(client->profile[0] != '\0' ? client->profile : NULL,
+                     &stats, client->live);
+    cJSON *reply = newReply(client, "done");
+    cJSON_AddStringToObject(reply, "output", client->output);
+    if (client->renditionCount > 0) {
+      cJSON *outputs = cJSON_AddArrayToObject(reply, "renditions");
+      for (int i = 0; i < client->renditionCount; i++)
+        cJSON_AddItemToArray(
+            outputs, cJSON_CreateString(client->renditions[i].output));
+    }
+    cJSON_AddNumberToObject(reply, "frames", stats.frames);
+    cJSON_AddNumberToObject(reply, "reused_frames", stats.reusedFrames);
+    cJSON_AddNumberToObject(reply, "checkpoints", stats.checkpoints);
+    cJSON_AddNumberToObject(reply, "video_bytes", (double)stats.videoBytes);
+    cJSON_AddNumberToObject(reply, "hinted_share", stats.hintedShare);
+    if (stats.regionSampleFrames > 0) {
+      cJSON_AddNumberToObject(reply, "region_sample_frames",
+                              stats.regionSampleFrames);
+      cJSON_AddNumberToObject(reply, "region_sample_bytes",
+                              (double)stats.regionSampleBytes);
+      cJSON_AddNumberToObject(reply, "uniform_sample_bytes",
+                              (double)stats.uniformSampleBytes);
+    }
+    cJSON_AddNumberToObject(reply, "gops", stats.gops);
+    cJSON_AddNumberToObject(reply, "boundary_gops", stats.boundaryGops);
+    if (client->live) {
+      cJSON_AddNumberToObject(reply, "deadline_misses", stats.deadlineMisses);
+      cJSON_AddNumberToObject(reply, "dropped_frames", stats.droppedFrames);
+      cJSON_AddNumberToObject(reply, "background_reused",
+                              stats.backgroundReused);
+      cJSON_AddNumberToObject(reply, "latency_ms", stats.latencyMs);
+      cJSON_AddNumberToObject(reply, "max_latency_ms", stats.maxLatencyMs);
+    }
+    cJSON_AddNumberToObject(reply, "overlay_rebuilds", stats.overlayRebuilds);
+    cJSON *memory = cJSON_AddObjectToObject(reply, "memory");
+    for (int i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++)
+      cJSON_AddNumberToObject(memory, memorySubsystemName(i),
+                              (double)stats.memory.bytes[i]);
+    cJSON_AddNumberToObject(memory, "peak_rss", (double)stats.peakRss);
+    cJSON_AddNumberToObject(reply, "queue_ms",
+                            client->startedAt - client->queuedAt);
+    cJSON_AddNumberToObject(reply, "setup_ms", stats.setupMs);
+    cJSON_AddNumberToObject(reply, "first_frame_ms", stats.firstFrameMs);
+    cJSON_AddNumberToObject(reply, "render_ms", stats.renderMs);
+    cJSON_AddNumberToObject(reply, "background_ms", stats.backgroundMs);
+    cJSON_AddNumberToObject(reply, "encode_ms", stats.encodeMs);
+    cJSON_AddNumberToObject(reply, "audio_ms", stats.audioMs);
+    cJSON_AddNumberToObject(reply, "total_ms", stats.totalMs);
+    cJSON_AddNumberToObject(reply, "fps",
+                            stats.totalMs > 0.0
+                                ? stats.frames * 1000.0 / stats.totalMs
+                                : 0.0);
+    sendReply(client, reply);
+  }
+  printf("[job %d] %s: %d frames in %.0fms (setup %.0fms)\n", client->id,
+         abortReason ? abortReason : ret < 0 ? "failed" : "done",
+         stats.frames, stats.totalMs, stats.setupMs);
+  closeClient(d, index);
+}
+
+// Render one frame of each running job in turn
+static void stepJobs(RenderDaemon *d) {
+  int running[DAEMON_MAX_CLIENTS];
+  int count = 0;
+  for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+    if (d->clients[i] && d->clients[i]->state == CLIENT_RUNNING)
+      running[count++] = i;
+  }
+  if (count == 0)
+    return;
+
+  beginRenderRound(d->ctx);
+  bool progressed = false;
+  for (int k = 0; k < count; k++) {
+    int index = running[(d->nextStep + k) % count];
+    RenderStepResult step = renderJobStep(d->clients[index]->job, false);
+    if (step == RENDER_STEP_DONE)
+      finishJob(d, index, NULL);
+    else if (step == RENDER_STEP_ERROR)
+      finishJob(d, index, "render failed");
+    if (step != RENDER_STEP_BUSY)
+      progressed = true;
+  }
+  if (!progressed) {
+    // Every job is waiting on its encoder or, live, on its next frame
+    // slot. A blocked step would hold up the others, and a live one sleeps
+    // until its slot, so with any live job running only nap briefly.
+    // Otherwise wait on one encoder rather than spin.
+    bool live = false;
+    for (int k = 0; k < count; k++)
+      live = live || d->clients[running[k]]->live;
+    if (live) {
+      usleep(DAEMON_LIVE_POLL_MS * 1000);
+    } else {
+      int index = running[d->nextStep % count];
+      RenderStepResult step = renderJobStep(d->clients[index]->job, true);
+      if (step == RENDER_STEP_DONE)
+        finishJob(d, index, NULL);
+      else if (step == RENDER_STEP_ERROR)
+        finishJob(d, index, "render failed");
+    }
+  }
+  endRenderRound(d->ctx);
+  d->nextStep++;
+}
+
+// ---------------------------------------------------------------------------
+
+static int openListenSocket(const char *socketPath) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    printf("Error: Socket path too long: %s\n", socketPath);
+    return -1;
+  }
+  strcpy(addr.sun_path, socketPath);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    printf("Error: Could not create socket: %s\n", strerror(errno));
+    return -1;
+  }
+  unlink(socketPath);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 16) < 0) {
+    printf("Error: Could not listen on %s: %s\n", socketPath,
+           strerror(errno));
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+int runRenderDaemon(RenderContext *ctx, const char *socketPath, int maxJobs) {
+  RenderDaemon d = {0};
+  d.ctx = ctx;
+  d.maxJobs = maxJobs;
+  if (d.maxJobs < 1)
+    d.maxJobs = 1;
+  if (d.maxJobs > DAEMON_MAX_BACKGROUNDS)
+    d.maxJobs = DAEMON_MAX_BACKGROUNDS;
+
+  d.listenFd = openListenSocket(socketPath);
+  if (d.listenFd < 0)
+    return -1;
+
+  struct sigaction sa = {0};
+  sa.sa_handler = onDaemonSignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  printf("Render daemon listening on %s (up to %d concurrent jobs)\n",
+         socketPath, d.maxJobs);
+
+  while (!daemonQuit) {
+    // Wait for requests, but only briefly while there are frames to render
+    struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+    int owners[DAEMON_MAX_CLIENTS + 1];
+    int nfds = 0;
+    fds[nfds].fd = d.listenFd;
+    fds[nfds].events = POLLIN;
+    owners[nfds++] = -1;
+    for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+      if (d.clients[i] && d.clients[i]->state == CLIENT_READING) {
+        fds[nfds].fd = d.clients[i]->fd;
+        fds[nfds].events = POLLIN;
+        owners[nfds++] = i;
+      }
+    }
+    int busy = countClients(&d, CLIENT_RUNNING) + countClients(&d, CLIENT_QUEUED);
+    if (poll(fds, nfds, busy > 0 ? 0 : DAEMON_IDLE_POLL_MS) > 0) {
+      for (int i = 1; i < nfds; i++) {
+        if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+          readRequest(&d, owners[i]);
+      }
+      if (fds[0].revents & POLLIN)
+        acceptClients(&d);
+    }
+
+    startQueuedJobs(&d);
+    stepJobs(&d);
+  }
+
+  printf("Render daemon shutting down\n");
+  for (int i = 0; i < DAEMON_MAX_CLIENTS; i++) {
+    if (!d.clients[i])
+      continue;
+    if (d.clients[i]->state == CLIENT_RUNNING) {
+      finishJob(&d, i, "daemon shutting down");
+    } else {
+      sendError(d.clients[i], "daemon shutting down");
+      closeClient(&d, i);
+    }
+  }
+  for (int i = 0; i < DAEMON_MAX_BACKGROUNDS; i++) {
+    if (d.backgrounds[i].open)
+      cleanupBackgroundVideo(&d.backgrounds[i].video);
+  }
+  close(d.listenFd);
+  unlink(socketPath);
+  return 0;
+}
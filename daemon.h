@@ -0,0 +1,25 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "render.h"
+
+// Render daemon. Listens on a Unix socket for one JSON request per
+// connection, e.g.
+//   {"project": "abc", "background": "./media/parkour1.mp4",
+//    "offset": 12.5, "bg_mode": "loop", "output": "abc.mp4",
+//    "profile": "fast", "output_layout": "faststart", "incremental": true,
+//    "audio_cache": true, "checkpoint_gops": 10, "resume": true,
+//    "roi": true, "roi_sample": true, "keyframes": "captions",
+//    "max_gop": 120}
+// and answers with one JSON line per state change ("queued", "started",
+// then "done" with per-job timing, or "error"). Up to maxJobs renders run
+// at once: frames are composited in turn on the GL thread and each job
+// encodes on its own thread. Open background decoders are kept between
+// jobs. A live job ("live": true, usually with an "output" like
+// "rtmp://host/app/key") paces itself to the wall clock and waits its turn
+// between frames. With "plan": true the project is only loaded and
+// checked, and the one reply ("planned") has what --plan reports. Runs
+// until SIGINT/SIGTERM.
+int runRenderDaemon(RenderContext *ctx, const char *socketPath, int maxJobs);
+
+#endif
@@ -0,0 +1,158 @@
+#include "headless.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <rlgl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEADLESS_MAX_DEVICES 16
+
+struct HeadlessGL {
+  EGLDisplay display;
+  EGLContext context;
+  EGLSurface surface; // only without EGL_KHR_surfaceless_context
+};
+
+static bool hasExtension(EGLDisplay display, const char *name) {
+  const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+  if (!extensions)
+    return false;
+  size_t length = strlen(name);
+  for (const char *p = extensions; (p = strstr(p, name)); p += length) {
+    if ((p == extensions || p[-1] == ' ') &&
+        (p[length] == ' ' || p[length] == '\0'))
+      return true;
+  }
+  return false;
+}
+
+static EGLDisplay openDisplay(int device, const char **platform) {
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+          "eglGetPlatformDisplayEXT");
+  if (!getPlatformDisplay)
+    return EGL_NO_DISPLAY;
+
+  // Mesa: renders on the default GPU without any display server
+  if (device < 0) {
+    EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                            EGL_DEFAULT_DISPLAY, NULL);
+    if (display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL)) {
+      *platform = "surfaceless";
+      return display;
+    }
+    device = 0;
+  }
+
+  // EGL devices, which is what the proprietary drivers offer
+  PFNEGLQUERYDEVICESEXTPROC queryDevices =
+      (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+  EGLDeviceEXT devices[HEADLESS_MAX_DEVICES];
+  EGLint count = 0;
+  if (!queryDevices ||
+      !queryDevices(HEADLESS_MAX_DEVICES, devices, &count) ||
+      device >= count) {
+    printf("Error: No EGL device %d (%d found)\n", device, count);
+    return EGL_NO_DISPLAY;
+  }
+  EGLDisplay display =
+      getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, devices[device], NULL);
+  if (display != EGL_NO_DISPLAY && eglInitialize(display, NULL, NULL)) {
+    *platform = "device";
+    return display;
+  }
+  return EGL_NO_DISPLAY;
+}
+
+HeadlessGL *createHeadlessGL(int device, int width, int height) {
+  HeadlessGL *gl = calloc(1, sizeof(HeadlessGL));
+  if (!gl)
+    return NULL;
+  gl->context = EGL_NO_CONTEXT;
+  gl->surface = EGL_NO_SURFACE;
+
+  const char *platform = NULL;
+  gl->display = openDisplay(device, &platform);
+  if (gl->display == EGL_NO_DISPLAY) {
+    free(gl);
+    return NULL;
+  }
+
+  // rlgl's default backend is OpenGL 3.3 core
+  const EGLint configAttribs[] = {EGL_SURFACE_TYPE,
+                                  EGL_PBUFFER_BIT,
+                                  EGL_RENDERABLE_TYPE,
+                                  EGL_OPENGL_BIT,
+                                  EGL_RED_SIZE,
+                                  8,
+                                  EGL_GREEN_SIZE,
+                                  8,
+                                  EGL_BLUE_SIZE,
+                                  8,
+                                  EGL_ALPHA_SIZE,
+                                  8,
+                                  EGL_NONE};
+  const EGLint contextAttribs[] = {EGL_CONTEXT_MAJOR_VERSION,
+                                   3,
+                                   EGL_CONTEXT_MINOR_VERSION,
+                                   3,
+                                   EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                   EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                   EGL_NONE};
+  EGLConfig config;
+  EGLint configCount = 0;
+  if (!eglChooseConfig(gl->display, configAttribs, &config, 1,
+                       &configCount) ||
+      configCount == 0 || !eglBindAPI(EGL_OPENGL_API)) {
+    printf("Error: No suitable EGL config for OpenGL\n");
+    destroyHeadlessGL(gl);
+    return NULL;
+  }
+  gl->context =
+      eglCreateContext(gl->display, config, EGL_NO_CONTEXT, contextAttribs);
+  if (gl->context == EGL_NO_CONTEXT) {
+    printf("Error: Could not create an OpenGL 3.3 context (0x%x)\n",
+           eglGetError());
+    destroyHeadlessGL(gl);
+    return NULL;
+  }
+
+  // Everything is drawn into FBOs; a 1x1 pbuffer stands in where contexts
+  // can't be current without a surface
+  if (!hasExtension(gl->display, "EGL_KHR_surfaceless_context")) {
+    const EGLint pbufferAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+    gl->surface = eglCreatePbufferSurface(gl->display, config, pbufferAttribs);
+  }
+  if (!eglMakeCurrent(gl->display, gl->surface, gl->surface, gl->context)) {
+    printf("Error: Could not make the headless context current (0x%x)\n",
+           eglGetError());
+    destroyHeadlessGL(gl);
+    return NULL;
+  }
+
+  rlLoadExtensions((void *)eglGetProcAddress);
+  rlglInit(width, height);
+  printf("Headless OpenGL: EGL %s platform, %s\n", platform,
+         eglQueryString(gl->display, EGL_VENDOR));
+  return gl;
+}
+
+void destroyHeadlessGL(HeadlessGL *gl) {
+  if (!gl)
+    return;
+  if (eglGetCurrentContext() == gl->context &&
+      gl->context != EGL_NO_CONTEXT) {
+    rlglClose();
+    eglMakeCurrent(gl->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+  }
+  if (gl->surface != EGL_NO_SURFACE)
+    eglDestroySurface(gl->display, gl->surface);
+  if (gl->context != EGL_NO_CONTEXT)
+    eglDestroyContext(gl->display, gl->context);
+  eglTerminate(gl->display);
+  free(gl);
+}
@@ -0,0 +1,18 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+// OpenGL context without a window system, for render and daemon mode. The
+// render path only draws into framebuffer objects, so all it needs is a
+// current context with rlgl set up on it: no display server, no swap and
+// no event polling. rlgl keeps global state, so there is one per process;
+// run one process per context to render several at once.
+typedef struct HeadlessGL HeadlessGL;
+
+// device < 0 tries Mesa's surfaceless platform first, then the first EGL
+// device; otherwise uses EGL device number device (one per GPU). Makes the
+// context current on the calling thread and initialises rlgl with a
+// width x height default framebuffer size. Returns NULL on failure.
+HeadlessGL *createHeadlessGL(int device, int width, int height);
+void destroyHeadlessGL(HeadlessGL *gl);
+
+#endif
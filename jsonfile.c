@@ -0,0 +1,45 @@
+#define _GNU_SOURCE
+#include "jsonfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+cJSON *readJsonFile(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return NULL;
+  fseek(file, 0, SEEK_END);
+  long fileSize = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *text = malloc(fileSize + 1);
+  size_t length = text ? fread(text, 1, fileSize, file) : 0;
+  fclose(file);
+  if (!text)
+    return NULL;
+  text[length] = '\0';
+  cJSON *json = cJSON_Parse(text);
+  free(text);
+  return json;
+}
+
+int writeJsonFile(const cJSON *json, const char *path) {
+  char *text = cJSON_Print(json);
+  if (!text)
+    return -1;
+  char tmpPath[512];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+  FILE *file = fopen(tmpPath, "w");
+  int ret = -1;
+  if (file) {
+    ret = fputs(text, file) < 0 || fflush(file) != 0 || fsync(fileno(file)) < 0
+              ? -1
+              : 0;
+    if (fclose(file) != 0 || ret < 0 || rename(tmpPath, path) != 0) {
+      remove(tmpPath);
+      ret = -1;
+    }
+  }
+  cJSON_free(text);
+  return ret;
+}
@@ -0,0 +1,14 @@
+#ifndef JSONFILE_H
+#define JSONFILE_H
+
+#include <cjson/cJSON.h>
+
+// The whole file at path parsed, or NULL if it is missing or not JSON
+cJSON *readJsonFile(const char *path);
+
+// Written next to path and renamed over it, so readers never see half a
+// file, and synced before the rename so it survives the machine going
+// away. Returns -1 on error, leaving whatever was at path.
+int writeJsonFile(const cJSON *json, const char *path);
+
+#endif
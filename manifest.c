@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include "manifest.h"
+
+#include <cjson/cJSON.h>
+#include <inttypes.h>
+#include <libavformat/avformat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "jsonfile.h"
+
+#define MANIFEST_VERSION 2
+
+struct GopSource {
+  char path[512];
+  AVFormatContext *fmt_ctx;
+  int stream_index;
+  AVRational time_base;
+  AVPacket *pkt;
+  bool holding; // pkt is the first packet of a later GOP
+  GopLayout layout;
+  bool *complete;
+};
+
+static const char *keyframePolicyNames[] = {"captions", "fixed"};
+
+int parseKeyframePolicy(const char *name, KeyframePolicy *policy) {
+  for (int i = 0; i < (int)(sizeof(keyframePolicyNames) /
+                            sizeof(keyframePolicyNames[0]));
+       i++) {
+    if (strcmp(name, keyframePolicyNames[i]) == 0) {
+      *policy = (KeyframePolicy)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *keyframePolicyName(KeyframePolicy policy) {
+  return keyframePolicyNames[policy];
+}
+
+int planGopLayout(GopLayout *layout, const Project *project,
+                  const SceneAssets *assets, int frameCount, int maxGop,
+                  KeyframePolicy policy) {
+  memset(layout, 0, sizeof(GopLayout));
+  layout->maxGop = maxGop;
+  layout->frameCount = frameCount;
+  // At worst every frame starts a GOP
+  int capacity = frameCount > 0 ? frameCount : 1;
+  layout->starts = malloc(capacity * sizeof(int));
+  int *boundaries = malloc(capacity * sizeof(int));
+  if (!layout->starts || !boundaries) {
+    free(boundaries);
+    freeGopLayout(layout);
+    return -1;
+  }
+
+  // Frames the caption or the speaker changes on, as the render loop gets
+  // there
+  int boundaryCount = 1;
+  boundaries[0] = 0;
+  if (policy == KEYFRAMES_CAPTIONS) {
+    SceneState scene;
+    initSceneState(&scene, assets, project);
+    float deltaTime = 1.0f / FPS;
+    const Caption *caption = NULL;
+    int speaker = scene.currentSpeaker;
+    for (int frame = 0; frame < frameCount; frame++) {
+      updateScene(&scene, assets, project, frame * deltaTime, deltaTime);
+      bool changed = scene.currentCaption != caption ||
+                     scene.currentSpeaker != speaker;
+      caption = scene.currentCaption;
+      speaker = scene.currentSpeaker;
+      if (changed && frame - boundaries[boundaryCount - 1] >= GOP_MIN_FRAMES)
+        boundaries[boundaryCount++] = frame;
+    }
+  }
+  layout->boundaries = boundaryCount - 1;
+
+  // Fixed GOPs are exactly maxGop long; between boundaries the stretch is
+  // split into as few GOPs as fit, all about the same length, so no
+  // keyframe lands a few frames before the next boundary
+  for (int i = 0; i < boundaryCount; i++) {
+    int start = boundaries[i];
+    int end = i + 1 < boundaryCount ? boundaries[i + 1] : frameCount;
+    int pieces = (end - start + maxGop - 1) / maxGop;
+    for (int k = 0; k < pieces; k++) {
+      layout->starts[layout->count++] =
+          policy == KEYFRAMES_FIXED
+              ? start + k * maxGop
+              : start + (int)((int64_t)(end - start) * k / pieces);
+    }
+  }
+  free(boundaries);
+  return 0;
+}
+
+int gopAt(const GopLayout *layout, int frame) {
+  // Last GOP starting at or before frame
+  int low = 0;
+  int high = layout->count - 1;
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (layout->starts[mid] <= frame)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+  return low;
+}
+
+int gopStart(const GopLayout *layout, int gop) {
+  return gop < layout->count ? layout->starts[gop] : layout->frameCount;
+}
+
+void freeGopLayout(GopLayout *layout) {
+  free(layout->starts);
+  memset(layout, 0, sizeof(GopLayout));
+}
+
+static int copyGopLayout(GopLayout *dst, const GopLayout *src) {
+  *dst = *src;
+  dst->starts = malloc((src->count > 0 ? src->count : 1) * sizeof(int));
+  if (!dst->starts) {
+    memset(dst, 0, sizeof(GopLayout));
+    return -1;
+  }
+  memcpy(dst->starts, src->starts, src->count * sizeof(int));
+  return 0;
+}
+
+uint64_t hashManifestData(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+uint64_t hashManifestString(uint64_t hash, const char *s) {
+  if (!s)
+    return hashManifestData(hash, "", 1);
+  return hashManifestData(hash, s, strlen(s) + 1);
+}
+
+uint64_t hashFileIdentity(uint64_t hash, const char *path) {
+  struct stat st;
+  int64_t identity[2] = {-1, -1};
+  if (stat(path, &st) == 0) {
+    identity[0] = st.st_size;
+    identity[1] = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  }
+  hash = hashManifestString(hash, path);
+  return hashManifestData(hash, identity, sizeof(identity));
+}
+
+static uint64_t hashCaption(const Caption *caption) {
+  uint64_t hash = MANIFEST_HASH_INIT;
+  hash = hashManifestString(hash, caption->text);
+  hash = hashManifestData(hash, &caption->startTime, sizeof(float));
+  hash = hashManifestData(hash, &caption->endTime, sizeof(float));
+  int speaker = caption->speaker;
+  hash = hashManifestData(hash, &speaker, sizeof(int));
+  for (int i = 0; i < caption->wordCount; i++) {
+    hash = hashManifestString(hash, caption->words[i].word);
+    hash = hashManifestData(hash, &caption->words[i].start, sizeof(float));
+    hash = hashManifestData(hash, &caption->words[i].end, sizeof(float));
+  }
+  return hash;
+}
+
+static uint64_t hashCharacter(uint64_t hash, const CharacterState *c) {
+  float values[6] = {c->x,     c->startX,        c->endX,
+                     c->alpha, c->slideProgress, c->fadeSpeed};
+  uint8_t flags[2] = {c->isVisible, c->isSliding};
+  hash = hashManifestData(hash, values, sizeof(values));
+  return hashManifestData(hash, flags, sizeof(flags));
+}
+
+int buildRenderManifest(RenderManifest *manifest, const Project *project,
+                        const SceneAssets *assets, const BackgroundVideo *bg,
+                        double bgOffset, const GopLayout *layout,
+                        uint64_t settings) {
+  memset(manifest, 0, sizeof(RenderManifest));
+  manifest->settings = settings;
+  if (copyGopLayout(&manifest->layout, layout) < 0)
+    return -1;
+  manifest->gops = calloc(layout->count > 0 ? layout->count : 1,
+                          sizeof(uint64_t));
+  uint64_t *captionHashes =
+      malloc((project->captionCount > 0 ? project->captionCount : 1) *
+             sizeof(uint64_t));
+  if (!manifest->gops || !captionHashes) {
+    free(captionHashes);
+    freeRenderManifest(manifest);
+    return -1;
+  }
+  for (int i = 0; i < project->captionCount; i++)
+    captionHashes[i] = hashCaption(&project->captions[i]);
+
+  // The background shows the same source frames as long as the file, mode,
+  // fit and offset stay the same
+  uint64_t bgHash = MANIFEST_HASH_INIT;
+  if (bg && bg->decoders[0].fmt_ctx) {
+    bgHash = hashFileIdentity(bgHash, bg->decoders[0].fmt_ctx->url);
+    int mode[] = {bg->mode, bg->fit};
+    bgHash = hashManifestData(bgHash, mode, sizeof(mode));
+    bgHash = hashManifestData(bgHash, &bgOffset, sizeof(double));
+  }
+
+  // Who is drawn where, and with which sprite; states below only say how
+  // far along each character is
+  uint64_t characterHash = MANIFEST_HASH_INIT;
+  for (int i = 0; i < project->characterCount; i++) {
+    const CharacterDef *c = &project->characters[i];
+    characterHash = hashManifestString(characterHash, c->name);
+    characterHash = hashFileIdentity(characterHash, c->sprite);
+    int layout[] = {c->anchor, c->enter, c->exit};
+    float size[] = {c->scale, c->margin};
+    characterHash = hashManifestData(characterHash, layout, sizeof(layout));
+    characterHash = hashManifestData(characterHash, size, sizeof(size));
+  }
+
+  // Same steps as the render loop, so the states match frame for frame
+  SceneState scene;
+  initSceneState(&scene, assets, project);
+  float deltaTime = 1.0f / FPS;
+  uint64_t hash = MANIFEST_HASH_INIT;
+  int gop = -1;
+  for (int frame = 0; frame < layout->frameCount; frame++) {
+    if (frame == gopStart(layout, gop + 1)) {
+      gop++;
+      hash = hashManifestData(MANIFEST_HASH_INIT, &bgHash, sizeof(bgHash));
+      hash = hashManifestData(hash, &characterHash, sizeof(characterHash));
+    }
+
+    float currentTime = frame * deltaTime;
+    updateScene(&scene, assets, project, currentTime, deltaTime);
+    hash = hashManifestData(hash, &currentTime, sizeof(float));
+    for (int i = 0; i < scene.characterCount; i++)
+      hash = hashCharacter(hash, &scene.characters[i]);
+    int speaker = scene.currentSpeaker;
+    hash = hashManifestData(hash, &speaker, sizeof(int));
+    uint64_t captionHash =
+        scene.currentCaption
+            ? captionHashes[scene.currentCaption - project->captions]
+            : 0;
+    hash = hashManifestData(hash, &captionHash, sizeof(captionHash));
+
+    manifest->gops[gop] = hash;
+  }
+  free(captionHashes);
+  return 0;
+}
+
+static int parseHash(const cJSON *item, uint64_t *hash) {
+  if (!cJSON_IsString(item))
+    return -1;
+  char *end;
+  *hash = strtoull(item->valuestring, &end, 16);
+  return *end == '\0' && end != item->valuestring ? 0 : -1;
+}
+
+static int parseManifest(const cJSON *json, RenderManifest *manifest) {
+  int ret = -1;
+  cJSON *version = cJSON_GetObjectItem(json, "version");
+  cJSON *maxGop = cJSON_GetObjectItem(json, "max_gop");
+  cJSON *frames = cJSON_GetObjectItem(json, "frames");
+  cJSON *starts = cJSON_GetObjectItem(json, "gop_starts");
+  cJSON *gops = cJSON_GetObjectItem(json, "gops");
+  if (cJSON_IsNumber(version) && version->valueint == MANIFEST_VERSION &&
+      cJSON_IsNumber(maxGop) && maxGop->valueint > 0 &&
+      cJSON_IsNumber(frames) && frames->valueint >= 0 &&
+      cJSON_IsArray(starts) && cJSON_IsArray(gops) &&
+      parseHash(cJSON_GetObjectItem(json, "settings"), &manifest->settings) ==
+          0) {
+    GopLayout *layout = &manifest->layout;
+    layout->maxGop = maxGop->valueint;
+    layout->frameCount = frames->valueint;
+    layout->count = cJSON_GetArraySize(gops);
+    layout->starts = malloc((layout->count > 0 ? layout->count : 1) *
+                            sizeof(int));
+    manifest->gops =
+        calloc(layout->count > 0 ? layout->count : 1, sizeof(uint64_t));
+    ret = layout->starts && manifest->gops &&
+                  cJSON_GetArraySize(starts) == layout->count
+              ? 0
+              : -1;
+    // GOPs start in order from frame 0 and none is empty
+    for (int i = 0; i < layout->count && ret == 0; i++) {
+      cJSON *start = cJSON_GetArrayItem(starts, i);
+      int previous = i > 0 ? layout->starts[i - 1] : -1;
+      if (cJSON_IsNumber(start) && start->valueint > previous &&
+          start->valueint < layout->frameCount &&
+          (i > 0 || start->valueint == 0))
+        layout->starts[i] = start->valueint;
+      else
+        ret = -1;
+      if (ret == 0)
+        ret = parseHash(cJSON_GetArrayItem(gops, i), &manifest->gops[i]);
+    }
+  }
+  return ret;
+}
+
+static cJSON *manifestJson(const RenderManifest *manifest) {
+  cJSON *json = cJSON_CreateObject();
+  cJSON *starts = cJSON_CreateArray();
+  cJSON *gops = cJSON_CreateArray();
+  char hex[17];
+  cJSON_AddNumberToObject(json, "version", MANIFEST_VERSION);
+  snprintf(hex, sizeof(hex), "%016" PRIx64, manifest->settings);
+  cJSON_AddStringToObject(json, "settings", hex);
+  cJSON_AddNumberToObject(json, "max_gop", manifest->layout.maxGop);
+  cJSON_AddNumberToObject(json, "frames", manifest->layout.frameCount);
+  for (int i = 0; i < manifest->layout.count; i++) {
+    cJSON_AddItemToArray(starts,
+                         cJSON_CreateNumber(manifest->layout.starts[i]));
+    snprintf(hex, sizeof(hex), "%016" PRIx64, manifest->gops[i]);
+    cJSON_AddItemToArray(gops, cJSON_CreateString(hex));
+  }
+  cJSON_AddItemToObject(json, "gop_starts", starts);
+  cJSON_AddItemToObject(json, "gops", gops);
+  return json;
+}
+
+int loadRenderManifest(RenderManifest *manifest, const char *path) {
+  memset(manifest, 0, sizeof(RenderManifest));
+  cJSON *json = readJsonFile(path);
+  if (!json)
+    return -1;
+  int ret = parseManifest(json, manifest);
+  cJSON_Delete(json);
+  if (ret < 0) {
+    printf("Warning: Ignoring invalid render manifest %s\n", path);
+    freeRenderManifest(manifest);
+  }
+  return ret;
+}
+
+int saveRenderManifest(const RenderManifest *manifest, const char *path) {
+  cJSON *json = manifestJson(manifest);
+  int ret = writeJsonFile(json, path);
+  cJSON_Delete(json);
+  if (ret < 0)
+    printf("Error: Could not write render manifest %s\n", path);
+  return ret;
+}
+
+void freeRenderManifest(RenderManifest *manifest) {
+  freeGopLayout(&manifest->layout);
+  free(manifest->gops);
+  memset(manifest, 0, sizeof(RenderManifest));
+}
+
+int loadRenderCheckpoint(RenderCheckpoint *checkpoint, const char *path) {
+  memset(checkpoint, 0, sizeof(RenderCheckpoint));
+  cJSON *json = readJsonFile(path);
+  if (!json)
+    return -1;
+  cJSON *file = cJSON_GetObjectItem(json, "file");
+  cJSON *complete = cJSON_GetObjectItem(json, "complete_gops");
+  cJSON *audio = cJSON_GetObjectItem(json, "audio_samples");
+  int ret = parseManifest(json, &checkpoint->manifest);
+  if (ret == 0 && cJSON_IsString(file) && cJSON_IsNumber(complete) &&
+      complete->valueint >= 0 &&
+      complete->valueint <= checkpoint->manifest.layout.count &&
+      cJSON_IsNumber(audio)) {
+    snprintf(checkpoint->file, sizeof(checkpoint->file), "%s",
+             file->valuestring);
+    checkpoint->completeGops = complete->valueint;
+    checkpoint->frameIndex =
+        gopStart(&checkpoint->manifest.layout, complete->valueint);
+    checkpoint->audioSamples = (int64_t)audio->valuedouble;
+  } else {
+    ret = -1;
+  }
+  cJSON_Delete(json);
+  if (ret < 0) {
+    printf("Warning: Ignoring invalid render checkpoint %s\n", path);
+    freeRenderManifest(&checkpoint->manifest);
+  }
+  return ret;
+}
+
+int saveRenderCheckpoint(const RenderCheckpoint *checkpoint, const char *path) {
+  cJSON *json = manifestJson(&checkpoint->manifest);
+  cJSON_AddStringToObject(json, "file", checkpoint->file);
+  cJSON_AddNumberToObject(json, "complete_gops", checkpoint->completeGops);
+  cJSON_AddNumberToObject(json, "frame", checkpoint->frameIndex);
+  cJSON_AddNumberToObject(json, "audio_samples",
+                          (double)checkpoint->audioSamples);
+  int ret = writeJsonFile(json, path);
+  cJSON_Delete(json);
+  if (ret < 0)
+    printf("Warning: Could not write render checkpoint %s\n", path);
+  return ret;
+}
+
+static int openGopInput(GopSource *src) {
+  if (avformat_open_input(&src->fmt_ctx, src->path, NULL, NULL) < 0)
+    return -1;
+  if (avformat_find_stream_info(src->fmt_ctx, NULL) < 0)
+    return -1;
+  src->stream_index = -1;
+  for (unsigned int i = 0; i < src->fmt_ctx->nb_streams; i++) {
+    if (src->fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+      src->stream_index = i;
+      src->time_base = src->fmt_ctx->streams[i]->time_base;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Next video packet with timestamps in frames; the renders have no B-frames,
+// so dts equals pts
+static int readGopPacket(GopSource *src, AVPacket *pkt) {
+  for (;;) {
+    int ret = av_read_frame(src->fmt_ctx, pkt);
+    if (ret < 0)
+      return ret;
+    if (pkt->stream_index == src->stream_index &&
+        pkt->pts != AV_NOPTS_VALUE) {
+      pkt->pts = av_rescale_q(pkt->pts, src->time_base, (AVRational){1, FPS});
+      pkt->dts = pkt->pts;
+      pkt->duration = 1;
+      pkt->pos = -1;
+      return 0;
+    }
+    av_packet_unref(pkt);
+  }
+}
+
+GopSource *openGopSource(const char *path, const AVCodecParameters *par,
+                         const GopLayout *layout) {
+  GopSource *src = calloc(1, sizeof(GopSource));
+  if (!src)
+    return NULL;
+  snprintf(src->path, sizeof(src->path), "%s", path);
+  int gopCount = layout->count;
+  src->complete = calloc(gopCount > 0 ? gopCount : 1, sizeof(bool));
+  int *counts = calloc(gopCount > 0 ? gopCount : 1, sizeof(int));
+  src->pkt = av_packet_alloc();
+  if (copyGopLayout(&src->layout, layout) < 0 || !src->complete || !counts ||
+      !src->pkt || openGopInput(src) < 0) {
+    free(counts);
+    closeGopSource(src);
+    return NULL;
+  }
+
+  // Packets can only be reused by a decoder set up from the same headers
+  const AVCodecParameters *old =
+      src->fmt_ctx->streams[src->stream_index]->codecpar;
+  if (old->codec_id != par->codec_id || old->width != par->width ||
+      old->height != par->height ||
+      old->extradata_size != par->extradata_size ||
+      (par->extradata_size > 0 &&
+       memcmp(old->extradata, par->extradata, par->extradata_size) != 0)) {
+    printf("Warning: %s was encoded differently, rendering everything\n",
+           path);
+    free(counts);
+    closeGopSource(src);
+    return NULL;
+  }
+
+  // A GOP is usable if every frame is there and the first is a keyframe
+  while (readGopPacket(src, src->pkt) >= 0) {
+    int64_t frame = src->pkt->pts;
+    if (frame >= 0 && frame < layout->frameCount) {
+      int gop = gopAt(layout, (int)frame);
+      counts[gop]++;
+      if (frame == layout->starts[gop] && (src->pkt->flags & AV_PKT_FLAG_KEY))
+        src->complete[gop] = true;
+    }
+    av_packet_unref(src->pkt);
+  }
+  for (int gop = 0; gop < gopCount; gop++) {
+    int expected = gopStart(layout, gop + 1) - layout->starts[gop];
+    src->complete[gop] = src->complete[gop] && counts[gop] == expected;
+  }
+  free(counts);
+
+  // Start over for copying
+  avformat_close_input(&src->fmt_ctx);
+  if (openGopInput(src) < 0) {
+    closeGopSource(src);
+    return NULL;
+  }
+  return src;
+}
+
+bool gopSourceHas(const GopSource *src, int gop) {
+  return gop >= 0 && gop < src->layout.count && src->complete[gop];
+}
+
+int copyGopPackets(GopSource *src, int gop,
+                   int (*write)(void *arg, AVPacket *pkt), void *arg) {
+  int64_t start = gopStart(&src->layout, gop);
+  int64_t end = gopStart(&src->layout, gop + 1);
+  for (;;) {
+    if (!src->holding) {
+      int ret = readGopPacket(src, src->pkt);
+      if (ret == AVERROR_EOF)
+        return 0;
+      if (ret < 0)
+        return -1;
+      src->holding = true;
+    }
+    if (src->pkt->pts >= end)
+      return 0;
+    src->holding = false;
+    int ret = 0;
+    if (src->pkt->pts >= start)
+      ret = write(arg, src->pkt);
+    av_packet_unref(src->pkt);
+    if (ret < 0)
+      return -1;
+  }
+}
+
+void closeGopSource(GopSource *src) {
+  if (!src)
+    return;
+  if (src->fmt_ctx)
+    avformat_close_input(&src->fmt_ctx);
+  if (src->pkt)
+    av_packet_free(&src->pkt);
+  freeGopLayout(&src->layout);
+  free(src->complete);
+  free(src);
+}
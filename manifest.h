@@ -0,0 +1,114 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <libavcodec/avcodec.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "background.h"
+#include "project.h"
+#include "scene.h"
+
+// Where keyframes go: at caption and speaker changes, or only every
+// maxGop frames
+typedef enum { KEYFRAMES_CAPTIONS, KEYFRAMES_FIXED } KeyframePolicy;
+
+int parseKeyframePolicy(const char *name, KeyframePolicy *policy);
+const char *keyframePolicyName(KeyframePolicy policy);
+
+// Keyframes closer than this to the previous one are left out, so a quick
+// exchange doesn't turn into a run of tiny GOPs
+#define GOP_MIN_FRAMES (FPS / 4)
+
+// The GOPs a render is split into, each starting with an IDR frame
+typedef struct {
+  int maxGop; // frames
+  int frameCount;
+  int count;
+  int *starts;    // first frame of each GOP, starts[0] is 0
+  int boundaries; // GOPs that start on a caption or speaker change
+} GopLayout;
+
+// Lay out frameCount frames. With KEYFRAMES_CAPTIONS a GOP starts wherever
+// the scene's caption or speaker changes, stepped exactly as the render
+// steps it; stretches longer than maxGop are split evenly. Returns -1 if
+// out of memory.
+int planGopLayout(GopLayout *layout, const Project *project,
+                  const SceneAssets *assets, int frameCount, int maxGop,
+                  KeyframePolicy policy);
+// GOP frame is in, and the first frame of gop (frameCount past the last)
+int gopAt(const GopLayout *layout, int frame);
+int gopStart(const GopLayout *layout, int gop);
+void freeGopLayout(GopLayout *layout);
+
+// Saved next to the output as <output>.manifest
+#define MANIFEST_SUFFIX ".manifest"
+#define MANIFEST_HASH_INIT 0xcbf29ce484222325ULL
+
+// What every GOP of a render shows, as one hash per GOP. A GOP whose hash
+// is unchanged since the last render can be copied from the old file.
+typedef struct {
+  uint64_t settings; // encoder, frame size and assets; changes invalidate all
+  GopLayout layout;
+  uint64_t *gops; // layout.count of them
+} RenderManifest;
+
+uint64_t hashManifestData(uint64_t hash, const void *data, size_t size);
+uint64_t hashManifestString(uint64_t hash, const char *s); // NULL is fine
+// Size and modification time of path, so edits to the file show up
+uint64_t hashFileIdentity(uint64_t hash, const char *path);
+
+// Hash the captions, character animation and background of every GOP of
+// layout, which is copied. The scene is simulated without drawing, exactly
+// as the render steps it.
+int buildRenderManifest(RenderManifest *manifest, const Project *project,
+                        const SceneAssets *assets, const BackgroundVideo *bg,
+                        double bgOffset, const GopLayout *layout,
+                        uint64_t settings);
+
+// Returns -1 if there is no readable manifest at path
+int loadRenderManifest(RenderManifest *manifest, const char *path);
+int saveRenderManifest(const RenderManifest *manifest, const char *path);
+void freeRenderManifest(RenderManifest *manifest);
+
+// Saved as <output>.checkpoint while a checkpointed render runs. The
+// partial output is fragmented MP4, so it stays readable up to its last
+// flushed fragment if the render dies. Everything else a resumed render
+// needs (scene and background state, the audio encode) is reproduced by
+// replaying the first frameIndex frames, which the manifest's GOP hashes
+// check.
+#define CHECKPOINT_SUFFIX ".checkpoint"
+
+typedef struct {
+  RenderManifest manifest; // of the render being checkpointed
+  char file[512];          // partial output
+  int completeGops;        // GOPs [0, completeGops) are flushed to file
+  int frameIndex;          // first frame after them
+  int64_t audioSamples;    // mixed when the checkpoint was taken
+} RenderCheckpoint;
+
+// Returns -1 if there is no readable checkpoint at path. Free with
+// freeRenderManifest(&checkpoint->manifest).
+int loadRenderCheckpoint(RenderCheckpoint *checkpoint, const char *path);
+int saveRenderCheckpoint(const RenderCheckpoint *checkpoint, const char *path);
+
+// Video packets of a previous render, handed out one GOP at a time in order
+typedef struct GopSource GopSource;
+
+// Open the previous render at path, laid out as layout says (its GOPs are
+// numbered the same). Returns NULL if it is missing or its video stream was
+// encoded differently from par.
+GopSource *openGopSource(const char *path, const AVCodecParameters *par,
+                         const GopLayout *layout);
+
+// GOP is complete in the previous render and starts on a keyframe
+bool gopSourceHas(const GopSource *src, int gop);
+
+// Pass every packet of gop to write, timestamps in frames. GOPs must be
+// requested in increasing order. Returns -1 on error.
+int copyGopPackets(GopSource *src, int gop,
+                   int (*write)(void *arg, AVPacket *pkt), void *arg);
+void closeGopSource(GopSource *src);
+
+#endif
@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include "mappedio.h"
+
+#include <fcntl.h>
+#include <libavutil/avutil.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Pages are faulted in this much at a time, so the thread notices seeks
+// and the other readers between chunks
+#define MAPPED_CHUNK (4 << 20)
+// Readers tell the thread where they are every this many bytes
+#define MAPPED_NOTIFY_STEP (1 << 20)
+// Pages this far behind the slowest reader are marked cold
+#define MAPPED_DROP_BEHIND (256 << 20)
+#define MAPPED_IO_BUFFER (64 << 10)
+
+typedef struct {
+  MappedFile *file;
+  bool used;
+  int64_t pos;      // reader side only
+  int64_t notifyAt; // reader side only
+  // Under the file lock
+  int64_t published; // last position the thread was told about
+  int64_t fetchStart; // pages in [fetchStart, fetchEnd) are faulted in
+  int64_t fetchEnd;
+} MappedReader;
+
+struct MappedFile {
+  const uint8_t *data;
+  int64_t size;
+  long pageSize;
+  MappedReader readers[MAPPED_MAX_READERS];
+  int64_t coldUntil; // everything before this has been marked cold
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool quit;
+};
+
+static int64_t alignDown(const MappedFile *file, int64_t offset) {
+  return offset - offset % file->pageSize;
+}
+
+// Fault in [start, end): ask the kernel for the whole range, then touch
+// every page so they are really there before a reader gets to them
+static void fetchRange(const MappedFile *file, int64_t start, int64_t end) {
+  start = alignDown(file, start);
+  madvise((void *)(file->data + start), end - start, MADV_WILLNEED);
+  volatile uint8_t sink = 0;
+  for (int64_t offset = start; offset < end; offset += file->pageSize)
+    sink += file->data[offset];
+  (void)sink;
+}
+
+// Mark what every reader has left well behind as cold. Called with the
+// lock held.
+static void dropBehind(MappedFile *file) {
+#ifdef MADV_COLD
+  int64_t slowest = file->size;
+  for (int i = 0; i < MAPPED_MAX_READERS; i++) {
+    if (file->readers[i].used && file->readers[i].published < slowest)
+      slowest = file->readers[i].published;
+  }
+  int64_t until = alignDown(file, slowest - MAPPED_DROP_BEHIND);
+  if (until < file->coldUntil) {
+    // Someone went back; start over from there
+    file->coldUntil = until > 0 ? until : 0;
+  } else if (until > file->coldUntil) {
+    madvise((void *)(file->data + file->coldUntil), until - file->coldUntil,
+            MADV_COLD);
+    file->coldUntil = until;
+  }
+#else
+  (void)file;
+#endif
+}
+
+// The reader that is closest to running out of fetched pages, with the
+// next chunk to fetch for it. Called with the lock held.
+static MappedReader *nextFetch(MappedFile *file, int64_t *start,
+                               int64_t *end) {
+  MappedReader *best = NULL;
+  int64_t bestLead = 0;
+  for (int i = 0; i < MAPPED_MAX_READERS; i++) {
+    MappedReader *r = &file->readers[i];
+    if (!r->used)
+      continue;
+    // After a seek out of the window, start a new one at the reader
+    if (r->published < r->fetchStart || r->published > r->fetchEnd) {
+      r->fetchStart = alignDown(file, r->published);
+      r->fetchEnd = r->fetchStart;
+    }
+    int64_t want = r->published + MAPPED_READAHEAD;
+    if (want > file->size)
+      want = file->size;
+    int64_t lead = r->fetchEnd - r->published;
+    if (r->fetchEnd < want && (!best || lead < bestLead)) {
+      best = r;
+      bestLead = lead;
+      *start = r->fetchEnd;
+      *end = want < r->fetchEnd + MAPPED_CHUNK ? want
+                                                : r->fetchEnd + MAPPED_CHUNK;
+    }
+  }
+  return best;
+}
+
+static void *readAheadThread(void *arg) {
+  MappedFile *file = arg;
+  pthread_mutex_lock(&file->lock);
+  while (!file->quit) {
+    int64_t start, end;
+    MappedReader *r = nextFetch(file, &start, &end);
+    if (!r) {
+      dropBehind(file);
+      pthread_cond_wait(&file->cond, &file->lock);
+      continue;
+    }
+    // Claimed up front; a seek meanwhile just restarts the window
+    r->fetchEnd = end;
+    pthread_mutex_unlock(&file->lock);
+    fetchRange(file, start, end);
+    pthread_mutex_lock(&file->lock);
+  }
+  pthread_mutex_unlock(&file->lock);
+  return NULL;
+}
+
+MappedFile *openMappedFile(const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  // Bigger kernel read-ahead for the pages the thread touches in order
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  MappedFile *file = calloc(1, sizeof(MappedFile));
+  if (!file) {
+    munmap(data, st.st_size);
+    return NULL;
+  }
+  file->data = data;
+  file->size = st.st_size;
+  file->pageSize = sysconf(_SC_PAGESIZE);
+  if (file->pageSize <= 0)
+    file->pageSize = 4096;
+  pthread_mutex_init(&file->lock, NULL);
+  pthread_cond_init(&file->cond, NULL);
+  if (pthread_create(&file->thread, NULL, readAheadThread, file) != 0) {
+    printf("Warning: Could not start read-ahead thread for %s\n", path);
+    pthread_mutex_destroy(&file->lock);
+    pthread_cond_destroy(&file->cond);
+    munmap(data, st.st_size);
+    free(file);
+    return NULL;
+  }
+  return file;
+}
+
+void closeMappedFile(MappedFile *file) {
+  if (!file)
+    return;
+  pthread_mutex_lock(&file->lock);
+  file->quit = true;
+  pthread_cond_signal(&file->cond);
+  pthread_mutex_unlock(&file->lock);
+  pthread_join(file->thread, NULL);
+  pthread_mutex_destroy(&file->lock);
+  pthread_cond_destroy(&file->cond);
+  munmap((void *)file->data, file->size);
+  free(file);
+}
+
+int64_t mappedFileSize(const MappedFile *file) { return file->size; }
+
+// Tell the thread where the reader is now
+static void publishPosition(MappedReader *r) {
+  MappedFile *file = r->file;
+  pthread_mutex_lock(&file->lock);
+  r->published = r->pos;
+  pthread_cond_signal(&file->cond);
+  pthread_mutex_unlock(&file->lock);
+  r->notifyAt = r->pos + MAPPED_NOTIFY_STEP;
+}
+
+static int readMapped(void *opaque, uint8_t *buf, int size) {
+  MappedReader *r = opaque;
+  int64_t left = r->file->size - r->pos;
+  if (left <= 0)
+    return AVERROR_EOF;
+  if (size > left)
+    size = (int)left;
+  memcpy(buf, r->file->data + r->pos, size);
+  r->pos += size;
+  if (r->pos >= r->notifyAt)
+    publishPosition(r);
+  return size;
+}
+
+static int64_t seekMapped(void *opaque, int64_t offset, int whence) {
+  MappedReader *r = opaque;
+  int64_t size = r->file->size;
+  switch (whence & ~AVSEEK_FORCE) {
+  case AVSEEK_SIZE:
+    return size;
+  case SEEK_SET:
+    break;
+  case SEEK_CUR:
+    offset += r->pos;
+    break;
+  case SEEK_END:
+    offset += size;
+    break;
+  default:
+    return -1;
+  }
+  if (offset < 0 || offset > size)
+    return -1;
+  r->pos = offset;
+  if (offset != r->published) {
+    // Get the kernel started on the first chunk right away; the thread
+    // picks up from there
+    int64_t start = alignDown(r->file, offset);
+    int64_t end = start + MAPPED_CHUNK < size ? start + MAPPED_CHUNK : size;
+    if (end > start)
+      madvise((void *)(r->file->data + start), end - start, MADV_WILLNEED);
+    publishPosition(r);
+  }
+  return offset;
+}
+
+AVIOContext *openMappedReader(MappedFile *file) {
+  MappedReader *r = NULL;
+  pthread_mutex_lock(&file->lock);
+  for (int i = 0; i < MAPPED_MAX_READERS && !r; i++) {
+    if (!file->readers[i].used) {
+      r = &file->readers[i];
+      memset(r, 0, sizeof(MappedReader));
+      r->file = file;
+      r->used = true;
+      r->notifyAt = MAPPED_NOTIFY_STEP;
+      pthread_cond_signal(&file->cond);
+    }
+  }
+  pthread_mutex_unlock(&file->lock);
+  if (!r)
+    return NULL;
+
+  unsigned char *buffer = av_malloc(MAPPED_IO_BUFFER);
+  AVIOContext *pb =
+      buffer ? avio_alloc_context(buffer, MAPPED_IO_BUFFER, 0, r, readMapped,
+                                  NULL, seekMapped)
+             : NULL;
+  if (!pb) {
+    av_free(buffer);
+    pthread_mutex_lock(&file->lock);
+    r->used = false;
+    pthread_mutex_unlock(&file->lock);
+    return NULL;
+  }
+  return pb;
+}
+
+void closeMappedReader(AVIOContext **pb) {
+  if (!*pb)
+    return;
+  MappedReader *r = (*pb)->opaque;
+  av_freep(&(*pb)->buffer);
+  avio_context_free(pb);
+  pthread_mutex_lock(&r->file->lock);
+  r->used = false;
+  pthread_mutex_unlock(&r->file->lock);
+}
@@ -0,0 +1,35 @@
+#ifndef MAPPEDIO_H
+#define MAPPEDIO_H
+
+#include <libavformat/avio.h>
+#include <stdint.h>
+
+// Read-only input for the background decoders: the file is mmap'd once and
+// every reader is an AVIOContext with its own position on the mapping. A
+// read-ahead thread faults in the pages ahead of each reader (the window
+// follows seeks), so demuxing on the render thread finds them resident
+// instead of waiting on the disk. Pages well behind every reader are
+// marked cold so long clips don't crowd out the rest of the page cache.
+#define MAPPED_READAHEAD (64 << 20) // bytes kept resident ahead of a reader
+#define MAPPED_MAX_READERS 4
+
+typedef struct MappedFile MappedFile;
+
+// Map path and start the read-ahead thread. Returns NULL (quietly) for
+// anything that isn't a regular file, so the caller can fall back to
+// avformat's own I/O.
+MappedFile *openMappedFile(const char *path);
+
+// Unmap and stop the thread; every reader must be closed first
+void closeMappedFile(MappedFile *file);
+
+int64_t mappedFileSize(const MappedFile *file);
+
+// New reader at position 0, for AVFormatContext.pb with
+// AVFMT_FLAG_CUSTOM_IO set. Returns NULL on error.
+AVIOContext *openMappedReader(MappedFile *file);
+
+// Free a reader (after avformat_close_input) and set *pb to NULL
+void closeMappedReader(AVIOContext **pb);
+
+#endif
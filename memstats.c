@@ -0,0 +1,84 @@
+#include "memstats.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+static const char *memorySubsystemNames[MEMORY_SUBSYSTEM_COUNT] = {
+    "process", "audio_pcm", "captions", "frame_buffers", "codecs",
+    "muxer_queue"};
+
+const char *memorySubsystemName(MemorySubsystem subsystem) {
+  return memorySubsystemNames[subsystem];
+}
+
+int64_t memoryAccountTotal(const MemoryAccount *account) {
+  int64_t total = 0;
+  for (int i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++)
+    total += account->bytes[i];
+  return total;
+}
+
+int parseMemorySize(const char *text, int64_t *bytes) {
+  char *end;
+  double value = strtod(text, &end);
+  if (end == text || value <= 0)
+    return -1;
+  int64_t unit = 1;
+  switch (tolower((unsigned char)*end)) {
+  case 'k':
+    unit = 1024;
+    end++;
+    break;
+  case 'm':
+    unit = 1024 * 1024;
+    end++;
+    break;
+  case 'g':
+    unit = 1024 * 1024 * 1024;
+    end++;
+    break;
+  }
+  // Allow "512MB" and "2GiB" as well
+  if (unit > 1 && tolower((unsigned char)*end) == 'i')
+    end++;
+  if (unit > 1 && tolower((unsigned char)*end) == 'b')
+    end++;
+  if (*end != '\0')
+    return -1;
+  *bytes = (int64_t)(value * unit);
+  return 0;
+}
+
+double memoryMB(int64_t bytes) { return bytes / (1024.0 * 1024.0); }
+
+void printMemoryAccount(const char *prefix, const MemoryAccount *account) {
+  for (int i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++)
+    printf("%s%-14s %8.1f MB\n", prefix, memorySubsystemNames[i],
+           memoryMB(account->bytes[i]));
+  printf("%s%-14s %8.1f MB\n", prefix, "total",
+         memoryMB(memoryAccountTotal(account)));
+}
+
+int64_t currentRss(void) {
+  FILE *file = fopen("/proc/self/statm", "r");
+  if (!file)
+    return -1;
+  long long size, resident;
+  int fields = fscanf(file, "%lld %lld", &size, &resident);
+  fclose(file);
+  long pageSize = sysconf(_SC_PAGESIZE);
+  if (fields != 2 || pageSize <= 0)
+    return -1;
+  return (int64_t)resident * pageSize;
+}
+
+int64_t peakRss(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return -1;
+  // Kilobytes on Linux
+  return (int64_t)usage.ru_maxrss * 1024;
+}
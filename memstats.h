@@ -0,0 +1,43 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include <stdint.h>
+
+// Where a render's memory goes. Buffers the renderer allocates itself are
+// counted as they are; what lives inside libavcodec and libx264 is
+// estimated from their settings.
+typedef enum {
+  MEMORY_PROCESS,       // resident before the job started: GL, assets, libs
+  MEMORY_AUDIO_PCM,     // decoded voice clips and mix buffers
+  MEMORY_CAPTIONS,      // caption timeline
+  MEMORY_FRAME_BUFFERS, // RGBA slots, background and encoder input frames
+  MEMORY_CODECS,        // decoder and encoder internals
+  MEMORY_MUXER_QUEUE,   // muxed bytes waiting for the writer threads
+  MEMORY_SUBSYSTEM_COUNT
+} MemorySubsystem;
+
+typedef struct {
+  int64_t bytes[MEMORY_SUBSYSTEM_COUNT];
+} MemoryAccount;
+
+// Short name for log lines and JSON keys
+const char *memorySubsystemName(MemorySubsystem subsystem);
+
+int64_t memoryAccountTotal(const MemoryAccount *account);
+
+// "512M", "2G", "800k" (powers of 1024) or plain bytes. Returns -1 if
+// malformed.
+int parseMemorySize(const char *text, int64_t *bytes);
+
+// bytes in MB with one decimal
+double memoryMB(int64_t bytes);
+
+// One line per subsystem, each starting with prefix
+void printMemoryAccount(const char *prefix, const MemoryAccount *account);
+
+// Resident set size of this process now and at its highest so far, in
+// bytes; -1 if the system doesn't say
+int64_t currentRss(void);
+int64_t peakRss(void);
+
+#endif
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include "outstream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Muxer side buffer; fragments are flushed as they complete, so this only
+// bounds how much goes into a single write callback
+#define OUTPUT_AVIO_BUFFER (256 * 1024)
+
+typedef struct OutputChunk {
+  struct OutputChunk *next;
+  int64_t offset; // position in the file, ignored for pipes
+  int size;
+  uint8_t data[];
+} OutputChunk;
+
+struct OutputStream {
+  int fd;
+  bool ownsFd;
+  bool seekable;
+  AVIOContext *avio;
+  AVIOContext *remote; // network target, written instead of fd
+
+  // Muxer side; only touched by the thread that runs the muxer
+  int64_t position;
+  int64_t size;
+
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  OutputChunk *head;
+  OutputChunk *tail;
+  int64_t queued;
+  int64_t queueLimit;
+  bool closing;
+  bool failed;
+  bool direct; // write on the muxer thread, set while finishing
+
+  // Stats
+  int64_t bytesWritten;
+  int64_t peakQueued;
+  double writeMs;
+};
+
+static const char *outputLayoutNames[] = {"auto", "mp4", "faststart",
+                                          "fragmented"};
+
+bool isNetworkOutput(const char *target) {
+  return strstr(target, "://") != NULL;
+}
+
+const char *networkOutputFormat(const char *target) {
+  return strncmp(target, "rtmp", 4) == 0 ? "flv" : "mpegts";
+}
+
+int parseOutputLayout(const char *name, OutputLayout *layout) {
+  for (int i = 0; i < (int)(sizeof(outputLayoutNames) /
+                            sizeof(outputLayoutNames[0]));
+       i++) {
+    if (strcmp(name, outputLayoutNames[i]) == 0) {
+      *layout = (OutputLayout)i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *outputLayoutName(OutputLayout layout) {
+  return outputLayoutNames[layout];
+}
+
+static double nowMs(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static int writeChunk(OutputStream *out, const OutputChunk *chunk) {
+  if (out->remote) {
+    // Flushed right away: whatever sits in the buffer is latency
+    avio_write(out->remote, chunk->data, chunk->size);
+    avio_flush(out->remote);
+    if (out->remote->error < 0) {
+      printf("Error: Output write failed: %s\n",
+             av_err2str(out->remote->error));
+      return -1;
+    }
+    return 0;
+  }
+  int done = 0;
+  while (done < chunk->size) {
+    ssize_t n = out->seekable
+                    ? pwrite(out->fd, chunk->data + done, chunk->size - done,
+                             chunk->offset + done)
+                    : write(out->fd, chunk->data + done, chunk->size - done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      printf("Error: Output write failed: %s\n", strerror(errno));
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+static void *outputWriterThread(void *arg) {
+  OutputStream *out = arg;
+  pthread_mutex_lock(&out->lock);
+  for (;;) {
+    while (!out->head && !out->closing)
+      pthread_cond_wait(&out->cond, &out->lock);
+    OutputChunk *chunk = out->head;
+    if (!chunk)
+      break;
+    out->head = chunk->next;
+    if (!out->head)
+      out->tail = NULL;
+    bool skip = out->failed;
+    pthread_mutex_unlock(&out->lock);
+
+    // After a failed write, keep draining so the muxer never blocks
+    int ret = 0;
+    double start = nowMs();
+    if (!skip)
+      ret = writeChunk(out, chunk);
+    double elapsed = nowMs() - start;
+
+    pthread_mutex_lock(&out->lock);
+    out->queued -= chunk->size;
+    out->writeMs += elapsed;
+    if (ret < 0)
+      out->failed = true;
+    else if (!skip)
+      out->bytesWritten += chunk->size;
+    pthread_cond_broadcast(&out->cond);
+    free(chunk);
+  }
+  pthread_mutex_unlock(&out->lock);
+  return NULL;
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+static int outputWritePacket(void *opaque, const uint8_t *buf, int size) {
+#else
+static int outputWritePacket(void *opaque, uint8_t *buf, int size) {
+#endif
+  OutputStream *out = opaque;
+  OutputChunk *chunk = malloc(sizeof(OutputChunk) + size);
+  if (!chunk)
+    return AVERROR(ENOMEM);
+  chunk->next = NULL;
+  chunk->offset = out->position;
+  chunk->size = size;
+  memcpy(chunk->data, buf, size);
+  out->position += size;
+  if (out->position > out->size)
+    out->size = out->position;
+
+  if (out->direct) {
+    double start = nowMs();
+    int ret = out->failed ? -1 : writeChunk(out, chunk);
+    pthread_mutex_lock(&out->lock);
+    out->writeMs += nowMs() - start;
+    if (ret < 0)
+      out->failed = true;
+    else
+      out->bytesWritten += size;
+    pthread_mutex_unlock(&out->lock);
+    free(chunk);
+    return ret < 0 ? AVERROR(EIO) : size;
+  }
+
+  pthread_mutex_lock(&out->lock);
+  while (out->queued > 0 && out->queued + size > out->queueLimit)
+    pthread_cond_wait(&out->cond, &out->lock);
+  bool failed = out->failed;
+  if (out->tail)
+    out->tail->next = chunk;
+  else
+    out->head = chunk;
+  out->tail = chunk;
+  out->queued += size;
+  if (out->queued > out->peakQueued)
+    out->peakQueued = out->queued;
+  pthread_cond_broadcast(&out->cond);
+  pthread_mutex_unlock(&out->lock);
+  return failed ? AVERROR(EIO) : size;
+}
+
+// Only moves the logical position; every chunk carries its own offset
+static int64_t outputSeek(void *opaque, int64_t offset, int whence) {
+  OutputStream *out = opaque;
+  if (whence & AVSEEK_SIZE)
+    return out->size;
+  int64_t position;
+  switch (whence & ~AVSEEK_FORCE) {
+  case SEEK_SET:
+    position = offset;
+    break;
+  case SEEK_CUR:
+    position = out->position + offset;
+    break;
+  case SEEK_END:
+    position = out->size + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+  if (position < 0)
+    return AVERROR(EINVAL);
+  out->position = position;
+  return position;
+}
+
+static void freeOutputStream(OutputStream *out) {
+  if (out->avio) {
+    av_freep(&out->avio->buffer);
+    avio_context_free(&out->avio);
+  }
+  if (out->ownsFd && out->fd >= 0)
+    close(out->fd);
+  if (out->remote)
+    avio_closep(&out->remote);
+  pthread_mutex_destroy(&out->lock);
+  pthread_cond_destroy(&out->cond);
+  free(out);
+}
+
+OutputStream *openOutputStream(const char *target, OutputLayout layout,
+                               AVFormatContext **fmt_ctx,
+                               AVDictionary **muxer_opts) {
+  OutputStream *out = calloc(1, sizeof(OutputStream));
+  if (!out)
+    return NULL;
+  out->fd = -1;
+  out->queueLimit = OUTPUT_QUEUE_LIMIT;
+  pthread_mutex_init(&out->lock, NULL);
+  pthread_cond_init(&out->cond, NULL);
+
+  // Work out where the bytes go
+  const char *path = NULL;
+  bool network = isNetworkOutput(target);
+  if (network) {
+    if (layout != OUTPUT_LAYOUT_AUTO) {
+      printf("Error: Output layouts are for MP4; %s is streamed as %s\n",
+             target, networkOutputFormat(target));
+      freeOutputStream(out);
+      return NULL;
+    }
+    // Connects (and for RTMP, handshakes) before anything is encoded
+    int ret = avio_open2(&out->remote, target, AVIO_FLAG_WRITE, NULL, NULL);
+    if (ret < 0) {
+      printf("Error: Could not connect to %s: %s\n", target,
+             av_err2str(ret));
+      freeOutputStream(out);
+      return NULL;
+    }
+  } else if (strcmp(target, "-") == 0) {
+    out->fd = STDOUT_FILENO;
+  } else if (strncmp(target, "fd:", 3) == 0) {
+    char *end;
+    long fd = strtol(target + 3, &end, 10);
+    if (*end != '\0' || end == target + 3 || fd < 0) {
+      printf("Error: Invalid output descriptor: %s\n", target);
+      freeOutputStream(out);
+      return NULL;
+    }
+    // The caller's to close, like stdout
+    out->fd = (int)fd;
+  } else {
+    path = target;
+    out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out->fd < 0) {
+      printf("Error: Could not open output file %s: %s\n", path,
+             strerror(errno));
+      freeOutputStream(out);
+      return NULL;
+    }
+    out->ownsFd = true;
+  }
+
+  struct stat st;
+  out->seekable = !network && fstat(out->fd, &st) == 0 &&
+                  S_ISREG(st.st_mode) && lseek(out->fd, 0, SEEK_CUR) >= 0;
+  if (layout == OUTPUT_LAYOUT_AUTO)
+    layout = out->seekable ? OUTPUT_LAYOUT_MP4 : OUTPUT_LAYOUT_FRAGMENTED;
+  if (!out->seekable && layout != OUTPUT_LAYOUT_FRAGMENTED) {
+    printf("Error: %s output needs a seekable file, use fragmented for "
+           "pipes\n",
+           outputLayoutName(layout));
+    freeOutputStream(out);
+    return NULL;
+  }
+  if (layout == OUTPUT_LAYOUT_FASTSTART && !path) {
+    // The muxer reopens the file by name to move the moov to the front
+    printf("Error: faststart output needs a file path\n");
+    freeOutputStream(out);
+    return NULL;
+  }
+
+  uint8_t *buffer = av_malloc(OUTPUT_AVIO_BUFFER);
+  if (buffer)
+    out->avio = avio_alloc_context(buffer, OUTPUT_AVIO_BUFFER, 1, out, NULL,
+                                   outputWritePacket,
+                                   out->seekable ? outputSeek : NULL);
+  if (!out->avio) {
+    av_freep(&buffer);
+    freeOutputStream(out);
+    return NULL;
+  }
+  out->avio->seekable = out->seekable ? AVIO_SEEKABLE_NORMAL : 0;
+
+  // MP4 for files and pipes: the layouts below are MP4 muxer options
+  avformat_alloc_output_context2(
+      fmt_ctx, NULL, network ? networkOutputFormat(target) : "mp4", path);
+  if (!*fmt_ctx) {
+    printf("Error: Could not create output context\n");
+    freeOutputStream(out);
+    return NULL;
+  }
+  (*fmt_ctx)->pb = out->avio;
+  (*fmt_ctx)->flags |= AVFMT_FLAG_CUSTOM_IO;
+  // Every packet goes to the writer as soon as it is muxed
+  if (network)
+    (*fmt_ctx)->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+
+  if (layout == OUTPUT_LAYOUT_FRAGMENTED)
+    av_dict_set(muxer_opts, "movflags",
+                "frag_keyframe+empty_moov+default_base_moof", 0);
+  else if (layout == OUTPUT_LAYOUT_FASTSTART)
+    av_dict_set(muxer_opts, "movflags", "+faststart", 0);
+
+  if (pthread_create(&out->writer, NULL, outputWriterThread, out) != 0) {
+    printf("Error: Could not start output writer thread\n");
+    (*fmt_ctx)->pb = NULL;
+    avformat_free_context(*fmt_ctx);
+    *fmt_ctx = NULL;
+    freeOutputStream(out);
+    return NULL;
+  }
+  return out;
+}
+
+void setOutputQueueLimit(OutputStream *out, int64_t bytes) {
+  pthread_mutex_lock(&out->lock);
+  out->queueLimit = bytes;
+  pthread_mutex_unlock(&out->lock);
+}
+
+int64_t outputPeakQueued(OutputStream *out) {
+  pthread_mutex_lock(&out->lock);
+  int64_t peak = out->peakQueued;
+  pthread_mutex_unlock(&out->lock);
+  return peak;
+}
+
+int syncOutputStream(OutputStream *out) {
+  avio_flush(out->avio);
+  pthread_mutex_lock(&out->lock);
+  while (out->queued > 0)
+    pthread_cond_wait(&out->cond, &out->lock);
+  bool failed = out->failed;
+  pthread_mutex_unlock(&out->lock);
+  if (failed)
+    return -1;
+  // Pipes have nothing to sync
+  if (out->seekable && fdatasync(out->fd) < 0) {
+    printf("Error: Could not sync output: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int prepareOutputTrailer(OutputStream *out) {
+  avio_flush(out->avio);
+  pthread_mutex_lock(&out->lock);
+  while (out->queued > 0)
+    pthread_cond_wait(&out->cond, &out->lock);
+  // The faststart rewrite reads back what it just wrote, so the trailer
+  // can't go through the queue
+  out->direct = true;
+  bool failed = out->failed;
+  pthread_mutex_unlock(&out->lock);
+  return failed ? -1 : 0;
+}
+
+int closeOutputStream(OutputStream *out, AVFormatContext *fmt_ctx,
+                      bool verbose) {
+  avio_flush(out->avio);
+  pthread_mutex_lock(&out->lock);
+  out->closing = true;
+  pthread_cond_broadcast(&out->cond);
+  pthread_mutex_unlock(&out->lock);
+  pthread_join(out->writer, NULL);
+
+  int ret = out->failed ? -1 : 0;
+  if (out->ownsFd && close(out->fd) < 0) {
+    printf("Error: Could not close output: %s\n", strerror(errno));
+    ret = -1;
+  }
+  out->ownsFd = false;
+  if (out->remote && avio_closep(&out->remote) < 0) {
+    printf("Error: Could not close the output connection\n");
+    ret = -1;
+  }
+  if (verbose)
+    printf("Output: %.1f MB written, peak queue %.1f MB, %.0fms in writes\n",
+           out->bytesWritten / (1024.0 * 1024.0),
+           out->peakQueued / (1024.0 * 1024.0), out->writeMs);
+
+  if (fmt_ctx && fmt_ctx->pb == out->avio)
+    fmt_ctx->pb = NULL;
+  freeOutputStream(out);
+  return ret;
+}
@@ -0,0 +1,63 @@
+#ifndef OUTSTREAM_H
+#define OUTSTREAM_H
+
+#include <libavformat/avformat.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// How the MP4 is laid out
+typedef enum {
+  OUTPUT_LAYOUT_AUTO,       // fragmented for pipes, plain MP4 for files
+  OUTPUT_LAYOUT_MP4,        // moov at the end, needs a seekable target
+  OUTPUT_LAYOUT_FASTSTART,  // moov moved to the front when finishing
+  OUTPUT_LAYOUT_FRAGMENTED  // moov first, then self-contained fragments
+} OutputLayout;
+
+int parseOutputLayout(const char *name, OutputLayout *layout);
+const char *outputLayoutName(OutputLayout layout);
+
+// Muxer output with its own writer thread. The muxer only copies into a
+// queue; a separate thread does the actual writes, so slow disks or slow
+// pipe readers don't stall encoding until the queue limit is reached.
+typedef struct OutputStream OutputStream;
+
+// Default for the most bytes waiting for the writer thread before the
+// muxer has to wait
+#define OUTPUT_QUEUE_LIMIT (64 * 1024 * 1024)
+
+// rtmp://, rtmps://, srt://, udp:// and the like: a live ingest rather than
+// a file, streamed as FLV (RTMP) or MPEG-TS (everything else)
+bool isNetworkOutput(const char *target);
+const char *networkOutputFormat(const char *target);
+
+// Open target, which is a file path, "-" for stdout, "fd:N" for an already
+// open descriptor (left open for the caller to close) or a network URL,
+// and create a muxer writing to it: MP4, or the URL's streaming format.
+// Muxer options for the layout are added to muxer_opts for
+// avformat_write_header.
+OutputStream *openOutputStream(const char *target, OutputLayout layout,
+                               AVFormatContext **fmt_ctx,
+                               AVDictionary **muxer_opts);
+
+// Change the queue limit, e.g. to keep a job within a memory budget
+void setOutputQueueLimit(OutputStream *out, int64_t bytes);
+
+// Most bytes that have been waiting at once so far
+int64_t outputPeakQueued(OutputStream *out);
+
+// Wait until everything the muxer has written so far is on disk, so a
+// checkpoint taken after this can trust the file. Flush the muxer first
+// (av_write_frame with NULL) or its buffered fragment stays behind.
+int syncOutputStream(OutputStream *out);
+
+// Call before av_write_trailer: waits until everything queued is written
+// and writes the trailer synchronously (the faststart rewrite reads the
+// file back)
+int prepareOutputTrailer(OutputStream *out);
+
+// Write out the rest, stop the thread and close the target. Frees fmt_ctx's
+// I/O context but not fmt_ctx itself. Returns -1 if any write failed.
+int closeOutputStream(OutputStream *out, AVFormatContext *fmt_ctx,
+                      bool verbose);
+
+#endif
@@ -0,0 +1,387 @@
+#include "plan.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "jsonfile.h"
+
+// Until a render has been measured: a mid-range machine with the default
+// profile, on the slow side
+static const StageCosts defaultStageCosts = {300.0, 1.5, 1.0, 4.0, 0.2, 0};
+
+static const char *costsKey(const char *profile) {
+  return profile ? profile : findEncoderProfile(NULL)->name;
+}
+
+static int parseStageCosts(const cJSON *entry, StageCosts *costs) {
+  cJSON *renders = cJSON_GetObjectItem(entry, "renders");
+  cJSON *setup = cJSON_GetObjectItem(entry, "setup_ms");
+  cJSON *render = cJSON_GetObjectItem(entry, "render_ms");
+  cJSON *background = cJSON_GetObjectItem(entry, "background_ms");
+  cJSON *encode = cJSON_GetObjectItem(entry, "encode_ms");
+  cJSON *audio = cJSON_GetObjectItem(entry, "audio_ms");
+  if (!cJSON_IsNumber(renders) || renders->valueint <= 0 ||
+      !cJSON_IsNumber(setup) || !cJSON_IsNumber(render) ||
+      !cJSON_IsNumber(background) || !cJSON_IsNumber(encode) ||
+      !cJSON_IsNumber(audio))
+    return -1;
+  costs->renders = renders->valueint;
+  costs->setupMs = setup->valuedouble;
+  costs->renderMs = render->valuedouble;
+  costs->backgroundMs = background->valuedouble;
+  costs->encodeMs = encode->valuedouble;
+  costs->audioMs = audio->valuedouble;
+  return 0;
+}
+
+static cJSON *stageCostsJson(const StageCosts *costs) {
+  cJSON *entry = cJSON_CreateObject();
+  cJSON_AddNumberToObject(entry, "renders", costs->renders);
+  cJSON_AddNumberToObject(entry, "setup_ms", costs->setupMs);
+  cJSON_AddNumberToObject(entry, "render_ms", costs->renderMs);
+  cJSON_AddNumberToObject(entry, "background_ms", costs->backgroundMs);
+  cJSON_AddNumberToObject(entry, "encode_ms", costs->encodeMs);
+  cJSON_AddNumberToObject(entry, "audio_ms", costs->audioMs);
+  return entry;
+}
+
+void loadStageCosts(const char *profile, StageCosts *costs) {
+  *costs = defaultStageCosts;
+  cJSON *json = readJsonFile(STAGE_COSTS_PATH);
+  if (json && parseStageCosts(cJSON_GetObjectItem(json, costsKey(profile)),
+                              costs) < 0)
+    *costs = defaultStageCosts;
+  cJSON_Delete(json);
+}
+
+void recordStageCosts(const char *profile, const RenderStats *stats,
+                      bool live) {
+  if (live || stats->frames <= 0 || stats->reusedFrames > 0)
+    return;
+  cJSON *json = readJsonFile(STAGE_COSTS_PATH);
+  if (!cJSON_IsObject(json)) {
+    cJSON_Delete(json);
+    json = cJSON_CreateObject();
+  }
+  const char *key = costsKey(profile);
+  StageCosts costs = {0};
+  if (parseStageCosts(cJSON_GetObjectItem(json, key), &costs) < 0)
+    memset(&costs, 0, sizeof(costs));
+
+  // Running mean over the last STAGE_COSTS_WINDOW renders or so
+  int n = costs.renders < STAGE_COSTS_WINDOW ? costs.renders + 1
+                                             : STAGE_COSTS_WINDOW;
+  double frames = stats->frames;
+  costs.setupMs += (stats->setupMs - costs.setupMs) / n;
+  costs.renderMs += (stats->renderMs / frames - costs.renderMs) / n;
+  costs.backgroundMs +=
+      (stats->backgroundMs / frames - costs.backgroundMs) / n;
+  costs.encodeMs += (stats->encodeMs / frames - costs.encodeMs) / n;
+  costs.audioMs += (stats->audioMs / frames - costs.audioMs) / n;
+  costs.renders++;
+  cJSON_DeleteItemFromObject(json, key);
+  cJSON_AddItemToObject(json, key, stageCostsJson(&costs));
+
+  // A plan running at the same time never reads half of it
+  writeJsonFile(json, STAGE_COSTS_PATH);
+  cJSON_Delete(json);
+}
+
+// ---------------------------------------------------------------------------
+// Planning
+
+static void addProblem(RenderPlan *plan, const char *format, ...) {
+  char(*grown)[192] = realloc(plan->problems, (plan->problemCount + 1) *
+                                                  sizeof(*plan->problems));
+  if (!grown)
+    return;
+  plan->problems = grown;
+  va_list args;
+  va_start(args, format);
+  vsnprintf(plan->problems[plan->problemCount++], sizeof(*plan->problems),
+            format, args);
+  va_end(args);
+}
+
+// Caption i against clip i, as mixProjectAudio will play them
+static void pairClips(RenderPlan *plan) {
+  const Project *project = &plan->project;
+  for (int i = 0; i < plan->pairCount; i++) {
+    PlanPair *pair = &plan->pairs[i];
+    const Caption *caption =
+        i < project->captionCount ? &project->captions[i] : NULL;
+    const AudioFile *af =
+        i < project->audioFileCount ? &project->audioFiles[i] : NULL;
+    pair->index = i;
+    pair->captionFile = caption ? caption->file : NULL;
+    pair->clipFile = af ? af->file : NULL;
+    pair->start = caption ? caption->startTime : 0.0;
+    pair->end = caption ? caption->endTime : 0.0;
+    pair->droppedWords = caption ? caption->droppedWords : 0;
+    pair->clipSeconds =
+        !af ? -1.0
+            : af->total_samples > 0
+                  ? (double)af->total_samples / AUDIO_SAMPLE_RATE
+                  : 0.0;
+    pair->cutSeconds = 0.0;
+
+    if (!af) {
+      addProblem(plan, "caption %d (%s) has no voice clip and plays silent",
+                 i, caption->file);
+    } else if (!caption) {
+      addProblem(plan, "clip %d (%s) has no caption and is never heard", i,
+                 af->file);
+    } else if (af->total_samples <= 0) {
+      addProblem(plan, "clip %d (%s) has no audio", i, af->file);
+    } else {
+      double cut = pair->clipSeconds - (pair->end - pair->start);
+      // Less than a frame is rounding
+      if (cut > 1.0 / FPS) {
+        pair->cutSeconds = cut;
+        addProblem(plan,
+                   "clip %d (%s) runs %.2fs past its caption (%s) and is "
+                   "cut off",
+                   i, af->file, cut, caption->file);
+      }
+    }
+    if (caption && caption->droppedWords > 0)
+      addProblem(plan,
+                 "caption %d (%s) has %d timed words past the first %d; "
+                 "they are not shown and the caption ends early",
+                 i, caption->file, caption->droppedWords, MAX_CAPTION_WORDS);
+  }
+}
+
+static void planBackground(RenderPlan *plan, const RenderOptions *opts) {
+  double video = (double)plan->frameCount / FPS;
+  const BackgroundVideo *bg = opts->background;
+  plan->hasBackground = bg != NULL;
+  plan->backgroundSeconds = -1.0;
+  plan->coveredSeconds = bg ? -1.0 : 0.0;
+  plan->uncoveredSeconds = bg ? -1.0 : video;
+  if (!bg)
+    return;
+  plan->bgMode = bg->mode;
+  if (bg->duration <= 0.0)
+    return;
+  plan->backgroundSeconds = bg->duration;
+  plan->coveredSeconds = video;
+  plan->uncoveredSeconds = 0.0;
+  if (bg->mode == BG_MODE_ONCE) {
+    double left = bg->duration - opts->backgroundOffset;
+    if (left < 0.0)
+      left = 0.0;
+    if (left < video) {
+      plan->coveredSeconds = left;
+      plan->uncoveredSeconds = video - left;
+      addProblem(plan,
+                 "the background runs out %.1fs into the %.1fs video; the "
+                 "last %.1fs are a plain colour (see --bg-mode)",
+                 left, video, video - left);
+    }
+  }
+}
+
+// The GL thread composites while the encoder and audio threads work on
+// earlier frames, so the slowest of the three sets the pace
+static void estimateRenderTime(RenderPlan *plan, const RenderOptions *opts) {
+  const StageCosts *c = &plan->costs;
+  double gl = c->renderMs + (plan->hasBackground ? c->backgroundMs : 0.0);
+  double audio = plan->project.audioFileCount > 0 ? c->audioMs : 0.0;
+  double frame = opts->encodeThread ? gl : gl + c->encodeMs;
+  if (opts->encodeThread && c->encodeMs > frame)
+    frame = c->encodeMs;
+  if (audio > frame)
+    frame = audio;
+  // Live renders can't go faster than the clock
+  if (opts->live && frame < 1000.0 / FPS)
+    frame = 1000.0 / FPS;
+  plan->estimatedMs = c->setupMs + frame * plan->frameCount;
+}
+
+int planRender(const RenderOptions *opts, RenderPlan *plan) {
+  memset(plan, 0, sizeof(RenderPlan));
+  if (loadProject(&plan->project, opts->projectId, PROJECT_AUDIO_STREAM) < 0)
+    return -1;
+  const Project *project = &plan->project;
+  plan->frameCount = (int)(FPS * project->duration);
+  if (opts->maxFrames > 0 && plan->frameCount > opts->maxFrames)
+    plan->frameCount = opts->maxFrames;
+  if (project->captionCount == 0)
+    addProblem(plan, "no captions in media/captions/%s", opts->projectId);
+
+  plan->pairCount = project->captionCount > project->audioFileCount
+                        ? project->captionCount
+                        : project->audioFileCount;
+  plan->pairs = calloc(plan->pairCount > 0 ? plan->pairCount : 1,
+                       sizeof(PlanPair));
+  if (!plan->pairs) {
+    printf("Error: Could not allocate the plan\n");
+    freeRenderPlan(plan);
+    return -1;
+  }
+  pairClips(plan);
+  planBackground(plan, opts);
+
+  plan->overBudget =
+      estimateRenderJob(&plan->project, opts, &plan->memory) != 0;
+  if (plan->overBudget)
+    addProblem(plan, "needs about %.0f MB, over the memory budget of %.0f MB",
+               memoryMB(memoryAccountTotal(&plan->memory)),
+               memoryMB(opts->memoryBudget));
+
+  loadStageCosts(opts->encoderProfile ? opts->encoderProfile->name
+                                      : opts->profile,
+                 &plan->costs);
+  estimateRenderTime(plan, opts);
+  return 0;
+}
+
+void freeRenderPlan(RenderPlan *plan) {
+  freeProject(&plan->project);
+  free(plan->pairs);
+  free(plan->problems);
+  memset(plan, 0, sizeof(RenderPlan));
+}
+
+void printRenderPlan(const RenderPlan *plan) {
+  const Project *project = &plan->project;
+  printf("Plan: %.1fs, %d frames, %d captions, %d voice clips\n",
+         project->duration, plan->frameCount, project->captionCount,
+         project->audioFileCount);
+  for (int i = 0; i < plan->pairCount; i++) {
+    const PlanPair *pair = &plan->pairs[i];
+    printf("  %3d %-24s", pair->index,
+           pair->captionFile ? pair->captionFile : "(no caption)");
+    if (pair->captionFile)
+      printf(" %7.2f-%-7.2fs", pair->start, pair->end);
+    else
+      printf(" %17s", "");
+    if (pair->clipFile)
+      printf(" %-24s %6.2fs\n", pair->clipFile, pair->clipSeconds);
+    else
+      printf(" (no clip)\n");
+  }
+
+  if (!plan->hasBackground)
+    printf("Background: plain colour\n");
+  else if (plan->backgroundSeconds < 0.0)
+    printf("Background: %s, length unknown\n",
+           backgroundModeName(plan->bgMode));
+  else
+    printf("Background: %.1fs clip, %s, covers %.1fs of the video\n",
+           plan->backgroundSeconds, backgroundModeName(plan->bgMode),
+           plan->coveredSeconds);
+
+  printf("Memory: about %.0f MB%s\n",
+         memoryMB(memoryAccountTotal(&plan->memory)),
+         plan->overBudget ? ", over the budget" : "");
+  printMemoryAccount("  ", &plan->memory);
+  printf("Estimated render time: %.1fs (", plan->estimatedMs / 1000.0);
+  if (plan->costs.renders > 0)
+    printf("costs measured on %d renders)\n", plan->costs.renders);
+  else
+    printf("guessed, no render measured yet)\n");
+
+  if (plan->problemCount == 0)
+    printf("No problems found\n");
+  for (int i = 0; i < plan->problemCount; i++)
+    printf("Problem: %s\n", plan->problems[i]);
+}
+
+void addRenderPlanJson(const RenderPlan *plan, cJSON *object) {
+  const Project *project = &plan->project;
+  cJSON_AddBoolToObject(object, "ok", plan->problemCount == 0);
+  cJSON_AddNumberToObject(object, "duration", project->duration);
+  cJSON_AddNumberToObject(object, "frames", plan->frameCount);
+  cJSON_AddNumberToObject(object, "captions", project->captionCount);
+  cJSON_AddNumberToObject(object, "clips", project->audioFileCount);
+
+  cJSON *pairs = cJSON_AddArrayToObject(object, "pairs");
+  for (int i = 0; i < plan->pairCount; i++) {
+    const PlanPair *pair = &plan->pairs[i];
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddNumberToObject(item, "index", pair->index);
+    if (pair->captionFile) {
+      cJSON_AddStringToObject(item, "caption", pair->captionFile);
+      cJSON_AddNumberToObject(item, "start", pair->start);
+      cJSON_AddNumberToObject(item, "end", pair->end);
+      cJSON_AddNumberToObject(item, "dropped_words", pair->droppedWords);
+    } else {
+      cJSON_AddNullToObject(item, "caption");
+    }
+    if (pair->clipFile) {
+      cJSON_AddStringToObject(item, "clip", pair->clipFile);
+      cJSON_AddNumberToObject(item, "clip_seconds", pair->clipSeconds);
+      cJSON_AddNumberToObject(item, "cut_seconds", pair->cutSeconds);
+    } else {
+      cJSON_AddNullToObject(item, "clip");
+    }
+    cJSON_AddItemToArray(pairs, item);
+  }
+
+  if (plan->hasBackground) {
+    cJSON *bg = cJSON_AddObjectToObject(object, "background");
+    cJSON_AddStringToObject(bg, "mode", backgroundModeName(plan->bgMode));
+    cJSON_AddNumberToObject(bg, "seconds", plan->backgroundSeconds);
+    cJSON_AddNumberToObject(bg, "covered", plan->coveredSeconds);
+    cJSON_AddNumberToObject(bg, "uncovered", plan->uncoveredSeconds);
+  } else {
+    cJSON_AddNullToObject(object, "background");
+  }
+
+  cJSON *memory = cJSON_AddObjectToObject(object, "memory");
+  for (int i = 0; i < MEMORY_SUBSYSTEM_COUNT; i++)
+    cJSON_AddNumberToObject(memory, memorySubsystemName(i),
+                            (double)plan->memory.bytes[i]);
+  cJSON_AddNumberToObject(memory, "total",
+                          (double)memoryAccountTotal(&plan->memory));
+  cJSON_AddBoolToObject(object, "over_budget", plan->overBudget);
+
+  cJSON *costs = stageCostsJson(&plan->costs);
+  cJSON_AddItemToObject(object, "frame_costs", costs);
+  cJSON_AddNumberToObject(object, "estimated_ms", plan->estimatedMs);
+
+  cJSON *problems = cJSON_AddArrayToObject(object, "problems");
+  for (int i = 0; i < plan->problemCount; i++)
+    cJSON_AddItemToArray(problems, cJSON_CreateString(plan->problems[i]));
+}
+
+int runRenderPlan(const RenderOptions *opts, const char *backgroundFile,
+                  BackgroundMode bgMode, BackgroundFit bgFit, FILE *json) {
+  RenderOptions planOpts = *opts;
+  BackgroundVideo bg = {0};
+  if (backgroundFile) {
+    if (initBackgroundVideo(&bg, backgroundFile, bgMode, bgFit) < 0) {
+      printf("Error: Could not open background video %s\n", backgroundFile);
+      cleanupBackgroundVideo(&bg);
+      return -1;
+    }
+    planOpts.background = &bg;
+  }
+
+  RenderPlan plan;
+  int ret = planRender(&planOpts, &plan);
+  if (ret == 0) {
+    if (json) {
+      cJSON *object = cJSON_CreateObject();
+      cJSON_AddStringToObject(object, "project", opts->projectId);
+      addRenderPlanJson(&plan, object);
+      char *text = cJSON_PrintUnformatted(object);
+      if (text)
+        fprintf(json, "%s\n", text);
+      cJSON_free(text);
+      cJSON_Delete(object);
+      fflush(json);
+    } else {
+      printRenderPlan(&plan);
+    }
+    ret = plan.problemCount;
+    freeRenderPlan(&plan);
+  }
+  if (backgroundFile)
+    cleanupBackgroundVideo(&bg);
+  return ret;
+}
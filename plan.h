@@ -0,0 +1,85 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <cjson/cJSON.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "background.h"
+#include "memstats.h"
+#include "render.h"
+
+// Per-frame stage costs of finished renders, one entry per encoder profile
+#define STAGE_COSTS_PATH "media/stagecosts.json"
+// Renders averaged over; newer ones replace older ones after that
+#define STAGE_COSTS_WINDOW 10
+
+// What one frame costs in each stage on this machine, in milliseconds
+typedef struct {
+  double setupMs; // per job
+  double renderMs;
+  double backgroundMs;
+  double encodeMs;
+  double audioMs;
+  int renders; // measured on, 0 for the built-in guesses
+} StageCosts;
+
+// Saved costs of profile (NULL for the default), or the built-in guesses
+void loadStageCosts(const char *profile, StageCosts *costs);
+
+// Fold a finished render into the saved costs. Live renders and those that
+// reused frames don't say what a frame costs and are left out.
+void recordStageCosts(const char *profile, const RenderStats *stats,
+                      bool live);
+
+// Caption i and the voice clip the mixer plays with it, which is simply
+// clip i of the sorted audio directory
+typedef struct {
+  int index;
+  const char *captionFile; // NULL without a caption
+  const char *clipFile;    // NULL without a clip
+  double start;            // caption, seconds
+  double end;
+  double clipSeconds;  // -1 without a clip, 0 if it has no audio
+  double cutSeconds;   // of the clip past the caption's end, not heard
+  int droppedWords;    // past MAX_CAPTION_WORDS
+} PlanPair;
+
+// What a render of a project would be, from loading it alone
+typedef struct {
+  Project project; // captions, clips and duration; the pairs point into it
+  int frameCount;
+  PlanPair *pairs;
+  int pairCount;
+  // Background clip against the video; seconds are -1 if unknown
+  bool hasBackground;
+  BackgroundMode bgMode;
+  double backgroundSeconds;
+  double coveredSeconds;   // of the video showing the clip
+  double uncoveredSeconds; // plain colour after a BG_MODE_ONCE clip ends
+  MemoryAccount memory;
+  bool overBudget;
+  StageCosts costs;
+  double estimatedMs; // render time, from costs
+  char (*problems)[192];
+  int problemCount;
+} RenderPlan;
+
+// Load opts' project (opening the clips but decoding nothing) and plan a
+// render of it against opts->background, which may be NULL. Nothing is
+// rendered or encoded and no GL context is needed. Returns -1 if the
+// project could not be loaded.
+int planRender(const RenderOptions *opts, RenderPlan *plan);
+void freeRenderPlan(RenderPlan *plan);
+
+void printRenderPlan(const RenderPlan *plan);
+// Adds the plan's fields to object
+void addRenderPlanJson(const RenderPlan *plan, cJSON *object);
+
+// --plan: plan opts' project against backgroundFile (NULL for none) and
+// write the report, as JSON to json if it isn't NULL. Returns -1 if the
+// project could not be planned, otherwise the number of problems found.
+int runRenderPlan(const RenderOptions *opts, const char *backgroundFile,
+                  BackgroundMode bgMode, BackgroundFit bgFit, FILE *json);
+
+#endif
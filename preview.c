@@ -0,0 +1,574 @@
+#include "preview.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <raylib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "project.h"
+#include "scene.h"
+
+// Samples per audio buffer; raylib plays one while the other is refilled
+#define PREVIEW_AUDIO_BUFFER 2048
+// Restart the audio at the picture's time once they are this far apart
+#define PREVIEW_AUDIO_DRIFT 0.1
+// Animation replayed before a seek target, so slides and fades are where
+// playing up to it would have left them
+#define PREVIEW_SETTLE_SECONDS 2.0f
+// Caption start frames kept decoded around the playhead, so jumping to a
+// caption shows its background at once
+#define PREVIEW_SEEK_CACHE 32
+#define PREVIEW_SKIP_SECONDS 5.0
+#define PREVIEW_TIMELINE_HEIGHT 28
+// Clicks on the timeline this close to a caption start land on it
+#define PREVIEW_SNAP_PIXELS 6
+
+// Background frame at preview size
+typedef struct {
+  uint8_t *pixels;
+  int64_t serial; // playback: the request it answers
+  int caption; // seek cache: the caption whose start this is, -1 for none
+  bool blank;  // nothing to show there, the plain colour
+} PreviewFrame;
+
+// Backgrounds decode on two threads of their own so the window never
+// waits: one follows the playhead, the other fills the seek cache
+typedef struct {
+  const Project *project;
+  int scale;
+
+  // Playback; shown[front] is read by the GL thread, the other filled
+  BackgroundVideo playBg;
+  uint8_t *playRgba; // full size
+  PreviewFrame shown[2];
+  int front;
+  int64_t shownSerial; // playBg frame in shown[front]
+
+  // Seek cache, slot caption % PREVIEW_SEEK_CACHE
+  BackgroundVideo seekBg;
+  uint8_t *seekRgba;
+  uint8_t *seekScratch;
+  PreviewFrame cache[PREVIEW_SEEK_CACHE];
+  int anchor; // caption at the playhead; the cache fills around it
+
+  pthread_t playThread;
+  pthread_t seekThread;
+  int threads; // started
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  double requestTime;
+  int64_t requestSerial;
+  int64_t doneSerial;
+  bool frameReady; // shown[front] changed since the last upload
+  bool quit;
+} PreviewBackground;
+
+typedef struct {
+  const Project *project;
+  const SceneAssets *assets;
+  SceneState scene;
+  int scale;
+  double time; // playhead
+  bool playing;
+  bool scrubbing;
+
+  bool audio; // device and stream are up
+  AudioStream stream;
+  int64_t audioCursor; // next sample to queue
+  float *left;
+  float *right;
+  float *interleaved;
+
+  PreviewBackground *bg; // NULL without a background
+  Texture2D bgTexture;
+  bool bgVisible;
+  int64_t seekSerial; // background requests before it are for old times
+} Preview;
+
+// Box filter WIDTH x HEIGHT RGBA down to the preview size
+static void downscaleFrame(const uint8_t *src, uint8_t *dst, int scale) {
+  if (scale == 1) {
+    memcpy(dst, src, (size_t)WIDTH * HEIGHT * 4);
+    return;
+  }
+  int width = WIDTH / scale;
+  int height = HEIGHT / scale;
+  int area = scale * scale;
+  for (int y = 0; y < height; y++) {
+    uint8_t *out = dst + (size_t)y * width * 4;
+    for (int x = 0; x < width; x++) {
+      int sum[4] = {0, 0, 0, 0};
+      for (int dy = 0; dy < scale; dy++) {
+        const uint8_t *in =
+            src + ((size_t)(y * scale + dy) * WIDTH + x * scale) * 4;
+        for (int i = 0; i < scale * 4; i++)
+          sum[i & 3] += in[i];
+      }
+      for (int c = 0; c < 4; c++)
+        out[x * 4 + c] = (uint8_t)(sum[c] / area);
+    }
+  }
+}
+
+// Last caption starting at or before time, -1 before the first
+static int captionAt(const Project *project, double time) {
+  int caption = -1;
+  for (int i = 0; i < project->captionCount; i++) {
+    if (project->captions[i].startTime <= time)
+      caption = i;
+  }
+  return caption;
+}
+
+static void *previewPlayThread(void *arg) {
+  PreviewBackground *pb = arg;
+  pthread_mutex_lock(&pb->lock);
+  for (;;) {
+    while (!pb->quit && pb->requestSerial == pb->doneSerial)
+      pthread_cond_wait(&pb->cond, &pb->lock);
+    if (pb->quit)
+      break;
+    double time = pb->requestTime;
+    int64_t serial = pb->requestSerial;
+    PreviewFrame *back = &pb->shown[!pb->front];
+    pthread_mutex_unlock(&pb->lock);
+
+    // Most calls at 60 fps show the same source frame as the last one
+    bool shown = getBackgroundFrame(&pb->playBg, time, pb->playRgba) == 0;
+    bool changed = !shown || pb->playBg.converted_serial != pb->shownSerial;
+    if (shown && changed) {
+      downscaleFrame(pb->playRgba, back->pixels, pb->scale);
+      pb->shownSerial = pb->playBg.converted_serial;
+    }
+    back->blank = !shown;
+    back->serial = serial;
+
+    pthread_mutex_lock(&pb->lock);
+    if (changed) {
+      pb->front = !pb->front;
+      pb->frameReady = true;
+    }
+    if (!shown)
+      pb->shownSerial = -1;
+    pb->doneSerial = serial;
+  }
+  pthread_mutex_unlock(&pb->lock);
+  return NULL;
+}
+
+// Next caption around the anchor without a cached frame, -1 if all are
+// there. Forward first, where reviewers usually go, and in timeline order
+// so the decoder mostly reads on instead of seeking.
+static int nextSeekCaption(const PreviewBackground *pb) {
+  int count = pb->project->captionCount;
+  int half = PREVIEW_SEEK_CACHE / 2;
+  for (int c = pb->anchor < 0 ? 0 : pb->anchor;
+       c < count && c < pb->anchor + half; c++) {
+    if (pb->cache[c % PREVIEW_SEEK_CACHE].caption != c)
+      return c;
+  }
+  for (int c = pb->anchor - half < 0 ? 0 : pb->anchor - half;
+       c < pb->anchor && c < count; c++) {
+    if (pb->cache[c % PREVIEW_SEEK_CACHE].caption != c)
+      return c;
+  }
+  return -1;
+}
+
+static void *previewSeekThread(void *arg) {
+  PreviewBackground *pb = arg;
+  pthread_mutex_lock(&pb->lock);
+  for (;;) {
+    int caption = -1;
+    while (!pb->quit && (caption = nextSeekCaption(pb)) < 0)
+      pthread_cond_wait(&pb->cond, &pb->lock);
+    if (pb->quit)
+      break;
+    double time = pb->project->captions[caption].startTime;
+    pthread_mutex_unlock(&pb->lock);
+
+    bool shown = getBackgroundFrame(&pb->seekBg, time, pb->seekRgba) == 0;
+    if (shown)
+      downscaleFrame(pb->seekRgba, pb->seekScratch, pb->scale);
+
+    pthread_mutex_lock(&pb->lock);
+    PreviewFrame *entry = &pb->cache[caption % PREVIEW_SEEK_CACHE];
+    if (shown) {
+      uint8_t *pixels = entry->pixels;
+      entry->pixels = pb->seekScratch;
+      pb->seekScratch = pixels;
+    }
+    entry->blank = !shown;
+    entry->caption = caption;
+  }
+  pthread_mutex_unlock(&pb->lock);
+  return NULL;
+}
+
+static void closePreviewBackground(PreviewBackground *pb) {
+  pthread_mutex_lock(&pb->lock);
+  pb->quit = true;
+  pthread_cond_broadcast(&pb->cond);
+  pthread_mutex_unlock(&pb->lock);
+  if (pb->threads > 0)
+    pthread_join(pb->playThread, NULL);
+  if (pb->threads > 1)
+    pthread_join(pb->seekThread, NULL);
+  cleanupBackgroundVideo(&pb->playBg);
+  cleanupBackgroundVideo(&pb->seekBg);
+  free(pb->playRgba);
+  free(pb->seekRgba);
+  free(pb->seekScratch);
+  for (int i = 0; i < 2; i++)
+    free(pb->shown[i].pixels);
+  for (int i = 0; i < PREVIEW_SEEK_CACHE; i++)
+    free(pb->cache[i].pixels);
+  pthread_mutex_destroy(&pb->lock);
+  pthread_cond_destroy(&pb->cond);
+  free(pb);
+}
+
+static PreviewBackground *openPreviewBackground(const PreviewOptions *opts,
+                                                const Project *project) {
+  PreviewBackground *pb = calloc(1, sizeof(PreviewBackground));
+  if (!pb)
+    return NULL;
+  pb->project = project;
+  pb->scale = opts->scale;
+  pthread_mutex_init(&pb->lock, NULL);
+  pthread_cond_init(&pb->cond, NULL);
+
+  size_t full = (size_t)WIDTH * HEIGHT * 4;
+  size_t small = (size_t)(WIDTH / opts->scale) * (HEIGHT / opts->scale) * 4;
+  pb->playRgba = malloc(full);
+  pb->seekRgba = malloc(full);
+  pb->seekScratch = malloc(small);
+  bool allocated = pb->playRgba && pb->seekRgba && pb->seekScratch;
+  for (int i = 0; i < 2; i++) {
+    pb->shown[i].pixels = malloc(small);
+    allocated = allocated && pb->shown[i].pixels;
+  }
+  for (int i = 0; i < PREVIEW_SEEK_CACHE; i++) {
+    pb->cache[i].pixels = malloc(small);
+    pb->cache[i].caption = -1;
+    allocated = allocated && pb->cache[i].pixels;
+  }
+  pb->shown[0].blank = true;
+  pb->shownSerial = -1;
+  if (!allocated ||
+      initBackgroundVideo(&pb->playBg, opts->background, opts->bgMode,
+                          opts->bgFit) < 0 ||
+      initBackgroundVideo(&pb->seekBg, opts->background, opts->bgMode,
+                          opts->bgFit) < 0) {
+    closePreviewBackground(pb);
+    return NULL;
+  }
+  if (pthread_create(&pb->playThread, NULL, previewPlayThread, pb) == 0)
+    pb->threads++;
+  if (pb->threads == 1 &&
+      pthread_create(&pb->seekThread, NULL, previewSeekThread, pb) == 0)
+    pb->threads++;
+  if (pb->threads < 2) {
+    printf("Error: Could not start background threads\n");
+    closePreviewBackground(pb);
+    return NULL;
+  }
+  return pb;
+}
+
+// Ask for the background at time; it shows up in a later frame. Returns
+// the request's serial.
+static int64_t requestBackground(PreviewBackground *pb, double time) {
+  pthread_mutex_lock(&pb->lock);
+  if (time != pb->requestTime || pb->requestSerial == 0) {
+    pb->requestTime = time;
+    pb->requestSerial++;
+  }
+  int anchor = captionAt(pb->project, time);
+  bool moved = anchor != pb->anchor;
+  pb->anchor = anchor;
+  if (moved || pb->requestSerial != pb->doneSerial)
+    pthread_cond_broadcast(&pb->cond);
+  int64_t serial = pb->requestSerial;
+  pthread_mutex_unlock(&pb->lock);
+  return serial;
+}
+
+static void showBackgroundFrame(Preview *p, const PreviewFrame *frame) {
+  p->bgVisible = !frame->blank;
+  if (!frame->blank)
+    UpdateTexture(p->bgTexture, frame->pixels);
+}
+
+// Upload the newest decoded frame, if there is one. Frames still on their
+// way from before a seek would flash the old position.
+static void uploadBackground(Preview *p) {
+  PreviewBackground *pb = p->bg;
+  pthread_mutex_lock(&pb->lock);
+  if (pb->frameReady && pb->shown[pb->front].serial >= p->seekSerial) {
+    showBackgroundFrame(p, &pb->shown[pb->front]);
+    pb->frameReady = false;
+  }
+  pthread_mutex_unlock(&pb->lock);
+}
+
+// Show the cached frame for a caption start, if there is one, until
+// playback catches up
+static void showCachedBackground(Preview *p, int caption) {
+  PreviewBackground *pb = p->bg;
+  pthread_mutex_lock(&pb->lock);
+  const PreviewFrame *entry = &pb->cache[caption % PREVIEW_SEEK_CACHE];
+  if (entry->caption == caption)
+    showBackgroundFrame(p, entry);
+  pthread_mutex_unlock(&pb->lock);
+}
+
+static void feedAudio(Preview *p) {
+  while (IsAudioStreamProcessed(p->stream)) {
+    mixProjectAudio(p->project, p->audioCursor, PREVIEW_AUDIO_BUFFER,
+                    p->left, p->right);
+    for (int i = 0; i < PREVIEW_AUDIO_BUFFER; i++) {
+      p->interleaved[2 * i] = p->left[i];
+      p->interleaved[2 * i + 1] = p->right[i];
+    }
+    UpdateAudioStream(p->stream, p->interleaved, PREVIEW_AUDIO_BUFFER);
+    p->audioCursor += PREVIEW_AUDIO_BUFFER;
+  }
+}
+
+// Drop whatever is queued and play on from the playhead
+static void restartAudio(Preview *p) {
+  if (!p->audio)
+    return;
+  StopAudioStream(p->stream);
+  p->audioCursor = (int64_t)llround(p->time * AUDIO_SAMPLE_RATE);
+  if (p->playing && !p->scrubbing) {
+    feedAudio(p);
+    PlayAudioStream(p->stream);
+  }
+}
+
+static void seekPreview(Preview *p, double time, int caption) {
+  if (time < 0.0)
+    time = 0.0;
+  if (time > p->project->duration)
+    time = p->project->duration;
+  p->time = time;
+
+  // Slides and fades depend on what came before
+  float deltaTime = 1.0f / FPS;
+  int last = (int)(time * FPS);
+  int first = last - (int)(PREVIEW_SETTLE_SECONDS * FPS);
+  initSceneState(&p->scene, p->assets, p->project);
+  for (int frame = first < 0 ? 0 : first; frame < last; frame++)
+    updateScene(&p->scene, p->assets, p->project, frame * deltaTime,
+                deltaTime);
+  updateScene(&p->scene, p->assets, p->project, (float)time, deltaTime);
+
+  if (p->bg) {
+    if (caption >= 0)
+      showCachedBackground(p, caption);
+    p->seekSerial = requestBackground(p->bg, time);
+  }
+  restartAudio(p);
+}
+
+static float timelineY(void) {
+  return GetScreenHeight() - PREVIEW_TIMELINE_HEIGHT;
+}
+
+static double timelineTime(const Preview *p, float x) {
+  return x / GetScreenWidth() * p->project->duration;
+}
+
+static float timelineX(const Preview *p, double time) {
+  if (p->project->duration <= 0.0f)
+    return 0.0f;
+  return (float)(time / p->project->duration * GetScreenWidth());
+}
+
+static void handleInput(Preview *p) {
+  const Project *project = p->project;
+  bool shift = IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT);
+  int current = captionAt(project, p->time);
+
+  if (IsKeyPressed(KEY_SPACE)) {
+    p->playing = !p->playing;
+    // Play from the start again once at the end
+    if (p->playing && p->time >= project->duration)
+      seekPreview(p, 0.0, -1);
+    else if (p->playing)
+      restartAudio(p);
+    else if (p->audio)
+      PauseAudioStream(p->stream);
+  }
+  if (IsKeyPressed(KEY_RIGHT) && shift) {
+    seekPreview(p, p->time + PREVIEW_SKIP_SECONDS, -1);
+  } else if (IsKeyPressed(KEY_LEFT) && shift) {
+    seekPreview(p, p->time - PREVIEW_SKIP_SECONDS, -1);
+  } else if (IsKeyPressed(KEY_RIGHT) && current + 1 < project->captionCount) {
+    seekPreview(p, project->captions[current + 1].startTime, current + 1);
+  } else if (IsKeyPressed(KEY_LEFT) && current >= 0) {
+    // Back to the start of this caption, or the one before if already there
+    int target = current;
+    if (p->time - project->captions[current].startTime < 0.25 && current > 0)
+      target--;
+    seekPreview(p, project->captions[target].startTime, target);
+  } else if (IsKeyPressed(KEY_HOME)) {
+    seekPreview(p, 0.0, -1);
+  } else if (IsKeyPressed(KEY_END) && project->captionCount > 0) {
+    int lastCaption = project->captionCount - 1;
+    seekPreview(p, project->captions[lastCaption].startTime, lastCaption);
+  }
+
+  // Scrub on the timeline; audio waits until the button is let go
+  Vector2 mouse = GetMousePosition();
+  if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT) && mouse.y >= timelineY())
+    p->scrubbing = true;
+  if (p->scrubbing && IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+    double time = timelineTime(p, mouse.x);
+    int caption = captionAt(project, time);
+    // Snap to the nearest caption start
+    for (int i = caption < 0 ? 0 : caption;
+         i <= caption + 1 && i < project->captionCount; i++) {
+      float x = timelineX(p, project->captions[i].startTime);
+      if (fabsf(x - mouse.x) <= PREVIEW_SNAP_PIXELS) {
+        time = project->captions[i].startTime;
+        caption = i;
+        break;
+      }
+    }
+    bool onCaption =
+        caption >= 0 && time == project->captions[caption].startTime;
+    if (time != p->time)
+      seekPreview(p, time, onCaption ? caption : -1);
+  } else if (p->scrubbing) {
+    p->scrubbing = false;
+    restartAudio(p);
+  }
+}
+
+static void drawTimeline(const Preview *p) {
+  const Project *project = p->project;
+  int width = GetScreenWidth();
+  int y = (int)timelineY();
+  DrawRectangle(0, y, width, PREVIEW_TIMELINE_HEIGHT, Fade(BLACK, 0.6f));
+  for (int i = 0; i < project->captionCount; i++) {
+    const Caption *caption = &project->captions[i];
+    int x = (int)timelineX(p, caption->startTime);
+    int end = (int)timelineX(p, caption->endTime);
+    DrawRectangle(x, y + 4, end - x > 1 ? end - x : 1,
+                  PREVIEW_TIMELINE_HEIGHT - 8, Fade(SKYBLUE, 0.5f));
+    DrawRectangle(x, y, 1, PREVIEW_TIMELINE_HEIGHT, WHITE);
+  }
+  DrawRectangle((int)timelineX(p, p->time) - 1, y - 4, 3,
+                PREVIEW_TIMELINE_HEIGHT + 4, RED);
+
+  char label[64];
+  snprintf(label, sizeof(label), "%s %d:%04.1f / %d:%04.1f",
+           p->playing ? ">" : "||", (int)p->time / 60, fmod(p->time, 60.0),
+           (int)project->duration / 60, fmod(project->duration, 60.0));
+  DrawText(label, 8, y - 24, 20, WHITE);
+}
+
+int runPreview(const PreviewOptions *opts) {
+  SceneAssets assets;
+  loadSceneAssets(&assets);
+  Project project;
+  if (loadProject(&project, opts->projectId, PROJECT_AUDIO_PRELOAD) < 0) {
+    unloadSceneAssets(&assets);
+    return -1;
+  }
+  addSceneSprites(&assets, &project);
+  printf("Preview: %.1f seconds, %d captions at %dx%d\n", project.duration,
+         project.captionCount, WIDTH / opts->scale, HEIGHT / opts->scale);
+
+  Preview p = {.project = &project, .assets = &assets, .scale = opts->scale};
+  p.left = malloc(PREVIEW_AUDIO_BUFFER * sizeof(float));
+  p.right = malloc(PREVIEW_AUDIO_BUFFER * sizeof(float));
+  p.interleaved = malloc(2 * PREVIEW_AUDIO_BUFFER * sizeof(float));
+  if (p.left && p.right && p.interleaved) {
+    InitAudioDevice();
+    if (IsAudioDeviceReady()) {
+      SetAudioStreamBufferSizeDefault(PREVIEW_AUDIO_BUFFER);
+      p.stream = LoadAudioStream(AUDIO_SAMPLE_RATE, 32, 2);
+      p.audio = true;
+    } else {
+      printf("Warning: No audio device, previewing without sound\n");
+    }
+  }
+
+  if (opts->background) {
+    p.bg = openPreviewBackground(opts, &project);
+    if (p.bg) {
+      Image blank = GenImageColor(WIDTH / opts->scale, HEIGHT / opts->scale,
+                                  BLANK);
+      p.bgTexture = LoadTextureFromImage(blank);
+      UnloadImage(blank);
+    } else {
+      printf("Warning: Previewing without the background\n");
+    }
+  }
+
+  Camera2D camera = {.zoom = 1.0f / opts->scale};
+  p.playing = true;
+  seekPreview(&p, 0.0, -1);
+  while (!WindowShouldClose()) {
+    handleInput(&p);
+    float deltaTime = 0.0f;
+    if (p.playing && !p.scrubbing) {
+      deltaTime = GetFrameTime();
+      p.time += deltaTime;
+      if (p.time >= project.duration) {
+        p.time = project.duration;
+        p.playing = false;
+        if (p.audio)
+          PauseAudioStream(p.stream);
+      }
+      updateScene(&p.scene, &assets, &project, (float)p.time, deltaTime);
+    }
+
+    if (p.audio && p.playing && !p.scrubbing) {
+      feedAudio(&p);
+      // What is playing now is about one and a half buffers behind what
+      // was queued last
+      double heard =
+          (p.audioCursor - 1.5 * PREVIEW_AUDIO_BUFFER) / AUDIO_SAMPLE_RATE;
+      if (fabs(heard - p.time) > PREVIEW_AUDIO_DRIFT)
+        restartAudio(&p);
+    }
+    if (p.bg) {
+      requestBackground(p.bg, p.time);
+      uploadBackground(&p);
+    }
+
+    BeginDrawing();
+    ClearBackground(DARKBLUE);
+    if (p.bgVisible)
+      DrawTexture(p.bgTexture, 0, 0, WHITE);
+    BeginMode2D(camera);
+    drawScene(&p.scene, &assets);
+    EndMode2D();
+    drawTimeline(&p);
+    EndDrawing();
+  }
+
+  if (p.bg) {
+    closePreviewBackground(p.bg);
+    UnloadTexture(p.bgTexture);
+  }
+  if (p.audio) {
+    UnloadAudioStream(p.stream);
+    CloseAudioDevice();
+  }
+  free(p.left);
+  free(p.right);
+  free(p.interleaved);
+  freeProject(&project);
+  unloadSceneAssets(&assets);
+  return 0;
+}
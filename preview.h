@@ -0,0 +1,27 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include "background.h"
+
+// Window size is WIDTH / scale x HEIGHT / scale
+#define PREVIEW_DEFAULT_SCALE 2
+#define PREVIEW_MAX_SCALE 4
+
+typedef struct {
+  const char *projectId;
+  const char *background; // NULL for a plain colour
+  BackgroundMode bgMode;
+  BackgroundFit bgFit;
+  int scale;
+} PreviewOptions;
+
+// Interactive preview in the already open window, which should be the
+// scaled size. Plays the mixed voice lines in sync with the picture and
+// seeks anywhere: space plays and pauses, left/right jump between
+// captions, shift+left/right skip 5 seconds, home/end go to the first and
+// last caption and the timeline at the bottom scrubs with the mouse.
+// Nothing is encoded. Returns 0 when the window is closed, -1 if the
+// project could not be loaded.
+int runPreview(const PreviewOptions *opts);
+
+#endif
@@ -0,0 +1,767 @@
+#define _GNU_SOURCE
+#include "project.h"
+
+#include <cjson/cJSON.h>
+#include <dirent.h>
+#include <libavutil/opt.h>
+#include <libavutil/samplefmt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// What every project used before character tables
+static const CharacterDef defaultCharacters[] = {
+    {"peter", "./peter.png", CHARACTER_SCALE, CHARACTER_ANCHOR_LEFT, 50.0f,
+     CHARACTER_ANIM_SLIDE, CHARACTER_ANIM_FADE},
+    {"stewie", "./stewie.png", CHARACTER_SCALE, CHARACTER_ANCHOR_RIGHT, 50.0f,
+     CHARACTER_ANIM_SLIDE, CHARACTER_ANIM_FADE},
+};
+
+static int parseAnimation(const cJSON *item, CharacterAnimation fallback,
+                          CharacterAnimation *animation) {
+  *animation = fallback;
+  if (!item)
+    return 0;
+  if (!cJSON_IsString(item))
+    return -1;
+  if (strcmp(item->valuestring, "slide") == 0) {
+    *animation = CHARACTER_ANIM_SLIDE;
+  } else if (strcmp(item->valuestring, "fade") == 0) {
+    *animation = CHARACTER_ANIM_FADE;
+  } else if (strcmp(item->valuestring, "none") == 0) {
+    *animation = CHARACTER_ANIM_NONE;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int parseCharacter(const cJSON *item, CharacterDef *c) {
+  memset(c, 0, sizeof(CharacterDef));
+  cJSON *name = cJSON_GetObjectItem(item, "name");
+  cJSON *sprite = cJSON_GetObjectItem(item, "sprite");
+  cJSON *scale = cJSON_GetObjectItem(item, "scale");
+  cJSON *anchor = cJSON_GetObjectItem(item, "anchor");
+  cJSON *margin = cJSON_GetObjectItem(item, "margin");
+  if (!cJSON_IsString(name) || !cJSON_IsString(sprite) ||
+      name->valuestring[0] == '\0' ||
+      strlen(name->valuestring) >= sizeof(c->name) ||
+      strlen(sprite->valuestring) >= sizeof(c->sprite))
+    return -1;
+  strcpy(c->name, name->valuestring);
+  strcpy(c->sprite, sprite->valuestring);
+  c->scale = cJSON_IsNumber(scale) && scale->valuedouble > 0.0
+                 ? (float)scale->valuedouble
+                 : CHARACTER_SCALE;
+  c->margin = cJSON_IsNumber(margin) ? (float)margin->valuedouble : 50.0f;
+
+  c->anchor = CHARACTER_ANCHOR_LEFT;
+  if (cJSON_IsString(anchor)) {
+    if (strcmp(anchor->valuestring, "right") == 0)
+      c->anchor = CHARACTER_ANCHOR_RIGHT;
+    else if (strcmp(anchor->valuestring, "center") == 0)
+      c->anchor = CHARACTER_ANCHOR_CENTER;
+    else if (strcmp(anchor->valuestring, "left") != 0)
+      return -1;
+  } else if (anchor) {
+    return -1;
+  }
+  if (parseAnimation(cJSON_GetObjectItem(item, "enter"), CHARACTER_ANIM_SLIDE,
+                     &c->enter) < 0 ||
+      parseAnimation(cJSON_GetObjectItem(item, "exit"), CHARACTER_ANIM_FADE,
+                     &c->exit) < 0)
+    return -1;
+  return 0;
+}
+
+int loadCharacterTable(const char *path, CharacterDef *characters,
+                       int maxCharacters) {
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return -1;
+  fseek(file, 0, SEEK_END);
+  long fileSize = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *text = malloc(fileSize + 1);
+  size_t length = text ? fread(text, 1, fileSize, file) : 0;
+  fclose(file);
+  if (!text)
+    return -1;
+  text[length] = '\0';
+  cJSON *json = cJSON_Parse(text);
+  free(text);
+
+  int count = 0;
+  cJSON *list = json ? cJSON_GetObjectItem(json, "characters") : NULL;
+  cJSON *item;
+  if (!cJSON_IsArray(list)) {
+    count = -1;
+  } else {
+    cJSON_ArrayForEach(item, list) {
+      if (count == maxCharacters) {
+        printf("Warning: %s has more than %d characters, ignoring the rest\n",
+               path, maxCharacters);
+        break;
+      }
+      if (parseCharacter(item, &characters[count]) < 0) {
+        count = -1;
+        break;
+      }
+      count++;
+    }
+  }
+  cJSON_Delete(json);
+  if (count < 0)
+    printf("Error: Invalid character table %s\n", path);
+  return count;
+}
+
+int loadCharacters(const char *projectId, CharacterDef *characters,
+                   int maxCharacters) {
+  int count;
+  if (projectId) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.json", CHARACTERS_DIR, projectId);
+    count = loadCharacterTable(path, characters, maxCharacters);
+    if (count > 0) {
+      printf("Loaded %d characters from %s\n", count, path);
+      return count;
+    }
+  }
+  count = (int)(sizeof(defaultCharacters) / sizeof(defaultCharacters[0]));
+  if (count > maxCharacters)
+    count = maxCharacters;
+  memcpy(characters, defaultCharacters, count * sizeof(CharacterDef));
+  return count;
+}
+
+// Caption file speaker: an explicit "speaker" name, else the longest
+// character name in the file name
+static int findSpeaker(const CharacterDef *characters, int characterCount,
+                       const cJSON *speaker, const char *fileName) {
+  if (cJSON_IsString(speaker)) {
+    for (int i = 0; i < characterCount; i++) {
+      if (strcasecmp(characters[i].name, speaker->valuestring) == 0)
+        return i;
+    }
+    printf("Warning: Unknown speaker \"%s\" in %s\n", speaker->valuestring,
+           fileName);
+  }
+  int best = 0;
+  size_t bestLength = 0;
+  for (int i = 0; i < characterCount; i++) {
+    size_t length = strlen(characters[i].name);
+    if (length > bestLength && strcasestr(fileName, characters[i].name)) {
+      best = i;
+      bestLength = length;
+    }
+  }
+  return best;
+}
+
+int loadCaptions(const char *projectId, const CharacterDef *characters,
+                 int characterCount, Caption *captions, int maxCaptions) {
+  char dirPath[256];
+  snprintf(dirPath, sizeof(dirPath), "media/captions/%s", projectId);
+
+  DIR *dir = opendir(dirPath);
+  if (!dir) {
+    printf("Warning: Could not open captions directory: %s\n", dirPath);
+    return 0;
+  }
+
+  // Get all JSON files and sort them by filename
+  struct dirent *entries[1000];
+  int fileCount = 0;
+  struct dirent *entry;
+
+  while ((entry = readdir(dir)) != NULL && fileCount < 1000) {
+    if (strstr(entry->d_name, ".json") != NULL) {
+      entries[fileCount] = malloc(sizeof(struct dirent));
+      *entries[fileCount] = *entry;
+      fileCount++;
+    }
+  }
+  closedir(dir);
+
+  // Simple sort by filename
+  for (int i = 0; i < fileCount - 1; i++) {
+    for (int j = i + 1; j < fileCount; j++) {
+      if (strcmp(entries[i]->d_name, entries[j]->d_name) > 0) {
+        struct dirent *temp = entries[i];
+        entries[i] = entries[j];
+        entries[j] = temp;
+      }
+    }
+  }
+
+  int captionCount = 0;
+  float currentTimeOffset = 0.0f;
+
+  for (int fileIdx = 0; fileIdx < fileCount && captionCount < maxCaptions;
+       fileIdx++) {
+    char filePath[512];
+    snprintf(filePath, sizeof(filePath), "%s/%s", dirPath,
+             entries[fileIdx]->d_name);
+
+    FILE *file = fopen(filePath, "r");
+    if (!file) {
+      free(entries[fileIdx]);
+      continue;
+    }
+
+    // Read entire file
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *jsonContent = malloc(fileSize + 1);
+    fread(jsonContent, 1, fileSize, file);
+    jsonContent[fileSize] = '\0';
+    fclose(file);
+
+    // Parse JSON
+    cJSON *json = cJSON_Parse(jsonContent);
+    if (!json) {
+      printf("Error parsing JSON in file: %s\n", entries[fileIdx]->d_name);
+      free(jsonContent);
+      free(entries[fileIdx]);
+      continue;
+    }
+
+    // Extract transcript
+    cJSON *transcript = cJSON_GetObjectItem(json, "transcript");
+    if (cJSON_IsString(transcript)) {
+      strncpy(captions[captionCount].text, transcript->valuestring,
+              MAX_TEXT_LENGTH - 1);
+      captions[captionCount].text[MAX_TEXT_LENGTH - 1] = '\0';
+
+      captions[captionCount].speaker =
+          findSpeaker(characters, characterCount,
+                      cJSON_GetObjectItem(json, "speaker"),
+                      entries[fileIdx]->d_name);
+
+      snprintf(captions[captionCount].file,
+               sizeof(captions[captionCount].file), "%s",
+               entries[fileIdx]->d_name);
+
+      // Parse word timing data
+      captions[captionCount].wordCount = 0;
+      captions[captionCount].droppedWords = 0;
+      cJSON *words = cJSON_GetObjectItem(json, "words");
+      if (cJSON_IsArray(words)) {
+        int wordIdx = 0;
+        cJSON *word = NULL;
+
+        cJSON_ArrayForEach(word, words) {
+          cJSON *wordText = cJSON_GetObjectItem(word, "word");
+          cJSON *startTime = cJSON_GetObjectItem(word, "start");
+          cJSON *endTime = cJSON_GetObjectItem(word, "end");
+
+          if (cJSON_IsString(wordText) && cJSON_IsNumber(startTime) &&
+              cJSON_IsNumber(endTime) && wordIdx >= MAX_CAPTION_WORDS) {
+            captions[captionCount].droppedWords++;
+          } else if (cJSON_IsString(wordText) && cJSON_IsNumber(startTime) &&
+                     cJSON_IsNumber(endTime)) {
+            strncpy(captions[captionCount].words[wordIdx].word,
+                    wordText->valuestring, 63);
+            captions[captionCount].words[wordIdx].word[63] = '\0';
+
+            // Add time offset to sequence the conversations
+            captions[captionCount].words[wordIdx].start =
+                startTime->valuedouble + currentTimeOffset;
+            captions[captionCount].words[wordIdx].end =
+                endTime->valuedouble + currentTimeOffset;
+            wordIdx++;
+          }
+        }
+        captions[captionCount].wordCount = wordIdx;
+        if (captions[captionCount].droppedWords > 0)
+          printf("Warning: %s has %d timed words, only the first %d are "
+                 "shown\n",
+                 entries[fileIdx]->d_name,
+                 wordIdx + captions[captionCount].droppedWords,
+                 MAX_CAPTION_WORDS);
+      }
+
+      // Set overall timing based on first and last word
+      if (captions[captionCount].wordCount > 0) {
+        captions[captionCount].startTime =
+            captions[captionCount].words[0].start;
+        captions[captionCount].endTime =
+            captions[captionCount]
+                .words[captions[captionCount].wordCount - 1]
+                .end;
+
+        // Update time offset for next file (add 0.5 second gap)
+        currentTimeOffset = captions[captionCount].endTime + 0.5f;
+      } else {
+        // Fallback timing
+        captions[captionCount].startTime = currentTimeOffset;
+        captions[captionCount].endTime = currentTimeOffset + 3.0f;
+        currentTimeOffset += 3.5f;
+      }
+
+      captionCount++;
+    }
+
+    cJSON_Delete(json);
+    free(jsonContent);
+    free(entries[fileIdx]);
+  }
+
+  printf("Loaded %d captions from %s (total duration: %.1fs)\n", captionCount,
+         dirPath, currentTimeOffset);
+
+  return captionCount;
+}
+
+// Clip length at 44.1kHz from the container, -1 if it doesn't say
+static int audioFileSamples(const AudioFile *af) {
+  double duration;
+  if (af->fmt_ctx->duration != AV_NOPTS_VALUE) {
+    duration = (double)af->fmt_ctx->duration / AV_TIME_BASE;
+  } else if (af->audio_stream->duration != AV_NOPTS_VALUE) {
+    duration = af->audio_stream->duration * av_q2d(af->audio_stream->time_base);
+  } else {
+    return -1;
+  }
+  return (int)llround(duration * AUDIO_SAMPLE_RATE);
+}
+
+// Decode the whole file into stereo_buffer as 44.1kHz interleaved stereo.
+// Sets total_samples to what was decoded if it wasn't known. Returns -1
+// (with total_samples 0, so the clip stays silent) on error.
+static int decodeAudioFile(AudioFile *af) {
+  // From the top with fresh decoder and resampler state; a streamed clip
+  // can be decoded again on a later render
+  av_seek_frame(af->fmt_ctx, af->stream_index, 0, AVSEEK_FLAG_BACKWARD);
+  avcodec_flush_buffers(af->codec_ctx);
+  swr_init(af->swr_ctx);
+
+  // Allocate buffer based on the known length + 10% safety margin, or
+  // ten seconds if unknown
+  int estimated_samples = af->total_samples > 0
+                              ? (int)(af->total_samples * 1.1)
+                              : AUDIO_SAMPLE_RATE * 10;
+  af->stereo_buffer = malloc(estimated_samples * 2 * sizeof(float));
+  af->buffer_samples = 0;
+  if (!af->stereo_buffer) {
+    printf("Error: Could not allocate audio buffer\n");
+    af->total_samples = 0;
+    return -1;
+  }
+
+  // Read entire file and convert to 44.1kHz stereo
+  while (av_read_frame(af->fmt_ctx, af->pkt) >= 0) {
+    if (af->pkt->stream_index != af->stream_index ||
+        avcodec_send_packet(af->codec_ctx, af->pkt) < 0) {
+      av_packet_unref(af->pkt);
+      continue;
+    }
+    while (avcodec_receive_frame(af->codec_ctx, af->frame) >= 0) {
+      uint8_t **out_data = NULL;
+      int out_linesize;
+      int out_samples = av_rescale_rnd(af->frame->nb_samples, 44100,
+                                       af->sample_rate, AV_ROUND_UP);
+      if (av_samples_alloc_array_and_samples(&out_data, &out_linesize, 2,
+                                             out_samples, AV_SAMPLE_FMT_FLTP,
+                                             0) < 0)
+        continue;
+      int converted =
+          swr_convert(af->swr_ctx, out_data, out_samples,
+                      (const uint8_t **)af->frame->data, af->frame->nb_samples);
+
+      if (converted > 0 &&
+          af->buffer_samples + converted >= estimated_samples) {
+        // Check if we need to resize buffer
+        printf("Warning: Audio file longer than estimated, expanding "
+               "buffer\n");
+        int grownSamples = (af->buffer_samples + converted) * 2;
+        float *grown = realloc(af->stereo_buffer,
+                               grownSamples * 2 * sizeof(float));
+        if (!grown) {
+          printf("Error: Could not expand audio buffer\n");
+          converted = 0;
+        } else {
+          af->stereo_buffer = grown;
+          estimated_samples = grownSamples;
+        }
+      }
+      if (converted > 0) {
+        float *left = (float *)out_data[0];
+        float *right = (float *)out_data[1];
+
+        // Simple interleave stereo samples
+        for (int i = 0; i < converted; i++) {
+          af->stereo_buffer[(af->buffer_samples + i) * 2] = left[i];
+          af->stereo_buffer[(af->buffer_samples + i) * 2 + 1] = right[i];
+        }
+        af->buffer_samples += converted;
+      }
+
+      av_freep(&out_data[0]);
+      av_freep(&out_data);
+    }
+    av_packet_unref(af->pkt);
+  }
+
+  // Give back the safety margin
+  if (af->buffer_samples > 0) {
+    float *fitted = realloc(af->stereo_buffer,
+                            af->buffer_samples * 2 * sizeof(float));
+    if (fitted)
+      af->stereo_buffer = fitted;
+  }
+  if (af->total_samples < 0)
+    af->total_samples = af->buffer_samples;
+  return 0;
+}
+
+static void unloadAudioFile(AudioFile *af) {
+  free(af->stereo_buffer);
+  af->stereo_buffer = NULL;
+  af->buffer_samples = 0;
+}
+
+int loadAudioFiles(const char *projectId, bool preload, AudioFile **audioFiles,
+                   int *audioCount) {
+  char audioDir[256];
+  snprintf(audioDir, sizeof(audioDir), "media/audio/%s", projectId);
+
+  DIR *dir = opendir(audioDir);
+  if (!dir) {
+    printf("Warning: Could not open audio directory: %s\n", audioDir);
+    return 0;
+  }
+
+  // Get all WAV files and sort them by filename (same as captions)
+  struct dirent *entries[1000];
+  int fileCount = 0;
+  struct dirent *entry;
+
+  while ((entry = readdir(dir)) != NULL && fileCount < 1000) {
+    if (strstr(entry->d_name, ".wav") != NULL) {
+      entries[fileCount] = malloc(sizeof(struct dirent));
+      *entries[fileCount] = *entry;
+      fileCount++;
+    }
+  }
+  closedir(dir);
+
+  // Simple sort by filename (matches caption loading logic)
+  for (int i = 0; i < fileCount - 1; i++) {
+    for (int j = i + 1; j < fileCount; j++) {
+      if (strcmp(entries[i]->d_name, entries[j]->d_name) > 0) {
+        struct dirent *temp = entries[i];
+        entries[i] = entries[j];
+        entries[j] = temp;
+      }
+    }
+  }
+
+  if (fileCount == 0) {
+    printf("No audio files found in %s\n", audioDir);
+    return 0;
+  }
+
+  *audioFiles = malloc(fileCount * sizeof(AudioFile));
+  *audioCount = 0;
+
+  // Load each WAV file in sorted order
+  for (int fileIdx = 0; fileIdx < fileCount; fileIdx++) {
+    char filePath[512];
+    snprintf(filePath, sizeof(filePath), "%s/%s", audioDir,
+             entries[fileIdx]->d_name);
+
+    AudioFile *af = &(*audioFiles)[*audioCount];
+    memset(af, 0, sizeof(AudioFile));
+    af->stream_index = -1;
+    snprintf(af->file, sizeof(af->file), "%s", entries[fileIdx]->d_name);
+
+    // Open audio file
+    if (avformat_open_input(&af->fmt_ctx, filePath, NULL, NULL) >= 0) {
+      if (avformat_find_stream_info(af->fmt_ctx, NULL) >= 0) {
+        // Find audio stream
+        for (unsigned int i = 0; i < af->fmt_ctx->nb_streams; i++) {
+          if (af->fmt_ctx->streams[i]->codecpar->codec_type ==
+              AVMEDIA_TYPE_AUDIO) {
+            af->stream_index = i;
+            af->audio_stream = af->fmt_ctx->streams[i];
+            break;
+          }
+        }
+
+        if (af->stream_index != -1) {
+          // Initialize decoder
+          const AVCodec *codec =
+              avcodec_find_decoder(af->audio_stream->codecpar->codec_id);
+          if (codec) {
+            af->codec_ctx = avcodec_alloc_context3(codec);
+            if (avcodec_parameters_to_context(
+                    af->codec_ctx, af->audio_stream->codecpar) >= 0) {
+              if (avcodec_open2(af->codec_ctx, codec, NULL) >= 0) {
+                af->time_base = av_q2d(af->audio_stream->time_base);
+                af->sample_rate = af->codec_ctx->sample_rate;
+                af->channels = af->codec_ctx->ch_layout.nb_channels;
+                af->frame = av_frame_alloc();
+                af->pkt = av_packet_alloc();
+
+                // Initialize resampler for format conversion with high quality
+                af->swr_ctx = swr_alloc();
+                if (af->swr_ctx) {
+                  av_opt_set_chlayout(af->swr_ctx, "in_chlayout",
+                                      &af->codec_ctx->ch_layout, 0);
+                  av_opt_set_int(af->swr_ctx, "in_sample_rate", af->sample_rate,
+                                 0);
+                  av_opt_set_sample_fmt(af->swr_ctx, "in_sample_fmt",
+                                        af->codec_ctx->sample_fmt, 0);
+
+                  AVChannelLayout stereo_layout = AV_CHANNEL_LAYOUT_STEREO;
+                  av_opt_set_chlayout(af->swr_ctx, "out_chlayout",
+                                      &stereo_layout, 0);
+                  av_opt_set_int(af->swr_ctx, "out_sample_rate", 44100, 0);
+                  av_opt_set_sample_fmt(af->swr_ctx, "out_sample_fmt",
+                                        AV_SAMPLE_FMT_FLTP, 0);
+
+                  // Use default resampling settings for stability
+
+                  if (swr_init(af->swr_ctx) < 0) {
+                    swr_free(&af->swr_ctx);
+                    af->swr_ctx = NULL;
+                  } else {
+                    af->total_samples = audioFileSamples(af);
+                    // Without a length from the container the clip has to
+                    // be decoded to place it, streamed or not
+                    if (preload || af->total_samples < 0) {
+                      if (preload)
+                        printf("Preloading audio file: %s\n",
+                               entries[fileIdx]->d_name);
+                      if (decodeAudioFile(af) == 0) {
+                        af->total_samples = af->buffer_samples;
+                        printf("Preloaded %d samples (%.2f seconds)\n",
+                               af->buffer_samples,
+                               (float)af->buffer_samples / 44100.0f);
+                      }
+                    }
+                  }
+                }
+
+                printf("Loaded audio file: %s (SR: %d, Ch: %d)\n",
+                       entries[fileIdx]->d_name, af->sample_rate, af->channels);
+                (*audioCount)++;
+              } else {
+                avcodec_free_context(&af->codec_ctx);
+                avformat_close_input(&af->fmt_ctx);
+              }
+            } else {
+              avcodec_free_context(&af->codec_ctx);
+              avformat_close_input(&af->fmt_ctx);
+            }
+          } else {
+            avformat_close_input(&af->fmt_ctx);
+          }
+        } else {
+          avformat_close_input(&af->fmt_ctx);
+        }
+      } else {
+        avformat_close_input(&af->fmt_ctx);
+      }
+    }
+
+    free(entries[fileIdx]);
+  }
+
+  printf("Loaded %d audio files from %s\n", *audioCount, audioDir);
+  return *audioCount;
+}
+
+typedef struct {
+  const char *projectId;
+  bool preload;
+  AudioFile *audioFiles;
+  int audioFileCount;
+} AudioFileLoad;
+
+static void *audioFileLoadThread(void *arg) {
+  AudioFileLoad *load = arg;
+  loadAudioFiles(load->projectId, load->preload, &load->audioFiles,
+                 &load->audioFileCount);
+  return NULL;
+}
+
+int loadProject(Project *project, const char *projectId, ProjectAudio audio) {
+  memset(project, 0, sizeof(Project));
+  project->captions = malloc(MAX_CAPTIONS * sizeof(Caption));
+  if (!project->captions) {
+    printf("Error: Could not allocate captions\n");
+    return -1;
+  }
+
+  // Opening the clips doesn't need the captions, so it runs alongside
+  // parsing them; they only meet in projectClipSpan
+  AudioFileLoad load = {projectId, audio == PROJECT_AUDIO_PRELOAD, NULL, 0};
+  pthread_t loader;
+  bool loading = audio != PROJECT_AUDIO_NONE &&
+                 pthread_create(&loader, NULL, audioFileLoadThread, &load) ==
+                     0;
+  project->characterCount =
+      loadCharacters(projectId, project->characters, MAX_CHARACTERS);
+  project->captionCount =
+      loadCaptions(projectId, project->characters, project->characterCount,
+                   project->captions, MAX_CAPTIONS);
+  // Keep only what was filled in
+  Caption *fitted = realloc(project->captions,
+                            (project->captionCount > 0 ? project->captionCount
+                                                       : 1) *
+                                sizeof(Caption));
+  if (fitted)
+    project->captions = fitted;
+
+  // Calculate total duration from captions
+  project->duration = 10.0f; // Default fallback
+  if (project->captionCount > 0) {
+    // Find the actual end time of the last caption
+    float maxEndTime = 0.0f;
+    for (int i = 0; i < project->captionCount; i++) {
+      if (project->captions[i].endTime > maxEndTime) {
+        maxEndTime = project->captions[i].endTime;
+      }
+    }
+    project->duration = maxEndTime + 1.0f; // Add 1 second buffer
+  }
+
+  if (audio != PROJECT_AUDIO_NONE) {
+    if (loading)
+      pthread_join(loader, NULL);
+    else
+      audioFileLoadThread(&load);
+    project->audioFiles = load.audioFiles;
+    project->audioFileCount = load.audioFileCount;
+    project->streamAudio = audio == PROJECT_AUDIO_STREAM;
+    project->audioPeakBytes = projectAudioBytes(project);
+  }
+  return 0;
+}
+
+void freeProject(Project *project) {
+  for (int i = 0; i < project->audioFileCount; i++) {
+    AudioFile *af = &project->audioFiles[i];
+    if (af->stereo_buffer)
+      free(af->stereo_buffer);
+    if (af->swr_ctx)
+      swr_free(&af->swr_ctx);
+    if (af->codec_ctx)
+      avcodec_free_context(&af->codec_ctx);
+    if (af->frame)
+      av_frame_free(&af->frame);
+    if (af->pkt)
+      av_packet_free(&af->pkt);
+    if (af->fmt_ctx)
+      avformat_close_input(&af->fmt_ctx);
+  }
+  free(project->audioFiles);
+  free(project->captions);
+  memset(project, 0, sizeof(Project));
+}
+
+bool projectClipSpan(const Project *project, int i, int64_t *start,
+                     int64_t *end) {
+  // Caption i is voiced by audio file i
+  if (i >= project->captionCount || i >= project->audioFileCount)
+    return false;
+  const Caption *caption = &project->captions[i];
+  const AudioFile *af = &project->audioFiles[i];
+  if (af->total_samples <= 0)
+    return false;
+  int64_t length =
+      llround((caption->endTime - caption->startTime) * AUDIO_SAMPLE_RATE);
+  if (length > af->total_samples)
+    length = af->total_samples;
+  *start = llround(caption->startTime * AUDIO_SAMPLE_RATE);
+  *end = *start + length;
+  return length > 0;
+}
+
+void mixProjectAudio(const Project *project, int64_t firstSample, int samples,
+                     float *left, float *right) {
+  memset(left, 0, samples * sizeof(float));
+  memset(right, 0, samples * sizeof(float));
+
+  // Earlier captions win where clips overlap, so they are written last
+  for (int i = project->audioFileCount - 1; i >= 0; i--) {
+    int64_t start, end;
+    if (!projectClipSpan(project, i, &start, &end))
+      continue;
+    int64_t from = start > firstSample ? start : firstSample;
+    int64_t to = end < firstSample + samples ? end : firstSample + samples;
+    const float *buffer = project->audioFiles[i].stereo_buffer;
+    if (!buffer)
+      continue;
+    // A streamed clip can decode shorter than its container said
+    if (to > start + project->audioFiles[i].buffer_samples)
+      to = start + project->audioFiles[i].buffer_samples;
+    for (int64_t n = from; n < to; n++) {
+      float l = buffer[(n - start) * 2];
+      float r = buffer[(n - start) * 2 + 1];
+      l = fmaxf(-1.0f, fminf(1.0f, l));
+      r = fmaxf(-1.0f, fminf(1.0f, r));
+      left[n - firstSample] = l * 0.9f;
+      right[n - firstSample] = r * 0.9f;
+    }
+  }
+}
+
+void loadProjectAudio(Project *project, int64_t from, int64_t to) {
+  for (int i = 0; i < project->audioFileCount; i++) {
+    AudioFile *af = &project->audioFiles[i];
+    int64_t start, end;
+    if (!projectClipSpan(project, i, &start, &end))
+      continue;
+    if (project->streamAudio && end <= from) {
+      if (af->stereo_buffer)
+        unloadAudioFile(af);
+    } else if (start < to && end > from && !af->stereo_buffer) {
+      decodeAudioFile(af);
+    }
+  }
+  int64_t bytes = projectAudioBytes(project);
+  if (bytes > project->audioPeakBytes)
+    project->audioPeakBytes = bytes;
+}
+
+int64_t projectAudioBytes(const Project *project) {
+  int64_t bytes = 0;
+  for (int i = 0; i < project->audioFileCount; i++) {
+    if (project->audioFiles[i].stereo_buffer)
+      bytes += (int64_t)project->audioFiles[i].buffer_samples * 2 *
+               sizeof(float);
+  }
+  return bytes;
+}
+
+int64_t estimateProjectAudioBytes(const Project *project, bool stream) {
+  int64_t total = 0, most = 0;
+  for (int i = 0; i < project->audioFileCount; i++) {
+    int64_t start, end;
+    if (!projectClipSpan(project, i, &start, &end))
+      continue;
+    int64_t bytes =
+        (int64_t)project->audioFiles[i].total_samples * 2 * sizeof(float);
+    total += bytes;
+    // Streamed, the most at once is at the start of some clip: it and
+    // every clip still playing there
+    int64_t resident = 0;
+    for (int j = 0; j < project->audioFileCount; j++) {
+      int64_t s, e;
+      if (projectClipSpan(project, j, &s, &e) && s <= start && e > start)
+        resident +=
+            (int64_t)project->audioFiles[j].total_samples * 2 * sizeof(float);
+    }
+    if (resident > most)
+      most = resident;
+  }
+  return stream ? most : total;
+}
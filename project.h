@@ -0,0 +1,153 @@
+#ifndef PROJECT_H
+#define PROJECT_H
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_CAPTIONS 1000
+#define MAX_TEXT_LENGTH 512
+#define MAX_CAPTION_WORDS 100
+#define AUDIO_SAMPLE_RATE 44100
+
+// Character tables live in media/characters/<projectId>.json; projects
+// without one get Peter and Stewie
+#define CHARACTERS_DIR "media/characters"
+#define MAX_CHARACTERS 8
+#define CHARACTER_SCALE 0.5f
+
+typedef enum {
+  CHARACTER_ANCHOR_LEFT,
+  CHARACTER_ANCHOR_RIGHT,
+  CHARACTER_ANCHOR_CENTER
+} CharacterAnchor;
+
+typedef enum {
+  CHARACTER_ANIM_SLIDE, // in from (and out to) the anchored edge
+  CHARACTER_ANIM_FADE,
+  CHARACTER_ANIM_NONE
+} CharacterAnimation;
+
+// One speaker: its sprite, where it stands and how it comes and goes
+typedef struct {
+  char name[32]; // captions are matched to speakers by name
+  char sprite[256];
+  float scale; // drawn size relative to the sprite image
+  CharacterAnchor anchor;
+  float margin; // distance from the anchored edge
+  CharacterAnimation enter;
+  CharacterAnimation exit;
+} CharacterDef;
+
+typedef struct {
+  float startTime;
+  float endTime;
+  char text[MAX_TEXT_LENGTH];
+  int speaker; // index into Project.characters
+  // Word timing data
+  struct {
+    char word[64];
+    float start;
+    float end;
+  } words[MAX_CAPTION_WORDS];
+  int wordCount;
+  int droppedWords; // timed words past MAX_CAPTION_WORDS, not shown
+  char file[128];   // caption file it was read from
+} Caption;
+
+// Audio mixer context
+typedef struct {
+  AVFormatContext *fmt_ctx;
+  AVCodecContext *codec_ctx;
+  AVStream *audio_stream;
+  struct SwrContext *swr_ctx;
+  AVFrame *frame;
+  AVPacket *pkt;
+  int stream_index;
+  double time_base;
+  uint8_t **audio_data;
+  int audio_linesize;
+  int sample_rate;
+  int channels;
+  int64_t pts;
+  // Preloaded audio buffer
+  float *stereo_buffer; // 44.1kHz stereo float samples, NULL until decoded
+  int buffer_samples;   // Total samples in buffer
+  int total_samples;    // clip length, known before it is decoded
+  char file[128];       // name in the project's audio directory
+} AudioFile;
+
+// What loadProject does with the voice lines
+typedef enum {
+  PROJECT_AUDIO_NONE,
+  PROJECT_AUDIO_PRELOAD, // decode every clip up front
+  PROJECT_AUDIO_STREAM   // only open them; see loadProjectAudio
+} ProjectAudio;
+
+// Captions and voice lines of one project
+typedef struct {
+  CharacterDef characters[MAX_CHARACTERS];
+  int characterCount;
+  Caption *captions;
+  int captionCount;
+  AudioFile *audioFiles;
+  int audioFileCount;
+  bool streamAudio;       // clips are decoded as the mix gets to them
+  int64_t audioPeakBytes; // most decoded PCM held at once so far
+  float duration; // end of the last caption plus a second
+} Project;
+
+// Read a character table ({"characters": [{"name": "peter", "sprite":
+// "./peter.png", "anchor": "left", "margin": 50, "enter": "slide", "exit":
+// "fade"}, ...]}). Returns the number of characters, -1 on error.
+int loadCharacterTable(const char *path, CharacterDef *characters,
+                       int maxCharacters);
+
+// The project's table, or the built-in Peter and Stewie one (always for a
+// NULL projectId)
+int loadCharacters(const char *projectId, CharacterDef *characters,
+                   int maxCharacters);
+
+// JSON parser for caption files using cJSON. Each caption's speaker is its
+// "speaker" field, or else the character whose name appears in the file
+// name (the first character if none does).
+int loadCaptions(const char *projectId, const CharacterDef *characters,
+                 int characterCount, Caption *captions, int maxCaptions);
+
+// Load audio files for mixing, decoding them right away with preload set
+int loadAudioFiles(const char *projectId, bool preload, AudioFile **audioFiles,
+                   int *audioCount);
+
+// Load captions from media/captions/<id>/ and, unless audio is
+// PROJECT_AUDIO_NONE, the voice lines from media/audio/<id>/ on a second
+// thread meanwhile. Returns 0 on success, -1 on error.
+int loadProject(Project *project, const char *projectId, ProjectAudio audio);
+void freeProject(Project *project);
+
+// Samples [*start, *end) of the audio timeline voiced by audio file i: it
+// starts on the sample its caption starts on and is cut off where the
+// caption ends. Returns false if the file has nothing to play.
+bool projectClipSpan(const Project *project, int i, int64_t *start,
+                     int64_t *end);
+
+// Decode the clips that play in samples [from, to) if they aren't yet and,
+// when streaming, free the ones that ended before from. Call before mixing
+// that stretch; the mix only hears clips that are decoded.
+void loadProjectAudio(Project *project, int64_t from, int64_t to);
+
+// Decoded PCM held now
+int64_t projectAudioBytes(const Project *project);
+
+// Most PCM the project will hold at once, preloaded or streamed in
+// timeline order
+int64_t estimateProjectAudioBytes(const Project *project, bool stream);
+
+// Mix the project audio for samples [firstSample, firstSample + samples) of
+// the timeline into left/right, which are overwritten. Where clips overlap
+// the earlier caption's is heard.
+void mixProjectAudio(const Project *project, int64_t firstSample, int samples,
+                     float *left, float *right);
+
+#endif
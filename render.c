@@ -0,0 +1,1897 @@
+#define _GNU_SOURCE
+#include "render.h"
+
+#include <GL/gl.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+#include <pthread.h>
+#include <rlgl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "audiostage.h"
+#include "audiotrack.h"
+#include "common.h"
+#include "manifest.h"
+#include "outstream.h"
+
+// Frames in flight between the GL thread and a job's encoder thread
+#define RENDER_QUEUE_DEPTH 3
+// Progress reports every 10 seconds of output
+#define RENDER_PROGRESS_INTERVAL 600
+#define AUDIO_SAMPLES_PER_FRAME (AUDIO_SAMPLE_RATE / FPS)
+#define AUDIO_BIT_RATE 128000
+// Region hints: quantizer offsets from -1 (finest) to 1 (coarsest) for the
+// caption and characters and for the background around them, and how far
+// past their edges the finer quantizers reach (about a macroblock)
+#define REGION_TEXT_QOFFSET av_make_q(-1, 10)
+#define REGION_BACKGROUND_QOFFSET av_make_q(1, 20)
+#define REGION_MARGIN 16
+// Output queue limit and encoder threads a memory budget can fall back to
+#define RENDER_SMALL_OUTPUT_QUEUE (8 * 1024 * 1024)
+#define RENDER_FEW_ENCODER_THREADS 2
+// Peak RSS is checked against the budget every second of output
+#define RENDER_MEMORY_INTERVAL FPS
+// Live pacing: a frame composited more than a frame interval after its
+// slot has missed its deadline and keeps the last background instead of
+// converting and uploading the next one; frames further behind than
+// LIVE_DROP_MS are skipped until the job has caught up
+#define LIVE_MISS_MS (1000.0 / FPS)
+#define LIVE_DROP_MS 250.0
+// For the libx264 estimate: each frame it holds costs about this many raw
+// frames (padded planes, half-pel copies of luma, lowres copies), and
+// presets without zerolatency look ahead this far (veryfast's rc-lookahead)
+#define X264_FRAME_COST 3
+#define X264_LOOKAHEAD 10
+
+static const EncoderProfile encoderProfiles[] = {
+    // Fastest encoding; what every render used before profiles existed.
+    // Its aq-mode=0 is switched to 1 while region hints are on (the
+    // default, see openVideoEncoder); uniformQuality keeps it as listed.
+    {"fast", "ultrafast", "zerolatency", "28",
+     "aq-mode=0:me=dia:subme=1:ref=1:analyse=none:trellis=0:no-fast-"
+     "pskip=0:8x8dct=0:sliced-threads=1",
+     8000000, 60},
+    // Slower, better looking encode for final uploads
+    {"quality", "veryfast", NULL, "23", NULL, 8000000, 60},
+};
+
+typedef struct {
+  uint8_t *rgba; // bottom row first when read back for the kernels
+  int frameIndex;
+  bool reused; // video comes from the previous render, only audio to encode
+  Rectangle regions[MAX_SCENE_REGIONS]; // caption and characters
+  int regionCount;
+} FrameSlot;
+
+// A further output encoded from the job's frames
+typedef struct {
+  char name[64]; // for log lines
+  OutputStream *output;
+  AVDictionary *muxer_opts;
+  AVFormatContext *fmt_ctx;
+  AVCodecContext *video_codec_ctx;
+  AVStream *video_st;
+  AVStream *audio_st; // shares the job's audio encoder
+  AVFrame *video_frame;
+  AVPacket *pkt;
+  struct SwsContext *sws_ctx; // from the job's encoder input
+  bool headerWritten;
+  int ret; // of the last encode
+} Rendition;
+
+struct RenderJob {
+  RenderContext *ctx;
+  char label[64];
+  bool verbose;
+  bool encodeThread;
+  bool referenceConvert;
+  const FrameTap *tap;
+  Project project;
+  SceneState scene;
+  SceneOverlay overlay;
+  int frameCount;
+  int frameIndex; // next frame to render
+
+  // Background
+  BackgroundVideo *bg;
+  uint8_t *bgBuffer;
+  Texture2D bgTexture;
+  int64_t uploadedSerial; // background frame currently in bgTexture
+  bool bgDrawn;           // the last frame showed it
+
+  // Output
+  OutputStream *output;
+  AVDictionary *muxer_opts; // layout options for the MP4 muxer
+  AVFormatContext *fmt_ctx;
+  AVCodecContext *video_codec_ctx;
+  AVCodecContext *audio_codec_ctx;
+  AVStream *video_st;
+  AVStream *audio_st;
+  AVFrame *video_frame;
+  AVPacket *pkt;
+  struct SwsContext *sws_ctx;
+  bool useKernels;
+  bool headerWritten;
+  bool regionHints; // finer quantizers on captions and characters
+  double hintedShare; // sum over encoded frames of the picture hinted
+  AVCodecContext *uniformSample; // the sample's encoder without hints
+  int sampleFrames;
+  bool sampleFailed;
+  // GOPs of the output; their starts are forced IDR frames unless the
+  // encoder places keyframes itself (fixed policy, not incremental)
+  GopLayout layout;
+  int maxGop; // the layout's, known before it is planned
+  bool forceKeyframes;
+
+  // The main encoder, opened on a helper thread while the project loads
+  // unless a memory budget may still change its threads
+  pthread_t opener;
+  bool opening;
+  const EncoderProfile *openerProfile;
+  bool openerGlobalHeader;
+  AVCodecContext *openedEncoder;
+
+  // Renditions, encoded in parallel with the main output
+  Rendition renditions[RENDER_MAX_RENDITIONS];
+  int renditionCount;
+  ThreadPool *encodePool;
+  int videoRet; // main output's part of the last parallel encode
+
+  // Incremental render: GOPs whose inputs are unchanged are copied from the
+  // previous file instead of being rendered
+  bool incremental;
+  RenderManifest manifest;
+  int *sourceGop; // previous render's GOP to copy, -1 to render
+  GopSource *previous;
+  int nextCopyGop;           // GOPs before this are written
+  int64_t videoFramesSent;   // to the encoder
+  int64_t videoPacketsOut;   // from the encoder, one per frame
+  char outputPath[512];      // final name; we write to tmpPath
+  char tmpPath[520];
+
+  // Checkpoints: the partial output in tmpPath is made durable every
+  // checkpointGops GOPs. checkpoint.file is the partial a resumed render
+  // continues from, or a stale one to clean up.
+  int checkpointGops;
+  int checkpointedGops; // GOPs covered by the last checkpoint
+  bool resuming;
+  RenderCheckpoint checkpoint;
+  char checkpointPath[600];
+
+  // Audio from pre-encoded clips instead of mixing and encoding; NULL when
+  // the mix goes through audio_codec_ctx
+  AudioTrack *audioTrack;
+  // Produces the audio packets ahead of the frame loop; NULL without audio
+  AudioStage *audioStage;
+
+  // Memory: settings a budget may lower and the job's account, estimated
+  // up front; audio and muxer queue are replaced by what they really
+  // reached when the job finishes
+  int64_t memoryBudget;
+  int encoderThreads;
+  int64_t outputQueueLimit;
+  MemoryAccount memory;
+
+  // End of the audio muxed so far, in samples
+  int64_t audio_sample_count;
+
+  // Hand-off to the encoder thread. produced is only written by the GL
+  // thread, consumed only by the encoder.
+  FrameSlot slots[RENDER_QUEUE_DEPTH];
+  int produced;
+  int consumed;
+  bool finished; // no more frames coming
+  bool failed;
+  pthread_t encoder;
+  bool encoderRunning;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  // Live: frame i is due at liveStart + i / FPS on the wall clock.
+  // Latencies are only touched by the encoder thread.
+  bool live;
+  double liveStart;
+  double latencySum;
+  int latencyCount;
+
+  RenderStats stats;
+  int gopsRendered;
+  double startTime;
+  double progressTime;
+};
+
+static double nowMs(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static double liveDue(const RenderJob *job, int64_t frameIndex) {
+  return job->liveStart + frameIndex * 1000.0 / FPS;
+}
+
+const EncoderProfile *findEncoderProfile(const char *name) {
+  if (!name)
+    return &encoderProfiles[0];
+  for (size_t i = 0; i < sizeof(encoderProfiles) / sizeof(encoderProfiles[0]);
+       i++) {
+    if (strcmp(encoderProfiles[i].name, name) == 0)
+      return &encoderProfiles[i];
+  }
+  return NULL;
+}
+
+static const EncoderProfile *jobProfile(const RenderOptions *opts) {
+  return opts->encoderProfile ? opts->encoderProfile
+                              : findEncoderProfile(opts->profile);
+}
+
+int parseRenditionOptions(char *spec, RenditionOptions *rendition) {
+  memset(rendition, 0, sizeof(RenditionOptions));
+  char *save = NULL;
+  for (char *part = strtok_r(spec, ",", &save); part;
+       part = strtok_r(NULL, ",", &save)) {
+    char *end = part + strlen(part);
+    if (strncmp(part, "size=", 5) == 0) {
+      rendition->width = (int)strtol(part + 5, &end, 10);
+      if (*end != 'x')
+        return -1;
+      rendition->height = (int)strtol(end + 1, &end, 10);
+    } else if (strncmp(part, "bitrate=", 8) == 0) {
+      rendition->maxBitRate = strtoll(part + 8, &end, 10) * 1000;
+    } else if (strncmp(part, "profile=", 8) == 0) {
+      rendition->profile = part + 8;
+    } else if (strncmp(part, "output=", 7) == 0) {
+      rendition->output = part + 7;
+    } else {
+      return -1;
+    }
+    if (*end != '\0')
+      return -1;
+  }
+  // 4:2:0 needs even dimensions
+  if (!rendition->output || rendition->output[0] == '\0' ||
+      rendition->width <= 0 || rendition->height <= 0 ||
+      rendition->width % 2 != 0 || rendition->height % 2 != 0 ||
+      rendition->maxBitRate < 0)
+    return -1;
+  return 0;
+}
+
+int initRenderContext(RenderContext *ctx, bool referenceConvert) {
+  memset(ctx, 0, sizeof(RenderContext));
+  ctx->windowed = IsWindowReady();
+  loadSceneAssets(&ctx->assets);
+
+  ctx->target = LoadRenderTexture(WIDTH, HEIGHT);
+  if (ctx->target.id == 0) {
+    printf("Error: Could not create offscreen render target\n");
+    unloadSceneAssets(&ctx->assets);
+    return -1;
+  }
+
+  // Colour conversion kernels, shared by the background decode and the
+  // encoder input of every job
+  ctx->referenceConvert = referenceConvert;
+  if (!referenceConvert) {
+    ctx->pool = createThreadPool(0);
+    initColorConverter(&ctx->converter, ctx->pool);
+    printf("Colour conversion: %s kernels on %d threads\n",
+           colorConverterKernelName(&ctx->converter),
+           threadPoolSize(ctx->pool));
+  } else {
+    printf("Colour conversion: sws_scale (reference)\n");
+  }
+  return 0;
+}
+
+void freeRenderContext(RenderContext *ctx) {
+  if (ctx->target.id != 0)
+    UnloadRenderTexture(ctx->target);
+  destroyThreadPool(ctx->pool);
+  unloadSceneAssets(&ctx->assets);
+  memset(ctx, 0, sizeof(RenderContext));
+}
+
+static int writeReusedPacket(void *arg, AVPacket *pkt) {
+  RenderJob *job = arg;
+  av_packet_rescale_ts(pkt, job->video_codec_ctx->time_base,
+                       job->video_st->time_base);
+  pkt->stream_index = job->video_st->index;
+  job->stats.videoBytes += pkt->size;
+  return av_interleaved_write_frame(job->fmt_ctx, pkt);
+}
+
+// Flush everything before GOP gop to disk and record it. Not being able to
+// save the checkpoint only costs the ability to resume from it.
+static int writeCheckpoint(RenderJob *job, int gop) {
+  if (av_interleaved_write_frame(job->fmt_ctx, NULL) < 0 ||
+      av_write_frame(job->fmt_ctx, NULL) < 0 ||
+      syncOutputStream(job->output) < 0)
+    return -1;
+  RenderCheckpoint checkpoint = {.manifest = job->manifest,
+                                 .completeGops = gop,
+                                 .frameIndex = gopStart(&job->layout, gop),
+                                 .audioSamples = job->audio_sample_count};
+  snprintf(checkpoint.file, sizeof(checkpoint.file), "%s", job->tmpPath);
+  if (saveRenderCheckpoint(&checkpoint, job->checkpointPath) == 0) {
+    job->checkpointedGops = gop;
+    job->stats.checkpoints++;
+  }
+  return 0;
+}
+
+// GOPs before gop are completely muxed; checkpoint if enough have been
+// since the last one
+static int maybeCheckpoint(RenderJob *job, int gop) {
+  if (job->checkpointGops <= 0 ||
+      gop - job->checkpointedGops < job->checkpointGops)
+    return 0;
+  return writeCheckpoint(job, gop);
+}
+
+// Copy the unchanged GOPs before gop from the previous render
+static int copyReusedGops(RenderJob *job, int gop) {
+  for (; job->nextCopyGop < gop; job->nextCopyGop++) {
+    int source = job->sourceGop[job->nextCopyGop];
+    if (source < 0)
+      continue;
+    if (copyGopPackets(job->previous, source, writeReusedPacket, job) < 0) {
+      printf("%sError: Could not copy GOP %d from the previous render\n",
+             job->label, job->nextCopyGop);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void beginRenderRound(const RenderContext *ctx) {
+  if (ctx->windowed)
+    BeginDrawing();
+}
+
+void endRenderRound(const RenderContext *ctx) {
+  if (ctx->windowed)
+    EndDrawing();
+}
+
+bool renderShouldStop(const RenderContext *ctx) {
+  return ctx->windowed && WindowShouldClose();
+}
+
+// Write an audio packet (timestamps in samples) to the output and every
+// rendition. Unreferences pkt.
+static int writeAudioPacket(RenderJob *job, AVPacket *pkt) {
+  AVRational time_base = job->audio_codec_ctx->time_base;
+  // The one audio encode goes into every rendition too
+  for (int i = 0; i < job->renditionCount; i++) {
+    Rendition *r = &job->renditions[i];
+    if (av_packet_ref(r->pkt, pkt) < 0) {
+      av_packet_unref(pkt);
+      return -1;
+    }
+    av_packet_rescale_ts(r->pkt, time_base, r->audio_st->time_base);
+    r->pkt->stream_index = r->audio_st->index;
+    int ret = av_interleaved_write_frame(r->fmt_ctx, r->pkt);
+    av_packet_unref(r->pkt);
+    if (ret < 0) {
+      av_packet_unref(pkt);
+      return ret;
+    }
+  }
+  av_packet_rescale_ts(pkt, time_base, job->audio_st->time_base);
+  pkt->stream_index = job->audio_st->index;
+  int ret = av_interleaved_write_frame(job->fmt_ctx, pkt);
+  av_packet_unref(pkt);
+  return ret;
+}
+
+// Encode a frame of the sample once more without region hints; at the end
+// of the sample (or with a NULL frame) flush and close that encoder
+static void sampleUniformQuality(RenderJob *job, const AVFrame *frame) {
+  AVCodecContext *ctx = job->uniformSample;
+  bool last = !frame || frame->pts >= REGION_SAMPLE_FRAMES - 1;
+  int ret = 0;
+  if (frame) {
+    AVFrame *plain = av_frame_clone(frame);
+    ret = plain ? 0 : -1;
+    if (plain) {
+      av_frame_remove_side_data(plain, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+      ret = avcodec_send_frame(ctx, plain);
+      av_frame_free(&plain);
+    }
+    job->sampleFrames++;
+  }
+  if (ret >= 0 && last)
+    ret = avcodec_send_frame(ctx, NULL);
+  while (ret >= 0 && avcodec_receive_packet(ctx, job->pkt) >= 0) {
+    job->stats.uniformSampleBytes += job->pkt->size;
+    av_packet_unref(job->pkt);
+  }
+  if (ret < 0)
+    job->sampleFailed = true;
+  if (ret < 0 || last)
+    avcodec_free_context(&job->uniformSample);
+}
+
+// Send a video frame (NULL to flush) and write out whatever packets come
+// back
+static int writePackets(RenderJob *job, AVCodecContext *codec_ctx,
+                        AVStream *stream, AVFrame *frame) {
+  if (job->uniformSample && (!frame || frame->pts < REGION_SAMPLE_FRAMES))
+    sampleUniformQuality(job, frame);
+  int ret = avcodec_send_frame(codec_ctx, frame);
+  if (ret < 0)
+    return ret;
+  if (frame)
+    job->videoFramesSent++;
+  while (avcodec_receive_packet(codec_ctx, job->pkt) >= 0) {
+    job->videoPacketsOut++;
+    if (job->live) {
+      // As far as we can see it: the ingest and the player add their own
+      double latency = nowMs() - liveDue(job, job->pkt->pts);
+      job->latencySum += latency;
+      job->latencyCount++;
+      if (latency > job->stats.maxLatencyMs)
+        job->stats.maxLatencyMs = latency;
+    }
+    // Reused GOPs in front of this one have to go out first. GOPs are
+    // closed, so once the first packet of one arrives everything before it
+    // is out.
+    int gop = gopAt(&job->layout, (int)job->pkt->pts);
+    if ((job->previous && copyReusedGops(job, gop) < 0) ||
+        (job->pkt->pts == gopStart(&job->layout, gop) &&
+         maybeCheckpoint(job, gop) < 0)) {
+      av_packet_unref(job->pkt);
+      return -1;
+    }
+    if (job->sampleFrames > 0 && job->pkt->pts < REGION_SAMPLE_FRAMES)
+      job->stats.regionSampleBytes += job->pkt->size;
+    av_packet_rescale_ts(job->pkt, codec_ctx->time_base, stream->time_base);
+    job->pkt->stream_index = stream->index;
+    job->stats.videoBytes += job->pkt->size;
+    ret = av_interleaved_write_frame(job->fmt_ctx, job->pkt);
+    av_packet_unref(job->pkt);
+    if (ret < 0)
+      return ret;
+    if (job->stats.firstFrameMs == 0.0)
+      job->stats.firstFrameMs = nowMs() - job->startTime;
+  }
+  return 0;
+}
+
+// Send a video frame (NULL to flush) to a rendition's encoder and write out
+// its packets
+static int writeRenditionPackets(Rendition *r, AVFrame *frame) {
+  int ret = avcodec_send_frame(r->video_codec_ctx, frame);
+  if (ret < 0)
+    return ret;
+  while (avcodec_receive_packet(r->video_codec_ctx, r->pkt) >= 0) {
+    av_packet_rescale_ts(r->pkt, r->video_codec_ctx->time_base,
+                         r->video_st->time_base);
+    r->pkt->stream_index = r->video_st->index;
+    ret = av_interleaved_write_frame(r->fmt_ctx, r->pkt);
+    av_packet_unref(r->pkt);
+    if (ret < 0)
+      return ret;
+  }
+  return 0;
+}
+
+// Task 0 encodes the job's frame for the main output, task i scales it for
+// rendition i - 1 and encodes that. Each writes to its own output.
+static void encodeVideoTask(void *arg, int task, int taskCount) {
+  (void)taskCount;
+  RenderJob *job = arg;
+  if (task == 0) {
+    job->videoRet = writePackets(job, job->video_codec_ctx, job->video_st,
+                                 job->video_frame);
+    return;
+  }
+  Rendition *r = &job->renditions[task - 1];
+  AVFrame *src = job->video_frame;
+  r->ret = av_frame_make_writable(r->video_frame);
+  if (r->ret < 0)
+    return;
+  sws_scale(r->sws_ctx, (const uint8_t *const *)src->data, src->linesize, 0,
+            HEIGHT, r->video_frame->data, r->video_frame->linesize);
+  r->video_frame->pts = src->pts;
+  r->video_frame->pict_type = src->pict_type; // keyframes line up
+  r->ret = writeRenditionPackets(r, r->video_frame);
+}
+
+// Write the audio packets that end by sample until (-1 for all of them)
+static int writeAudioStage(RenderJob *job, int64_t until) {
+  int ret;
+  while ((ret = readAudioStage(job->audioStage, until, job->pkt)) > 0) {
+    int64_t end = job->pkt->pts + job->pkt->duration;
+    if (writeAudioPacket(job, job->pkt) < 0)
+      return -1;
+    if (end > job->audio_sample_count)
+      job->audio_sample_count = end;
+  }
+  return ret;
+}
+
+// Mux the audio that has played by the end of one video frame. The stage
+// mixes and encodes it on its own thread ahead of time, so the frame loop
+// never waits for the AAC encoder.
+static int encodeFrameAudio(RenderJob *job, int frameIndex) {
+  if (!job->audioStage)
+    return 0;
+  return writeAudioStage(job,
+                         (int64_t)(frameIndex + 1) * AUDIO_SAMPLES_PER_FRAME);
+}
+
+// Tell the encoder where the caption and characters are: they get finer
+// quantizers and the background around them coarser ones. Encoders
+// without region support ignore the side data.
+static int attachRegionHints(RenderJob *job, AVFrame *frame,
+                             const FrameSlot *slot) {
+  av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+  if (!job->regionHints)
+    return 0;
+  // Earlier regions win where they overlap, so the background goes last
+  int count = slot->regionCount + 1;
+  AVFrameSideData *side = av_frame_new_side_data(
+      frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+      count * sizeof(AVRegionOfInterest));
+  if (!side)
+    return -1;
+  AVRegionOfInterest *roi = (AVRegionOfInterest *)side->data;
+  double hinted = 0.0;
+  for (int i = 0; i < slot->regionCount; i++) {
+    const Rectangle *r = &slot->regions[i];
+    int left = (int)r->x - REGION_MARGIN;
+    int top = (int)r->y - REGION_MARGIN;
+    int right = (int)(r->x + r->width) + REGION_MARGIN;
+    int bottom = (int)(r->y + r->height) + REGION_MARGIN;
+    roi[i] = (AVRegionOfInterest){
+        .self_size = sizeof(AVRegionOfInterest),
+        .left = left < 0 ? 0 : left,
+        .top = top < 0 ? 0 : top,
+        .right = right > WIDTH ? WIDTH : right,
+        .bottom = bottom > HEIGHT ? HEIGHT : bottom,
+        .qoffset = REGION_TEXT_QOFFSET};
+    if (roi[i].right > roi[i].left && roi[i].bottom > roi[i].top)
+      hinted += (double)(roi[i].right - roi[i].left) *
+                (roi[i].bottom - roi[i].top);
+  }
+  roi[count - 1] = (AVRegionOfInterest){.self_size = sizeof(AVRegionOfInterest),
+                                        .right = WIDTH,
+                                        .bottom = HEIGHT,
+                                        .qoffset = REGION_BACKGROUND_QOFFSET};
+  // Overlaps count twice; close enough for a stat
+  hinted /= (double)WIDTH * HEIGHT;
+  job->hintedShare += hinted < 1.0 ? hinted : 1.0;
+  return 0;
+}
+
+// Convert, encode and mux one rendered frame plus its audio
+static int encodeFrame(RenderJob *job, const FrameSlot *slot) {
+  int frameIndex = slot->frameIndex;
+  if (slot->reused) {
+    // Once the encoder has caught up, the previous render's GOP can go
+    // straight out
+    if (job->videoPacketsOut == job->videoFramesSent &&
+        (copyReusedGops(job, gopAt(&job->layout, frameIndex) + 1) < 0 ||
+         maybeCheckpoint(job, job->nextCopyGop) < 0))
+      return -1;
+    return encodeFrameAudio(job, frameIndex);
+  }
+
+  const uint8_t *rgba = slot->rgba;
+  AVFrame *video_frame = job->video_frame;
+  if (av_frame_make_writable(video_frame) < 0)
+    return -1;
+
+  if (job->useKernels) {
+    convertRGBAToYUV(&job->ctx->converter, rgba, WIDTH * 4, true,
+                     video_frame);
+  } else {
+    // Convert RGBA to YUV using pre-allocated buffer
+    const uint8_t *in_data[1] = {rgba};
+    int in_linesize[1] = {4 * WIDTH};
+    sws_scale(job->sws_ctx, in_data, in_linesize, 0, HEIGHT, video_frame->data,
+              video_frame->linesize);
+  }
+
+  video_frame->pts = frameIndex;
+  // Every GOP starts with an IDR frame, so any of them can be spliced
+  // between copied ones or cut at without re-encoding
+  video_frame->pict_type =
+      job->forceKeyframes &&
+              frameIndex == gopStart(&job->layout,
+                                     gopAt(&job->layout, frameIndex))
+          ? AV_PICTURE_TYPE_I
+          : AV_PICTURE_TYPE_NONE;
+  if (attachRegionHints(job, video_frame, slot) < 0)
+    return -1;
+  if (job->tap && job->tap->video)
+    job->tap->video(job->tap->arg, video_frame);
+  if (job->renditionCount == 0) {
+    if (writePackets(job, job->video_codec_ctx, job->video_st, video_frame) <
+        0)
+      return -1;
+  } else {
+    // The composite is paid for once; only the encodes scale with the
+    // number of outputs
+    runThreadPool(job->encodePool, job->renditionCount + 1, encodeVideoTask,
+                  job);
+    if (job->videoRet < 0)
+      return -1;
+    for (int i = 0; i < job->renditionCount; i++) {
+      if (job->renditions[i].ret < 0) {
+        printf("%sError: Could not encode rendition %s\n", job->label,
+               job->renditions[i].name);
+        return -1;
+      }
+    }
+  }
+  return encodeFrameAudio(job, frameIndex);
+}
+
+static void *renderEncoderThread(void *arg) {
+  RenderJob *job = arg;
+
+  pthread_mutex_lock(&job->lock);
+  for (;;) {
+    while (job->consumed == job->produced && !job->finished)
+      pthread_cond_wait(&job->cond, &job->lock);
+    if (job->consumed == job->produced)
+      break;
+    FrameSlot *slot = &job->slots[job->consumed % RENDER_QUEUE_DEPTH];
+    bool skip = job->failed;
+    pthread_mutex_unlock(&job->lock);
+
+    double start = nowMs();
+    int ret = skip ? 0 : encodeFrame(job, slot);
+    double elapsed = nowMs() - start;
+
+    pthread_mutex_lock(&job->lock);
+    if (ret < 0)
+      job->failed = true;
+    job->stats.encodeMs += elapsed;
+    job->consumed++;
+    pthread_cond_broadcast(&job->cond);
+  }
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
+
+// Open a width x height encoder with profile. maxBitRate > 0 caps the
+// rate; with regionHints the encoder is set up to apply them, and
+// globalHeader is for muxers that want the parameter sets up front.
+// Returns NULL on failure.
+static AVCodecContext *openVideoEncoder(RenderJob *job,
+                                        const EncoderProfile *profile,
+                                        int width, int height,
+                                        int64_t maxBitRate, int threads,
+                                        bool regionHints, bool globalHeader) {
+  // Setup video codec with optimizations
+  const AVCodec *video_codec = avcodec_find_encoder_by_name("h264_amf");
+  if (!video_codec) {
+    if (job->verbose)
+      fprintf(stderr, "h264_amf encoder not found, falling back to libx264\n");
+    video_codec = avcodec_find_encoder_by_name("libx264");
+    if (!video_codec) {
+      fprintf(stderr, "libx264 encoder not found\n");
+      return NULL;
+    }
+  }
+
+  AVCodecContext *video_codec_ctx = avcodec_alloc_context3(video_codec);
+  if (!video_codec_ctx)
+    return NULL;
+
+  // Common settings
+  video_codec_ctx->bit_rate = profile->bitRate;
+  video_codec_ctx->width = width;
+  video_codec_ctx->height = height;
+  video_codec_ctx->time_base = (AVRational){1, FPS};
+  video_codec_ctx->framerate = (AVRational){FPS, 1};
+  video_codec_ctx->gop_size = job->maxGop;
+  video_codec_ctx->max_b_frames = 0;
+  video_codec_ctx->pix_fmt = (strstr(video_codec->name, "amf")) ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+  if (maxBitRate > 0) {
+    // CRF as usual, but never above maxBitRate over a two second window
+    video_codec_ctx->bit_rate = maxBitRate;
+    video_codec_ctx->rc_max_rate = maxBitRate;
+    video_codec_ctx->rc_buffer_size = (int)(maxBitRate * 2);
+  }
+
+  AVDictionary *encoder_opts = NULL;
+  // AMF specific options
+  if (strstr(video_codec->name, "amf")) {
+    av_dict_set(&encoder_opts, "usage", "lowlatency", 0);
+    av_dict_set(&encoder_opts, "profile", "main", 0);
+    av_dict_set(&encoder_opts, "quality", "speed", 0);
+    if (maxBitRate > 0) {
+      av_dict_set(&encoder_opts, "rc", "vbr_peak", 0);
+    } else {
+      av_dict_set(&encoder_opts, "rc", "cqp", 0);
+      av_dict_set(&encoder_opts, "qp_i", "23", 0);
+      av_dict_set(&encoder_opts, "qp_p", "23", 0);
+    }
+  } else {
+    av_dict_set(&encoder_opts, "preset", profile->preset, 0);
+    // Live frames can't wait in the lookahead or behind frame threads
+    char tune[64] = "";
+    if (profile->tune)
+      snprintf(tune, sizeof(tune), "%s", profile->tune);
+    size_t tuneLength = strlen(tune);
+    if (job->live && !strstr(tune, "zerolatency"))
+      snprintf(tune + tuneLength, sizeof(tune) - tuneLength, "%szerolatency",
+               tuneLength > 0 ? "," : "");
+    if (tune[0] != '\0')
+      av_dict_set(&encoder_opts, "tune", tune, 0);
+    av_dict_set(&encoder_opts, "crf", profile->crf, 0);
+    // 0 uses all CPU threads; concurrent jobs share the machine instead
+    av_dict_set_int(&encoder_opts, "threads", threads, 0);
+    av_dict_set(&encoder_opts, "thread_type", "slice+frame",
+                0); // Enable both slice and frame threading
+    // libx264 ignores region hints without adaptive quantization, which
+    // ultrafast (and so the fast profile) turns off; later keys win
+    char params[256];
+    snprintf(params, sizeof(params), "%s%s%s",
+             profile->x264Params ? profile->x264Params : "",
+             profile->x264Params && regionHints ? ":" : "",
+             regionHints ? "aq-mode=1" : "");
+    if (params[0] != '\0')
+      av_dict_set(&encoder_opts, "x264-params", params, 0);
+  }
+  if (job->forceKeyframes)
+    av_dict_set(&encoder_opts, "forced-idr", "1", 0);
+  if (job->incremental) {
+    // Keyframes exactly at GOP starts and nowhere else, and no references
+    // across them
+    video_codec_ctx->keyint_min = job->maxGop;
+    video_codec_ctx->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+    av_dict_set(&encoder_opts, "sc_threshold", "0", 0);
+  }
+
+  if (globalHeader)
+    video_codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  if (avcodec_open2(video_codec_ctx, video_codec, &encoder_opts) < 0) {
+    fprintf(stderr, "Could not open video codec\n");
+    av_dict_free(&encoder_opts);
+    avcodec_free_context(&video_codec_ctx);
+    return NULL;
+  }
+  av_dict_free(&encoder_opts);
+  return video_codec_ctx;
+}
+
+// FLV only carries the parameter sets in its sequence header
+static bool wantsGlobalHeader(const AVFormatContext *fmt_ctx) {
+  return strcmp(fmt_ctx->oformat->name, "flv") == 0;
+}
+
+// Add the stream codec_ctx encodes to fmt_ctx. Returns -1 on failure.
+static int addVideoStream(RenderJob *job, AVFormatContext *fmt_ctx,
+                          AVCodecContext *codec_ctx,
+                          const EncoderProfile *profile, AVStream **stream) {
+  AVStream *video_st = avformat_new_stream(fmt_ctx, codec_ctx->codec);
+  if (!video_st)
+    return -1;
+  video_st->time_base = (AVRational){1, FPS};
+  avcodec_parameters_from_context(video_st->codecpar, codec_ctx);
+  if (job->verbose)
+    printf("%sSuccessfully initialized %s encoder (profile %s, %dx%d)\n",
+           job->label, codec_ctx->codec->name, profile->name,
+           codec_ctx->width, codec_ctx->height);
+  *stream = video_st;
+  return 0;
+}
+
+// libx264 takes a while to open and needs nothing of the project, so the
+// main encoder is opened here while startRenderJob loads it
+static void *openEncoderThread(void *arg) {
+  RenderJob *job = arg;
+  job->openedEncoder =
+      openVideoEncoder(job, job->openerProfile, WIDTH, HEIGHT, 0,
+                       job->encoderThreads, job->regionHints,
+                       job->openerGlobalHeader);
+  return NULL;
+}
+
+// The encoder openEncoderThread opened, or NULL if there is none
+static AVCodecContext *joinEncoderOpener(RenderJob *job) {
+  if (job->opening) {
+    pthread_join(job->opener, NULL);
+    job->opening = false;
+  }
+  AVCodecContext *codec_ctx = job->openedEncoder;
+  job->openedEncoder = NULL;
+  return codec_ctx;
+}
+
+static int openJobOutput(RenderJob *job, const RenderOptions *opts) {
+  const EncoderProfile *profile = jobProfile(opts);
+  // Without forced keyframes the layout only numbers the GOPs
+  if (planGopLayout(&job->layout, &job->project, &job->ctx->assets,
+                    (int)(FPS * job->project.duration), job->maxGop,
+                    opts->keyframes) < 0) {
+    printf("%sError: Could not plan the GOP layout\n", job->label);
+    return -1;
+  }
+  if (job->verbose && job->forceKeyframes)
+    printf("%s%d GOPs of at most %d frames, %d starting on a caption or "
+           "speaker change\n",
+           job->label, job->layout.count, job->maxGop,
+           job->layout.boundaries);
+
+  // Setup output format with both video and audio. A checkpointed partial
+  // has to be readable without its trailer.
+  job->output = openOutputStream(
+      job->incremental ? job->tmpPath : opts->output,
+      job->checkpointGops > 0 ? OUTPUT_LAYOUT_FRAGMENTED : opts->outputLayout,
+      &job->fmt_ctx, &job->muxer_opts);
+  if (!job->output)
+    return -1;
+  setOutputQueueLimit(job->output, job->outputQueueLimit);
+
+  // One opened ahead is used unless the muxer turned out to want other
+  // headers than it was opened for
+  bool globalHeader = wantsGlobalHeader(job->fmt_ctx);
+  AVCodecContext *opened = joinEncoderOpener(job);
+  if (opened &&
+      ((opened->flags & AV_CODEC_FLAG_GLOBAL_HEADER) != 0) != globalHeader)
+    avcodec_free_context(&opened);
+  job->video_codec_ctx =
+      opened ? opened
+             : openVideoEncoder(job, profile, WIDTH, HEIGHT, 0,
+                                job->encoderThreads, job->regionHints,
+                                globalHeader);
+  if (!job->video_codec_ctx ||
+      addVideoStream(job, job->fmt_ctx, job->video_codec_ctx, profile,
+                     &job->video_st) < 0)
+    return -1;
+  AVCodecContext *video_codec_ctx = job->video_codec_ctx;
+  // Only libx264 reads the hints; others would drop them unseen
+  if (job->regionHints &&
+      strcmp(video_codec_ctx->codec->name, "libx264") != 0) {
+    if (job->verbose)
+      printf("%s%s ignores region hints, encoding at uniform quality\n",
+             job->label, video_codec_ctx->codec->name);
+    job->regionHints = false;
+  }
+  // What the hints change, measured on the first frames encoded a second
+  // time exactly as uniformQuality would encode them. Only when asked for,
+  // as it doubles the encode of those frames; live encodes can't spare it.
+  if (job->regionHints && opts->regionSample && !job->live)
+    job->uniformSample =
+        openVideoEncoder(job, profile, WIDTH, HEIGHT, 0, job->encoderThreads,
+                         false, false);
+
+  // Setup audio codec if we have audio files
+  if (job->project.audioFileCount > 0) {
+    const AVCodec *audio_codec = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if (audio_codec) {
+      job->audio_st = avformat_new_stream(job->fmt_ctx, audio_codec);
+      AVCodecContext *audio_codec_ctx = avcodec_alloc_context3(audio_codec);
+      audio_codec_ctx->bit_rate = AUDIO_BIT_RATE; // Standard for stability
+      audio_codec_ctx->sample_rate = AUDIO_SAMPLE_RATE;
+      audio_codec_ctx->ch_layout = (AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO;
+      audio_codec_ctx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+      audio_codec_ctx->time_base = (AVRational){1, AUDIO_SAMPLE_RATE};
+
+      if (avcodec_open2(audio_codec_ctx, audio_codec, NULL) >= 0) {
+        avcodec_parameters_from_context(job->audio_st->codecpar,
+                                        audio_codec_ctx);
+        job->audio_codec_ctx = audio_codec_ctx;
+        if (job->verbose)
+          printf("%sAudio encoding enabled\n", job->label);
+      } else {
+        printf("%sWarning: Could not open audio codec\n", job->label);
+        avcodec_free_context(&audio_codec_ctx);
+      }
+    }
+  }
+
+  if (avformat_write_header(job->fmt_ctx, &job->muxer_opts) < 0) {
+    fprintf(stderr, "Error occurred when opening output file\n");
+    return -1;
+  }
+  job->headerWritten = true;
+  // Readers of a pipe can start on the init segment right away
+  avio_flush(job->fmt_ctx->pb);
+
+  job->video_frame = av_frame_alloc();
+  job->pkt = av_packet_alloc();
+  if (!job->video_frame || !job->pkt)
+    return -1;
+  job->video_frame->format = video_codec_ctx->pix_fmt;
+  job->video_frame->width = video_codec_ctx->width;
+  job->video_frame->height = video_codec_ctx->height;
+  if (av_frame_get_buffer(job->video_frame, 0) < 0)
+    return -1;
+
+  // Reference path, and fallback if the kernels don't cover the encoder format
+  job->sws_ctx = sws_getContext(WIDTH, HEIGHT, AV_PIX_FMT_RGBA, WIDTH, HEIGHT,
+                                video_codec_ctx->pix_fmt, SWS_FAST_BILINEAR,
+                                NULL, NULL, NULL);
+  job->useKernels = !job->referenceConvert &&
+                    colorConverterSupports(video_codec_ctx->pix_fmt, WIDTH,
+                                           HEIGHT);
+  if (!job->useKernels && !job->sws_ctx) {
+    printf("%sError: Could not initialize color conversion context\n",
+           job->label);
+    return -1;
+  }
+  return 0;
+}
+
+// Rendition i: its own output and scaled video encode, plus a stream for the
+// job's audio. Needs the job's encoders open.
+static int openRendition(RenderJob *job, const RenderOptions *opts, int i) {
+  const RenditionOptions *ro = &opts->renditions[i];
+  Rendition *r = &job->renditions[i];
+  job->renditionCount = i + 1;
+  snprintf(r->name, sizeof(r->name), "%dx%d", ro->width, ro->height);
+  const EncoderProfile *profile =
+      ro->profile ? findEncoderProfile(ro->profile) : jobProfile(opts);
+  if (!profile) {
+    printf("%sError: Unknown encoder profile: %s\n", job->label, ro->profile);
+    return -1;
+  }
+
+  r->output = openOutputStream(ro->output, opts->outputLayout, &r->fmt_ctx,
+                               &r->muxer_opts);
+  if (!r->output)
+    return -1;
+  setOutputQueueLimit(r->output, job->outputQueueLimit);
+  r->video_codec_ctx =
+      openVideoEncoder(job, profile, ro->width, ro->height, ro->maxBitRate,
+                       job->encoderThreads, false,
+                       wantsGlobalHeader(r->fmt_ctx));
+  if (!r->video_codec_ctx ||
+      addVideoStream(job, r->fmt_ctx, r->video_codec_ctx, profile,
+                     &r->video_st) < 0)
+    return -1;
+  if (job->audio_codec_ctx) {
+    r->audio_st = avformat_new_stream(r->fmt_ctx, NULL);
+    if (!r->audio_st)
+      return -1;
+    r->audio_st->time_base = job->audio_codec_ctx->time_base;
+    avcodec_parameters_from_context(r->audio_st->codecpar,
+                                    job->audio_codec_ctx);
+  }
+
+  if (avformat_write_header(r->fmt_ctx, &r->muxer_opts) < 0) {
+    printf("%sError: Could not write the header of %s\n", job->label,
+           ro->output);
+    return -1;
+  }
+  r->headerWritten = true;
+  avio_flush(r->fmt_ctx->pb);
+
+  r->video_frame = av_frame_alloc();
+  r->pkt = av_packet_alloc();
+  if (!r->video_frame || !r->pkt)
+    return -1;
+  r->video_frame->format = r->video_codec_ctx->pix_fmt;
+  r->video_frame->width = ro->width;
+  r->video_frame->height = ro->height;
+  if (av_frame_get_buffer(r->video_frame, 0) < 0)
+    return -1;
+  // Scaled from the converted frame, so RGBA -> YUV still happens once
+  r->sws_ctx = sws_getContext(WIDTH, HEIGHT, job->video_codec_ctx->pix_fmt,
+                              ro->width, ro->height,
+                              r->video_codec_ctx->pix_fmt, SWS_BILINEAR, NULL,
+                              NULL, NULL);
+  if (!r->sws_ctx) {
+    printf("%sError: Could not initialize scaling for %s\n", job->label,
+           r->name);
+    return -1;
+  }
+  if (job->verbose)
+    printf("%sRendition %s (profile %s) -> %s\n", job->label, r->name,
+           profile->name, ro->output);
+  return 0;
+}
+
+static void freeRendition(Rendition *r) {
+  av_dict_free(&r->muxer_opts);
+  if (r->output)
+    closeOutputStream(r->output, r->fmt_ctx, false);
+  if (r->fmt_ctx)
+    avformat_free_context(r->fmt_ctx);
+  if (r->video_codec_ctx)
+    avcodec_free_context(&r->video_codec_ctx);
+  if (r->video_frame)
+    av_frame_free(&r->video_frame);
+  if (r->pkt)
+    av_packet_free(&r->pkt);
+  if (r->sws_ctx)
+    sws_freeContext(r->sws_ctx);
+}
+
+// Finish a rendition's file once its encoder is flushed
+static int finishRendition(RenderJob *job, Rendition *r) {
+  int ret = 0;
+  if (r->headerWritten) {
+    if (prepareOutputTrailer(r->output) < 0 ||
+        av_write_trailer(r->fmt_ctx) < 0)
+      ret = -1;
+  }
+  if (r->output) {
+    if (closeOutputStream(r->output, r->fmt_ctx, job->verbose) < 0)
+      ret = -1;
+    r->output = NULL;
+  }
+  if (ret < 0)
+    printf("%sError: Could not finish rendition %s\n", job->label, r->name);
+  return ret;
+}
+
+static void freeRenderJob(RenderJob *job) {
+  AVCodecContext *opened = joinEncoderOpener(job);
+  avcodec_free_context(&opened);
+  // Uses the project, the audio encoder and the track until it stops
+  stopAudioStage(job->audioStage);
+  for (int i = 0; i < RENDER_QUEUE_DEPTH; i++)
+    free(job->slots[i].rgba);
+  free(job->bgBuffer);
+  if (job->bgTexture.id != 0)
+    UnloadTexture(job->bgTexture);
+  freeSceneOverlay(&job->overlay);
+
+  destroyThreadPool(job->encodePool);
+  for (int i = 0; i < job->renditionCount; i++)
+    freeRendition(&job->renditions[i]);
+  av_dict_free(&job->muxer_opts);
+  closeGopSource(job->previous);
+  freeRenderManifest(&job->manifest);
+  freeRenderManifest(&job->checkpoint.manifest);
+  free(job->sourceGop);
+  freeGopLayout(&job->layout);
+  if (job->output)
+    closeOutputStream(job->output, job->fmt_ctx, false);
+  if (job->fmt_ctx)
+    avformat_free_context(job->fmt_ctx);
+  if (job->video_codec_ctx)
+    avcodec_free_context(&job->video_codec_ctx);
+  avcodec_free_context(&job->uniformSample);
+  closeAudioTrack(job->audioTrack);
+  if (job->audio_codec_ctx)
+    avcodec_free_context(&job->audio_codec_ctx);
+  if (job->video_frame)
+    av_frame_free(&job->video_frame);
+  if (job->pkt)
+    av_packet_free(&job->pkt);
+  if (job->sws_ctx)
+    sws_freeContext(job->sws_ctx);
+
+  freeProject(&job->project);
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->cond);
+  free(job);
+}
+
+// Everything that changes every frame of the output
+static uint64_t hashRenderSettings(RenderJob *job, const RenderOptions *opts) {
+  const EncoderProfile *profile = jobProfile(opts);
+  AVCodecContext *codec_ctx = job->video_codec_ctx;
+  int layout[] = {WIDTH, HEIGHT, FPS, FONT_SIZE, job->useKernels,
+                  codec_ctx->pix_fmt, job->regionHints};
+  uint64_t hash = MANIFEST_HASH_INIT;
+  hash = hashManifestData(hash, layout, sizeof(layout));
+  hash = hashManifestString(hash, codec_ctx->codec->name);
+  hash = hashManifestString(hash, profile->name);
+  hash = hashManifestString(hash, profile->preset);
+  hash = hashManifestString(hash, profile->tune);
+  hash = hashManifestString(hash, profile->crf);
+  hash = hashManifestString(hash, profile->x264Params);
+  hash = hashManifestData(hash, &profile->bitRate, sizeof(profile->bitRate));
+  hash = hashManifestData(hash, &job->layout.maxGop, sizeof(int));
+  hash = hashManifestData(hash, codec_ctx->extradata,
+                          codec_ctx->extradata_size);
+  return hashFileIdentity(hash, FONT_PATH);
+}
+
+// Compare against the previous render's manifest and pick the GOPs to render
+static int prepareIncremental(RenderJob *job, const RenderOptions *opts) {
+  if (buildRenderManifest(&job->manifest, &job->project, &job->ctx->assets,
+                          job->bg, opts->backgroundOffset, &job->layout,
+                          hashRenderSettings(job, opts)) < 0)
+    return -1;
+  int gopCount = job->layout.count;
+  job->sourceGop = malloc((gopCount > 0 ? gopCount : 1) * sizeof(int));
+  if (!job->sourceGop)
+    return -1;
+  for (int gop = 0; gop < gopCount; gop++)
+    job->sourceGop[gop] = -1;
+
+  // A resumed render continues the checkpoint's partial file instead of
+  // the last complete one, as far as the checkpoint got
+  char manifestPath[600];
+  snprintf(manifestPath, sizeof(manifestPath), "%s%s", job->outputPath,
+           MANIFEST_SUFFIX);
+  RenderManifest previous;
+  const char *previousPath = job->outputPath;
+  int usableGops = 0; // of the previous render's
+  int loaded;
+  if (job->resuming) {
+    previous = job->checkpoint.manifest;
+    memset(&job->checkpoint.manifest, 0, sizeof(RenderManifest));
+    previousPath = job->checkpoint.file;
+    usableGops = job->checkpoint.completeGops;
+    loaded = 0;
+  } else {
+    loaded = loadRenderManifest(&previous, manifestPath);
+    usableGops = previous.layout.count;
+  }
+  if (loaded == 0) {
+    if (previous.settings == job->manifest.settings)
+      job->previous = openGopSource(previousPath, job->video_st->codecpar,
+                                    &previous.layout);
+    // Captions that moved move the GOPs around them, so GOPs are matched
+    // by the frames they cover rather than by number
+    int reused = 0;
+    int match = 0;
+    for (int gop = 0; job->previous && gop < gopCount; gop++) {
+      int start = gopStart(&job->layout, gop);
+      while (match < previous.layout.count &&
+             gopStart(&previous.layout, match) < start)
+        match++;
+      if (match < usableGops && gopStart(&previous.layout, match) == start &&
+          gopStart(&previous.layout, match + 1) ==
+              gopStart(&job->layout, gop + 1) &&
+          previous.gops[match] == job->manifest.gops[gop] &&
+          gopSourceHas(job->previous, match)) {
+        job->sourceGop[gop] = match;
+        reused++;
+      }
+    }
+    freeRenderManifest(&previous);
+    if (reused == 0) {
+      closeGopSource(job->previous);
+      job->previous = NULL;
+    }
+    if (job->resuming)
+      printf("%sResuming from %s: %d of %d checkpointed GOPs usable\n",
+             job->label, previousPath, reused, usableGops);
+  }
+
+  for (int gop = 0; gop < gopCount; gop++)
+    job->gopsRendered += job->sourceGop[gop] < 0;
+  if (opts->incremental || job->resuming)
+    printf("%sIncremental: rendering %d of %d GOPs\n", job->label,
+           job->gopsRendered, gopCount);
+  return 0;
+}
+
+// What libx264 holds for one output: every frame it is encoding, its
+// references and its lookahead
+static int64_t estimateEncoderMemory(const EncoderProfile *profile, int width,
+                                     int height, int threads) {
+  int64_t frame = (int64_t)width * height * 3 / 2;
+  bool sliced =
+      profile->x264Params && strstr(profile->x264Params, "sliced-threads=1");
+  // x264 runs 1.5 frame threads per CPU unless told otherwise
+  int frameThreads = sliced ? 1 : threads > 0 ? threads : cpuCount() * 3 / 2;
+  int lookahead = profile->tune && strstr(profile->tune, "zerolatency")
+                      ? 0
+                      : X264_LOOKAHEAD;
+  return frame * X264_FRAME_COST * (frameThreads + lookahead + 2);
+}
+
+// The job's memory with its current settings. Buffers are sized as they
+// will be allocated, output queues count as full.
+static void estimateJobMemory(const RenderJob *job, const RenderOptions *opts,
+                              MemoryAccount *account) {
+  int64_t rgba = (int64_t)WIDTH * HEIGHT * 4;
+  int64_t yuv = (int64_t)WIDTH * HEIGHT * 3 / 2;
+  int64_t process = job->memory.bytes[MEMORY_PROCESS];
+  memset(account, 0, sizeof(MemoryAccount));
+  account->bytes[MEMORY_PROCESS] = process;
+  account->bytes[MEMORY_AUDIO_PCM] =
+      estimateProjectAudioBytes(&job->project, job->project.streamAudio) +
+      (job->project.audioFileCount > 0 ? estimateAudioStageBytes(AUDIO_BIT_RATE)
+                                       : 0);
+  account->bytes[MEMORY_CAPTIONS] =
+      (int64_t)job->project.captionCount * sizeof(Caption);
+
+  int slotCount = job->encodeThread ? RENDER_QUEUE_DEPTH : 1;
+  account->bytes[MEMORY_FRAME_BUFFERS] = slotCount * rgba + yuv;
+  if (job->bg) {
+    account->bytes[MEMORY_FRAME_BUFFERS] += rgba;
+    accountBackgroundMemory(job->bg, account);
+  }
+  const EncoderProfile *profile = jobProfile(opts);
+  // Twice while the region hint sample is encoded without them as well
+  int encoders =
+      job->regionHints && opts->regionSample && !job->live ? 2 : 1;
+  if (profile)
+    account->bytes[MEMORY_CODECS] +=
+        encoders *
+        estimateEncoderMemory(profile, WIDTH, HEIGHT, job->encoderThreads);
+  for (int i = 0; i < opts->renditionCount; i++) {
+    const RenditionOptions *ro = &opts->renditions[i];
+    const EncoderProfile *rp =
+        ro->profile ? findEncoderProfile(ro->profile) : profile;
+    account->bytes[MEMORY_FRAME_BUFFERS] +=
+        (int64_t)ro->width * ro->height * 3 / 2;
+    if (rp)
+      account->bytes[MEMORY_CODECS] += estimateEncoderMemory(
+          rp, ro->width, ro->height, job->encoderThreads);
+  }
+  account->bytes[MEMORY_MUXER_QUEUE] =
+      (1 + opts->renditionCount) * job->outputQueueLimit;
+}
+
+// Give up speed for memory, cheapest first, until the estimate fits the
+// budget. Called with the project's audio opened for streaming and before
+// any frame buffer is allocated. Returns -1 if the job can't fit.
+static int planMemory(RenderJob *job, const RenderOptions *opts) {
+  char applied[160] = "";
+  job->project.streamAudio = false;
+  estimateJobMemory(job, opts, &job->memory);
+  for (int step = 0; step < 4 && memoryAccountTotal(&job->memory) >
+                                     job->memoryBudget;
+       step++) {
+    const char *what = NULL;
+    switch (step) {
+    case 0:
+      job->project.streamAudio = true;
+      what = "streamed audio";
+      break;
+    case 1:
+      if (job->outputQueueLimit > RENDER_SMALL_OUTPUT_QUEUE) {
+        job->outputQueueLimit = RENDER_SMALL_OUTPUT_QUEUE;
+        what = "smaller output queues";
+      }
+      break;
+    case 2:
+      if (job->encodeThread) {
+        job->encodeThread = false;
+        what = "inline encoding";
+      }
+      break;
+    case 3:
+      if (job->encoderThreads == 0 ||
+          job->encoderThreads > RENDER_FEW_ENCODER_THREADS) {
+        job->encoderThreads = RENDER_FEW_ENCODER_THREADS;
+        what = "fewer encoder threads";
+      }
+      break;
+    }
+    if (what) {
+      size_t len = strlen(applied);
+      snprintf(applied + len, sizeof(applied) - len, "%s%s",
+               len > 0 ? ", " : "", what);
+      estimateJobMemory(job, opts, &job->memory);
+    }
+  }
+
+  int64_t total = memoryAccountTotal(&job->memory);
+  if (total > job->memoryBudget) {
+    printf("%sError: The job needs about %.0f MB, over the memory budget of "
+           "%.0f MB even with %s:\n",
+           job->label, memoryMB(total), memoryMB(job->memoryBudget), applied);
+    char prefix[80];
+    snprintf(prefix, sizeof(prefix), "%s  ", job->label);
+    printMemoryAccount(prefix, &job->memory);
+    return -1;
+  }
+  if (job->verbose)
+    printf("%sMemory: about %.0f MB of %.0f MB budget%s%s\n", job->label,
+           memoryMB(total), memoryMB(job->memoryBudget),
+           applied[0] ? " with " : "", applied);
+  return 0;
+}
+
+int estimateRenderJob(const Project *project, const RenderOptions *opts,
+                      MemoryAccount *account) {
+  RenderJob *job = calloc(1, sizeof(RenderJob));
+  if (!job) {
+    memset(account, 0, sizeof(MemoryAccount));
+    return 0;
+  }
+  // Only what the estimate reads; the project stays the caller's
+  job->project = *project;
+  job->bg = opts->background;
+  job->verbose = opts->verbose;
+  job->regionHints = !opts->uniformQuality;
+  job->live = opts->live;
+  job->encodeThread = opts->encodeThread;
+  job->memoryBudget = opts->memoryBudget;
+  job->encoderThreads = opts->encoderThreads;
+  job->outputQueueLimit = OUTPUT_QUEUE_LIMIT;
+  int64_t rss = currentRss();
+  job->memory.bytes[MEMORY_PROCESS] = rss > 0 ? rss : 0;
+  if (opts->label)
+    snprintf(job->label, sizeof(job->label), "[%s] ", opts->label);
+
+  int ret = 0;
+  if (job->memoryBudget > 0) {
+    ret = planMemory(job, opts) < 0 ? 1 : 0;
+  } else {
+    job->project.streamAudio = false;
+    estimateJobMemory(job, opts, &job->memory);
+  }
+  *account = job->memory;
+  free(job);
+  return ret;
+}
+
+RenderJob *startRenderJob(RenderContext *ctx, const RenderOptions *opts) {
+  RenderJob *job = calloc(1, sizeof(RenderJob));
+  if (!job) {
+    printf("Error: Could not allocate render job\n");
+    return NULL;
+  }
+  job->startTime = nowMs();
+  job->ctx = ctx;
+  job->verbose = opts->verbose;
+  job->encodeThread = opts->encodeThread;
+  job->referenceConvert = ctx->referenceConvert || opts->referenceConvert;
+  job->regionHints = !opts->uniformQuality;
+  job->live = opts->live;
+  job->tap = opts->tap;
+  job->uploadedSerial = -1;
+  job->memoryBudget = opts->memoryBudget;
+  job->encoderThreads = opts->encoderThreads;
+  job->outputQueueLimit = OUTPUT_QUEUE_LIMIT;
+  int64_t rss = currentRss();
+  job->memory.bytes[MEMORY_PROCESS] = rss > 0 ? rss : 0;
+  if (opts->label)
+    snprintf(job->label, sizeof(job->label), "[%s] ", opts->label);
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->cond, NULL);
+
+  // The encoder's settings don't depend on the project, so it opens while
+  // the project loads. Under a memory budget its threads aren't known yet.
+  const EncoderProfile *profile = jobProfile(opts);
+  if (!profile) {
+    printf("%sError: Unknown encoder profile: %s\n", job->label,
+           opts->profile);
+    freeRenderJob(job);
+    return NULL;
+  }
+  bool incremental =
+      opts->incremental || opts->checkpointGops > 0 || opts->resume;
+  job->maxGop = opts->maxGop > 0 ? opts->maxGop : profile->gopSize;
+  job->incremental = incremental;
+  job->forceKeyframes = opts->keyframes == KEYFRAMES_CAPTIONS || incremental;
+  if (job->memoryBudget == 0) {
+    job->openerProfile = profile;
+    job->openerGlobalHeader =
+        isNetworkOutput(opts->output) &&
+        strcmp(networkOutputFormat(opts->output), "flv") == 0;
+    job->opening =
+        pthread_create(&job->opener, NULL, openEncoderThread, job) == 0;
+  }
+
+  // The clips are only opened here. The audio thread decodes them as the
+  // mix gets to them, so the first frames don't wait for clips that play
+  // later and those finish decoding while the video renders. Decoded
+  // clips are kept unless planMemory has them streamed.
+  if (loadProject(&job->project, opts->projectId, PROJECT_AUDIO_STREAM) < 0) {
+    freeRenderJob(job);
+    return NULL;
+  }
+  addSceneSprites(&ctx->assets, &job->project);
+  initSceneState(&job->scene, &ctx->assets, &job->project);
+  if (initSceneOverlay(&job->overlay) < 0) {
+    freeRenderJob(job);
+    return NULL;
+  }
+  job->frameCount = (int)(FPS * job->project.duration);
+  if (opts->maxFrames > 0 && job->frameCount > opts->maxFrames)
+    job->frameCount = opts->maxFrames;
+  if (job->verbose)
+    printf("%sVideo duration: %.1f seconds (%d frames)\n", job->label,
+           job->project.duration, job->frameCount);
+
+  if (opts->background) {
+    job->bg = opts->background;
+    resetBackgroundVideo(job->bg, opts->backgroundOffset);
+    job->bg->converter = job->referenceConvert ? NULL : &ctx->converter;
+    job->bgBuffer = malloc(WIDTH * HEIGHT * 4); // RGBA
+    if (!job->bgBuffer) {
+      printf("Error: Could not allocate background buffer\n");
+      freeRenderJob(job);
+      return NULL;
+    }
+  }
+
+  if (job->memoryBudget > 0) {
+    if (planMemory(job, opts) < 0) {
+      freeRenderJob(job);
+      return NULL;
+    }
+  } else {
+    job->project.streamAudio = false;
+    estimateJobMemory(job, opts, &job->memory);
+  }
+
+  int slotCount = job->encodeThread ? RENDER_QUEUE_DEPTH : 1;
+  bool allocated = true;
+  for (int i = 0; i < slotCount; i++) {
+    job->slots[i].rgba = malloc(WIDTH * HEIGHT * 4);
+    allocated = allocated && job->slots[i].rgba;
+  }
+  if (!allocated) {
+    printf("Error: Could not allocate frame buffer\n");
+    freeRenderJob(job);
+    return NULL;
+  }
+
+  if (job->live && incremental) {
+    printf("%sError: Live renders can't be incremental or checkpointed\n",
+           job->label);
+    freeRenderJob(job);
+    return NULL;
+  }
+  if (opts->renditionCount > RENDER_MAX_RENDITIONS ||
+      (opts->renditionCount > 0 && incremental)) {
+    printf("%sError: Up to %d renditions, and none with incremental or "
+           "checkpointed renders\n",
+           job->label, RENDER_MAX_RENDITIONS);
+    freeRenderJob(job);
+    return NULL;
+  }
+  if (incremental) {
+    // The output is replaced by renaming over it and its name is the base
+    // of the side files, so it has to be a regular file or not exist yet
+    struct stat st;
+    if (strcmp(opts->output, "-") == 0 ||
+        strncmp(opts->output, "fd:", 3) == 0 ||
+        isNetworkOutput(opts->output) ||
+        (stat(opts->output, &st) == 0 && !S_ISREG(st.st_mode))) {
+      printf("%sError: Incremental and checkpointed renders need a regular "
+             "file output\n",
+             job->label);
+      freeRenderJob(job);
+      return NULL;
+    }
+    // The previous render stays in place until this one is complete
+    snprintf(job->outputPath, sizeof(job->outputPath), "%s", opts->output);
+    snprintf(job->tmpPath, sizeof(job->tmpPath), "%s.tmp", opts->output);
+    snprintf(job->checkpointPath, sizeof(job->checkpointPath), "%s%s",
+             opts->output, CHECKPOINT_SUFFIX);
+    job->checkpointGops = opts->checkpointGops;
+    if (job->checkpointGops > 0 &&
+        opts->outputLayout != OUTPUT_LAYOUT_AUTO &&
+        opts->outputLayout != OUTPUT_LAYOUT_FRAGMENTED)
+      printf("%sWarning: Checkpointed renders are written fragmented, not "
+             "%s\n",
+             job->label, outputLayoutName(opts->outputLayout));
+
+    // An existing checkpoint is continued or, without resume, replaced
+    if (loadRenderCheckpoint(&job->checkpoint, job->checkpointPath) == 0) {
+      job->resuming = opts->resume;
+      if (!job->resuming) {
+        printf("%sWarning: Not resuming from %s, it will be replaced\n",
+               job->label, job->checkpointPath);
+        freeRenderManifest(&job->checkpoint.manifest);
+      }
+    } else if (opts->resume) {
+      printf("%sNo checkpoint for %s, starting from the beginning\n",
+             job->label, opts->output);
+    }
+    // The partial being resumed is read while the new one is written
+    if (job->checkpointGops > 0 || job->resuming) {
+      char part0[520];
+      snprintf(part0, sizeof(part0), "%s.part0", opts->output);
+      snprintf(job->tmpPath, sizeof(job->tmpPath), "%s.part%d", opts->output,
+               strcmp(job->checkpoint.file, part0) == 0);
+    }
+  }
+
+  if (openJobOutput(job, opts) < 0 ||
+      (job->incremental && prepareIncremental(job, opts) < 0)) {
+    if (job->incremental)
+      remove(job->tmpPath);
+    freeRenderJob(job);
+    return NULL;
+  }
+  // A tap has to see the mixed audio, so it always goes through the mixer
+  if (opts->audioCache && job->audio_codec_ctx &&
+      !(job->tap && job->tap->audio))
+    job->audioTrack =
+        openAudioTrack(&job->project, job->audio_codec_ctx,
+                       (int64_t)job->frameCount * AUDIO_SAMPLES_PER_FRAME);
+  for (int i = 0; i < opts->renditionCount; i++) {
+    if (openRendition(job, opts, i) < 0) {
+      freeRenderJob(job);
+      return NULL;
+    }
+  }
+  if (job->renditionCount > 0) {
+    // One thread per output; the encoder thread is one of them
+    job->encodePool = createThreadPool(job->renditionCount + 1);
+  }
+  if (job->audio_codec_ctx) {
+    job->audioStage = startAudioStage(
+        &job->project, job->audioTrack ? NULL : job->audio_codec_ctx,
+        job->audioTrack, (int64_t)job->frameCount * AUDIO_SAMPLES_PER_FRAME,
+        job->tap);
+    if (!job->audioStage) {
+      freeRenderJob(job);
+      return NULL;
+    }
+  }
+
+  if (job->encodeThread) {
+    if (pthread_create(&job->encoder, NULL, renderEncoderThread, job) != 0) {
+      printf("Warning: Could not start encoder thread, encoding inline\n");
+      job->encodeThread = false;
+    } else {
+      job->encoderRunning = true;
+    }
+  }
+
+  job->stats.setupMs = nowMs() - job->startTime;
+  job->progressTime = nowMs();
+  return job;
+}
+
+// Composite one frame into the offscreen target and read it back into rgba.
+// With reuseBackground the last background frame is shown again instead of
+// converting and uploading the next one; the decoder still keeps up.
+static void renderFrame(RenderJob *job, uint8_t *rgba, bool reuseBackground) {
+  RenderContext *ctx = job->ctx;
+  // Use fixed time step for consistent 60fps output video
+  float deltaTime = 1.0f / FPS;
+  float currentTime = job->frameIndex * deltaTime;
+  updateScene(&job->scene, &ctx->assets, &job->project, currentTime,
+              deltaTime);
+  // Has to happen before the frame's own texture mode
+  updateSceneOverlay(&job->overlay, &job->scene, &ctx->assets);
+
+  BeginTextureMode(ctx->target);
+
+  bool drewBackground = false;
+  if (job->bg) {
+    double bgStart = nowMs();
+    if (reuseBackground && job->bgDrawn) {
+      skipBackgroundFrame(job->bg, currentTime);
+      DrawTexture(job->bgTexture, 0, 0, WHITE);
+      drewBackground = true;
+      job->stats.backgroundReused++;
+    } else if (getBackgroundFrame(job->bg, currentTime, job->bgBuffer) ==
+               0) {
+      // Initialize texture once, then just update data
+      if (job->bgTexture.id == 0) {
+        Image bgImage = {.data = job->bgBuffer,
+                         .width = WIDTH,
+                         .height = HEIGHT,
+                         .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+                         .mipmaps = 1};
+        job->bgTexture = LoadTextureFromImage(bgImage);
+      } else if (job->uploadedSerial != job->bg->converted_serial) {
+        // Much faster than recreating texture
+        UpdateTexture(job->bgTexture, job->bgBuffer);
+      }
+      job->uploadedSerial = job->bg->converted_serial;
+      DrawTexture(job->bgTexture, 0, 0, WHITE);
+      drewBackground = true;
+    }
+    job->stats.backgroundMs += nowMs() - bgStart;
+  }
+  if (!drewBackground)
+    ClearBackground(DARKBLUE);
+  job->bgDrawn = drewBackground;
+
+  drawSceneOverlay(&job->overlay);
+  rlDrawRenderBatchActive();
+
+  if (job->useKernels) {
+    // Read the frame as is (bottom row first) straight into the slot; the
+    // kernels flip while converting
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+  } else {
+    // Direct OpenGL pixel read - much faster than LoadImageFromScreen()
+    unsigned char *pixels = rlReadScreenPixels(WIDTH, HEIGHT);
+    if (pixels) {
+      memcpy(rgba, pixels, WIDTH * HEIGHT * 4);
+      RL_FREE(pixels); // Free the pixel data returned by rlReadScreenPixels
+    }
+  }
+
+  EndTextureMode();
+}
+
+void renderJobProgress(RenderJob *job, RenderProgress *progress) {
+  // Only the encoder thread's side needs the lock
+  pthread_mutex_lock(&job->lock);
+  progress->encodeMs = job->stats.encodeMs;
+  progress->encoded = job->consumed;
+  pthread_mutex_unlock(&job->lock);
+  progress->frameCount = job->frameCount;
+  progress->rendered = job->frameIndex;
+  progress->renderMs = job->stats.renderMs;
+  progress->backgroundMs = job->stats.backgroundMs;
+  progress->elapsedMs = nowMs() - job->startTime;
+}
+
+static void reportProgress(RenderJob *job) {
+  double now = nowMs();
+  double time_elapsed = (now - job->progressTime) / 1000.0;
+  job->progressTime = now;
+  float avg_fps = RENDER_PROGRESS_INTERVAL / time_elapsed;
+
+  RenderProgress p;
+  renderJobProgress(job, &p);
+  float progress = (float)p.rendered / p.frameCount * 100.0f;
+  double avg_bg = p.backgroundMs / p.rendered;
+  double avg_render = (p.renderMs - p.backgroundMs) / p.rendered;
+  double avg_encode = p.encoded > 0 ? p.encodeMs / p.encoded : 0.0;
+
+  printf("%sProgress: %.1f%% (%d/%d frames) - %.1f fps\n", job->label,
+         progress, p.rendered, p.frameCount, avg_fps);
+  printf("%s  Timing - BG: %.2fms, Render: %.2fms, Encode: %.2fms\n",
+         job->label, avg_bg, avg_render, avg_encode);
+}
+
+RenderStepResult renderJobStep(RenderJob *job, bool block) {
+  if (job->frameIndex >= job->frameCount)
+    return RENDER_STEP_DONE;
+
+  // Wait for a free frame buffer
+  pthread_mutex_lock(&job->lock);
+  while (job->produced - job->consumed >= RENDER_QUEUE_DEPTH) {
+    if (!block) {
+      pthread_mutex_unlock(&job->lock);
+      return RENDER_STEP_BUSY;
+    }
+    pthread_cond_wait(&job->cond, &job->lock);
+  }
+  bool failed = job->failed;
+  pthread_mutex_unlock(&job->lock);
+  if (failed)
+    return RENDER_STEP_ERROR;
+
+  // Live: wait for the frame's slot, and when behind, skip frames and
+  // background decodes rather than fall further behind
+  bool reuseBackground = false;
+  if (job->live) {
+    if (job->frameIndex == 0)
+      job->liveStart = nowMs();
+    double late = nowMs() - liveDue(job, job->frameIndex);
+    if (late < 0.0) {
+      if (!block)
+        return RENDER_STEP_BUSY;
+      usleep((useconds_t)(-late * 1000.0));
+    }
+    // A GOP's first frame is never dropped: it carries the forced IDR the
+    // rest of the GOP (and the keyframe stats) count on
+    float deltaTime = 1.0f / FPS;
+    while (late > LIVE_DROP_MS && job->frameIndex < job->frameCount - 1 &&
+           !(job->forceKeyframes &&
+             job->frameIndex == gopStart(&job->layout,
+                                         gopAt(&job->layout,
+                                               job->frameIndex)))) {
+      updateScene(&job->scene, &job->ctx->assets, &job->project,
+                  job->frameIndex * deltaTime, deltaTime);
+      job->frameIndex++;
+      job->stats.droppedFrames++;
+      late = nowMs() - liveDue(job, job->frameIndex);
+    }
+    if (late > LIVE_MISS_MS) {
+      job->stats.deadlineMisses++;
+      reuseBackground = true;
+    }
+  }
+
+  int slotCount = job->encodeThread ? RENDER_QUEUE_DEPTH : 1;
+  FrameSlot *slot = &job->slots[job->produced % slotCount];
+  double start = nowMs();
+  slot->frameIndex = job->frameIndex;
+  slot->reused =
+      job->previous &&
+      job->sourceGop[gopAt(&job->layout, job->frameIndex)] >= 0;
+  if (slot->reused) {
+    // Only the animation state has to keep up
+    float deltaTime = 1.0f / FPS;
+    updateScene(&job->scene, &job->ctx->assets, &job->project,
+                job->frameIndex * deltaTime, deltaTime);
+    job->stats.reusedFrames++;
+  } else {
+    renderFrame(job, slot->rgba, reuseBackground);
+    slot->regionCount =
+        job->regionHints
+            ? sceneRegions(&job->scene, &job->ctx->assets, slot->regions)
+            : 0;
+  }
+  job->stats.renderMs += nowMs() - start;
+
+  if (job->encodeThread) {
+    pthread_mutex_lock(&job->lock);
+    job->produced++;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+  } else {
+    start = nowMs();
+    int ret = encodeFrame(job, slot);
+    job->stats.encodeMs += nowMs() - start;
+    job->produced++;
+    job->consumed++;
+    if (ret < 0) {
+      job->failed = true;
+      return RENDER_STEP_ERROR;
+    }
+  }
+  job->frameIndex++;
+
+  if (job->memoryBudget > 0 &&
+      job->frameIndex % RENDER_MEMORY_INTERVAL == 0) {
+    int64_t rss = peakRss();
+    if (rss > job->memoryBudget) {
+      printf("%sError: Peak RSS of %.0f MB is over the memory budget of "
+             "%.0f MB, stopping\n",
+             job->label, memoryMB(rss), memoryMB(job->memoryBudget));
+      // Even after the last frame, so finishRenderJob doesn't keep it
+      pthread_mutex_lock(&job->lock);
+      job->failed = true;
+      pthread_mutex_unlock(&job->lock);
+      return RENDER_STEP_ERROR;
+    }
+  }
+
+  // Progress reporting (less frequent for better performance)
+  if (job->verbose && job->frameIndex % RENDER_PROGRESS_INTERVAL == 0)
+    reportProgress(job);
+
+  return job->frameIndex >= job->frameCount ? RENDER_STEP_DONE
+                                            : RENDER_STEP_FRAME;
+}
+
+int finishRenderJob(RenderJob *job, RenderStats *stats) {
+  if (job->encoderRunning) {
+    pthread_mutex_lock(&job->lock);
+    job->finished = true;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    pthread_join(job->encoder, NULL);
+    job->encoderRunning = false;
+  }
+
+  int ret = job->failed || job->frameIndex < job->frameCount ? -1 : 0;
+  if (job->headerWritten) {
+    double start = nowMs();
+    // Flush video encoder
+    if (writePackets(job, job->video_codec_ctx, job->video_st, NULL) < 0)
+      ret = -1;
+    if (job->previous && copyReusedGops(job, job->layout.count) < 0)
+      ret = -1;
+    for (int i = 0; i < job->renditionCount; i++) {
+      Rendition *r = &job->renditions[i];
+      if (r->headerWritten && writeRenditionPackets(r, NULL) < 0)
+        ret = -1;
+    }
+
+    if (job->audioStage && writeAudioStage(job, -1) < 0)
+      ret = -1;
+    if (job->audioTrack) {
+      if (job->verbose) {
+        AudioTrackStats audio;
+        getAudioTrackStats(job->audioTrack, &audio);
+        printf("%sAudio: %d clips from the cache, %d encoded and cached, "
+               "%d overlapping stretches mixed\n",
+               job->label, audio.cachedClips, audio.encodedClips,
+               audio.mixedSpans);
+      }
+    }
+
+    if (prepareOutputTrailer(job->output) < 0 ||
+        av_write_trailer(job->fmt_ctx) < 0)
+      ret = -1;
+    job->stats.encodeMs += nowMs() - start;
+  }
+  // What audio and the output queues really took, instead of the estimate
+  job->memory.bytes[MEMORY_AUDIO_PCM] = job->project.audioPeakBytes;
+  if (job->audioStage) {
+    job->memory.bytes[MEMORY_AUDIO_PCM] += audioStagePeakBytes(job->audioStage);
+    job->stats.audioMs = audioStageMs(job->audioStage);
+  }
+  job->memory.bytes[MEMORY_MUXER_QUEUE] =
+      job->output ? outputPeakQueued(job->output) : 0;
+  for (int i = 0; i < job->renditionCount; i++) {
+    if (job->renditions[i].output)
+      job->memory.bytes[MEMORY_MUXER_QUEUE] +=
+          outputPeakQueued(job->renditions[i].output);
+  }
+  if (job->output) {
+    if (closeOutputStream(job->output, job->fmt_ctx, job->verbose) < 0)
+      ret = -1;
+    job->output = NULL;
+  }
+  for (int i = 0; i < job->renditionCount; i++) {
+    if (finishRendition(job, &job->renditions[i]) < 0)
+      ret = -1;
+  }
+  if (job->incremental) {
+    // Replace the previous render and record what this one contains
+    closeGopSource(job->previous);
+    job->previous = NULL;
+    char manifestPath[600];
+    snprintf(manifestPath, sizeof(manifestPath), "%s%s", job->outputPath,
+             MANIFEST_SUFFIX);
+    if (ret == 0) {
+      // A stale manifest must never describe the new file
+      remove(manifestPath);
+      if (rename(job->tmpPath, job->outputPath) != 0) {
+        printf("%sError: Could not replace %s\n", job->label,
+               job->outputPath);
+        ret = -1;
+      } else {
+        saveRenderManifest(&job->manifest, manifestPath);
+      }
+    }
+    bool checkpointed = job->checkpointedGops > 0;
+    if (ret == 0 || checkpointed) {
+      // The last checkpoint, if still wanted, now points at tmpPath
+      if (ret == 0)
+        remove(job->checkpointPath);
+      if (job->checkpoint.file[0] != '\0')
+        remove(job->checkpoint.file);
+    }
+    if (ret < 0 && checkpointed)
+      printf("%sPartial render kept in %s, continue it with --resume\n",
+             job->label, job->tmpPath);
+    else if (ret < 0)
+      remove(job->tmpPath);
+  }
+
+  job->stats.frames = job->consumed;
+  job->stats.overlayRebuilds = job->overlay.rebuilds;
+  if (job->latencyCount > 0)
+    job->stats.latencyMs = job->latencySum / job->latencyCount;
+  if (job->forceKeyframes) {
+    job->stats.gops = job->layout.count;
+    job->stats.boundaryGops = job->layout.boundaries;
+  }
+  int encoded = job->consumed - job->stats.reusedFrames;
+  job->stats.hintedShare = encoded > 0 ? job->hintedShare / encoded : 0.0;
+  if (job->sampleFailed || job->uniformSample) {
+    job->stats.regionSampleBytes = 0;
+    job->stats.uniformSampleBytes = 0;
+  } else {
+    job->stats.regionSampleFrames = job->sampleFrames;
+  }
+  job->stats.memory = job->memory;
+  job->stats.peakRss = peakRss();
+  job->stats.totalMs = nowMs() - job->startTime;
+  if (stats)
+    *stats = job->stats;
+  freeRenderJob(job);
+  return ret;
+}
+
+int renderJobFrames(RenderJob *job, int frames) {
+  int rendered = 0;
+  while (rendered < frames && job->frameIndex < job->frameCount &&
+         !renderShouldStop(job->ctx)) {
+    beginRenderRound(job->ctx);
+    RenderStepResult step = renderJobStep(job, true);
+    endRenderRound(job->ctx);
+    if (step == RENDER_STEP_ERROR)
+      return -1;
+    rendered++;
+  }
+  return rendered;
+}
+
+int renderProject(RenderContext *ctx, const RenderOptions *opts,
+                  RenderStats *stats) {
+  RenderJob *job = startRenderJob(ctx, opts);
+  if (!job)
+    return -1;
+
+  int rendered = renderJobFrames(job, job->frameCount);
+  int finished = finishRenderJob(job, stats);
+  return rendered < 0 ? -1 : finished;
+}
@@ -0,0 +1,216 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <raylib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "background.h"
+#include "colorconv.h"
+#include "manifest.h"
+#include "memstats.h"
+#include "outstream.h"
+#include "scene.h"
+#include "threadpool.h"
+
+// Encoder settings selectable per job
+typedef struct {
+  const char *name;
+  const char *preset;
+  const char *tune; // may be NULL
+  const char *crf;
+  const char *x264Params; // may be NULL
+  int64_t bitRate;
+  int gopSize;
+} EncoderProfile;
+
+// NULL if there is no profile of that name
+const EncoderProfile *findEncoderProfile(const char *name);
+
+// Everything that outlives a single render: the GL context (owned by the
+// caller), assets, the offscreen frame and the conversion threads. The
+// renderer keeps no state of its own outside the context and its jobs, so
+// anything can embed it and run any number of jobs side by side: sprites,
+// font and converter are shared, and each job has its own project, scene,
+// background position, encoders and output. raylib's GL state is per
+// process, though, so there is one context per process and its jobs are
+// stepped on the thread that owns the GL context.
+typedef struct {
+  SceneAssets assets;
+  RenderTexture2D target; // jobs draw their frames into this
+  ThreadPool *pool;
+  ColorConverter converter;
+  bool referenceConvert; // rlReadScreenPixels + sws_scale instead of kernels
+  bool windowed;         // raylib window rather than a headless context
+} RenderContext;
+
+// Extra outputs a job encodes from the same composited frames
+#define RENDER_MAX_RENDITIONS 4
+// Frames at the start a region sample also encodes without the hints, to
+// measure what they change
+#define REGION_SAMPLE_FRAMES (2 * FPS)
+
+// One of them: its own size, encoder settings and file. The audio is
+// encoded once and muxed into every output.
+typedef struct {
+  const char *output; // path or "fd:N"
+  int width;          // even, scaled from the WIDTH x HEIGHT composite
+  int height;
+  const char *profile; // NULL for the job's profile
+  int64_t maxBitRate;  // caps the encoder's rate, 0 for no cap
+} RenditionOptions;
+
+// "size=WxH,bitrate=KBPS,profile=NAME,output=PATH" (bitrate and profile
+// optional). Modifies spec, which output then points into. Returns -1 if
+// malformed.
+int parseRenditionOptions(char *spec, RenditionOptions *rendition);
+
+// Sees every frame exactly as it goes into the encoders. Called on the
+// thread doing the encoding; frames are only valid during the call.
+typedef struct {
+  void (*video)(void *arg, const AVFrame *frame); // pts is the frame index
+  void (*audio)(void *arg, const AVFrame *frame);
+  void *arg;
+} FrameTap;
+
+typedef struct {
+  const char *projectId;
+  const char *output;          // path, "-" or "fd:N"
+  OutputLayout outputLayout;
+  const char *profile;         // NULL for the default profile
+  const EncoderProfile *encoderProfile; // overrides profile if set
+  BackgroundVideo *background; // owned by the caller, NULL for plain colour
+  double backgroundOffset;     // start this far into the background clip
+  int encoderThreads;          // 0 lets the encoder decide
+  bool encodeThread;           // encode on a separate thread per job
+  bool verbose;                // progress reports while rendering
+  const char *label;           // prefix for log lines, may be NULL
+  bool referenceConvert;       // this job only, see RenderContext
+  bool incremental;            // reuse unchanged GOPs of the last render
+  bool audioCache;             // build the audio from cached clip encodes
+  // Checkpoint every this many GOPs, 0 for none. The output is written
+  // fragmented to a partial file that a later render with resume continues
+  // from its last checkpoint. Implies the GOP layout of incremental renders.
+  int checkpointGops;
+  bool resume;                 // continue from output's checkpoint if any
+  bool uniformQuality;         // no finer quantizers for captions and
+                               // characters (region hints)
+  // Also encode the first frames as uniformQuality would and report both
+  // sizes in the stats. Costs a second encoder; ignored for live renders.
+  bool regionSample;
+  // IDR frames at caption and speaker changes (the default) or only where
+  // the encoder puts them, at least every maxGop frames. 0 for the
+  // profile's GOP size.
+  KeyframePolicy keyframes;
+  int maxGop;
+  // Emit frames on the wall clock, one every 1/FPS seconds, encoding with
+  // zerolatency. Frames that run late keep the last background, and when
+  // the job falls far behind frames are dropped to catch up.
+  bool live;
+  const FrameTap *tap;         // may be NULL
+  int maxFrames;               // stop early, 0 renders the whole project
+  const RenditionOptions *renditions; // besides output, may be NULL
+  int renditionCount;
+  // Peak RSS to stay under, 0 for no limit. The job streams its audio,
+  // shrinks its queues and encodes with fewer threads as far as it takes,
+  // refuses to start if that isn't enough and stops if the process goes
+  // over anyway. RSS is per process, so meant for one job per process.
+  int64_t memoryBudget;
+} RenderOptions;
+
+typedef struct {
+  int frames;
+  int reusedFrames;    // copied from the previous render, incremental only
+  int overlayRebuilds; // frames that redrew characters and captions
+  int checkpoints;     // taken while rendering
+  int gops;            // forced keyframes, 0 if the encoder placed them
+  int boundaryGops;    // of those, on a caption or speaker change
+  int deadlineMisses;   // live: frames composited after their slot
+  int droppedFrames;    // live: skipped to catch up
+  int backgroundReused; // live: late frames that kept the last background
+  double latencyMs;     // live: from a frame's slot to its packet muxed
+  double maxLatencyMs;
+  int64_t videoBytes;  // main output's video stream
+  double hintedShare;  // of the picture, on average, given finer quantizers
+  // The first frames encoded with and without the hints, 0 frames if not
+  // measured
+  int regionSampleFrames;
+  int64_t regionSampleBytes;
+  int64_t uniformSampleBytes;
+  double setupMs;      // project load and encoder setup
+  double firstFrameMs; // from the job's start to its first frame encoded
+  double renderMs;     // GL thread: update, draw and readback
+  double backgroundMs; // GL thread: background decode and upload
+  double encodeMs;     // conversion, encoding and muxing
+  double audioMs;      // audio thread: mixing and AAC encoding
+  double totalMs;
+  MemoryAccount memory; // per subsystem at its peak, codecs estimated
+  int64_t peakRss;      // of the whole process
+} RenderStats;
+
+// How far a running job has got
+typedef struct {
+  int frameCount;
+  int rendered;    // composited (or reused) and handed to the encoder
+  int encoded;     // encoded and muxed
+  double renderMs; // as in RenderStats, so far
+  double backgroundMs;
+  double encodeMs;
+  double elapsedMs; // since the job started
+} RenderProgress;
+
+typedef struct RenderJob RenderJob;
+
+typedef enum {
+  RENDER_STEP_ERROR = -1,
+  RENDER_STEP_FRAME, // rendered a frame, more to come
+  RENDER_STEP_BUSY,  // encoder holds every frame buffer, try again later
+  RENDER_STEP_DONE   // all frames rendered
+} RenderStepResult;
+
+// Needs the GL context, a raylib window or a headless one. Returns 0 on
+// success, -1 on error.
+int initRenderContext(RenderContext *ctx, bool referenceConvert);
+void freeRenderContext(RenderContext *ctx);
+
+// Loops that step jobs call these around each round. With a window they run
+// raylib's frame (buffer swap and event polling); headless there is nothing
+// to present and they do nothing.
+void beginRenderRound(const RenderContext *ctx);
+void endRenderRound(const RenderContext *ctx);
+// The window was closed; never true headless
+bool renderShouldStop(const RenderContext *ctx);
+
+// Memory a job with opts would need for project (opened with
+// PROJECT_AUDIO_STREAM), worked out the way startRenderJob does it and
+// without allocating any of it. The process share is what this process
+// holds now. Returns 1 if it won't fit opts->memoryBudget, otherwise 0.
+int estimateRenderJob(const Project *project, const RenderOptions *opts,
+                      MemoryAccount *account);
+
+// Load the project and its sprites, open the output and start the encoder
+// thread
+RenderJob *startRenderJob(RenderContext *ctx, const RenderOptions *opts);
+
+// Render the next frame and hand it to the encoder. With block set, waits
+// for a free frame buffer instead of returning RENDER_STEP_BUSY.
+RenderStepResult renderJobStep(RenderJob *job, bool block);
+
+// Render up to frames more frames of a job that has the context to itself,
+// in a round of their own like renderProject. Returns the number rendered,
+// -1 on error; fewer than asked means the job is done or the window was
+// closed.
+int renderJobFrames(RenderJob *job, int frames);
+
+// Where the job is, from the thread that steps it
+void renderJobProgress(RenderJob *job, RenderProgress *progress);
+
+// Flush the encoders, finish the file and free the job. Returns 0 if the
+// whole job succeeded.
+int finishRenderJob(RenderJob *job, RenderStats *stats);
+
+// Run a job start to finish on the calling (GL) thread
+int renderProject(RenderContext *ctx, const RenderOptions *opts,
+                  RenderStats *stats);
+
+#endif
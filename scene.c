@@ -0,0 +1,625 @@
+#include "scene.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <math.h>
+#include <rlgl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "common.h"
+
+static double elapsedMs(const struct timeval *start) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000.0 +
+         (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+// Transparent gap between sprites so bilinear filtering doesn't pick up
+// a neighbour
+#define ATLAS_PADDING 2
+#define CHARACTER_SPEED 3.0f // slides and fades per second
+#define PLACEHOLDER_WIDTH 400
+#define PLACEHOLDER_HEIGHT 600
+
+static const Color placeholderColors[] = {
+    {0, 0, 255, 255},   {0, 255, 0, 255},   {255, 0, 0, 255},
+    {255, 160, 0, 255}, {160, 0, 255, 255}, {0, 200, 200, 255},
+    {255, 0, 160, 255}, {160, 160, 160, 255},
+};
+
+static int findAtlasSprite(const SpriteAtlas *atlas, const char *source,
+                           float scale) {
+  for (int i = 0; i < atlas->spriteCount; i++) {
+    if (atlas->sprites[i].scale == scale &&
+        strcmp(atlas->sprites[i].source, source) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Load a sprite and pack it onto the current shelf, or a new one below.
+// Returns its slot, -1 if it can't be loaded or there is no room.
+static int packAtlasSprite(SpriteAtlas *atlas, AssetCache *cache,
+                           const char *source, float scale) {
+  if (atlas->spriteCount == MAX_ATLAS_SPRITES) {
+    printf("Warning: Sprite atlas is full, drawing %s as a placeholder\n",
+           source);
+    return -1;
+  }
+  Image image = loadSpriteImage(cache, source, scale);
+  if (!image.data) {
+    printf("Warning: Could not load %s\n", source);
+    return -1;
+  }
+
+  if (atlas->shelfX + image.width > SPRITE_ATLAS_SIZE) {
+    atlas->shelfY += atlas->shelfHeight + ATLAS_PADDING;
+    atlas->shelfX = 0;
+    atlas->shelfHeight = 0;
+  }
+  if (image.width > SPRITE_ATLAS_SIZE ||
+      atlas->shelfY + image.height > SPRITE_ATLAS_SIZE) {
+    printf("Warning: No room for %s in the sprite atlas, drawing a "
+           "placeholder\n",
+           source);
+    UnloadImage(image);
+    return -1;
+  }
+  if (atlas->texture.id == 0) {
+    Image blank = GenImageColor(SPRITE_ATLAS_SIZE, SPRITE_ATLAS_SIZE, BLANK);
+    atlas->texture = LoadTextureFromImage(blank);
+    UnloadImage(blank);
+    if (atlas->texture.id == 0) {
+      printf("Warning: Could not create the sprite atlas\n");
+      UnloadImage(image);
+      return -1;
+    }
+    SetTextureFilter(atlas->texture, TEXTURE_FILTER_BILINEAR);
+  }
+
+  Rectangle rect = {atlas->shelfX, atlas->shelfY, image.width, image.height};
+  UpdateTextureRec(atlas->texture, rect, image.data);
+  UnloadImage(image);
+
+  AtlasSprite *sprite = &atlas->sprites[atlas->spriteCount];
+  snprintf(sprite->source, sizeof(sprite->source), "%s", source);
+  sprite->scale = scale;
+  sprite->rect = rect;
+  atlas->shelfX += (int)rect.width + ATLAS_PADDING;
+  if ((int)rect.height > atlas->shelfHeight)
+    atlas->shelfHeight = (int)rect.height;
+  return atlas->spriteCount++;
+}
+
+// Returns how many sprites could not be added
+static int addCharacterSprites(SpriteAtlas *atlas,
+                               const CharacterDef *characters, int count) {
+  AssetCache *assetCache = NULL;
+  bool cacheOpened = false;
+  int missing = 0;
+  for (int i = 0; i < count; i++) {
+    const CharacterDef *c = &characters[i];
+    if (findAtlasSprite(atlas, c->sprite, c->scale) >= 0)
+      continue;
+    // Only map the cache once something actually needs loading
+    if (!cacheOpened) {
+      assetCache = openAssetCache(ASSET_CACHE_PATH);
+      cacheOpened = true;
+    }
+    if (packAtlasSprite(atlas, assetCache, c->sprite, c->scale) < 0)
+      missing++;
+  }
+  closeAssetCache(assetCache);
+  return missing;
+}
+
+void loadSceneAssets(SceneAssets *assets) {
+  // Baked assets if the cache is there and current, source files otherwise
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  memset(assets, 0, sizeof(SceneAssets));
+  AssetCache *assetCache = openAssetCache(ASSET_CACHE_PATH);
+
+  // Load font at high resolution
+  assets->font = loadFontAsset(assetCache, FONT_PATH, FONT_SIZE);
+  if (assets->font.texture.id == 0) {
+    printf("Warning: Could not load theboldfont.ttf, using default font\n");
+    assets->font = GetFontDefault();
+  }
+  closeAssetCache(assetCache);
+
+  // The default characters' sprites up front; projects with their own
+  // table add theirs when they are rendered
+  CharacterDef characters[MAX_CHARACTERS];
+  int count = loadCharacters(NULL, characters, MAX_CHARACTERS);
+  addCharacterSprites(&assets->atlas, characters, count);
+  printf("Assets loaded in %.2fms (%d sprites)\n", elapsedMs(&start),
+         assets->atlas.spriteCount);
+}
+
+void unloadSceneAssets(SceneAssets *assets) {
+  if (assets->atlas.texture.id != 0)
+    UnloadTexture(assets->atlas.texture);
+  if (assets->font.texture.id != GetFontDefault().texture.id)
+    UnloadFont(assets->font);
+  memset(assets, 0, sizeof(SceneAssets));
+}
+
+int addSceneSprites(SceneAssets *assets, const Project *project) {
+  return addCharacterSprites(&assets->atlas, project->characters,
+                             project->characterCount);
+}
+
+// Add a sprite spec unless an identical one is already there
+static int addSpriteSpec(AssetSpec *specs, int count, int maxSpecs,
+                         const CharacterDef *c) {
+  for (int i = 0; i < count; i++) {
+    if (specs[i].type == ASSET_SPRITE && specs[i].scale == c->scale &&
+        strcmp(specs[i].source, c->sprite) == 0)
+      return count;
+  }
+  if (count == maxSpecs) {
+    printf("Warning: Too many sprites to bake, skipping %s\n", c->sprite);
+    return count;
+  }
+  specs[count] = (AssetSpec){ASSET_SPRITE, c->sprite, c->scale, 0};
+  return count + 1;
+}
+
+int bakeSceneAssets(void) {
+  CharacterDef characters[MAX_ATLAS_SPRITES];
+  AssetSpec specs[MAX_ATLAS_SPRITES + 1];
+  int specCount = 0;
+  specs[specCount++] = (AssetSpec){ASSET_FONT, FONT_PATH, 0.0f, FONT_SIZE};
+
+  int defined = loadCharacters(NULL, characters, MAX_CHARACTERS);
+  DIR *dir = opendir(CHARACTERS_DIR);
+  struct dirent *entry;
+  while (dir && (entry = readdir(dir)) != NULL &&
+         defined < MAX_ATLAS_SPRITES) {
+    size_t length = strlen(entry->d_name);
+    if (length < 5 || strcmp(entry->d_name + length - 5, ".json") != 0)
+      continue;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", CHARACTERS_DIR, entry->d_name);
+    int count = loadCharacterTable(path, &characters[defined],
+                                   MAX_ATLAS_SPRITES - defined);
+    if (count > 0)
+      defined += count;
+  }
+  if (dir)
+    closedir(dir);
+
+  for (int i = 0; i < defined; i++)
+    specCount = addSpriteSpec(specs, specCount, MAX_ATLAS_SPRITES + 1,
+                              &characters[i]);
+  return bakeAssets(ASSET_CACHE_PATH, specs, specCount);
+}
+
+void initSceneState(SceneState *state, const SceneAssets *assets,
+                    const Project *project) {
+  memset(state, 0, sizeof(SceneState));
+  state->characterCount = project->characterCount;
+
+  // Everyone stands on the same baseline, 100px from the bottom
+  for (int i = 0; i < state->characterCount; i++) {
+    const CharacterDef *def = &project->characters[i];
+    CharacterLayout *layout = &state->layouts[i];
+    layout->sprite = findAtlasSprite(&assets->atlas, def->sprite, def->scale);
+    if (layout->sprite >= 0) {
+      layout->width = assets->atlas.sprites[layout->sprite].rect.width;
+      layout->height = assets->atlas.sprites[layout->sprite].rect.height;
+    } else {
+      layout->width = PLACEHOLDER_WIDTH;
+      layout->height = PLACEHOLDER_HEIGHT;
+    }
+    layout->y = HEIGHT - 100 - layout->height;
+    switch (def->anchor) {
+    case CHARACTER_ANCHOR_LEFT:
+      layout->targetX = def->margin;
+      layout->hiddenX = -layout->width;
+      break;
+    case CHARACTER_ANCHOR_RIGHT:
+      layout->targetX = WIDTH - layout->width - def->margin;
+      layout->hiddenX = WIDTH;
+      break;
+    case CHARACTER_ANCHOR_CENTER:
+      layout->targetX = (WIDTH - layout->width) / 2;
+      layout->hiddenX = -layout->width;
+      break;
+    }
+    layout->enter = def->enter;
+    layout->exit = def->exit;
+    for (int j = 0; def->name[j] && j < (int)sizeof(layout->label) - 1; j++)
+      layout->label[j] = (char)toupper((unsigned char)def->name[j]);
+
+    CharacterState *c = &state->characters[i];
+    c->x = layout->hiddenX;
+    c->startX = layout->hiddenX;
+    c->endX = layout->hiddenX;
+  }
+  state->currentSpeaker = 0;
+}
+
+static void startSlide(CharacterState *c, float endX) {
+  c->isSliding = true;
+  c->slideProgress = 0.0f;
+  c->startX = c->x;
+  c->endX = endX;
+}
+
+static void showCharacter(CharacterState *c, const CharacterLayout *layout) {
+  c->isVisible = true;
+  switch (layout->enter) {
+  case CHARACTER_ANIM_SLIDE:
+    startSlide(c, layout->targetX);
+    c->alpha = 1.0f;
+    c->fadeSpeed = 0.0f;
+    break;
+  case CHARACTER_ANIM_FADE:
+    c->isSliding = false;
+    c->x = layout->targetX;
+    c->fadeSpeed = CHARACTER_SPEED;
+    break;
+  case CHARACTER_ANIM_NONE:
+    c->isSliding = false;
+    c->x = layout->targetX;
+    c->alpha = 1.0f;
+    c->fadeSpeed = 0.0f;
+    break;
+  }
+}
+
+static void hideCharacter(CharacterState *c, const CharacterLayout *layout) {
+  c->isVisible = false;
+  switch (layout->exit) {
+  case CHARACTER_ANIM_SLIDE:
+    startSlide(c, layout->hiddenX);
+    c->fadeSpeed = 0.0f;
+    break;
+  case CHARACTER_ANIM_FADE:
+    c->fadeSpeed = -CHARACTER_SPEED;
+    break;
+  case CHARACTER_ANIM_NONE:
+    c->isSliding = false;
+    c->x = layout->hiddenX;
+    c->alpha = 0.0f;
+    c->fadeSpeed = 0.0f;
+    break;
+  }
+}
+
+static void animateCharacter(CharacterState *c, const CharacterLayout *layout,
+                             float deltaTime) {
+  if (c->isSliding) {
+    c->slideProgress += deltaTime * CHARACTER_SPEED;
+    if (c->slideProgress >= 1.0f) {
+      c->slideProgress = 1.0f;
+      c->isSliding = false;
+    }
+    // Ease-out cubic curve for smooth deceleration
+    float t = c->slideProgress;
+    float eased = 1.0f - powf(1.0f - t, 3.0f);
+    c->x = c->startX + (c->endX - c->startX) * eased;
+  }
+  if (c->fadeSpeed != 0.0f) {
+    c->alpha += deltaTime * c->fadeSpeed;
+    if (c->alpha >= 1.0f) {
+      c->alpha = 1.0f;
+      c->fadeSpeed = 0.0f;
+    } else if (c->alpha <= 0.0f) {
+      c->alpha = 0.0f;
+      c->fadeSpeed = 0.0f;
+      c->isSliding = false;
+      c->x = layout->hiddenX;
+    }
+  }
+}
+
+void updateScene(SceneState *state, const SceneAssets *assets,
+                 const Project *project, float currentTime, float deltaTime) {
+  (void)assets;
+  state->time = currentTime;
+  state->speakerTimer += deltaTime;
+
+  // Find current caption and speaker based on time
+  int newSpeaker = state->currentSpeaker;
+  const Caption *currentCaptionData = NULL;
+
+  for (int i = 0; i < project->captionCount; i++) {
+    if (currentTime >= project->captions[i].startTime &&
+        currentTime <= project->captions[i].endTime) {
+      newSpeaker = project->captions[i].speaker;
+      currentCaptionData = &project->captions[i];
+      break;
+    }
+  }
+
+  // Update speaker if changed
+  if (newSpeaker != state->currentSpeaker && newSpeaker >= 0 &&
+      newSpeaker < state->characterCount) {
+    state->currentSpeaker = newSpeaker;
+    state->speakerTimer = 0.0f;
+  }
+
+  // The speaker comes on, everyone else leaves
+  for (int i = 0; i < state->characterCount; i++) {
+    CharacterState *c = &state->characters[i];
+    const CharacterLayout *layout = &state->layouts[i];
+    if (i == state->currentSpeaker && !c->isVisible)
+      showCharacter(c, layout);
+    else if (i != state->currentSpeaker && c->isVisible)
+      hideCharacter(c, layout);
+    animateCharacter(c, layout, deltaTime);
+  }
+
+  state->currentCaption = currentCaptionData;
+}
+
+static bool characterOnScreen(const CharacterState *c,
+                              const CharacterLayout *layout) {
+  return c->x > -layout->width && c->x < WIDTH && c->alpha > 0.0f;
+}
+
+// The words of the current caption on screen: returns the first and sets
+// groupEnd to the last, -1 if there are none
+static int captionGroup(const SceneState *state, int *groupEnd) {
+  const Caption *caption = state->currentCaption;
+  if (!caption || caption->wordCount == 0)
+    return -1;
+  int currentWordIdx = -1;
+
+  // Find current word being spoken
+  for (int i = 0; i < caption->wordCount; i++) {
+    if (state->time >= caption->words[i].start &&
+        state->time <= caption->words[i].end) {
+      currentWordIdx = i;
+      break;
+    }
+  }
+
+  // If no word is currently being spoken, find the next upcoming word
+  if (currentWordIdx == -1) {
+    for (int i = 0; i < caption->wordCount; i++) {
+      if (state->time < caption->words[i].start) {
+        currentWordIdx = i;
+        break;
+      }
+    }
+  }
+
+  // If still no word found, use the last word if we're past the end
+  if (currentWordIdx == -1 && state->time >= caption->startTime) {
+    currentWordIdx = caption->wordCount - 1;
+  }
+  if (currentWordIdx < 0)
+    return -1;
+
+  // Calculate which group of 3 words to show based on current word
+  int groupStart = (currentWordIdx / 3) * 3;
+  *groupEnd = groupStart + 2;
+  if (*groupEnd >= caption->wordCount) {
+    *groupEnd = caption->wordCount - 1;
+  }
+  return groupStart;
+}
+
+// Width of words [groupStart, groupEnd] of caption as drawScene sets them
+static float captionGroupWidth(const Caption *caption,
+                               const SceneAssets *assets, int groupStart,
+                               int groupEnd) {
+  float totalWidth = 0;
+  for (int i = groupStart; i <= groupEnd; i++) {
+    char word[64];
+    strncpy(word, caption->words[i].word, 63);
+    word[63] = '\0';
+    totalWidth += MeasureTextEx(assets->font, word, CAPTION_FONT_SIZE, 1).x;
+    if (i < groupEnd)
+      totalWidth += MeasureTextEx(assets->font, " ", CAPTION_FONT_SIZE, 1).x;
+  }
+  return totalWidth;
+}
+
+static bool wordHighlighted(const SceneState *state, int word) {
+  const Caption *caption = state->currentCaption;
+  return state->time >= caption->words[word].start &&
+         state->time <= caption->words[word].end;
+}
+
+// Text isn't premultiplied: blend its colour as usual but build up alpha
+// the premultiplied way, so it also comes out right in a transparent
+// overlay. Colours on an opaque target are the same as with BLEND_ALPHA.
+static void beginTextBlend(void) {
+  rlSetBlendFactorsSeparate(RL_SRC_ALPHA, RL_ONE_MINUS_SRC_ALPHA, RL_ONE,
+                            RL_ONE_MINUS_SRC_ALPHA, RL_FUNC_ADD, RL_FUNC_ADD);
+  BeginBlendMode(BLEND_CUSTOM_SEPARATE);
+}
+
+void drawScene(const SceneState *state, const SceneAssets *assets) {
+  const Caption *caption = state->currentCaption;
+
+  // All characters in one batch off the atlas. Placeholder boxes use
+  // premultiplied colours too so the blend mode can stay put.
+  BeginBlendMode(BLEND_ALPHA_PREMULTIPLY);
+  for (int i = 0; i < state->characterCount; i++) {
+    const CharacterState *c = &state->characters[i];
+    const CharacterLayout *layout = &state->layouts[i];
+    if (!characterOnScreen(c, layout))
+      continue;
+    unsigned char a = (unsigned char)(c->alpha * 255);
+    Rectangle dest = {c->x, layout->y, layout->width, layout->height};
+    if (layout->sprite >= 0) {
+      DrawTexturePro(assets->atlas.texture,
+                     assets->atlas.sprites[layout->sprite].rect, dest,
+                     (Vector2){0, 0}, 0.0f, (Color){a, a, a, a});
+    } else {
+      Color base = placeholderColors[i % (int)(sizeof(placeholderColors) /
+                                               sizeof(placeholderColors[0]))];
+      Color fill = {base.r * a / 255, base.g * a / 255, base.b * a / 255, a};
+      DrawRectangleRec(dest, fill);
+    }
+  }
+  EndBlendMode();
+
+  // The default font isn't premultiplied, so placeholder names go on after
+  beginTextBlend();
+  for (int i = 0; i < state->characterCount; i++) {
+    const CharacterState *c = &state->characters[i];
+    const CharacterLayout *layout = &state->layouts[i];
+    if (layout->sprite < 0 && characterOnScreen(c, layout))
+      DrawText(layout->label, c->x + 50, layout->y + layout->height / 2, 40,
+               (Color){255, 255, 255, (unsigned char)(c->alpha * 255)});
+  }
+
+  // Draw captions with word highlighting
+  int groupEnd;
+  int groupStart = captionGroup(state, &groupEnd);
+  if (groupStart >= 0) {
+    int fontSize = CAPTION_FONT_SIZE;
+    // Build display text for this group
+    char displayWords[3][64];
+    int wordsInGroup = 0;
+    for (int i = groupStart; i <= groupEnd; i++) {
+      strncpy(displayWords[wordsInGroup], caption->words[i].word, 63);
+      displayWords[wordsInGroup][63] = '\0';
+      wordsInGroup++;
+    }
+
+    // Calculate total width for centering
+    float totalWidth =
+        captionGroupWidth(caption, assets, groupStart, groupEnd);
+
+    int textX = (WIDTH - totalWidth) / 2;
+    int textY = (HEIGHT - fontSize) / 2; // Vertical center
+
+    // Draw words individually with black outline and highlighting
+    float xOffset = 0;
+    for (int i = 0; i < wordsInGroup; i++) {
+      int wordIdx = groupStart + i;
+      Color wordColor = WHITE;
+
+      // Highlight if this word is currently being spoken
+      if (wordHighlighted(state, wordIdx)) {
+        wordColor = GREEN;
+      }
+
+      Vector2 wordPos = {textX + xOffset, textY};
+
+      // Draw black outline by drawing text in 8 directions
+      int outlineSize = CAPTION_OUTLINE;
+      for (int ox = -outlineSize; ox <= outlineSize; ox++) {
+        for (int oy = -outlineSize; oy <= outlineSize; oy++) {
+          if (ox != 0 || oy != 0) {
+            DrawTextEx(assets->font, displayWords[i],
+                       (Vector2){wordPos.x + ox, wordPos.y + oy}, fontSize,
+                       1, BLACK); // Reduced spacing for sharper text
+          }
+        }
+      }
+
+      // Draw main text
+      DrawTextEx(assets->font, displayWords[i], wordPos, fontSize, 1,
+                 wordColor);
+
+      Vector2 wordSize =
+          MeasureTextEx(assets->font, displayWords[i], fontSize, 1);
+      xOffset += wordSize.x;
+
+      // Add space between words
+      if (i < wordsInGroup - 1) {
+        Vector2 spaceSize = MeasureTextEx(assets->font, " ", fontSize, 1);
+        xOffset += spaceSize.x;
+      }
+    }
+  }
+  EndBlendMode();
+}
+
+int sceneRegions(const SceneState *state, const SceneAssets *assets,
+                 Rectangle *regions) {
+  int count = 0;
+  int groupEnd;
+  int groupStart = captionGroup(state, &groupEnd);
+  if (groupStart >= 0) {
+    float totalWidth = captionGroupWidth(state->currentCaption, assets,
+                                         groupStart, groupEnd);
+    int textX = (WIDTH - totalWidth) / 2;
+    int textY = (HEIGHT - CAPTION_FONT_SIZE) / 2;
+    regions[count++] =
+        (Rectangle){textX - CAPTION_OUTLINE, textY - CAPTION_OUTLINE,
+                    totalWidth + 2 * CAPTION_OUTLINE,
+                    CAPTION_FONT_SIZE + 2 * CAPTION_OUTLINE};
+  }
+  for (int i = 0; i < state->characterCount; i++) {
+    const CharacterState *c = &state->characters[i];
+    const CharacterLayout *layout = &state->layouts[i];
+    if (characterOnScreen(c, layout))
+      regions[count++] =
+          (Rectangle){c->x, layout->y, layout->width, layout->height};
+  }
+  return count;
+}
+
+int initSceneOverlay(SceneOverlay *overlay) {
+  memset(overlay, 0, sizeof(SceneOverlay));
+  overlay->target = LoadRenderTexture(WIDTH, HEIGHT);
+  if (overlay->target.id == 0) {
+    printf("Error: Could not create overlay texture\n");
+    return -1;
+  }
+  return 0;
+}
+
+void freeSceneOverlay(SceneOverlay *overlay) {
+  if (overlay->target.id != 0)
+    UnloadRenderTexture(overlay->target);
+  memset(overlay, 0, sizeof(SceneOverlay));
+}
+
+static void overlayKey(const SceneState *state, OverlayKey *key) {
+  // Zeroed as a whole so padding and unused slots compare equal
+  memset(key, 0, sizeof(OverlayKey));
+  for (int i = 0; i < state->characterCount; i++) {
+    const CharacterState *c = &state->characters[i];
+    if (!characterOnScreen(c, &state->layouts[i]))
+      continue;
+    key->x[i] = c->x;
+    key->alpha[i] = c->alpha;
+  }
+  key->groupStart = captionGroup(state, &key->groupEnd);
+  if (key->groupStart < 0)
+    return;
+  key->caption = state->currentCaption;
+  for (int i = key->groupStart; i <= key->groupEnd; i++) {
+    if (wordHighlighted(state, i))
+      key->highlighted |= 1u << (i - key->groupStart);
+  }
+}
+
+bool updateSceneOverlay(SceneOverlay *overlay, const SceneState *state,
+                        const SceneAssets *assets) {
+  OverlayKey key;
+  overlayKey(state, &key);
+  if (overlay->valid && memcmp(&key, &overlay->key, sizeof(OverlayKey)) == 0)
+    return false;
+  BeginTextureMode(overlay->target);
+  ClearBackground(BLANK);
+  drawScene(state, assets);
+  EndTextureMode();
+  overlay->key = key;
+  overlay->valid = true;
+  overlay->rebuilds++;
+  return true;
+}
+
+void drawSceneOverlay(const SceneOverlay *overlay) {
+  // Render textures come out upside down
+  BeginBlendMode(BLEND_ALPHA_PREMULTIPLY);
+  DrawTextureRec(overlay->target.texture,
+                 (Rectangle){0, 0, (float)WIDTH, -(float)HEIGHT},
+                 (Vector2){0, 0}, WHITE);
+  EndBlendMode();
+}
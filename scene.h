@@ -0,0 +1,144 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <raylib.h>
+#include <stdbool.h>
+
+#include "assetcache.h"
+#include "project.h"
+
+#define FONT_PATH "./media/theboldfont.ttf"
+#define FONT_SIZE 128
+// Caption words are drawn at this size with an outline this thick
+#define CAPTION_FONT_SIZE 72
+#define CAPTION_OUTLINE 2
+
+// Every character sprite lives in one texture so a frame's characters draw
+// in a single batch. Sprites are packed onto shelves as projects need them
+// and stay until the assets are unloaded.
+#define SPRITE_ATLAS_SIZE 2048
+#define MAX_ATLAS_SPRITES 32
+
+typedef struct {
+  char source[256];
+  float scale;
+  Rectangle rect; // where it sits in the atlas, at drawn size
+} AtlasSprite;
+
+typedef struct {
+  Texture2D texture; // premultiplied alpha, created with the first sprite
+  AtlasSprite sprites[MAX_ATLAS_SPRITES];
+  int spriteCount;
+  int shelfX; // next free spot on the current shelf
+  int shelfY;
+  int shelfHeight;
+} SpriteAtlas;
+
+// Font and sprites, loaded once and shared by every scene
+typedef struct {
+  Font font;
+  SpriteAtlas atlas;
+} SceneAssets;
+
+typedef struct {
+  float x;
+  float startX; // slide from startX to endX
+  float endX;
+  float alpha;
+  float slideProgress;
+  float fadeSpeed; // alpha per second, 0 when not fading
+  bool isVisible;
+  bool isSliding;
+} CharacterState;
+
+// Where a character is drawn, worked out once per project
+typedef struct {
+  int sprite; // atlas slot, -1 for a placeholder box
+  float width;
+  float height;
+  float y;
+  float targetX; // on screen
+  float hiddenX; // just off the anchored edge
+  CharacterAnimation enter;
+  CharacterAnimation exit;
+  char label[32]; // placeholder text
+} CharacterLayout;
+
+// Animation state of one timeline
+typedef struct {
+  CharacterState characters[MAX_CHARACTERS];
+  CharacterLayout layouts[MAX_CHARACTERS];
+  int characterCount;
+  int currentSpeaker;
+  float speakerTimer;
+  float time;
+  const Caption *currentCaption;
+} SceneState;
+
+// Everything that decides what drawScene puts on screen; two frames with
+// the same key draw the same overlay
+typedef struct {
+  float x[MAX_CHARACTERS];
+  float alpha[MAX_CHARACTERS]; // 0 while off screen
+  const Caption *caption;
+  int groupStart; // words shown, -1 for none
+  int groupEnd;
+  unsigned highlighted; // bit per shown word
+} OverlayKey;
+
+// Characters and captions drawn once into a transparent texture
+// (premultiplied alpha) and redrawn only when the key changes, so a frame
+// between state changes is its background plus one quad
+typedef struct {
+  RenderTexture2D target;
+  OverlayKey key;
+  bool valid;
+  int rebuilds;
+} SceneOverlay;
+
+// Load the font and the default characters' sprites, from the asset cache
+// when it is current
+void loadSceneAssets(SceneAssets *assets);
+void unloadSceneAssets(SceneAssets *assets);
+
+// Add the sprites of project's characters to the atlas if they aren't there
+// yet. Needs the GL context. Returns how many could not be added (they are
+// drawn as placeholders).
+int addSceneSprites(SceneAssets *assets, const Project *project);
+
+// Write the asset cache for the font and the sprites of the default
+// characters and of every table in CHARACTERS_DIR. Returns 0 on success.
+int bakeSceneAssets(void);
+
+void initSceneState(SceneState *state, const SceneAssets *assets,
+                    const Project *project);
+
+// Advance the animation to currentTime, deltaTime after the previous update
+void updateScene(SceneState *state, const SceneAssets *assets,
+                 const Project *project, float currentTime, float deltaTime);
+
+// Draw characters and captions over whatever background is already there
+void drawScene(const SceneState *state, const SceneAssets *assets);
+
+// What viewers read: the caption line and every character on screen
+#define MAX_SCENE_REGIONS (MAX_CHARACTERS + 1)
+
+// Fill regions with the screen rectangles drawScene would cover with the
+// caption and with characters for state, caption first. Returns how many,
+// up to MAX_SCENE_REGIONS.
+int sceneRegions(const SceneState *state, const SceneAssets *assets,
+                 Rectangle *regions);
+
+// Needs the GL context. Returns 0 on success.
+int initSceneOverlay(SceneOverlay *overlay);
+void freeSceneOverlay(SceneOverlay *overlay);
+
+// Redraw the overlay if state has changed since the last update. Call
+// outside any texture mode. Returns true if it was redrawn.
+bool updateSceneOverlay(SceneOverlay *overlay, const SceneState *state,
+                        const SceneAssets *assets);
+
+// Composite the overlay over whatever is already there
+void drawSceneOverlay(const SceneOverlay *overlay);
+
+#endif
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include "threadpool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct ThreadPool {
+  pthread_t *threads;
+  int threadCount;
+  pthread_mutex_t lock;
+  pthread_cond_t workReady;
+  pthread_cond_t workDone;
+  // Current job
+  ThreadPoolTask fn;
+  void *arg;
+  int taskCount;
+  int nextTask;
+  int finishedTasks;
+  unsigned long generation;
+  bool quit;
+  // Only one job runs at a time
+  pthread_mutex_t runLock;
+};
+
+int cpuCount(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+// Claim and run tasks of the current job until none are left. Called with
+// the pool lock held, returns with it held.
+static void drainTasks(ThreadPool *pool) {
+  while (pool->nextTask < pool->taskCount) {
+    int task = pool->nextTask++;
+    ThreadPoolTask fn = pool->fn;
+    void *arg = pool->arg;
+    int taskCount = pool->taskCount;
+    pthread_mutex_unlock(&pool->lock);
+
+    fn(arg, task, taskCount);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->finishedTasks++;
+    if (pool->finishedTasks == pool->taskCount)
+      pthread_cond_broadcast(&pool->workDone);
+  }
+}
+
+static void *threadPoolWorker(void *arg) {
+  ThreadPool *pool = arg;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->generation == seen && !pool->quit)
+      pthread_cond_wait(&pool->workReady, &pool->lock);
+    if (pool->quit)
+      break;
+    seen = pool->generation;
+    drainTasks(pool);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+ThreadPool *createThreadPool(int threads) {
+  if (threads <= 0)
+    threads = cpuCount();
+
+  ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+  if (!pool)
+    return NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_mutex_init(&pool->runLock, NULL);
+  pthread_cond_init(&pool->workReady, NULL);
+  pthread_cond_init(&pool->workDone, NULL);
+
+  // The caller of runThreadPool is one of the workers
+  pool->threads = malloc((threads - 1 > 0 ? threads - 1 : 1) *
+                         sizeof(pthread_t));
+  if (!pool->threads) {
+    destroyThreadPool(pool);
+    return NULL;
+  }
+  for (int i = 0; i < threads - 1; i++) {
+    if (pthread_create(&pool->threads[i], NULL, threadPoolWorker, pool) != 0) {
+      printf("Warning: Could only start %d of %d pool threads\n", i + 1,
+             threads);
+      break;
+    }
+    pool->threadCount++;
+  }
+  return pool;
+}
+
+void destroyThreadPool(ThreadPool *pool) {
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->workReady);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->threadCount; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_mutex_destroy(&pool->runLock);
+  pthread_cond_destroy(&pool->workReady);
+  pthread_cond_destroy(&pool->workDone);
+  free(pool->threads);
+  free(pool);
+}
+
+int threadPoolSize(const ThreadPool *pool) {
+  return pool ? pool->threadCount + 1 : 1;
+}
+
+void runThreadPool(ThreadPool *pool, int taskCount, ThreadPoolTask fn,
+                   void *arg) {
+  if (!pool || pool->threadCount == 0 || taskCount <= 1) {
+    for (int i = 0; i < taskCount; i++)
+      fn(arg, i, taskCount);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->runLock);
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->taskCount = taskCount;
+  pool->nextTask = 0;
+  pool->finishedTasks = 0;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->workReady);
+
+  drainTasks(pool);
+  while (pool->finishedTasks < pool->taskCount)
+    pthread_cond_wait(&pool->workDone, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+  pthread_mutex_unlock(&pool->runLock);
+}
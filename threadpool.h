@@ -0,0 +1,22 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// Fixed set of worker threads for splitting one job into parallel tasks
+typedef struct ThreadPool ThreadPool;
+
+typedef void (*ThreadPoolTask)(void *arg, int task, int taskCount);
+
+// Create a pool with the given number of threads (0 = one per CPU)
+ThreadPool *createThreadPool(int threads);
+void destroyThreadPool(ThreadPool *pool);
+int threadPoolSize(const ThreadPool *pool);
+
+// Run fn(arg, task, taskCount) for every task in [0, taskCount) and wait for
+// all of them. The calling thread works on tasks too. pool may be NULL, in
+// which case everything runs on the caller.
+void runThreadPool(ThreadPool *pool, int taskCount, ThreadPoolTask fn,
+                   void *arg);
+
+int cpuCount(void);
+
+#endif
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE
+#include "tuning.h"
+
+#include <libavcodec/avcodec.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "project.h"
+#include "threadpool.h"
+
+// Settings have to beat the fps target by this much; conversion and muxing
+// share the encoder thread
+#define TUNING_HEADROOM 1.15
+// Projected sizes are from the opening seconds only, so aim a bit lower
+#define TUNING_SIZE_MARGIN 0.95
+#define TUNING_DEFAULT_CRF 23
+#define TUNING_MIN_CRF 16
+#define TUNING_MAX_CRF 40
+#define TUNING_AUDIO_BITRATE 128000
+
+// Fastest first
+static const char *tuningPresets[] = {"ultrafast", "superfast", "veryfast",
+                                      "faster",    "fast",      "medium"};
+#define TUNING_PRESET_COUNT                                                    \
+  ((int)(sizeof(tuningPresets) / sizeof(tuningPresets[0])))
+
+typedef struct {
+  int threads;
+  bool sliced;
+} Threading;
+
+typedef struct {
+  const char *preset;
+  int crf;
+  Threading threading;
+  double fps;
+  double bytesPerFrame;
+} Trial;
+
+typedef struct {
+  AVFrame **frames;
+  int count;
+  int capacity;
+} CapturedFrames;
+
+static double nowMs(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+int parseEncodeTarget(const char *spec, EncodeTarget *target) {
+  memset(target, 0, sizeof(EncodeTarget));
+  char buffer[128];
+  snprintf(buffer, sizeof(buffer), "%s", spec);
+  char *save = NULL;
+  for (char *part = strtok_r(buffer, ",", &save); part;
+       part = strtok_r(NULL, ",", &save)) {
+    char *end;
+    if (strncmp(part, "fps=", 4) == 0) {
+      target->fps = strtod(part + 4, &end);
+    } else if (strncmp(part, "size=", 5) == 0) {
+      target->sizeMB = strtod(part + 5, &end);
+    } else {
+      return -1;
+    }
+    if (*end != '\0' || end == strchr(part, '=') + 1)
+      return -1;
+  }
+  return target->fps > 0 || target->sizeMB > 0 ? 0 : -1;
+}
+
+// Keep a reference to every frame the calibration render encodes
+static void captureFrame(void *arg, const AVFrame *frame) {
+  CapturedFrames *captured = arg;
+  if (captured->count == captured->capacity)
+    return;
+  AVFrame *clone = av_frame_clone(frame);
+  if (clone)
+    captured->frames[captured->count++] = clone;
+}
+
+static int runTrial(CapturedFrames *captured, int gopSize, Trial *trial) {
+  const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+  if (!codec)
+    return -1;
+  AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+  AVPacket *pkt = av_packet_alloc();
+  if (!codec_ctx || !pkt) {
+    avcodec_free_context(&codec_ctx);
+    av_packet_free(&pkt);
+    return -1;
+  }
+  // Same stream setup as a render job
+  codec_ctx->width = WIDTH;
+  codec_ctx->height = HEIGHT;
+  codec_ctx->time_base = (AVRational){1, FPS};
+  codec_ctx->framerate = (AVRational){FPS, 1};
+  codec_ctx->gop_size = gopSize;
+  codec_ctx->max_b_frames = 0;
+  codec_ctx->pix_fmt = captured->frames[0]->format;
+
+  AVDictionary *encoder_opts = NULL;
+  av_dict_set(&encoder_opts, "preset", trial->preset, 0);
+  av_dict_set_int(&encoder_opts, "crf", trial->crf, 0);
+  av_dict_set_int(&encoder_opts, "threads", trial->threading.threads, 0);
+  av_dict_set(&encoder_opts, "thread_type", "slice+frame", 0);
+  av_dict_set(&encoder_opts, "x264-params",
+              trial->threading.sliced ? "sliced-threads=1"
+                                      : "sliced-threads=0",
+              0);
+  int ret = avcodec_open2(codec_ctx, codec, &encoder_opts);
+  av_dict_free(&encoder_opts);
+
+  int64_t bytes = 0;
+  double start = nowMs();
+  for (int i = 0; i <= captured->count && ret >= 0; i++) {
+    AVFrame *frame = i < captured->count ? captured->frames[i] : NULL;
+    if (frame)
+      frame->pts = i;
+    ret = avcodec_send_frame(codec_ctx, frame);
+    while (ret >= 0 && avcodec_receive_packet(codec_ctx, pkt) >= 0) {
+      bytes += pkt->size;
+      av_packet_unref(pkt);
+    }
+  }
+  double elapsed = nowMs() - start;
+
+  avcodec_free_context(&codec_ctx);
+  av_packet_free(&pkt);
+  if (ret < 0)
+    return -1;
+  trial->fps = elapsed > 0 ? captured->count * 1000.0 / elapsed : 0.0;
+  trial->bytesPerFrame = (double)bytes / captured->count;
+  printf("Tuning: %-9s crf %2d, %2d %s threads: %7.1f fps, %6.1f KB/frame\n",
+         trial->preset, trial->crf, trial->threading.threads,
+         trial->threading.sliced ? "sliced" : "frame", trial->fps,
+         trial->bytesPerFrame / 1024.0);
+  return 0;
+}
+
+static double projectedMB(const Trial *trial, double duration) {
+  double video = trial->bytesPerFrame * duration * FPS;
+  double audio = TUNING_AUDIO_BITRATE / 8.0 * duration;
+  return (video + audio) / (1024.0 * 1024.0);
+}
+
+// Fastest threading for a preset at crf
+static int bestThreading(CapturedFrames *captured, int gopSize,
+                         const Threading *threadings, int threadingCount,
+                         const char *preset, int crf, Trial *best) {
+  best->fps = -1.0;
+  for (int i = 0; i < threadingCount; i++) {
+    Trial trial = {preset, crf, threadings[i], 0.0, 0.0};
+    if (runTrial(captured, gopSize, &trial) == 0 && trial.fps > best->fps)
+      *best = trial;
+  }
+  return best->fps >= 0.0 ? 0 : -1;
+}
+
+int tuneEncoder(RenderContext *ctx, const RenderOptions *opts,
+                const EncodeTarget *target, TunedEncoder *tuned) {
+  // Total length, for the size projection
+  Project project;
+  if (loadProject(&project, opts->projectId, PROJECT_AUDIO_NONE) < 0)
+    return -1;
+  double duration = project.duration;
+  freeProject(&project);
+
+  CapturedFrames captured = {0};
+  captured.capacity = TUNING_SECONDS * FPS;
+  captured.frames = calloc(captured.capacity, sizeof(AVFrame *));
+  if (!captured.frames)
+    return -1;
+
+  // Real frames of this project, encoded cheaply while capturing
+  FrameTap tap = {captureFrame, NULL, &captured};
+  RenderOptions calibration = *opts;
+  calibration.output = "/dev/null";
+  calibration.outputLayout = OUTPUT_LAYOUT_AUTO;
+  calibration.profile = "fast";
+  calibration.encoderProfile = NULL;
+  calibration.verbose = false;
+  // Plain and at full speed: nothing but the frames may touch the output
+  calibration.incremental = false;
+  calibration.checkpointGops = 0;
+  calibration.resume = false;
+  calibration.live = false;
+  calibration.memoryBudget = 0;
+  // No region hint side data or sample encoder in the measured costs
+  calibration.uniformQuality = true;
+  calibration.regionSample = false;
+  calibration.audioCache = false; // cut-off clips would only clutter it
+  calibration.renditionCount = 0;
+  calibration.label = "tuning";
+  calibration.tap = &tap;
+  calibration.maxFrames = captured.capacity;
+  printf("Tuning: rendering the first %d seconds for calibration\n",
+         TUNING_SECONDS);
+  double start = nowMs();
+  int ret = renderProject(ctx, &calibration, NULL);
+  if (ret < 0 || captured.count == 0) {
+    printf("Error: Calibration render failed\n");
+    ret = -1;
+  }
+
+  const EncoderProfile *base = findEncoderProfile(NULL);
+  int cpus = cpuCount();
+  Threading threadings[3] = {{cpus, false}, {cpus / 2, false}, {cpus, true}};
+  int threadingCount = cpus > 2 ? 3 : 1;
+
+  // Slowest preset that keeps up, each with its fastest threading
+  Trial chosen = {0};
+  if (ret == 0 && target->fps > 0) {
+    for (int p = 0; p < TUNING_PRESET_COUNT; p++) {
+      Trial trial;
+      if (bestThreading(&captured, base->gopSize, threadings, threadingCount,
+                        tuningPresets[p], TUNING_DEFAULT_CRF, &trial) < 0)
+        break;
+      if (p > 0 && trial.fps < target->fps * TUNING_HEADROOM)
+        break;
+      chosen = trial;
+      if (trial.fps < target->fps * TUNING_HEADROOM) {
+        printf("Warning: Even %s encodes only %.1f fps, below the %.1f fps "
+               "target\n",
+               trial.preset, trial.fps, target->fps);
+        break;
+      }
+    }
+  } else if (ret == 0) {
+    // Only a size budget: the preset of the quality profile
+    bestThreading(&captured, base->gopSize, threadings, threadingCount,
+                  findEncoderProfile("quality")->preset, TUNING_DEFAULT_CRF,
+                  &chosen);
+  }
+  if (ret == 0 && !chosen.preset) {
+    printf("Error: libx264 trial encodes failed\n");
+    ret = -1;
+  }
+
+  // Lowest CRF whose projected size fits (and that still keeps up)
+  if (ret == 0 && target->sizeMB > 0) {
+    double budget = target->sizeMB * TUNING_SIZE_MARGIN;
+    int low = TUNING_MIN_CRF, high = TUNING_MAX_CRF;
+    Trial fit = {0};
+    while (low <= high) {
+      int crf = (low + high) / 2;
+      Trial trial = {chosen.preset, crf, chosen.threading, 0.0, 0.0};
+      if (runTrial(&captured, base->gopSize, &trial) < 0)
+        break;
+      bool fast = target->fps <= 0 ||
+                  trial.fps >= target->fps * TUNING_HEADROOM ||
+                  trial.fps >= chosen.fps;
+      if (projectedMB(&trial, duration) <= budget && fast) {
+        fit = trial;
+        high = crf - 1;
+      } else {
+        low = crf + 1;
+      }
+    }
+    if (fit.preset) {
+      chosen = fit;
+    } else {
+      chosen.crf = TUNING_MAX_CRF;
+      printf("Warning: No CRF up to %d fits %.1f MB\n", TUNING_MAX_CRF,
+             target->sizeMB);
+    }
+  }
+
+  for (int i = 0; i < captured.count; i++)
+    av_frame_free(&captured.frames[i]);
+  free(captured.frames);
+  if (ret < 0)
+    return -1;
+
+  memset(tuned, 0, sizeof(TunedEncoder));
+  snprintf(tuned->name, sizeof(tuned->name), "tuned-%s", chosen.preset);
+  snprintf(tuned->crf, sizeof(tuned->crf), "%d", chosen.crf);
+  tuned->threads = chosen.threading.threads;
+  tuned->profile = (EncoderProfile){
+      tuned->name,
+      chosen.preset,
+      NULL,
+      tuned->crf,
+      chosen.threading.sliced ? "sliced-threads=1" : NULL,
+      base->bitRate,
+      base->gopSize};
+  printf("Tuning: locked in preset %s, crf %d, %d %s threads (%.1f fps",
+         chosen.preset, chosen.crf, chosen.threading.threads,
+         chosen.threading.sliced ? "sliced" : "frame", chosen.fps);
+  if (chosen.bytesPerFrame > 0)
+    printf(", ~%.0f MB projected", projectedMB(&chosen, duration));
+  printf(") after %.1fs of calibration\n", (nowMs() - start) / 1000.0);
+  return 0;
+}
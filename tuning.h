@@ -0,0 +1,33 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include "render.h"
+
+// Seconds of the project rendered and trial-encoded for calibration
+#define TUNING_SECONDS 2
+
+// What the encoder settings have to achieve on this machine
+typedef struct {
+  double fps;    // encoder throughput to sustain, 0 for no limit
+  double sizeMB; // projected output size, 0 for no limit
+} EncodeTarget;
+
+// "fps=N", "size=MB" or both, comma separated. Returns -1 if malformed.
+int parseEncodeTarget(const char *spec, EncodeTarget *target);
+
+// Settings picked by tuneEncoder; profile points into this struct
+typedef struct {
+  EncoderProfile profile;
+  char name[32];
+  char crf[8];
+  int threads; // for RenderOptions.encoderThreads
+} TunedEncoder;
+
+// Render the first TUNING_SECONDS of opts' project and trial-encode those
+// frames with libx264 across presets, CRF, thread counts and sliced versus
+// frame threading. Picks the best quality that still meets target, prints
+// it and fills tuned. Returns -1 if the calibration could not run.
+int tuneEncoder(RenderContext *ctx, const RenderOptions *opts,
+                const EncodeTarget *target, TunedEncoder *tuned);
+
+#endif
@@ -0,0 +1,497 @@
+#include "verify.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Frames kept per path while waiting for the other path's copy. The paths
+// are stepped in turn, so they never drift more than a queue depth apart.
+#define VERIFY_PENDING 16
+// Out-of-tolerance frames printed individually
+#define VERIFY_REPORT_LIMIT 10
+// Progress reports every 10 seconds of output
+#define VERIFY_PROGRESS_INTERVAL 600
+
+enum { SIDE_REFERENCE, SIDE_FAST };
+
+typedef struct {
+  int index; // -1 when free
+  int planeCount;
+  int widths[3]; // bytes per row
+  int heights[3];
+  uint8_t *planes[3];
+} VerifyFrame;
+
+typedef struct {
+  VerifyFrame pending[VERIFY_PENDING];
+  uint64_t *audioHashes; // one per audio frame
+  int audioFrames;
+  int audioCapacity;
+  int64_t audioSamples;
+  int format;
+  bool overrun; // a frame arrived with no free slot
+  bool unsupported;
+} VerifySide;
+
+typedef struct Verifier Verifier;
+
+typedef struct {
+  Verifier *verifier;
+  VerifySide *side;
+} VerifyTapArg;
+
+struct Verifier {
+  pthread_mutex_t lock;
+  VerifySide sides[2];
+  VerifyTapArg tapArgs[2];
+  FrameTap taps[2];
+  const VerifyTolerance *tolerance;
+
+  int compared; // frames 0..compared-1 are done
+  int identical;
+  int outOfTolerance;
+  double psnrSum; // over frames that aren't identical
+  double minPsnr;
+  double minSsim;
+  int minPsnrFrame;
+  int minSsimFrame;
+  double compareMs;
+};
+
+static double nowMs(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// FNV-1a over 64-bit words; only used to spot identical data
+static uint64_t hashBytes(uint64_t hash, const uint8_t *data, size_t size) {
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * 0x100000001b3ULL;
+  }
+  for (; i < size; i++)
+    hash = (hash ^ data[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+// Plane sizes in bytes for the encoder formats we know; 0 if unknown
+static int framePlanes(const AVFrame *frame, int widths[3], int heights[3]) {
+  int chromaWidth = (frame->width + 1) / 2;
+  int chromaHeight = (frame->height + 1) / 2;
+  widths[0] = frame->width;
+  heights[0] = frame->height;
+  switch (frame->format) {
+  case AV_PIX_FMT_YUV420P:
+  case AV_PIX_FMT_YUVJ420P:
+    widths[1] = widths[2] = chromaWidth;
+    heights[1] = heights[2] = chromaHeight;
+    return 3;
+  case AV_PIX_FMT_NV12:
+    widths[1] = chromaWidth * 2;
+    heights[1] = chromaHeight;
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+// Encoder thread of either job: copy the frame for the GL thread to compare
+static void tapVideo(void *arg, const AVFrame *frame) {
+  VerifyTapArg *tap = arg;
+  VerifySide *side = tap->side;
+  int index = (int)frame->pts;
+  VerifyFrame *slot = &side->pending[index % VERIFY_PENDING];
+
+  pthread_mutex_lock(&tap->verifier->lock);
+  bool busy = slot->index >= 0;
+  if (busy)
+    side->overrun = true;
+  side->format = frame->format;
+  pthread_mutex_unlock(&tap->verifier->lock);
+  if (busy)
+    return;
+
+  int widths[3], heights[3];
+  int planeCount = framePlanes(frame, widths, heights);
+  if (planeCount == 0) {
+    side->unsupported = true;
+    return;
+  }
+  for (int p = 0; p < planeCount; p++) {
+    if (!slot->planes[p]) {
+      slot->planes[p] = malloc((size_t)widths[p] * heights[p]);
+      if (!slot->planes[p]) {
+        side->overrun = true;
+        return;
+      }
+    }
+    for (int y = 0; y < heights[p]; y++)
+      memcpy(slot->planes[p] + (size_t)y * widths[p],
+             frame->data[p] + (size_t)y * frame->linesize[p], widths[p]);
+    slot->widths[p] = widths[p];
+    slot->heights[p] = heights[p];
+  }
+  slot->planeCount = planeCount;
+
+  pthread_mutex_lock(&tap->verifier->lock);
+  slot->index = index;
+  pthread_mutex_unlock(&tap->verifier->lock);
+}
+
+static void tapAudio(void *arg, const AVFrame *frame) {
+  VerifyTapArg *tap = arg;
+  VerifySide *side = tap->side;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int ch = 0; ch < frame->ch_layout.nb_channels; ch++)
+    hash = hashBytes(hash, frame->data[ch],
+                     (size_t)frame->nb_samples * sizeof(float));
+
+  pthread_mutex_lock(&tap->verifier->lock);
+  if (side->audioFrames == side->audioCapacity) {
+    int capacity = side->audioCapacity ? side->audioCapacity * 2 : 1024;
+    uint64_t *hashes =
+        realloc(side->audioHashes, capacity * sizeof(uint64_t));
+    if (!hashes) {
+      side->overrun = true;
+      pthread_mutex_unlock(&tap->verifier->lock);
+      return;
+    }
+    side->audioHashes = hashes;
+    side->audioCapacity = capacity;
+  }
+  side->audioHashes[side->audioFrames++] = hash;
+  side->audioSamples += frame->nb_samples;
+  pthread_mutex_unlock(&tap->verifier->lock);
+}
+
+static uint64_t frameChecksum(const VerifyFrame *frame) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (int p = 0; p < frame->planeCount; p++)
+    hash = hashBytes(hash, frame->planes[p],
+                     (size_t)frame->widths[p] * frame->heights[p]);
+  return hash;
+}
+
+// Mean SSIM over 8x8 blocks
+static double lumaSsim(const uint8_t *a, const uint8_t *b, int width,
+                       int height) {
+  const double c1 = (0.01 * 255) * (0.01 * 255);
+  const double c2 = (0.03 * 255) * (0.03 * 255);
+  double total = 0.0;
+  int blocks = 0;
+  for (int by = 0; by + 8 <= height; by += 8) {
+    for (int bx = 0; bx + 8 <= width; bx += 8) {
+      int64_t sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+      for (int y = 0; y < 8; y++) {
+        const uint8_t *ra = a + (size_t)(by + y) * width + bx;
+        const uint8_t *rb = b + (size_t)(by + y) * width + bx;
+        for (int x = 0; x < 8; x++) {
+          sa += ra[x];
+          sb += rb[x];
+          saa += ra[x] * ra[x];
+          sbb += rb[x] * rb[x];
+          sab += ra[x] * rb[x];
+        }
+      }
+      double ma = sa / 64.0, mb = sb / 64.0;
+      double va = saa / 64.0 - ma * ma, vb = sbb / 64.0 - mb * mb;
+      double cov = sab / 64.0 - ma * mb;
+      total += ((2 * ma * mb + c1) * (2 * cov + c2)) /
+               ((ma * ma + mb * mb + c1) * (va + vb + c2));
+      blocks++;
+    }
+  }
+  return blocks > 0 ? total / blocks : 1.0;
+}
+
+static void compareFrames(Verifier *v, const VerifyFrame *ref,
+                          const VerifyFrame *fast) {
+  int index = ref->index;
+  if (frameChecksum(ref) == frameChecksum(fast)) {
+    v->identical++;
+    return;
+  }
+
+  uint64_t sse = 0;
+  uint64_t samples = 0;
+  for (int p = 0; p < ref->planeCount; p++) {
+    size_t size = (size_t)ref->widths[p] * ref->heights[p];
+    for (size_t i = 0; i < size; i++) {
+      int d = ref->planes[p][i] - fast->planes[p][i];
+      sse += d * d;
+    }
+    samples += size;
+  }
+  double psnr = sse > 0 ? 10.0 * log10(255.0 * 255.0 * samples / sse)
+                        : INFINITY;
+  double ssim = lumaSsim(ref->planes[0], fast->planes[0], ref->widths[0],
+                         ref->heights[0]);
+
+  v->psnrSum += psnr;
+  if (psnr < v->minPsnr) {
+    v->minPsnr = psnr;
+    v->minPsnrFrame = index;
+  }
+  if (ssim < v->minSsim) {
+    v->minSsim = ssim;
+    v->minSsimFrame = index;
+  }
+  if (psnr < v->tolerance->minPsnr || ssim < v->tolerance->minSsim) {
+    if (v->outOfTolerance < VERIFY_REPORT_LIMIT)
+      printf("Verify: frame %d out of tolerance: PSNR %.2f dB, SSIM %.5f\n",
+             index, psnr, ssim);
+    v->outOfTolerance++;
+  }
+}
+
+// GL thread: compare every frame both paths have delivered so far
+static void drainVerifier(Verifier *v) {
+  double start = nowMs();
+  for (;;) {
+    VerifyFrame *ref =
+        &v->sides[SIDE_REFERENCE].pending[v->compared % VERIFY_PENDING];
+    VerifyFrame *fast =
+        &v->sides[SIDE_FAST].pending[v->compared % VERIFY_PENDING];
+    pthread_mutex_lock(&v->lock);
+    bool ready = ref->index == v->compared && fast->index == v->compared;
+    pthread_mutex_unlock(&v->lock);
+    if (!ready)
+      break;
+
+    if (ref->planeCount == fast->planeCount) {
+      compareFrames(v, ref, fast);
+    } else {
+      printf("Verify: frame %d has a different layout\n", v->compared);
+      v->outOfTolerance++;
+    }
+    pthread_mutex_lock(&v->lock);
+    ref->index = -1;
+    fast->index = -1;
+    pthread_mutex_unlock(&v->lock);
+    v->compared++;
+  }
+  v->compareMs += nowMs() - start;
+}
+
+// First audio frame that differs, -1 if the audio is sample-exact
+static int compareAudio(const VerifySide *ref, const VerifySide *fast) {
+  int frames = ref->audioFrames < fast->audioFrames ? ref->audioFrames
+                                                    : fast->audioFrames;
+  for (int i = 0; i < frames; i++) {
+    if (ref->audioHashes[i] != fast->audioHashes[i])
+      return i;
+  }
+  return ref->audioFrames != fast->audioFrames ? frames : -1;
+}
+
+static void printTimingRow(const char *name, double refMs, int refFrames,
+                           double fastMs, int fastFrames) {
+  printf("  %-18s %9.2fms %9.2fms\n", name,
+         refFrames > 0 ? refMs / refFrames : 0.0,
+         fastFrames > 0 ? fastMs / fastFrames : 0.0);
+}
+
+// Both paths' own work per frame. They ran interleaved, so wall time is
+// shared; the fps estimate assumes each path ran alone.
+static void printTiming(const RenderStats *ref, const RenderStats *fast) {
+  printf("Verify timing per frame   reference       fast\n");
+  printTimingRow("background", ref->backgroundMs, ref->frames,
+                 fast->backgroundMs, fast->frames);
+  printTimingRow("render + readback", ref->renderMs - ref->backgroundMs,
+                 ref->frames, fast->renderMs - fast->backgroundMs,
+                 fast->frames);
+  printTimingRow("convert + encode", ref->encodeMs, ref->frames,
+                 fast->encodeMs, fast->frames);
+  // The reference encodes inline; the fast path overlaps the two
+  double refPath = ref->renderMs + ref->encodeMs;
+  double fastPath =
+      fast->renderMs > fast->encodeMs ? fast->renderMs : fast->encodeMs;
+  double refFps = refPath > 0 ? ref->frames * 1000.0 / refPath : 0.0;
+  double fastFps = fastPath > 0 ? fast->frames * 1000.0 / fastPath : 0.0;
+  printf("  %-18s %9.1f   %9.1f    (%.2fx)\n", "est. fps", refFps, fastFps,
+         refFps > 0 ? fastFps / refFps : 0.0);
+  printf("  %-18s %9.0fms %9.0fms\n", "setup", ref->setupMs, fast->setupMs);
+}
+
+static void freeVerifier(Verifier *v) {
+  for (int s = 0; s < 2; s++) {
+    for (int i = 0; i < VERIFY_PENDING; i++) {
+      for (int p = 0; p < 3; p++)
+        free(v->sides[s].pending[i].planes[p]);
+    }
+    free(v->sides[s].audioHashes);
+  }
+  pthread_mutex_destroy(&v->lock);
+}
+
+int runRenderVerify(RenderContext *ctx, const RenderOptions *opts,
+                    const char *backgroundFile, BackgroundMode bgMode,
+                    BackgroundFit bgFit, const VerifyTolerance *tolerance) {
+  if (ctx->referenceConvert) {
+    printf("Error: Verification needs the fast path enabled, drop "
+           "--reference-convert\n");
+    return -1;
+  }
+
+  Verifier v;
+  memset(&v, 0, sizeof(Verifier));
+  pthread_mutex_init(&v.lock, NULL);
+  v.tolerance = tolerance;
+  v.minPsnr = INFINITY;
+  v.minSsim = 1.0;
+  v.minPsnrFrame = v.minSsimFrame = -1;
+  for (int s = 0; s < 2; s++) {
+    for (int i = 0; i < VERIFY_PENDING; i++)
+      v.sides[s].pending[i].index = -1;
+    v.sides[s].format = AV_PIX_FMT_NONE;
+    v.tapArgs[s] = (VerifyTapArg){&v, &v.sides[s]};
+    v.taps[s] = (FrameTap){tapVideo, tapAudio, &v.tapArgs[s]};
+  }
+
+  // Each path decodes the background itself
+  BackgroundVideo backgrounds[2];
+  memset(backgrounds, 0, sizeof(backgrounds));
+  int ret = 0;
+  for (int s = 0; s < 2 && backgroundFile && ret == 0; s++) {
+    if (initBackgroundVideo(&backgrounds[s], backgroundFile, bgMode, bgFit) <
+        0) {
+      printf("Error: Failed to initialize background video\n");
+      ret = -1;
+    }
+  }
+
+  RenderOptions refOpts = *opts;
+  refOpts.output = VERIFY_REFERENCE_OUTPUT;
+  refOpts.outputLayout = OUTPUT_LAYOUT_AUTO;
+  refOpts.background = backgroundFile ? &backgrounds[SIDE_REFERENCE] : NULL;
+  refOpts.encodeThread = false;
+  refOpts.referenceConvert = true;
+  refOpts.incremental = false;
+  refOpts.checkpointGops = 0;
+  refOpts.resume = false;
+  refOpts.memoryBudget = 0;
+  refOpts.live = false;
+  refOpts.renditionCount = 0;
+  refOpts.verbose = false;
+  refOpts.label = "reference";
+  refOpts.tap = &v.taps[SIDE_REFERENCE];
+
+  RenderOptions fastOpts = *opts;
+  fastOpts.background = backgroundFile ? &backgrounds[SIDE_FAST] : NULL;
+  fastOpts.verbose = false;
+  // Every frame has to be rendered to compare, none copied from a
+  // previous or partial output
+  fastOpts.incremental = false;
+  fastOpts.checkpointGops = 0;
+  fastOpts.resume = false;
+  fastOpts.memoryBudget = 0;
+  // Paced to the clock the jobs would drop frames and reuse backgrounds
+  fastOpts.live = false;
+  fastOpts.renditionCount = 0;
+  fastOpts.label = "fast";
+  fastOpts.tap = &v.taps[SIDE_FAST];
+
+  RenderJob *ref = ret == 0 ? startRenderJob(ctx, &refOpts) : NULL;
+  RenderJob *fast = ref ? startRenderJob(ctx, &fastOpts) : NULL;
+  RenderStats refStats = {0}, fastStats = {0};
+  if (!ref || !fast) {
+    if (ref)
+      finishRenderJob(ref, NULL);
+    for (int s = 0; s < 2; s++)
+      cleanupBackgroundVideo(&backgrounds[s]);
+    freeVerifier(&v);
+    return -1;
+  }
+
+  printf("Verify: rendering %s through the reference and fast paths "
+         "(reference output: %s)\n",
+         opts->projectId, VERIFY_REFERENCE_OUTPUT);
+  double start = nowMs();
+  RenderStepResult refStep = RENDER_STEP_FRAME, fastStep = RENDER_STEP_FRAME;
+  int frames = 0;
+  while (refStep != RENDER_STEP_DONE || fastStep != RENDER_STEP_DONE) {
+    // The fast path goes first so the reference never runs ahead of it by
+    // more than its encoder queue
+    beginRenderRound(ctx);
+    if (fastStep != RENDER_STEP_DONE)
+      fastStep = renderJobStep(fast, true);
+    if (refStep != RENDER_STEP_DONE)
+      refStep = renderJobStep(ref, true);
+    endRenderRound(ctx);
+    if (refStep == RENDER_STEP_ERROR || fastStep == RENDER_STEP_ERROR ||
+        renderShouldStop(ctx)) {
+      ret = -1;
+      break;
+    }
+    drainVerifier(&v);
+    if (++frames % VERIFY_PROGRESS_INTERVAL == 0)
+      printf("Verify: %d frames compared, %d out of tolerance\n", v.compared,
+             v.outOfTolerance);
+  }
+
+  if (finishRenderJob(ref, &refStats) < 0 ||
+      finishRenderJob(fast, &fastStats) < 0)
+    ret = -1;
+  drainVerifier(&v);
+  double totalMs = nowMs() - start;
+
+  // Report
+  VerifySide *refSide = &v.sides[SIDE_REFERENCE];
+  VerifySide *fastSide = &v.sides[SIDE_FAST];
+  printf("Verify: %d frames compared in %.2fs (%.0fms comparing)\n",
+         v.compared, totalMs / 1000.0, v.compareMs);
+  if (ret < 0)
+    printf("Verify: FAIL - a render did not complete\n");
+  if (refSide->unsupported || fastSide->unsupported ||
+      refSide->format != fastSide->format) {
+    printf("Verify: FAIL - encoder input formats differ or can't be "
+           "compared\n");
+    ret = -1;
+  }
+  if (refSide->overrun || fastSide->overrun ||
+      v.compared != refStats.frames || v.compared != fastStats.frames) {
+    printf("Verify: FAIL - only %d of %d/%d frames could be compared\n",
+           v.compared, refStats.frames, fastStats.frames);
+    ret = -1;
+  }
+
+  int differing = v.compared - v.identical;
+  printf("  video: %d identical, %d differing", v.identical, differing);
+  if (differing > 0)
+    printf(", PSNR min %.2f dB (frame %d) avg %.2f dB, SSIM min %.5f "
+           "(frame %d)",
+           v.minPsnr, v.minPsnrFrame, v.psnrSum / differing, v.minSsim,
+           v.minSsimFrame);
+  printf("\n");
+  if (v.outOfTolerance > 0) {
+    printf("Verify: FAIL - %d frames below PSNR %.1f dB / SSIM %.3f\n",
+           v.outOfTolerance, tolerance->minPsnr, tolerance->minSsim);
+    ret = -1;
+  }
+
+  int audioMismatch = compareAudio(refSide, fastSide);
+  if (audioMismatch < 0) {
+    printf("  audio: sample-exact (%lld samples)\n",
+           (long long)refSide->audioSamples);
+  } else {
+    printf("Verify: FAIL - audio differs from encoder frame %d "
+           "(%lld vs %lld samples)\n",
+           audioMismatch, (long long)refSide->audioSamples,
+           (long long)fastSide->audioSamples);
+    ret = -1;
+  }
+
+  printTiming(&refStats, &fastStats);
+  printf("Verify: %s\n", ret == 0 ? "PASS" : "FAIL");
+
+  for (int s = 0; s < 2; s++)
+    cleanupBackgroundVideo(&backgrounds[s]);
+  freeVerifier(&v);
+  return ret;
+}
@@ -0,0 +1,27 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "background.h"
+#include "render.h"
+
+// Worst frame still accepted
+typedef struct {
+  double minPsnr; // dB over Y, U and V together
+  double minSsim; // luma
+} VerifyTolerance;
+
+#define VERIFY_DEFAULT_PSNR 40.0
+#define VERIFY_DEFAULT_SSIM 0.98
+#define VERIFY_REFERENCE_OUTPUT "output_reference.mp4"
+
+// Render opts->projectId twice in lockstep: once through the reference
+// path (rlReadScreenPixels, sws_scale, encoding inline on the GL thread)
+// and once as opts describes. Every YUV frame handed to the two encoders is
+// compared (checksum, PSNR, SSIM), as is every audio sample. Each job gets
+// its own decoder for backgroundFile (NULL for none). Prints a report with
+// both paths' timing. Returns 0 if everything is within tolerance.
+int runRenderVerify(RenderContext *ctx, const RenderOptions *opts,
+                    const char *backgroundFile, BackgroundMode bgMode,
+                    BackgroundFit bgFit, const VerifyTolerance *tolerance);
+
+#endif